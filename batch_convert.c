@@ -0,0 +1,166 @@
+// Each file is converted whole by one worker: LoadTextFile maps and decodes it, and
+// SaveTextFile writes the new encoding to a temporary file that replaces the original,
+// so a failure part way leaves the file as it was. Files are independent, so the pool
+// keeps every core busy until the last few; results are reported in command-line order.
+#include "batch_convert.h"
+#include "file_io.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+typedef struct ConvertFile {
+    const char *path;
+    TextEncoding target;
+    guint64 bytesIn;
+    guint64 bytesOut;
+    const char *error;          // NULL once converted
+} ConvertFile;
+
+gboolean IsConvertCommand(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--") == 0) break;
+        if (strcmp(argv[i], "--convert") == 0) return TRUE;
+    }
+    return FALSE;
+}
+
+static gboolean ParseEncoding(const char *name, TextEncoding *encoding) {
+    char *key = g_ascii_strdown(name, -1);
+    char *out = key;
+    for (const char *in = key; *in; in++) {
+        if (*in != '-' && *in != '_') *out++ = *in;
+    }
+    *out = '\0';
+
+    gboolean ok = TRUE;
+    if (strcmp(key, "utf8") == 0) {
+        *encoding = ENC_UTF8;
+    } else if (strcmp(key, "utf16le") == 0 || strcmp(key, "utf16") == 0) {
+        *encoding = ENC_UTF16LE;
+    } else if (strcmp(key, "utf16be") == 0) {
+        *encoding = ENC_UTF16BE;
+    } else if (strcmp(key, "ansi") == 0) {
+        *encoding = ENC_ANSI;
+    } else {
+        ok = FALSE;
+    }
+    g_free(key);
+    return ok;
+}
+
+static const char *EncodingName(TextEncoding encoding) {
+    switch (encoding) {
+    case ENC_UTF16LE: return "UTF-16 LE";
+    case ENC_UTF16BE: return "UTF-16 BE";
+    case ENC_ANSI: return "ANSI";
+    case ENC_UTF8:
+    default: return "UTF-8";
+    }
+}
+
+static void ConvertFileThread(gpointer data, gpointer userData) {
+    ConvertFile *file = (ConvertFile *)data;
+    GStatBuf st;
+    if (g_stat(file->path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        file->error = "not a readable file";
+        return;
+    }
+    file->bytesIn = st.st_size;
+
+    char *text = NULL;
+    size_t length = 0;
+    TextEncoding source;
+    if (!LoadTextFile(NULL, file->path, &text, &length, &source)) {
+        file->error = "cannot read or decode";
+        return;
+    }
+    gboolean saved = SaveTextFile(NULL, file->path, text, length, file->target);
+    g_free(text);
+    if (!saved) {
+        file->error = "cannot write";
+        return;
+    }
+    if (g_stat(file->path, &st) == 0) {
+        file->bytesOut = st.st_size;
+    }
+}
+
+int RunConvertCommand(int argc, char **argv) {
+    gboolean convert = FALSE;
+    char *to = NULL;
+    gint jobs = 0;
+    char **paths = NULL;
+    GOptionEntry entries[] = {
+        { "convert", 0, 0, G_OPTION_ARG_NONE, &convert,
+          "Convert files instead of opening the editor", NULL },
+        { "to", 't', 0, G_OPTION_ARG_STRING, &to,
+          "Target encoding: utf8, utf16le, utf16be or ansi", "ENCODING" },
+        { "jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+          "Files converted at once (default: one per processor)", "N" },
+        { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &paths, NULL, "FILE..." },
+        { NULL }
+    };
+
+    GOptionContext *context = g_option_context_new("- convert text files between encodings");
+    g_option_context_add_main_entries(context, entries, NULL);
+    GError *error = NULL;
+    gboolean parsed = g_option_context_parse(context, &argc, &argv, &error);
+    g_option_context_free(context);
+    if (!parsed) {
+        g_printerr("retropad: %s\n", error->message);
+        g_error_free(error);
+        return 2;
+    }
+
+    TextEncoding target;
+    if (!to || !ParseEncoding(to, &target)) {
+        g_printerr("retropad: --convert needs --to utf8, utf16le, utf16be or ansi\n");
+        g_free(to);
+        g_strfreev(paths);
+        return 2;
+    }
+    g_free(to);
+    guint count = paths ? g_strv_length(paths) : 0;
+    if (count == 0) {
+        g_printerr("retropad: no files to convert\n");
+        g_strfreev(paths);
+        return 2;
+    }
+    if (jobs <= 0) jobs = g_get_num_processors();
+    jobs = MIN((guint)jobs, count);
+
+    ConvertFile *files = g_new0(ConvertFile, count);
+    gint64 started = g_get_monotonic_time();
+    GThreadPool *pool = g_thread_pool_new(ConvertFileThread, NULL, jobs, TRUE, NULL);
+    for (guint i = 0; i < count; i++) {
+        files[i].path = paths[i];
+        files[i].target = target;
+        g_thread_pool_push(pool, &files[i], NULL);
+    }
+    g_thread_pool_free(pool, FALSE, TRUE);
+    double seconds = (g_get_monotonic_time() - started) / (double)G_USEC_PER_SEC;
+
+    guint converted = 0;
+    guint64 bytesIn = 0, bytesOut = 0;
+    for (guint i = 0; i < count; i++) {
+        if (files[i].error) {
+            g_printerr("retropad: %s: %s\n", files[i].path, files[i].error);
+            continue;
+        }
+        converted++;
+        bytesIn += files[i].bytesIn;
+        bytesOut += files[i].bytesOut;
+    }
+
+    double megabytes = bytesIn / (1024.0 * 1024.0);
+    if (seconds <= 0) seconds = 1e-6;
+    printf("Converted %u of %u files to %s in %.2f s with %d jobs: "
+           "%.1f MB read, %.1f MB written, %.1f MB/s, %.0f files/s\n",
+           converted, count, EncodingName(target), seconds, jobs,
+           megabytes, bytesOut / (1024.0 * 1024.0), megabytes / seconds, converted / seconds);
+
+    g_free(files);
+    g_strfreev(paths);
+    return converted == count ? 0 : 1;
+}
@@ -0,0 +1,12 @@
+// Headless batch transcoding: `retropad --convert --to ENCODING [--jobs N] FILE...`
+// rewrites each file in the target encoding using the editor's own load/save code,
+// without initializing GTK.
+#pragma once
+
+#include <glib.h>
+
+// TRUE if the command line asks for batch conversion rather than the editor
+gboolean IsConvertCommand(int argc, char **argv);
+// Converts the files named on the command line across a worker pool and prints a
+// throughput summary. Returns the process exit status.
+int RunConvertCommand(int argc, char **argv);
@@ -0,0 +1,237 @@
+// Change notifications only trigger a read; the read itself compares the file's size and
+// identity with what was read last, so it does not matter how many events arrive or which
+// kind. At most one read runs at a time, and events arriving meanwhile collapse into one
+// more read, so the work done tracks the rate of appends, not the file size or the number
+// of writes.
+#include "file_follow.h"
+#include <glib/gstdio.h>
+
+#define FOLLOW_READ_MAX (1024 * 1024)   // Bytes read per round; a backlog takes several
+#define FOLLOW_RATE_LIMIT_MS 100        // Minimum gap between change notifications
+
+struct FileFollow {
+    char *path;
+    GFileMonitor *monitor;
+    GCancellable *cancellable;
+    FileFollowFunc appended;
+    FileFollowErrorFunc failed;
+    gpointer data;
+
+    // Owned by the read in flight, if any; the main thread leaves them alone meanwhile
+    GFileInputStream *stream;
+    guint64 device;             // Identity of the file the stream reads
+    guint64 inode;
+    guint64 offset;             // Bytes of it read so far
+    TextEncoding encoding;      // The document's; a rotated file is read in it as well
+    TextDecoder *decoder;
+
+    gboolean reading;
+    gboolean recheck;           // The file changed again while a read was running
+    gboolean stopped;           // Stopped during a read; freed when the read returns
+};
+
+typedef struct FollowChunk {
+    GString *text;
+    gboolean restart;
+    gboolean more;              // Read stopped at FOLLOW_READ_MAX, not at the end
+    TextEncoding encoding;
+} FollowChunk;
+
+static void FreeFollowChunk(gpointer data) {
+    FollowChunk *chunk = (FollowChunk *)data;
+    g_string_free(chunk->text, TRUE);
+    g_free(chunk);
+}
+
+static void CloseFollowedFile(FileFollow *follow) {
+    if (follow->stream) {
+        g_input_stream_close(G_INPUT_STREAM(follow->stream), NULL, NULL);
+        g_clear_object(&follow->stream);
+    }
+    TextDecoderFree(follow->decoder);
+    follow->decoder = NULL;
+}
+
+// Opens whatever file is at the path now, to be read from the start
+static gboolean OpenFollowedFile(FileFollow *follow, GCancellable *cancellable, GError **error) {
+    CloseFollowedFile(follow);
+
+    GFile *file = g_file_new_for_path(follow->path);
+    follow->stream = g_file_read(file, cancellable, error);
+    g_object_unref(file);
+    if (!follow->stream) return FALSE;
+
+    GFileInfo *info = g_file_input_stream_query_info(follow->stream,
+        G_FILE_ATTRIBUTE_UNIX_DEVICE "," G_FILE_ATTRIBUTE_UNIX_INODE, cancellable, error);
+    if (!info) {
+        g_clear_object(&follow->stream);
+        return FALSE;
+    }
+    follow->device = g_file_info_get_attribute_uint32(info, G_FILE_ATTRIBUTE_UNIX_DEVICE);
+    follow->inode = g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_UNIX_INODE);
+    g_object_unref(info);
+
+    follow->offset = 0;
+    follow->decoder = TextDecoderNewForEncoding(follow->encoding);
+    return TRUE;
+}
+
+static void FollowReadThread(GTask *task, gpointer sourceObject, gpointer taskData,
+                             GCancellable *cancellable) {
+    FileFollow *follow = (FileFollow *)taskData;
+    FollowChunk *chunk = g_new0(FollowChunk, 1);
+    chunk->text = g_string_new(NULL);
+    GError *error = NULL;
+
+    // Rotated away and not recreated yet: wait for the next event
+    GStatBuf st;
+    if (g_stat(follow->path, &st) != 0) {
+        g_task_return_pointer(task, chunk, FreeFollowChunk);
+        return;
+    }
+
+    // Replaced by another file, or truncated: start over from its beginning
+    if ((guint64)st.st_dev != follow->device || (guint64)st.st_ino != follow->inode ||
+        (guint64)st.st_size < follow->offset) {
+        if (!OpenFollowedFile(follow, cancellable, &error)) {
+            FreeFollowChunk(chunk);
+            g_task_return_error(task, error);
+            return;
+        }
+        chunk->restart = TRUE;
+    }
+
+    gsize want = (gsize)MIN((guint64)st.st_size - follow->offset, (guint64)FOLLOW_READ_MAX);
+    if (want > 0) {
+        guchar *buffer = g_malloc(want);
+        gsize got = 0;
+        if (!g_seekable_seek(G_SEEKABLE(follow->stream), (goffset)follow->offset, G_SEEK_SET,
+                             cancellable, &error) ||
+            !g_input_stream_read_all(G_INPUT_STREAM(follow->stream), buffer, want, &got,
+                                     cancellable, &error)) {
+            g_free(buffer);
+            FreeFollowChunk(chunk);
+            g_task_return_error(task, error);
+            return;
+        }
+        // A file read from its start may open with a BOM, which is not text
+        gsize bom = follow->offset == 0 ? TextEncodingBomLength(buffer, got, follow->encoding) : 0;
+        // A sequence split by the writer stays in the decoder until the rest arrives
+        gboolean ok = TextDecoderFeed(follow->decoder, buffer + bom, got - bom, FALSE, chunk->text);
+        g_free(buffer);
+        if (!ok) {
+            FreeFollowChunk(chunk);
+            g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                    "Text appended to %s is not valid", follow->path);
+            return;
+        }
+        follow->offset += got;
+    }
+    chunk->more = follow->offset < (guint64)st.st_size;
+    chunk->encoding = TextDecoderGetEncoding(follow->decoder);
+    g_task_return_pointer(task, chunk, FreeFollowChunk);
+}
+
+static void FreeFileFollow(FileFollow *follow) {
+    CloseFollowedFile(follow);
+    g_object_unref(follow->cancellable);
+    g_free(follow->path);
+    g_free(follow);
+}
+
+static void StartFollowRead(FileFollow *follow);
+
+static void OnFollowRead(GObject *sourceObject, GAsyncResult *result, gpointer userData) {
+    FileFollow *follow = (FileFollow *)userData;
+    GError *error = NULL;
+    FollowChunk *chunk = g_task_propagate_pointer(G_TASK(result), &error);
+    follow->reading = FALSE;
+
+    if (follow->stopped) {
+        if (chunk) FreeFollowChunk(chunk);
+        g_clear_error(&error);
+        FreeFileFollow(follow);
+        return;
+    }
+    if (!chunk) {
+        follow->failed(error, follow->data);
+        g_error_free(error);
+        return;
+    }
+
+    if (chunk->restart || chunk->text->len > 0) {
+        follow->appended(chunk->text->str, chunk->text->len, chunk->restart, chunk->encoding,
+                         follow->data);
+    }
+    gboolean again = chunk->more || follow->recheck;
+    FreeFollowChunk(chunk);
+    if (again && !follow->stopped) {
+        StartFollowRead(follow);
+    }
+}
+
+static void StartFollowRead(FileFollow *follow) {
+    if (follow->reading) {
+        follow->recheck = TRUE;
+        return;
+    }
+    follow->reading = TRUE;
+    follow->recheck = FALSE;
+
+    GTask *task = g_task_new(NULL, follow->cancellable, OnFollowRead, follow);
+    g_task_set_task_data(task, follow, NULL);
+    g_task_run_in_thread(task, FollowReadThread);
+    g_object_unref(task);
+}
+
+static void on_followed_file_changed(GFileMonitor *monitor, GFile *file, GFile *otherFile,
+                                     GFileMonitorEvent event, gpointer userData) {
+    StartFollowRead((FileFollow *)userData);
+}
+
+FileFollow *FileFollowStart(const char *path, guint64 offset, TextEncoding encoding,
+                            FileFollowFunc appended, FileFollowErrorFunc failed,
+                            gpointer data, GError **error) {
+    FileFollow *follow = g_new0(FileFollow, 1);
+    follow->path = g_strdup(path);
+    follow->cancellable = g_cancellable_new();
+    follow->appended = appended;
+    follow->failed = failed;
+    follow->data = data;
+    follow->encoding = encoding;
+
+    if (!OpenFollowedFile(follow, NULL, error)) {
+        FreeFileFollow(follow);
+        return NULL;
+    }
+    // The caller has shown everything up to offset, BOM included
+    follow->offset = offset;
+
+    GFile *file = g_file_new_for_path(path);
+    follow->monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE, NULL, error);
+    g_object_unref(file);
+    if (!follow->monitor) {
+        FreeFileFollow(follow);
+        return NULL;
+    }
+    g_file_monitor_set_rate_limit(follow->monitor, FOLLOW_RATE_LIMIT_MS);
+    g_signal_connect(follow->monitor, "changed", G_CALLBACK(on_followed_file_changed), follow);
+
+    StartFollowRead(follow);
+    return follow;
+}
+
+void FileFollowStop(FileFollow *follow) {
+    if (!follow) return;
+    g_signal_handlers_disconnect_by_data(follow->monitor, follow);
+    g_file_monitor_cancel(follow->monitor);
+    g_object_unref(follow->monitor);
+    follow->monitor = NULL;
+
+    if (follow->reading) {
+        follow->stopped = TRUE;
+        g_cancellable_cancel(follow->cancellable);
+        return;
+    }
+    FreeFileFollow(follow);
+}
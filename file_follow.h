@@ -0,0 +1,26 @@
+// Follows a growing file, as tail -F does: watches it with a GFileMonitor and reads only
+// the bytes appended since the last read, decoded incrementally on a worker.
+#pragma once
+
+#include <gio/gio.h>
+#include "file_io.h"
+
+typedef struct FileFollow FileFollow;
+
+// Called on the main thread with newly appended text, as UTF-8. restart is TRUE when the
+// file was truncated or replaced (rotated); text is then the start of its new contents,
+// in encoding, and replaces what was shown before.
+typedef void (*FileFollowFunc)(const char *text, gsize length, gboolean restart,
+                               TextEncoding encoding, gpointer data);
+// Called once if reading fails (e.g. appended bytes are not valid text); nothing more is
+// reported afterwards and the follow should be stopped.
+typedef void (*FileFollowErrorFunc)(const GError *error, gpointer data);
+
+// Starts following path from byte offset, the end of what the caller has already shown,
+// which was decoded as encoding. Anything appended since is reported straight away.
+// A file that replaces it (rotation) is decoded in the same encoding.
+FileFollow *FileFollowStart(const char *path, guint64 offset, TextEncoding encoding,
+                            FileFollowFunc appended, FileFollowErrorFunc failed,
+                            gpointer data, GError **error);
+// No callbacks run after this returns.
+void FileFollowStop(FileFollow *follow);
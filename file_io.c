@@ -1,68 +1,228 @@
 // Text file load/save helpers with simple BOM detection for retropad.
 #include "file_io.h"
+#include "text_simd.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 
-static TextEncoding DetectEncoding(const guchar *data, gsize size) {
+#define TRANSCODE_BLOCK (64 * 1024)
+#define DETECT_SAMPLE_BYTES 4096
+#define PREFETCH_BYTES (64 * 1024 * 1024)   // Readahead is only requested for the start of a file
+
+// BOM-less UTF-16 shows up as NUL high bytes in every other position for Latin text.
+// Returns FALSE, leaving *encodingOut alone, if data doesn't look like UTF-16.
+static gboolean DetectUTF16WithoutBOM(const guchar *data, gsize size, TextEncoding *encodingOut) {
+    gsize sample = MIN(size, DETECT_SAMPLE_BYTES) & ~(gsize)1;
+    gsize pairs = sample / 2;
+    if (pairs < 2) return FALSE;
+
+    gsize evenNuls = 0;
+    gsize oddNuls = 0;
+    for (gsize i = 0; i < sample; i += 2) {
+        evenNuls += data[i] == 0;
+        oddNuls += data[i + 1] == 0;
+    }
+
+    if (oddNuls * 10 >= pairs * 4 && evenNuls * 10 < pairs) {
+        *encodingOut = ENC_UTF16LE;
+        return TRUE;
+    }
+    if (evenNuls * 10 >= pairs * 4 && oddNuls * 10 < pairs) {
+        *encodingOut = ENC_UTF16BE;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static gboolean StartsWithBOM(const guchar *data, gsize size) {
+    return (size >= 2 && data[0] == 0xFF && data[1] == 0xFE) ||
+           (size >= 2 && data[0] == 0xFE && data[1] == 0xFF) ||
+           (size >= 3 && data[0] == 0xEF && data[1] == 0xBB && data[2] == 0xBF);
+}
+
+// Strip a multi-byte sequence cut off at the end of a partial buffer before validating
+static gsize TrimIncompleteUTF8(const guchar *data, gsize size) {
+    gsize back = 0;
+    while (back < 3 && back < size && (data[size - 1 - back] & 0xC0) == 0x80) {
+        back++;
+    }
+    if (back >= size) return size;
+
+    guchar lead = data[size - 1 - back];
+    gsize needed = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+    return (back + 1 < needed) ? size - 1 - back : size;
+}
+
+// complete is FALSE when data is only the first chunk of a stream
+static TextEncoding DetectEncoding(const guchar *data, gsize size, gboolean complete) {
     if (size >= 2 && data[0] == 0xFF && data[1] == 0xFE) {
         return ENC_UTF16LE;
     }
     if (size >= 2 && data[0] == 0xFE && data[1] == 0xFF) {
         return ENC_UTF16BE;
     }
-    if (size >= 3 && data[0] == 0xEF && data[1] == 0xBB && data[2] == 0xBF) {
-        return ENC_UTF8;
+
+    TextEncoding utf16;
+    if (DetectUTF16WithoutBOM(data, size, &utf16)) {
+        return utf16;
     }
-    // Assume UTF-8 for Linux
-    return ENC_UTF8;
+
+    // Assume UTF-8 for Linux, but fall back to ANSI if it doesn't validate
+    gsize check = complete ? size : TrimIncompleteUTF8(data, size);
+    return Utf8Validate(data, check) ? ENC_UTF8 : ENC_ANSI;
 }
 
-static gboolean DecodeToUTF8(const guchar *data, gsize size, TextEncoding encoding, char **outText, size_t *outLength) {
-    char *result = NULL;
-    GError *error = NULL;
+static gsize BomLength(const guchar *data, gsize size, TextEncoding encoding) {
+    switch (encoding) {
+    case ENC_UTF16LE:
+        return (size >= 2 && data[0] == 0xFF && data[1] == 0xFE) ? 2 : 0;
+    case ENC_UTF16BE:
+        return (size >= 2 && data[0] == 0xFE && data[1] == 0xFF) ? 2 : 0;
+    case ENC_UTF8:
+        return (size >= 3 && data[0] == 0xEF && data[1] == 0xBB && data[2] == 0xBF) ? 3 : 0;
+    case ENC_ANSI:
+    default:
+        return 0;
+    }
+}
+
+TextEncoding DetectTextEncoding(const guchar *data, gsize size, gsize *bomLengthOut) {
+    TextEncoding enc = DetectEncoding(data, size, TRUE);
+    if (bomLengthOut) *bomLengthOut = BomLength(data, size, enc);
+    return enc;
+}
 
+gsize TextEncodingBomLength(const guchar *data, gsize size, TextEncoding encoding) {
+    return BomLength(data, size, encoding);
+}
+
+// UTF-16 goes through the text_simd.c transcoders; only ANSI still needs iconv
+static const char *IconvSourceCharset(TextEncoding encoding) {
     switch (encoding) {
-    case ENC_UTF16LE: {
-        if (size < 2) return FALSE;
-        gsize byteOffset = (data[0] == 0xFF && data[1] == 0xFE) ? 2 : 0;
-        result = g_convert((const gchar *)(data + byteOffset), size - byteOffset,
-                          "UTF-8", "UTF-16LE", NULL, NULL, &error);
-        break;
+    case ENC_ANSI: return "ISO-8859-1";
+    case ENC_UTF16LE:
+    case ENC_UTF16BE:
+    case ENC_UTF8:
+    default: return NULL;
     }
-    case ENC_UTF16BE: {
-        if (size < 2) return FALSE;
-        gsize byteOffset = (data[0] == 0xFE && data[1] == 0xFF) ? 2 : 0;
-        result = g_convert((const gchar *)(data + byteOffset), size - byteOffset,
-                          "UTF-8", "UTF-16BE", NULL, NULL, &error);
-        break;
+}
+
+static gboolean IsUTF16(TextEncoding encoding) {
+    return encoding == ENC_UTF16LE || encoding == ENC_UTF16BE;
+}
+
+// Same contract as IconvToString, for UTF-16 input: appends to out in TRANSCODE_BLOCK
+// steps and leaves a split trailing code unit or surrogate pair unconsumed unless atEnd.
+static gboolean UTF16ToString(const guchar *input, gsize size, gboolean bigEndian, gboolean atEnd,
+                              GString *out, gsize *consumed) {
+    gsize pos = 0;
+    gboolean ok = TRUE;
+
+    while (pos < size) {
+        gsize block = MIN(size - pos, TRANSCODE_BLOCK);
+        gsize oldLen = out->len;
+        gsize used = 0;
+        gsize produced = 0;
+        g_string_set_size(out, oldLen + Utf16ToUtf8Bound(block));
+        ok = Utf16ToUtf8(input + pos, block, bigEndian, (guchar *)out->str + oldLen, &used, &produced);
+        g_string_truncate(out, oldLen + produced);
+        pos += used;
+        if (!ok || used == 0) break;
     }
-    case ENC_UTF8: {
-        gsize byteOffset = (size >= 3 && data[0] == 0xEF && data[1] == 0xBB && data[2] == 0xBF) ? 3 : 0;
-        result = g_strndup((const gchar *)(data + byteOffset), size - byteOffset);
+
+    if (ok && pos < size && atEnd) ok = FALSE;   // Odd byte or lone high surrogate at the end
+    if (consumed) *consumed = pos;
+    return ok;
+}
+
+// Runs iconv over input in TRANSCODE_BLOCK steps, growing out directly so no full-size
+// intermediate buffer is needed. Stops early on a split trailing sequence unless atEnd.
+static gboolean IconvToString(GIConv cd, const gchar *input, gsize size, gboolean atEnd,
+                              GString *out, gsize *consumed) {
+    gchar *inBuf = (gchar *)input;
+    gsize inLeft = size;
+    gboolean ok = TRUE;
+
+    while (inLeft > 0) {
+        gsize oldLen = out->len;
+        g_string_set_size(out, oldLen + TRANSCODE_BLOCK);
+        gchar *outBuf = out->str + oldLen;
+        gsize outLeft = TRANSCODE_BLOCK;
+        gsize res = g_iconv(cd, &inBuf, &inLeft, &outBuf, &outLeft);
+        int err = errno;
+        g_string_truncate(out, oldLen + (TRANSCODE_BLOCK - outLeft));
+        if (res != (gsize)-1 || err == E2BIG) continue;
+        if (err != EINVAL || atEnd) ok = FALSE;   // EINVAL: incomplete trailing sequence
         break;
     }
-    case ENC_ANSI:
-    default: {
-        result = g_convert((const gchar *)data, size, "UTF-8", "ISO-8859-1", NULL, NULL, &error);
-        break;
+
+    if (consumed) *consumed = size - inLeft;
+    return ok;
+}
+
+static gboolean DecodeToUTF8(const guchar *data, gsize size, TextEncoding encoding, char **outText, size_t *outLength) {
+    if (encoding == ENC_UTF8) {
+        gsize byteOffset = BomLength(data, size, ENC_UTF8);
+        *outText = g_strndup((const gchar *)(data + byteOffset), size - byteOffset);
+        if (outLength) *outLength = size - byteOffset;
+        return TRUE;
     }
+
+    if (IsUTF16(encoding) && size < 2) return FALSE;
+
+    gsize byteOffset = BomLength(data, size, encoding);
+    GString *out = g_string_sized_new(size - byteOffset + (size - byteOffset) / 2 + 1);
+    gboolean ok;
+    if (IsUTF16(encoding)) {
+        ok = UTF16ToString(data + byteOffset, size - byteOffset, encoding == ENC_UTF16BE, TRUE, out, NULL);
+    } else {
+        GIConv cd = g_iconv_open("UTF-8", IconvSourceCharset(encoding));
+        if (cd == (GIConv)-1) {
+            g_string_free(out, TRUE);
+            return FALSE;
+        }
+        ok = IconvToString(cd, (const gchar *)(data + byteOffset), size - byteOffset, TRUE, out, NULL);
+        g_iconv_close(cd);
     }
 
-    if (error) {
-        g_error_free(error);
-        g_free(result);
+    if (!ok) {
+        g_string_free(out, TRUE);
         return FALSE;
     }
+    if (outLength) *outLength = out->len;
+    *outText = g_string_free(out, FALSE);
+    return TRUE;
+}
 
-    if (!result) return FALSE;
-    *outText = result;
-    if (outLength) {
-        *outLength = strlen(result);
+// Maps the file instead of reading it into a heap buffer, so the only full-size copy
+// made is the decoded result.
+static GMappedFile *MapTextFile(const char *path, const guchar **dataOut, gsize *sizeOut) {
+    GError *error = NULL;
+    GMappedFile *mapped = g_mapped_file_new(path, FALSE, &error);
+    if (!mapped) {
+        g_error_free(error);
+        return NULL;
     }
-    return TRUE;
+    *dataOut = (const guchar *)g_mapped_file_get_contents(mapped);
+    *sizeOut = g_mapped_file_get_length(mapped);
+    return mapped;
+}
+
+void PrefetchTextFile(const char *path) {
+#ifdef POSIX_FADV_WILLNEED
+    int fd = g_open(path, O_RDONLY, 0);
+    if (fd < 0) return;
+    // Starts reading into the page cache in the background; the descriptor is not needed
+    // for that to continue
+    posix_fadvise(fd, 0, PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+    close(fd);
+#endif
 }
 
 gboolean LoadTextFile(void *owner, const char *path, char **textOut, size_t *lengthOut, TextEncoding *encodingOut) {
@@ -70,105 +230,444 @@ gboolean LoadTextFile(void *owner, const char *path, char **textOut, size_t *len
     if (lengthOut) *lengthOut = 0;
     if (encodingOut) *encodingOut = ENC_UTF8;
 
-    GError *error = NULL;
-    gchar *buffer = NULL;
+    const guchar *data = NULL;
     gsize bytes = 0;
-
-    if (!g_file_get_contents(path, &buffer, &bytes, &error)) {
-        g_error_free(error);
+    GMappedFile *mapped = MapTextFile(path, &data, &bytes);
+    if (!mapped) {
         return FALSE;
     }
 
     if (bytes == 0) {
-        char *empty = g_strdup("");
-        *textOut = empty;
-        if (lengthOut) *lengthOut = 0;
-        if (encodingOut) *encodingOut = ENC_UTF8;
-        g_free(buffer);
+        *textOut = g_strdup("");
+        g_mapped_file_unref(mapped);
         return TRUE;
     }
 
-    TextEncoding enc = DetectEncoding((const guchar *)buffer, bytes);
+    TextEncoding enc = DetectEncoding(data, bytes, TRUE);
     char *text = NULL;
     size_t len = 0;
-    if (!DecodeToUTF8((const guchar *)buffer, bytes, enc, &text, &len)) {
-        g_free(buffer);
+    gboolean ok = DecodeToUTF8(data, bytes, enc, &text, &len);
+    g_mapped_file_unref(mapped);
+    if (!ok) {
         return FALSE;
     }
 
-    g_free(buffer);
     *textOut = text;
     if (lengthOut) *lengthOut = len;
     if (encodingOut) *encodingOut = enc;
     return TRUE;
 }
 
-static gboolean WriteUTF8WithBOM(FILE *file, const char *text, size_t length) {
-    static const guchar bom[] = {0xEF, 0xBB, 0xBF};
-    if (fwrite(bom, sizeof(bom), 1, file) != 1) {
+gboolean LoadTextFileBytes(const char *path, GBytes **textOut, TextEncoding *encodingOut) {
+    *textOut = NULL;
+    if (encodingOut) *encodingOut = ENC_UTF8;
+
+    const guchar *data = NULL;
+    gsize bytes = 0;
+    GMappedFile *mapped = MapTextFile(path, &data, &bytes);
+    if (!mapped) {
         return FALSE;
     }
-    if (fwrite(text, 1, length, file) != length) {
-        return FALSE;
+
+    gsize bom = 0;
+    TextEncoding enc = DetectTextEncoding(data, bytes, &bom);
+    if (enc == ENC_UTF8) {
+        // Hand out a view of the mapping itself: no copy, BOM skipped
+        GBytes *all = g_mapped_file_get_bytes(mapped);
+        *textOut = g_bytes_new_from_bytes(all, bom, bytes - bom);
+        g_bytes_unref(all);
+    } else {
+        char *text = NULL;
+        size_t len = 0;
+        if (!DecodeToUTF8(data, bytes, enc, &text, &len)) {
+            g_mapped_file_unref(mapped);
+            return FALSE;
+        }
+        *textOut = g_bytes_new_take(text, len);
     }
+
+    g_mapped_file_unref(mapped);
+    if (encodingOut) *encodingOut = enc;
     return TRUE;
 }
 
-static gboolean WriteUTF16LE(FILE *file, const char *text, size_t length) {
-    static const guchar bom[] = {0xFF, 0xFE};
-    if (fwrite(bom, sizeof(bom), 1, file) != 1) {
-        return FALSE;
+static gboolean WriteBOM(FILE *file, TextEncoding encoding) {
+    static const guchar bomUTF8[] = {0xEF, 0xBB, 0xBF};
+    static const guchar bomLE[] = {0xFF, 0xFE};
+    static const guchar bomBE[] = {0xFE, 0xFF};
+    switch (encoding) {
+    case ENC_UTF16LE:
+        return fwrite(bomLE, sizeof(bomLE), 1, file) == 1;
+    case ENC_UTF16BE:
+        return fwrite(bomBE, sizeof(bomBE), 1, file) == 1;
+    case ENC_ANSI:
+        return TRUE;
+    case ENC_UTF8:
+    default:
+        return fwrite(bomUTF8, sizeof(bomUTF8), 1, file) == 1;
     }
-    GError *error = NULL;
-    gchar *converted = g_convert(text, length, "UTF-16LE", "UTF-8", NULL, NULL, &error);
-    if (error) {
-        g_error_free(error);
+}
+
+// Encodes UTF-8 text into charset one TRANSCODE_BLOCK at a time, writing each block
+// straight to the file; extra memory is constant and lengths are exact byte counts.
+static gboolean WriteConverted(FILE *file, const char *text, size_t length, const char *charset) {
+    GIConv cd = g_iconv_open(charset, "UTF-8");
+    if (cd == (GIConv)-1) {
         return FALSE;
     }
-    gsize conv_len = strlen(converted);
-    gboolean ok = fwrite(converted, 1, conv_len, file) == conv_len;
-    g_free(converted);
+
+    gchar *block = g_malloc(TRANSCODE_BLOCK);
+    gchar *inBuf = (gchar *)text;
+    gsize inLeft = length;
+    gboolean ok = TRUE;
+
+    while (ok && inLeft > 0) {
+        gchar *outBuf = block;
+        gsize outLeft = TRANSCODE_BLOCK;
+        gsize res = g_iconv(cd, &inBuf, &inLeft, &outBuf, &outLeft);
+        int err = errno;
+        gsize produced = TRANSCODE_BLOCK - outLeft;
+        if (produced > 0 && fwrite(block, 1, produced, file) != produced) {
+            ok = FALSE;
+        }
+        if (res == (gsize)-1 && err != E2BIG) {
+            ok = FALSE;   // Unrepresentable character or malformed input
+        }
+    }
+
+    g_free(block);
+    g_iconv_close(cd);
     return ok;
 }
 
-static gboolean WriteANSI(FILE *file, const char *text, size_t length) {
-    GError *error = NULL;
-    gchar *converted = g_convert(text, length, "ISO-8859-1", "UTF-8", NULL, NULL, &error);
-    if (error) {
-        g_error_free(error);
-        return FALSE;
+// Encodes with the text_simd.c transcoder one TRANSCODE_BLOCK of UTF-8 at a time; a
+// sequence split by the block boundary is picked up at the start of the next block.
+static gboolean WriteUTF16(FILE *file, const char *text, size_t length, gboolean bigEndian) {
+    guchar *block = g_malloc(Utf8ToUtf16Bound(TRANSCODE_BLOCK));
+    const guchar *input = (const guchar *)text;
+    gsize pos = 0;
+    gboolean ok = TRUE;
+
+    while (ok && pos < length) {
+        gsize used = 0;
+        gsize produced = 0;
+        ok = Utf8ToUtf16(input + pos, MIN(length - pos, TRANSCODE_BLOCK), bigEndian, block, &used, &produced);
+        if (produced > 0 && fwrite(block, 1, produced, file) != produced) {
+            ok = FALSE;
+        }
+        if (used == 0) {
+            ok = FALSE;   // Malformed or truncated input
+        }
+        pos += used;
     }
-    gsize conv_len = strlen(converted);
-    gboolean ok = fwrite(converted, 1, conv_len, file) == conv_len;
-    g_free(converted);
+
+    g_free(block);
     return ok;
 }
 
-gboolean SaveTextFile(void *owner, const char *path, const char *text, size_t length, TextEncoding encoding) {
-    FILE *file = g_fopen(path, "wb");
-    if (!file) {
-        return FALSE;
-    }
+static gboolean WriteANSI(FILE *file, const char *text, size_t length) {
+    return WriteConverted(file, text, length, "ISO-8859-1");
+}
 
-    gboolean ok = FALSE;
+// Encodes one run of UTF-8 text; the BOM is written separately, once per file
+static gboolean WriteEncoded(FILE *file, const char *text, size_t length, TextEncoding encoding) {
     switch (encoding) {
     case ENC_UTF16LE:
-        ok = WriteUTF16LE(file, text, length);
-        break;
-    case ENC_ANSI:
-        ok = WriteANSI(file, text, length);
-        break;
     case ENC_UTF16BE:
-        // Saving as UTF-16BE is uncommon; fall back to UTF-8 with BOM to preserve readability
-        ok = WriteUTF8WithBOM(file, text, length);
-        encoding = ENC_UTF8;
-        break;
+        return WriteUTF16(file, text, length, encoding == ENC_UTF16BE);
+    case ENC_ANSI:
+        return WriteANSI(file, text, length);
     case ENC_UTF8:
     default:
-        ok = WriteUTF8WithBOM(file, text, length);
-        break;
+        return fwrite(text, 1, length, file) == length;
+    }
+}
+
+// Save in place of a symlink's target rather than replacing the link itself
+static char *ResolveSaveTarget(const char *path) {
+    char *resolved = realpath(path, NULL);
+    if (!resolved) {
+        return g_strdup(path);
+    }
+    char *target = g_strdup(resolved);
+    free(resolved);
+    return target;
+}
+
+// Mode open(2) would give a new file created with 0666. The umask can only be read by
+// setting it, and saves run on worker threads, so that is done once.
+static mode_t NewFileMode(void) {
+    static gsize mode = 0;      // Stored plus one, as g_once needs a non-zero value
+    if (g_once_init_enter(&mode)) {
+        mode_t mask = umask(0);
+        umask(mask);
+        g_once_init_leave(&mode, (gsize)(0666 & ~mask) + 1);
+    }
+    return (mode_t)(mode - 1);
+}
+
+static void SyncDirectory(const char *dir) {
+    int fd = g_open(dir, O_RDONLY | O_DIRECTORY, 0);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+typedef gboolean (*SaveWriter)(FILE *file, gpointer data);
+
+// Writes to a temp file next to the target, fsyncs it and renames it over the target,
+// so a crash mid-save leaves either the old file or the new one, never a truncated one.
+static gboolean SaveAtomically(const char *path, SaveWriter writer, gpointer data) {
+    char *target = ResolveSaveTarget(path);
+    char *dir = g_path_get_dirname(target);
+    char *base = g_path_get_basename(target);
+    char *tempPath = g_strdup_printf("%s/.%s.XXXXXX", dir, base);
+    g_free(base);
+
+    int fd = g_mkstemp(tempPath);
+    if (fd < 0) {
+        g_free(tempPath);
+        g_free(dir);
+        g_free(target);
+        return FALSE;
+    }
+
+    // mkstemp creates the file 0600: keep the permissions of the file being replaced, or
+    // give a new one what the umask allows
+    GStatBuf st;
+    fchmod(fd, g_stat(target, &st) == 0 ? (st.st_mode & 07777) : NewFileMode());
+
+    FILE *file = fdopen(fd, "wb");
+    if (!file) {
+        close(fd);
+        g_unlink(tempPath);
+        g_free(tempPath);
+        g_free(dir);
+        g_free(target);
+        return FALSE;
+    }
+
+    gboolean ok = writer(file, data);
+
+    if (ok) {
+        ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    }
+    if (fclose(file) != 0) {
+        ok = FALSE;
+    }
+    if (ok) {
+        ok = g_rename(tempPath, target) == 0;
     }
 
-    fclose(file);
+    if (ok) {
+        SyncDirectory(dir);
+    } else {
+        g_unlink(tempPath);
+    }
+
+    g_free(tempPath);
+    g_free(dir);
+    g_free(target);
     return ok;
 }
+
+typedef struct TextWrite {
+    const char *text;
+    size_t length;
+    TextEncoding encoding;
+    TextSpanSource source;
+    gpointer sourceData;
+    FILE *file;
+} TextWrite;
+
+static gboolean WriteText(FILE *file, gpointer data) {
+    const TextWrite *write = (const TextWrite *)data;
+    return WriteBOM(file, write->encoding) &&
+           WriteEncoded(file, write->text, write->length, write->encoding);
+}
+
+gboolean SaveTextFile(void *owner, const char *path, const char *text, size_t length, TextEncoding encoding) {
+    TextWrite write = { text, length, encoding, NULL, NULL, NULL };
+    return SaveAtomically(path, WriteText, &write);
+}
+
+static gboolean WriteSpan(const char *text, gsize length, gpointer data) {
+    const TextWrite *write = (const TextWrite *)data;
+    return WriteEncoded(write->file, text, length, write->encoding);
+}
+
+static gboolean WriteSpans(FILE *file, gpointer data) {
+    TextWrite *write = (TextWrite *)data;
+    write->file = file;
+    return WriteBOM(file, write->encoding) && write->source(write->sourceData, WriteSpan, write);
+}
+
+gboolean SaveTextSpans(const char *path, TextSpanSource source, gpointer sourceData, TextEncoding encoding) {
+    TextWrite write = { NULL, 0, encoding, source, sourceData, NULL };
+    return SaveAtomically(path, WriteSpans, &write);
+}
+
+// Without a BOM the decoder holds input back until it has the same sample that whole-file
+// detection looks at, so the UTF-16 heuristic sees enough code units to be trusted
+#define DECODER_DETECT_BYTES DETECT_SAMPLE_BYTES
+
+struct TextDecoder {
+    TextEncoding encoding;
+    gboolean detected;
+    gboolean guessed;       // UTF-8 picked from the first bytes alone; may turn out to be ANSI
+    gboolean lenient;       // Replace undecodable input instead of failing
+    GIConv iconv;
+    GByteArray *pending;    // Undecoded carry-over: BOM prefix or a split sequence
+};
+
+TextDecoder *TextDecoderNew(void) {
+    TextDecoder *decoder = g_new0(TextDecoder, 1);
+    decoder->encoding = ENC_UTF8;
+    decoder->iconv = (GIConv)-1;
+    decoder->pending = g_byte_array_new();
+    return decoder;
+}
+
+TextDecoder *TextDecoderNewForEncoding(TextEncoding encoding) {
+    TextDecoder *decoder = TextDecoderNew();
+    decoder->encoding = encoding;
+    decoder->detected = TRUE;
+    const char *charset = IconvSourceCharset(encoding);
+    if (charset) {
+        decoder->iconv = g_iconv_open("UTF-8", charset);
+    }
+    return decoder;
+}
+
+void TextDecoderFree(TextDecoder *decoder) {
+    if (!decoder) return;
+    if (decoder->iconv != (GIConv)-1) {
+        g_iconv_close(decoder->iconv);
+    }
+    g_byte_array_free(decoder->pending, TRUE);
+    g_free(decoder);
+}
+
+TextEncoding TextDecoderGetEncoding(const TextDecoder *decoder) {
+    return decoder->encoding;
+}
+
+// Decodes as much of data as forms complete characters; returns the number of bytes consumed.
+static gboolean DecodeAvailable(TextDecoder *decoder, const guchar *data, gsize size,
+                                gboolean atEnd, GString *out, gsize *consumed) {
+    *consumed = 0;
+
+    if (IsUTF16(decoder->encoding)) {
+        return UTF16ToString(data, size, decoder->encoding == ENC_UTF16BE, atEnd, out, consumed);
+    }
+
+    if (decoder->iconv == (GIConv)-1) {
+        if (Utf8Validate(data, size)) {
+            g_string_append_len(out, (const gchar *)data, size);
+            *consumed = size;
+            return TRUE;
+        }
+        gsize valid = Utf8ValidPrefix(data, size);
+        g_string_append_len(out, (const gchar *)data, valid);
+        *consumed = valid;
+        // A sequence cut off by the chunk boundary is fine; anything else is invalid input
+        if (!atEnd && TrimIncompleteUTF8(data, size) == valid) return TRUE;
+        if (!decoder->guessed) return FALSE;
+
+        // The guess was wrong: read the rest as ANSI, which takes any byte, rather than fail
+        decoder->guessed = FALSE;
+        decoder->encoding = ENC_ANSI;
+        decoder->iconv = g_iconv_open("UTF-8", IconvSourceCharset(ENC_ANSI));
+        if (decoder->iconv == (GIConv)-1) return FALSE;
+        gsize converted = 0;
+        gboolean ok = IconvToString(decoder->iconv, (const gchar *)data + valid, size - valid,
+                                    atEnd, out, &converted);
+        *consumed = valid + converted;
+        return ok;
+    }
+
+    return IconvToString(decoder->iconv, (const gchar *)data, size, atEnd, out, consumed);
+}
+
+// Puts U+FFFD in place of each code unit DecodeAvailable rejects and carries on after it
+static gboolean DecodeLeniently(TextDecoder *decoder, const guchar *data, gsize size,
+                                gboolean atEnd, GString *out, gsize *consumed) {
+    gsize pos = 0;
+    for (;;) {
+        gsize used = 0;
+        gboolean ok = DecodeAvailable(decoder, data + pos, size - pos, atEnd, out, &used);
+        pos += used;
+        if (ok || pos >= size) break;
+        g_string_append(out, "\xEF\xBF\xBD");
+        pos += IsUTF16(decoder->encoding) ? MIN(2, size - pos) : 1;
+    }
+    *consumed = pos;
+    return TRUE;
+}
+
+// settle decides the encoding from whatever is held back instead of waiting for more
+static gboolean Feed(TextDecoder *decoder, const guchar *data, gsize size, gboolean atEnd,
+                     gboolean settle, GString *out) {
+    const guchar *input = data;
+    gsize inputSize = size;
+
+    if (decoder->pending->len > 0) {
+        if (size > 0) {
+            g_byte_array_append(decoder->pending, data, size);
+        }
+        input = decoder->pending->data;
+        inputSize = decoder->pending->len;
+    }
+
+    if (!decoder->detected) {
+        if (inputSize < DECODER_DETECT_BYTES && !atEnd && !settle &&
+            !StartsWithBOM(input, inputSize)) {
+            if (input == data) {
+                g_byte_array_append(decoder->pending, data, size);
+            }
+            return TRUE;
+        }
+        decoder->encoding = DetectEncoding(input, inputSize, atEnd);
+        decoder->detected = TRUE;
+
+        const char *charset = IconvSourceCharset(decoder->encoding);
+        if (charset) {
+            decoder->iconv = g_iconv_open("UTF-8", charset);
+            if (decoder->iconv == (GIConv)-1) return FALSE;
+        }
+
+        gsize bom = BomLength(input, inputSize, decoder->encoding);
+        decoder->guessed = decoder->encoding == ENC_UTF8 && bom == 0;
+        input += bom;
+        inputSize -= bom;
+    }
+
+    gsize consumed = 0;
+    if (decoder->lenient) {
+        DecodeLeniently(decoder, input, inputSize, atEnd, out, &consumed);
+    } else if (!DecodeAvailable(decoder, input, inputSize, atEnd, out, &consumed)) {
+        return FALSE;
+    }
+
+    // Keep the undecoded tail for the next chunk
+    GByteArray *carry = g_byte_array_new();
+    g_byte_array_append(carry, input + consumed, inputSize - consumed);
+    g_byte_array_free(decoder->pending, TRUE);
+    decoder->pending = carry;
+
+    return !atEnd || decoder->pending->len == 0;
+}
+
+void TextDecoderSetLenient(TextDecoder *decoder) {
+    decoder->lenient = TRUE;
+}
+
+gboolean TextDecoderFeed(TextDecoder *decoder, const guchar *data, gsize size, gboolean atEnd, GString *out) {
+    return Feed(decoder, data, size, atEnd, FALSE, out);
+}
+
+gboolean TextDecoderSettle(TextDecoder *decoder, GString *out) {
+    if (decoder->detected || decoder->pending->len == 0) return TRUE;
+    return Feed(decoder, NULL, 0, FALSE, TRUE, out);
+}
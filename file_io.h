@@ -17,5 +17,38 @@ typedef struct FileResult {
     TextEncoding encoding;
 } FileResult;
 
+// Asks the kernel to start reading the beginning of path into the page cache, so a load
+// that follows soon finds it there. Returns at once; errors are ignored.
+void PrefetchTextFile(const char *path);
 gboolean LoadTextFile(void *owner, const char *path, char **textOut, size_t *lengthOut, TextEncoding *encodingOut);
+// Like LoadTextFile, but UTF-8 files come back as a zero-copy view of the memory-mapped file.
+gboolean LoadTextFileBytes(const char *path, GBytes **textOut, TextEncoding *encodingOut);
+TextEncoding DetectTextEncoding(const guchar *data, gsize size, gsize *bomLengthOut);
+// Length of the BOM for encoding that data starts with, or 0 if it has none.
+gsize TextEncodingBomLength(const guchar *data, gsize size, TextEncoding encoding);
 gboolean SaveTextFile(void *owner, const char *path, const char *text, size_t length, TextEncoding encoding);
+
+// Saves text that is held as a sequence of UTF-8 runs rather than one buffer. The source
+// calls emit with each run in order and returns FALSE as soon as emit does. Runs must
+// break on character boundaries; the BOM is written once, before the first.
+typedef gboolean (*TextSpanFunc)(const char *text, gsize length, gpointer data);
+typedef gboolean (*TextSpanSource)(gpointer source, TextSpanFunc emit, gpointer emitData);
+gboolean SaveTextSpans(const char *path, TextSpanSource source, gpointer sourceData, TextEncoding encoding);
+
+// Incremental decoder for streamed loads: detects the encoding from the first bytes,
+// then turns arbitrary-sized chunks into UTF-8, carrying split sequences across calls.
+// Input detected as UTF-8 (without a BOM) that later proves not to be is finished as
+// ANSI; TextDecoderGetEncoding then reports ENC_ANSI.
+typedef struct TextDecoder TextDecoder;
+
+TextDecoder *TextDecoderNew(void);
+// For text known to be in encoding that starts mid-file: no detection and no BOM.
+TextDecoder *TextDecoderNewForEncoding(TextEncoding encoding);
+void TextDecoderFree(TextDecoder *decoder);
+// From now on, input that cannot be decoded comes out as U+FFFD instead of failing Feed.
+void TextDecoderSetLenient(TextDecoder *decoder);
+gboolean TextDecoderFeed(TextDecoder *decoder, const guchar *data, gsize size, gboolean atEnd, GString *out);
+// Without a BOM, Feed holds back the first few KB until the encoding can be told apart.
+// A live stream that has gone quiet settles it from what has arrived so far instead.
+gboolean TextDecoderSettle(TextDecoder *decoder, GString *out);
+TextEncoding TextDecoderGetEncoding(const TextDecoder *decoder);
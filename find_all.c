@@ -0,0 +1,217 @@
+// Parallel find-all. The text is cut into chunks at character boundaries; each worker
+// collects the matches that start inside its chunk, reading up to one maximum match
+// length past the end. Chunks are scanned independently, so a chunk's first matches may
+// overlap the last match of the chunk before it; the merge rescans from that match's end
+// until it lands on a match the chunk also found, after which the two chains agree.
+#include "find_all.h"
+#include <string.h>
+
+#define FIND_ALL_MIN_CHUNK (4 * 1024 * 1024)   // Smaller texts are scanned on the caller's thread
+#define FIND_ALL_CHUNKS_PER_THREAD 4           // Spare chunks even out uneven match density
+#define FIND_ALL_CANCEL_INTERVAL 4096          // Matches between cancellation checks
+
+typedef struct FindAllJob FindAllJob;
+
+typedef struct FindAllChunk {
+    FindAllJob *job;
+    gsize start;
+    gsize end;
+    gsize limit;        // end plus the longest possible match, clamped to the text
+    GArray *matches;
+} FindAllChunk;
+
+struct FindAllJob {
+    const TextPattern *pattern;
+    const char *text;
+    GCancellable *cancellable;
+    GMutex lock;
+    GCond done;
+    guint pending;
+};
+
+typedef struct FindAllRequest {
+    GBytes *text;
+    char *needle;
+    gboolean matchCase;
+} FindAllRequest;
+
+static GThreadPool *g_findPool;
+
+static void ScanChunk(FindAllChunk *chunk) {
+    const FindAllJob *job = chunk->job;
+    gsize from = chunk->start;
+    guint sinceCheck = 0;
+    while (from < chunk->end) {
+        if (++sinceCheck == FIND_ALL_CANCEL_INTERVAL) {
+            sinceCheck = 0;
+            if (g_cancellable_is_cancelled(job->cancellable)) break;
+        }
+        TextMatch match;
+        gssize found = TextPatternFindForward(job->pattern, job->text, chunk->limit, from, &match.length);
+        if (found < 0 || (gsize)found >= chunk->end) break;
+        match.start = found;
+        g_array_append_val(chunk->matches, match);
+        from = match.start + match.length;
+    }
+}
+
+static void ScanChunkThread(gpointer data, gpointer userData) {
+    FindAllChunk *chunk = (FindAllChunk *)data;
+    FindAllJob *job = chunk->job;
+    if (!g_cancellable_is_cancelled(job->cancellable)) {
+        ScanChunk(chunk);
+    }
+    g_mutex_lock(&job->lock);
+    if (--job->pending == 0) {
+        g_cond_signal(&job->done);
+    }
+    g_mutex_unlock(&job->lock);
+}
+
+static GThreadPool *GetFindPool(void) {
+    static gsize ready = 0;
+    if (g_once_init_enter(&ready)) {
+        g_findPool = g_thread_pool_new(ScanChunkThread, NULL, g_get_num_processors(), FALSE, NULL);
+        g_once_init_leave(&ready, 1);
+    }
+    return g_findPool;
+}
+
+// Appends one chunk's matches, first rescanning past any that overlap the previous chunk's
+// last match. prevEnd is the end of the last match kept so far.
+static void MergeChunk(GArray *merged, const FindAllChunk *chunk, const FindAllJob *job,
+                       gsize *prevEnd) {
+    const TextMatch *found = (const TextMatch *)chunk->matches->data;
+    guint count = chunk->matches->len;
+    guint next = 0;
+
+    if (count == 0 || found[0].start < *prevEnd) {
+        for (;;) {
+            TextMatch match;
+            gssize pos = TextPatternFindForward(job->pattern, job->text, chunk->limit,
+                                                *prevEnd, &match.length);
+            if (pos < 0 || (gsize)pos >= chunk->end) return;
+            match.start = pos;
+            while (next < count && found[next].start < match.start) next++;
+            if (next < count && found[next].start == match.start) break;
+            g_array_append_val(merged, match);
+            *prevEnd = match.start + match.length;
+        }
+    }
+
+    if (next < count) {
+        g_array_append_vals(merged, found + next, count - next);
+        *prevEnd = found[count - 1].start + found[count - 1].length;
+    }
+}
+
+static gsize NextCharBoundary(const char *text, gsize length, gsize pos) {
+    while (pos < length && ((guchar)text[pos] & 0xC0) == 0x80) pos++;
+    return pos;
+}
+
+GArray *FindAllMatches(const TextPattern *pattern, const char *text, gsize length,
+                       GCancellable *cancellable) {
+    GArray *merged = g_array_new(FALSE, FALSE, sizeof(TextMatch));
+    if (!pattern || !text) return merged;
+
+    FindAllJob job;
+    job.pattern = pattern;
+    job.text = text;
+    job.cancellable = cancellable;
+    g_mutex_init(&job.lock);
+    g_cond_init(&job.done);
+
+    guint threads = g_get_num_processors();
+    guint chunkCount = MIN(length / FIND_ALL_MIN_CHUNK, threads * FIND_ALL_CHUNKS_PER_THREAD);
+    if (threads < 2 || chunkCount < 2) chunkCount = 1;
+    gsize overlap = TextPatternMaxMatchLength(pattern);
+
+    FindAllChunk *chunks = g_new0(FindAllChunk, chunkCount);
+    gsize start = 0;
+    for (guint i = 0; i < chunkCount; i++) {
+        gsize end = (i + 1 == chunkCount) ? length
+                  : NextCharBoundary(text, length, (gsize)((guint64)length * (i + 1) / chunkCount));
+        chunks[i].job = &job;
+        chunks[i].start = start;
+        chunks[i].end = end;
+        chunks[i].limit = MIN(length, end + overlap);
+        chunks[i].matches = g_array_new(FALSE, FALSE, sizeof(TextMatch));
+        start = end;
+    }
+
+    if (chunkCount == 1) {
+        ScanChunk(&chunks[0]);
+    } else {
+        GThreadPool *pool = GetFindPool();
+        job.pending = chunkCount;
+        for (guint i = 0; i < chunkCount; i++) {
+            g_thread_pool_push(pool, &chunks[i], NULL);
+        }
+        g_mutex_lock(&job.lock);
+        while (job.pending > 0) {
+            g_cond_wait(&job.done, &job.lock);
+        }
+        g_mutex_unlock(&job.lock);
+    }
+
+    gboolean cancelled = g_cancellable_is_cancelled(cancellable);
+    gsize prevEnd = 0;
+    for (guint i = 0; i < chunkCount; i++) {
+        if (!cancelled) {
+            MergeChunk(merged, &chunks[i], &job, &prevEnd);
+        }
+        g_array_free(chunks[i].matches, TRUE);
+    }
+    g_free(chunks);
+    g_mutex_clear(&job.lock);
+    g_cond_clear(&job.done);
+
+    if (cancelled) {
+        g_array_free(merged, TRUE);
+        return NULL;
+    }
+    return merged;
+}
+
+static void FreeFindAllRequest(gpointer data) {
+    FindAllRequest *request = (FindAllRequest *)data;
+    g_bytes_unref(request->text);
+    g_free(request->needle);
+    g_free(request);
+}
+
+static void FindAllThread(GTask *task, gpointer sourceObject, gpointer taskData,
+                          GCancellable *cancellable) {
+    FindAllRequest *request = (FindAllRequest *)taskData;
+    gsize length = 0;
+    const char *text = g_bytes_get_data(request->text, &length);
+
+    TextPattern *pattern = TextPatternNew(request->needle, strlen(request->needle), request->matchCase);
+    GArray *matches = FindAllMatches(pattern, text, length, cancellable);
+    TextPatternFree(pattern);
+
+    if (!matches) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Search cancelled");
+        return;
+    }
+    g_task_return_pointer(task, matches, (GDestroyNotify)g_array_unref);
+}
+
+void FindAllMatchesAsync(GBytes *text, const char *needle, gboolean matchCase,
+                         GCancellable *cancellable, GAsyncReadyCallback callback,
+                         gpointer userData) {
+    FindAllRequest *request = g_new0(FindAllRequest, 1);
+    request->text = g_bytes_ref(text);
+    request->needle = g_strdup(needle ? needle : "");
+    request->matchCase = matchCase;
+
+    GTask *task = g_task_new(NULL, cancellable, callback, userData);
+    g_task_set_task_data(task, request, FreeFindAllRequest);
+    g_task_run_in_thread(task, FindAllThread);
+    g_object_unref(task);
+}
+
+GArray *FindAllMatchesFinish(GAsyncResult *result, GError **error) {
+    return g_task_propagate_pointer(G_TASK(result), error);
+}
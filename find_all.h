@@ -0,0 +1,25 @@
+// Parallel find-all over an immutable text snapshot
+#pragma once
+
+#include <gio/gio.h>
+#include "text_search.h"
+
+// One match, as a byte range of the searched text
+typedef struct TextMatch {
+    gsize start;
+    gsize length;
+} TextMatch;
+
+// Every non-overlapping match in text, in order, exactly as repeated
+// TextPatternFindForward calls would find them. The text is split into overlapping chunks
+// that are scanned on a shared worker pool; the caller blocks until they are merged.
+// Returns a GArray of TextMatch, or NULL if cancelled.
+GArray *FindAllMatches(const TextPattern *pattern, const char *text, gsize length,
+                       GCancellable *cancellable);
+
+// The same, run off the calling thread. The snapshot is referenced until the search
+// finishes, so the caller may drop its own copy at any time.
+void FindAllMatchesAsync(GBytes *text, const char *needle, gboolean matchCase,
+                         GCancellable *cancellable, GAsyncReadyCallback callback,
+                         gpointer userData);
+GArray *FindAllMatchesFinish(GAsyncResult *result, GError **error);
@@ -0,0 +1,205 @@
+// Myers' O(ND) diff over lines. The common prefix and suffix are trimmed first, which
+// is all a typical external edit needs; what remains is split into lines, each hashed
+// once, and the greedy forward search keeps one copy of its frontier per edit so the
+// script can be traced back. That copy is what limits D: past LINE_DIFF_MAX_EDITS the
+// changed region is reported as a single hunk instead.
+#include "line_diff.h"
+#include <string.h>
+
+#define LINE_DIFF_MAX_EDITS 2048            // Frontier copies cost O(D^2) memory
+#define LINE_DIFF_COMPARE_BLOCK 4096        // Bytes compared per memcmp when trimming
+
+typedef struct DiffLines {
+    const char *text;
+    GArray *starts;     // gsize: start of each line, plus the end of the last
+    GArray *hashes;     // guint64 per line
+} DiffLines;
+
+static gsize CommonPrefix(const char *a, const char *b, gsize limit) {
+    gsize pos = 0;
+    while (pos + LINE_DIFF_COMPARE_BLOCK <= limit &&
+           memcmp(a + pos, b + pos, LINE_DIFF_COMPARE_BLOCK) == 0) {
+        pos += LINE_DIFF_COMPARE_BLOCK;
+    }
+    while (pos < limit && a[pos] == b[pos]) pos++;
+    return pos;
+}
+
+// Common tail of a[0..aEnd) and b[0..bEnd), at most limit bytes
+static gsize CommonSuffix(const char *a, gsize aEnd, const char *b, gsize bEnd, gsize limit) {
+    gsize n = 0;
+    while (n + LINE_DIFF_COMPARE_BLOCK <= limit &&
+           memcmp(a + aEnd - n - LINE_DIFF_COMPARE_BLOCK,
+                  b + bEnd - n - LINE_DIFF_COMPARE_BLOCK, LINE_DIFF_COMPARE_BLOCK) == 0) {
+        n += LINE_DIFF_COMPARE_BLOCK;
+    }
+    while (n < limit && a[aEnd - n - 1] == b[bEnd - n - 1]) n++;
+    return n;
+}
+
+static void SplitLines(DiffLines *lines, const char *text, gsize start, gsize end) {
+    lines->text = text;
+    lines->starts = g_array_new(FALSE, FALSE, sizeof(gsize));
+    lines->hashes = g_array_new(FALSE, FALSE, sizeof(guint64));
+    gsize pos = start;
+    while (pos < end) {
+        const char *newline = memchr(text + pos, '\n', end - pos);
+        gsize next = newline ? (gsize)(newline - text) + 1 : end;
+        // FNV-1a
+        guint64 hash = 14695981039346656037ULL;
+        for (gsize i = pos; i < next; i++) {
+            hash = (hash ^ (guchar)text[i]) * 1099511628211ULL;
+        }
+        g_array_append_val(lines->starts, pos);
+        g_array_append_val(lines->hashes, hash);
+        pos = next;
+    }
+    g_array_append_val(lines->starts, end);
+}
+
+static void FreeLines(DiffLines *lines) {
+    g_array_free(lines->starts, TRUE);
+    g_array_free(lines->hashes, TRUE);
+}
+
+static gboolean LinesEqual(const DiffLines *a, gint x, const DiffLines *b, gint y) {
+    if (g_array_index(a->hashes, guint64, x) != g_array_index(b->hashes, guint64, y)) return FALSE;
+    gsize aStart = g_array_index(a->starts, gsize, x);
+    gsize aLength = g_array_index(a->starts, gsize, x + 1) - aStart;
+    gsize bStart = g_array_index(b->starts, gsize, y);
+    gsize bLength = g_array_index(b->starts, gsize, y + 1) - bStart;
+    return aLength == bLength && memcmp(a->text + aStart, b->text + bStart, aLength) == 0;
+}
+
+static void AppendHunk(GArray *hunks, const DiffLines *a, gint x0, gint x1,
+                       const DiffLines *b, gint y0, gint y1) {
+    LineDiffHunk hunk;
+    hunk.oldStart = g_array_index(a->starts, gsize, x0);
+    hunk.oldLength = g_array_index(a->starts, gsize, x1) - hunk.oldStart;
+    hunk.newStart = g_array_index(b->starts, gsize, y0);
+    hunk.newLength = g_array_index(b->starts, gsize, y1) - hunk.newStart;
+    g_array_append_val(hunks, hunk);
+}
+
+// One step of the traced-back edit script: delete old line x, or insert new line y,
+// starting from the point (x, y)
+typedef struct DiffEdit {
+    gint x;
+    gint y;
+    gboolean insert;
+} DiffEdit;
+
+// Appends the hunks turning a's lines into b's. FALSE if cancelled; TRUE with nothing
+// appended if the edit limit was hit.
+static gboolean MyersDiff(const DiffLines *a, const DiffLines *b, GArray *hunks,
+                          GCancellable *cancellable, gboolean *tooMany) {
+    gint n = a->hashes->len;
+    gint m = b->hashes->len;
+    gint maxD = MIN(n + m, LINE_DIFF_MAX_EDITS);
+    gint *v = g_new0(gint, 2 * maxD + 3);
+    gint *center = v + maxD + 1;       // center[k] for k in [-maxD - 1, maxD + 1]
+    GPtrArray *trace = g_ptr_array_new_with_free_func(g_free);
+    gint found = -1;
+    *tooMany = FALSE;
+
+    for (gint d = 0; d <= maxD && found < 0; d++) {
+        if (g_cancellable_is_cancelled(cancellable)) {
+            g_ptr_array_free(trace, TRUE);
+            g_free(v);
+            return FALSE;
+        }
+        for (gint k = -d; k <= d; k += 2) {
+            gint x = (k == -d || (k != d && center[k - 1] < center[k + 1]))
+                ? center[k + 1] : center[k - 1] + 1;
+            gint y = x - k;
+            while (x < n && y < m && LinesEqual(a, x, b, y)) {
+                x++;
+                y++;
+            }
+            center[k] = x;
+            if (x >= n && y >= m) {
+                found = d;
+                break;
+            }
+        }
+        // Frontier after step d, for k in [-d, d]
+        gint *copy = g_new(gint, 2 * d + 1);
+        memcpy(copy, center - d, (2 * d + 1) * sizeof(gint));
+        g_ptr_array_add(trace, copy);
+    }
+    g_free(v);
+
+    if (found < 0) {
+        g_ptr_array_free(trace, TRUE);
+        *tooMany = TRUE;
+        return TRUE;
+    }
+
+    // Trace back from (n, m), collecting the edits last to first
+    GArray *edits = g_array_new(FALSE, FALSE, sizeof(DiffEdit));
+    gint x = n, y = m;
+    for (gint d = found; d > 0; d--) {
+        const gint *prev = (const gint *)g_ptr_array_index(trace, d - 1) + (d - 1);
+        gint k = x - y;
+        gboolean insert = k == -d || (k != d && prev[k - 1] < prev[k + 1]);
+        gint prevK = insert ? k + 1 : k - 1;
+        gint prevX = prev[prevK];
+        gint prevY = prevX - prevK;
+        DiffEdit edit = { prevX, prevY, insert };
+        g_array_append_val(edits, edit);
+        x = prevX;
+        y = prevY;
+    }
+    g_ptr_array_free(trace, TRUE);
+
+    // Consecutive edits, each starting where the last ended, form one hunk
+    gint x0 = 0, y0 = 0, x1 = -1, y1 = -1;
+    for (guint i = edits->len; i > 0; i--) {
+        const DiffEdit *edit = &g_array_index(edits, DiffEdit, i - 1);
+        if (edit->x != x1 || edit->y != y1) {
+            if (x1 >= 0) AppendHunk(hunks, a, x0, x1, b, y0, y1);
+            x0 = edit->x;
+            y0 = edit->y;
+        }
+        x1 = edit->x + (edit->insert ? 0 : 1);
+        y1 = edit->y + (edit->insert ? 1 : 0);
+    }
+    if (x1 >= 0) AppendHunk(hunks, a, x0, x1, b, y0, y1);
+    g_array_free(edits, TRUE);
+    return TRUE;
+}
+
+GArray *LineDiff(const char *oldText, gsize oldLength, const char *newText, gsize newLength,
+                 GCancellable *cancellable) {
+    GArray *hunks = g_array_new(FALSE, FALSE, sizeof(LineDiffHunk));
+
+    // Shared leading lines: back the common bytes off to the last line start
+    gsize prefix = CommonPrefix(oldText, newText, MIN(oldLength, newLength));
+    if (prefix == oldLength && prefix == newLength) return hunks;
+    while (prefix > 0 && oldText[prefix - 1] != '\n') prefix--;
+
+    // Shared trailing lines: the tail must start just after a newline inside it, so that
+    // the byte before it is common to both texts as well
+    gsize suffix = CommonSuffix(oldText, oldLength, newText, newLength,
+                                MIN(oldLength, newLength) - prefix);
+    const char *tail = oldText + oldLength - suffix;
+    const char *newline = suffix > 0 ? memchr(tail, '\n', suffix) : NULL;
+    suffix = newline ? suffix - (newline - tail) - 1 : 0;
+
+    DiffLines a, b;
+    SplitLines(&a, oldText, prefix, oldLength - suffix);
+    SplitLines(&b, newText, prefix, newLength - suffix);
+    gboolean tooMany = FALSE;
+    gboolean ok = MyersDiff(&a, &b, hunks, cancellable, &tooMany);
+    if (ok && tooMany) {
+        AppendHunk(hunks, &a, 0, a.hashes->len, &b, 0, b.hashes->len);
+    }
+    FreeLines(&a);
+    FreeLines(&b);
+
+    if (!ok) {
+        g_array_free(hunks, TRUE);
+        return NULL;
+    }
+    return hunks;
+}
@@ -0,0 +1,20 @@
+// Line-level diff between two texts, used to apply external changes to an open document
+#pragma once
+
+#include <gio/gio.h>
+
+// A run of whole lines that differs: oldLength bytes at oldStart in the old text became
+// newLength bytes at newStart in the new one. Either length may be zero.
+typedef struct LineDiffHunk {
+    gsize oldStart;
+    gsize oldLength;
+    gsize newStart;
+    gsize newLength;
+} LineDiffHunk;
+
+// Returns a GArray of LineDiffHunk in text order (empty if the texts are equal), or NULL
+// if cancelled. Lines shared at the start and end are skipped with plain byte
+// comparisons, so the cost beyond that is in the size of the changed region. Changes
+// too scattered to diff cheaply come back as one hunk covering that region.
+GArray *LineDiff(const char *oldText, gsize oldLength, const char *newText, gsize newLength,
+                 GCancellable *cancellable);
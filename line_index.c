@@ -0,0 +1,141 @@
+// The index keeps the start of every LINE_INDEX_STRIDE-th line rather than of every line,
+// so a billion-line log needs about 125 MB of index instead of 8 GB; a lookup scans at
+// most that many lines forward from the nearest entry. The worker publishes entries in
+// batches under a mutex, so readers on the UI thread never wait for more than an append.
+#include "line_index.h"
+#include <string.h>
+
+#define LINE_INDEX_STRIDE 64
+#define LINE_INDEX_BATCH (1024 * 1024)     // Bytes scanned between publishes
+
+struct LineIndex {
+    const char *text;
+    guint64 length;
+    GThread *thread;
+    gint stop;
+    GMutex lock;
+    GArray *starts;         // guint64: start of line k * LINE_INDEX_STRIDE
+    guint64 indexedBytes;   // Everything before this has been scanned
+    guint64 newlines;       // Newlines before indexedBytes
+    gboolean complete;
+};
+
+static gpointer LineIndexThread(gpointer data) {
+    LineIndex *index = (LineIndex *)data;
+    GArray *pending = g_array_new(FALSE, FALSE, sizeof(guint64));
+    guint64 newlines = 0;
+    guint64 pos = 0;
+
+    while (pos < index->length && !g_atomic_int_get(&index->stop)) {
+        guint64 end = MIN(index->length, pos + LINE_INDEX_BATCH);
+        const char *p = index->text + pos;
+        const char *stop = index->text + end;
+        while ((p = memchr(p, '\n', stop - p)) != NULL) {
+            p++;
+            if (++newlines % LINE_INDEX_STRIDE == 0) {
+                guint64 start = p - index->text;
+                g_array_append_val(pending, start);
+            }
+        }
+        pos = end;
+
+        g_mutex_lock(&index->lock);
+        g_array_append_vals(index->starts, pending->data, pending->len);
+        index->indexedBytes = pos;
+        index->newlines = newlines;
+        index->complete = pos == index->length;
+        g_mutex_unlock(&index->lock);
+        g_array_set_size(pending, 0);
+    }
+
+    g_array_free(pending, TRUE);
+    return NULL;
+}
+
+LineIndex *LineIndexNew(const char *text, guint64 length) {
+    LineIndex *index = g_new0(LineIndex, 1);
+    index->text = text;
+    index->length = length;
+    index->starts = g_array_new(FALSE, FALSE, sizeof(guint64));
+    guint64 zero = 0;
+    g_array_append_val(index->starts, zero);
+    g_mutex_init(&index->lock);
+    index->complete = length == 0;
+    if (length > 0) {
+        index->thread = g_thread_new("line-index", LineIndexThread, index);
+    }
+    return index;
+}
+
+void LineIndexFree(LineIndex *index) {
+    if (!index) return;
+    if (index->thread) {
+        g_atomic_int_set(&index->stop, 1);
+        g_thread_join(index->thread);
+    }
+    g_array_free(index->starts, TRUE);
+    g_mutex_clear(&index->lock);
+    g_free(index);
+}
+
+gboolean LineIndexIsComplete(LineIndex *index) {
+    g_mutex_lock(&index->lock);
+    gboolean complete = index->complete;
+    g_mutex_unlock(&index->lock);
+    return complete;
+}
+
+gint LineIndexProgress(LineIndex *index) {
+    if (index->length == 0) return 1000;
+    g_mutex_lock(&index->lock);
+    gint progress = (gint)(index->indexedBytes * 1000 / index->length);
+    g_mutex_unlock(&index->lock);
+    return progress;
+}
+
+guint64 LineIndexLineCount(LineIndex *index) {
+    g_mutex_lock(&index->lock);
+    guint64 lines = index->newlines + 1;
+    g_mutex_unlock(&index->lock);
+    return lines;
+}
+
+gboolean LineIndexLineStart(LineIndex *index, guint64 line, guint64 *offset) {
+    g_mutex_lock(&index->lock);
+    gboolean known = line <= index->newlines;
+    guint64 start = known ? g_array_index(index->starts, guint64, line / LINE_INDEX_STRIDE) : 0;
+    g_mutex_unlock(&index->lock);
+    if (!known) return FALSE;
+
+    // The line's start lies within the scanned part, so this always finds it
+    const char *p = index->text + start;
+    const char *end = index->text + index->length;
+    for (guint64 skip = line % LINE_INDEX_STRIDE; skip > 0; skip--) {
+        p = (const char *)memchr(p, '\n', end - p) + 1;
+    }
+    *offset = p - index->text;
+    return TRUE;
+}
+
+guint64 LineIndexLineAt(LineIndex *index, guint64 offset) {
+    offset = MIN(offset, index->length);
+
+    g_mutex_lock(&index->lock);
+    const guint64 *starts = (const guint64 *)index->starts->data;
+    guint lo = 0, hi = index->starts->len;
+    while (hi - lo > 1) {
+        guint mid = lo + (hi - lo) / 2;
+        if (starts[mid] <= offset) lo = mid; else hi = mid;
+    }
+    guint64 from = starts[lo];
+    g_mutex_unlock(&index->lock);
+
+    guint64 line = (guint64)lo * LINE_INDEX_STRIDE;
+    const char *p = index->text + from;
+    const char *end = index->text + offset;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        p++;
+        line++;
+    }
+    return line;
+}
@@ -0,0 +1,24 @@
+// Line-offset index over an immutable text, built on a background thread
+#pragma once
+
+#include <glib.h>
+
+typedef struct LineIndex LineIndex;
+
+// Starts indexing text at once. text must stay valid and unchanged until the index is
+// freed. Lookups work from the first moment, over whatever has been indexed so far.
+LineIndex *LineIndexNew(const char *text, guint64 length);
+// Stops the indexing thread if it is still running.
+void LineIndexFree(LineIndex *index);
+
+gboolean LineIndexIsComplete(LineIndex *index);
+// Permille of the text indexed
+gint LineIndexProgress(LineIndex *index);
+// Lines whose start is known: every line so far, or, once complete, the line count
+// (text ending in a newline has an empty last line, as in the editor).
+guint64 LineIndexLineCount(LineIndex *index);
+
+// Byte offset where a 0-based line starts; FALSE if that line has not been reached yet.
+gboolean LineIndexLineStart(LineIndex *index, guint64 line, guint64 *offset);
+// 0-based line containing offset. Offsets beyond the indexed part are counted directly.
+guint64 LineIndexLineAt(LineIndex *index, guint64 offset);
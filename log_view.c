@@ -0,0 +1,665 @@
+// Log viewer drawn on a GtkDrawingArea. The vertical adjustment counts lines, not pixels,
+// so its range is simply the number of lines indexed so far and grows while the index is
+// built; a draw lays out one PangoLayout per visible row and nothing else.
+#include "log_view.h"
+#include "line_index.h"
+#include "text_search.h"
+#include <string.h>
+
+#define LOG_VIEW_MARGIN 4                   // Pixels left of the text
+#define LOG_VIEW_MAX_LINE_BYTES (16 * 1024) // Longer lines are cut off on screen
+#define LOG_VIEW_INDEX_POLL_MS 100
+#define LOG_VIEW_DETECT_BYTES (64 * 1024)   // Sample used to tell the encoding
+#define LOG_VIEW_SEARCH_BLOCK (64 * 1024 * 1024)
+#define LOG_VIEW_NO_LINE G_MAXUINT64
+
+struct LogView {
+    GMappedFile *mapped;
+    const char *text;           // Past the BOM
+    guint64 length;
+    TextEncoding encoding;
+    LineIndex *index;
+
+    GtkWidget *grid;
+    GtkWidget *area;
+    GtkAdjustment *vadj;        // Lines
+    GtkAdjustment *hadj;        // Pixels
+    PangoFontDescription *font;
+    gint lineHeight;            // 0 until measured with the current font
+    gint maxWidth;              // Widest line drawn so far
+
+    guint64 anchor;             // Selection: anchor and caret, as byte offsets
+    guint64 caret;
+    guint64 caretLine;
+    guint64 goalColumn;         // Characters; kept while moving up and down
+    gboolean revealPending;     // Selection lies past the index; show it once reached
+    guint indexTimer;
+
+    void (*changed)(gpointer data);
+    gpointer changedData;
+};
+
+typedef struct LogFind {
+    GMappedFile *mapped;
+    const char *text;
+    guint64 length;
+    TextPattern *pattern;
+    gboolean forward;
+    guint64 from;               // Forward: search start; backward: limit
+    guint64 matchStart;
+    guint64 matchEnd;
+} LogFind;
+
+static void NotifyChanged(LogView *view) {
+    if (view->changed) {
+        view->changed(view->changedData);
+    }
+}
+
+// One line as displayed: UTF-8, without its line break, cut at LOG_VIEW_MAX_LINE_BYTES.
+// raw is TRUE when the text is byte for byte the file's, so byte offsets carry over.
+// next is the following line's start, or LOG_VIEW_NO_LINE after the last line or when
+// the index has not found it yet.
+static char *DisplayLine(LogView *view, guint64 start, guint64 line, guint64 *next,
+                         gsize *length, gboolean *raw) {
+    const char *p = view->text + start;
+    guint64 available = view->length - start;
+    gsize scan = (gsize)MIN(available, (guint64)LOG_VIEW_MAX_LINE_BYTES);
+    const char *newline = memchr(p, '\n', scan);
+    gsize bytes;
+
+    if (newline) {
+        bytes = newline - p;
+        *next = start + bytes + 1;
+    } else if (available <= LOG_VIEW_MAX_LINE_BYTES) {
+        bytes = available;
+        *next = LOG_VIEW_NO_LINE;
+    } else {
+        bytes = scan;
+        while (bytes > 0 && ((guchar)p[bytes] & 0xC0) == 0x80) bytes--;
+        if (!LineIndexLineStart(view->index, line + 1, next)) {
+            *next = LOG_VIEW_NO_LINE;
+        }
+    }
+    if (bytes > 0 && p[bytes - 1] == '\r') bytes--;
+
+    char *display = NULL;
+    if (view->encoding == ENC_ANSI) {
+        gsize written = 0;
+        display = g_convert(p, bytes, "UTF-8", "ISO-8859-1", NULL, &written, NULL);
+        *raw = display && written == bytes;
+        *length = display ? written : 0;
+    } else if (g_utf8_validate(p, bytes, NULL)) {
+        display = g_strndup(p, bytes);
+        *raw = TRUE;
+        *length = bytes;
+    } else {
+        display = g_utf8_make_valid(p, bytes);
+        *raw = FALSE;
+        *length = strlen(display);
+    }
+    return display ? display : g_strdup("");
+}
+
+static PangoLayout *CreateLineLayout(LogView *view) {
+    PangoLayout *layout = gtk_widget_create_pango_layout(view->area, NULL);
+    if (view->font) {
+        pango_layout_set_font_description(layout, view->font);
+    }
+    return layout;
+}
+
+static gint LineHeight(LogView *view) {
+    if (view->lineHeight == 0) {
+        PangoLayout *layout = CreateLineLayout(view);
+        pango_layout_set_text(layout, "Xg", -1);
+        pango_layout_get_pixel_size(layout, NULL, &view->lineHeight);
+        g_object_unref(layout);
+        view->lineHeight = MAX(view->lineHeight, 1);
+    }
+    return view->lineHeight;
+}
+
+static gint VisibleRows(LogView *view) {
+    return MAX(1, gtk_widget_get_allocated_height(view->area) / LineHeight(view));
+}
+
+static void UpdateScrollRange(LogView *view) {
+    gint rows = VisibleRows(view);
+    guint64 lines = LineIndexLineCount(view->index);
+    gtk_adjustment_configure(view->vadj, gtk_adjustment_get_value(view->vadj), 0, (gdouble)lines,
+                             1, MAX(1, rows - 1), MIN((gdouble)rows, (gdouble)lines));
+
+    gint width = gtk_widget_get_allocated_width(view->area);
+    gtk_adjustment_configure(view->hadj, gtk_adjustment_get_value(view->hadj), 0,
+                             view->maxWidth + 2 * LOG_VIEW_MARGIN, LineHeight(view),
+                             MAX(1, width - LineHeight(view)), width);
+}
+
+// Scrolls so the caret is on screen. The caret's line must already be indexed.
+static gboolean RevealCaret(LogView *view) {
+    guint64 lineStart;
+    if (!LineIndexLineStart(view->index, view->caretLine, &lineStart)) {
+        view->revealPending = TRUE;
+        return FALSE;
+    }
+    view->revealPending = FALSE;
+    UpdateScrollRange(view);
+
+    gint rows = VisibleRows(view);
+    guint64 top = (guint64)gtk_adjustment_get_value(view->vadj);
+    if (view->caretLine < top) {
+        top = view->caretLine;
+    } else if (view->caretLine >= top + rows) {
+        top = view->caretLine - rows + 1;
+    }
+    gtk_adjustment_set_value(view->vadj, (gdouble)top);
+
+    // Horizontally, keep the caret inside the page
+    guint64 next;
+    gsize length;
+    gboolean raw;
+    char *display = DisplayLine(view, lineStart, view->caretLine, &next, &length, &raw);
+    if (raw && view->caret - lineStart <= length) {
+        PangoLayout *layout = CreateLineLayout(view);
+        PangoRectangle pos;
+        pango_layout_set_text(layout, display, length);
+        pango_layout_index_to_pos(layout, (gint)(view->caret - lineStart), &pos);
+        gint x = pos.x / PANGO_SCALE;
+        gint width = gtk_widget_get_allocated_width(view->area) - 2 * LOG_VIEW_MARGIN;
+        gdouble left = gtk_adjustment_get_value(view->hadj);
+        if (x < left || x > left + width) {
+            if (x + 2 * LOG_VIEW_MARGIN > view->maxWidth) {
+                view->maxWidth = x + 2 * LOG_VIEW_MARGIN;
+                UpdateScrollRange(view);
+            }
+            gtk_adjustment_set_value(view->hadj, MAX(0, x - width / 2));
+        }
+        g_object_unref(layout);
+    }
+    g_free(display);
+
+    gtk_widget_queue_draw(view->area);
+    return TRUE;
+}
+
+static void SetSelection(LogView *view, guint64 anchor, guint64 caret) {
+    view->anchor = MIN(anchor, view->length);
+    view->caret = MIN(caret, view->length);
+    view->caretLine = LineIndexLineAt(view->index, view->caret);
+    RevealCaret(view);
+    NotifyChanged(view);
+}
+
+// Byte offset goalColumn characters into the line starting at start, or the line's end
+static guint64 OffsetAtColumn(LogView *view, guint64 start, guint64 column) {
+    const char *p = view->text + start;
+    const char *end = view->text + view->length;
+    while (column > 0 && p < end && *p != '\n') {
+        p = view->encoding == ENC_ANSI ? p + 1 : g_utf8_find_next_char(p, end);
+        if (!p) p = end;
+        column--;
+    }
+    return p - view->text;
+}
+
+static guint64 ColumnAtOffset(LogView *view, guint64 lineStart, guint64 offset) {
+    if (view->encoding == ENC_ANSI) return offset - lineStart;
+    return g_utf8_strlen(view->text + lineStart, offset - lineStart);
+}
+
+static void MoveCaretToLine(LogView *view, gint64 line, gboolean extend) {
+    guint64 lines = LineIndexLineCount(view->index);
+    line = CLAMP(line, 0, (gint64)lines - 1);
+    guint64 start;
+    if (!LineIndexLineStart(view->index, line, &start)) return;
+    guint64 caret = OffsetAtColumn(view, start, view->goalColumn);
+    SetSelection(view, extend ? view->anchor : caret, caret);
+}
+
+static void MoveCaretByChar(LogView *view, gboolean forward, gboolean extend) {
+    const char *p = view->text + view->caret;
+    const char *end = view->text + view->length;
+    if (forward && p < end) {
+        p = view->encoding == ENC_ANSI ? p + 1 : g_utf8_find_next_char(p, end);
+        if (!p) p = end;
+    } else if (!forward && p > view->text) {
+        p = view->encoding == ENC_ANSI ? p - 1 : g_utf8_find_prev_char(view->text, p);
+    }
+    guint64 caret = p - view->text;
+    SetSelection(view, extend ? view->anchor : caret, caret);
+
+    guint64 lineStart;
+    if (LineIndexLineStart(view->index, view->caretLine, &lineStart)) {
+        view->goalColumn = ColumnAtOffset(view, lineStart, view->caret);
+    }
+}
+
+static gboolean on_log_view_draw(GtkWidget *widget, cairo_t *cr, gpointer userData) {
+    LogView *view = (LogView *)userData;
+    GtkStyleContext *style = gtk_widget_get_style_context(widget);
+    gint width = gtk_widget_get_allocated_width(widget);
+    gint height = gtk_widget_get_allocated_height(widget);
+    gtk_render_background(style, cr, 0, 0, width, height);
+
+    GdkRGBA color;
+    gtk_style_context_get_color(style, gtk_style_context_get_state(style), &color);
+
+    guint64 line = (guint64)gtk_adjustment_get_value(view->vadj);
+    guint64 start;
+    if (!LineIndexLineStart(view->index, line, &start)) return FALSE;
+
+    PangoLayout *layout = CreateLineLayout(view);
+    gint lineHeight = LineHeight(view);
+    gdouble left = LOG_VIEW_MARGIN - gtk_adjustment_get_value(view->hadj);
+    guint64 selStart = MIN(view->anchor, view->caret);
+    guint64 selEnd = MAX(view->anchor, view->caret);
+    gint widest = view->maxWidth;
+
+    for (gint y = 0; y < height; y += lineHeight, line++) {
+        guint64 next;
+        gsize length;
+        gboolean raw;
+        char *display = DisplayLine(view, start, line, &next, &length, &raw);
+        pango_layout_set_text(layout, display, length);
+
+        gint lineWidth = 0;
+        pango_layout_get_pixel_size(layout, &lineWidth, NULL);
+        widest = MAX(widest, lineWidth + 2 * LOG_VIEW_MARGIN);
+
+        // Selection, where the displayed bytes are the file's
+        if (raw && selStart < selEnd && selStart <= start + length && selEnd >= start) {
+            PangoRectangle from, to;
+            pango_layout_index_to_pos(layout, (gint)(MAX(selStart, start) - start), &from);
+            pango_layout_index_to_pos(layout, (gint)(MIN(selEnd, start + length) - start), &to);
+            gdouble x1 = from.x / PANGO_SCALE;
+            gdouble x2 = selEnd > start + length ? lineWidth + lineHeight / 2 : to.x / PANGO_SCALE;
+            cairo_set_source_rgba(cr, 0.26, 0.52, 0.96, 0.35);
+            cairo_rectangle(cr, left + x1, y, x2 - x1, lineHeight);
+            cairo_fill(cr);
+        }
+
+        gdk_cairo_set_source_rgba(cr, &color);
+        cairo_move_to(cr, left, y);
+        pango_cairo_show_layout(cr, layout);
+
+        if (line == view->caretLine && gtk_widget_has_focus(widget) &&
+            view->caret >= start && view->caret - start <= length) {
+            PangoRectangle caret;
+            pango_layout_index_to_pos(layout, raw ? (gint)(view->caret - start) : 0, &caret);
+            cairo_rectangle(cr, left + caret.x / PANGO_SCALE, y, 1, lineHeight);
+            cairo_fill(cr);
+        }
+
+        g_free(display);
+        if (next == LOG_VIEW_NO_LINE) break;
+        start = next;
+    }
+    g_object_unref(layout);
+
+    if (widest > view->maxWidth) {
+        view->maxWidth = widest;
+        UpdateScrollRange(view);
+    }
+    return FALSE;
+}
+
+static void on_log_view_size_allocate(GtkWidget *widget, GdkRectangle *allocation, gpointer userData) {
+    UpdateScrollRange((LogView *)userData);
+}
+
+static void on_log_view_scrolled(GtkAdjustment *adjustment, gpointer userData) {
+    gtk_widget_queue_draw(((LogView *)userData)->area);
+}
+
+static gboolean on_log_view_scroll(GtkWidget *widget, GdkEventScroll *event, gpointer userData) {
+    LogView *view = (LogView *)userData;
+    gdouble dx = 0, dy = 0;
+    switch (event->direction) {
+    case GDK_SCROLL_UP:    dy = -3; break;
+    case GDK_SCROLL_DOWN:  dy = 3; break;
+    case GDK_SCROLL_LEFT:  dx = -3; break;
+    case GDK_SCROLL_RIGHT: dx = 3; break;
+    case GDK_SCROLL_SMOOTH:
+        gdk_event_get_scroll_deltas((GdkEvent *)event, &dx, &dy);
+        dx *= 3;
+        dy *= 3;
+        break;
+    default:
+        break;
+    }
+    gtk_adjustment_set_value(view->vadj, gtk_adjustment_get_value(view->vadj) + dy);
+    gtk_adjustment_set_value(view->hadj, gtk_adjustment_get_value(view->hadj) + dx * LineHeight(view));
+    return TRUE;
+}
+
+static gboolean on_log_view_button(GtkWidget *widget, GdkEventButton *event, gpointer userData) {
+    LogView *view = (LogView *)userData;
+    if (event->type != GDK_BUTTON_PRESS || event->button != GDK_BUTTON_PRIMARY) return FALSE;
+    gtk_widget_grab_focus(widget);
+
+    guint64 lines = LineIndexLineCount(view->index);
+    guint64 line = (guint64)gtk_adjustment_get_value(view->vadj) + (guint64)(event->y / LineHeight(view));
+    line = MIN(line, lines - 1);
+    guint64 start;
+    if (!LineIndexLineStart(view->index, line, &start)) return TRUE;
+
+    guint64 next;
+    gsize length;
+    gboolean raw;
+    char *display = DisplayLine(view, start, line, &next, &length, &raw);
+    guint64 caret = start;
+    if (raw) {
+        PangoLayout *layout = CreateLineLayout(view);
+        pango_layout_set_text(layout, display, length);
+        gdouble x = event->x - LOG_VIEW_MARGIN + gtk_adjustment_get_value(view->hadj);
+        gint index = 0, trailing = 0;
+        pango_layout_xy_to_index(layout, (gint)(x * PANGO_SCALE), 0, &index, &trailing);
+        const char *p = display + index;
+        while (trailing-- > 0 && *p) p = g_utf8_next_char(p);
+        caret = start + (p - display);
+        g_object_unref(layout);
+    }
+    g_free(display);
+
+    gboolean extend = (event->state & GDK_SHIFT_MASK) != 0;
+    SetSelection(view, extend ? view->anchor : caret, caret);
+    view->goalColumn = ColumnAtOffset(view, start, caret);
+    return TRUE;
+}
+
+static gboolean on_log_view_key(GtkWidget *widget, GdkEventKey *event, gpointer userData) {
+    LogView *view = (LogView *)userData;
+    gboolean extend = (event->state & GDK_SHIFT_MASK) != 0;
+    gboolean control = (event->state & GDK_CONTROL_MASK) != 0;
+    gint64 line = (gint64)view->caretLine;
+    gint rows = VisibleRows(view);
+
+    switch (event->keyval) {
+    case GDK_KEY_Up:        MoveCaretToLine(view, line - 1, extend); return TRUE;
+    case GDK_KEY_Down:      MoveCaretToLine(view, line + 1, extend); return TRUE;
+    case GDK_KEY_Page_Up:   MoveCaretToLine(view, line - rows + 1, extend); return TRUE;
+    case GDK_KEY_Page_Down: MoveCaretToLine(view, line + rows - 1, extend); return TRUE;
+    case GDK_KEY_Left:      MoveCaretByChar(view, FALSE, extend); return TRUE;
+    case GDK_KEY_Right:     MoveCaretByChar(view, TRUE, extend); return TRUE;
+    case GDK_KEY_Home:
+        view->goalColumn = 0;
+        MoveCaretToLine(view, control ? 0 : line, extend);
+        return TRUE;
+    case GDK_KEY_End:
+        view->goalColumn = G_MAXUINT64;
+        MoveCaretToLine(view, control ? G_MAXINT64 : line, extend);
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static gboolean on_log_view_focus(GtkWidget *widget, GdkEvent *event, gpointer userData) {
+    gtk_widget_queue_draw(widget);
+    return FALSE;
+}
+
+static gboolean on_index_poll(gpointer userData) {
+    LogView *view = (LogView *)userData;
+    gboolean complete = LineIndexIsComplete(view->index);
+    UpdateScrollRange(view);
+    if (view->revealPending) {
+        RevealCaret(view);
+    }
+    gtk_widget_queue_draw(view->area);
+    NotifyChanged(view);
+
+    if (complete) {
+        view->indexTimer = 0;
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// Looks at the start of the file only: validating gigabytes of UTF-8 up front would
+// cost the very time the viewer is meant to save. The sample ends at a line break so
+// it never cuts a character in two.
+static TextEncoding DetectViewerEncoding(const char *data, gsize size, gsize *bom) {
+    gsize sample = MIN(size, LOG_VIEW_DETECT_BYTES);
+    if (sample < size) {
+        const char *newline = g_strrstr_len(data, sample, "\n");
+        if (newline) sample = newline - data + 1;
+    }
+    return DetectTextEncoding((const guchar *)data, sample, bom);
+}
+
+LogView *LogViewOpen(const char *path, GError **error) {
+    GMappedFile *mapped = g_mapped_file_new(path, FALSE, error);
+    if (!mapped) return NULL;
+
+    const char *data = g_mapped_file_get_contents(mapped);
+    gsize size = g_mapped_file_get_length(mapped);
+    gsize bom = 0;
+    TextEncoding encoding = size > 0 ? DetectViewerEncoding(data, size, &bom) : ENC_UTF8;
+    if (encoding == ENC_UTF16LE || encoding == ENC_UTF16BE) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    "%s is UTF-16 and cannot be viewed in place", path);
+        g_mapped_file_unref(mapped);
+        return NULL;
+    }
+
+    LogView *view = g_new0(LogView, 1);
+    view->mapped = mapped;
+    view->text = data ? data + bom : "";
+    view->length = size - bom;
+    view->encoding = encoding;
+    view->index = LineIndexNew(view->text, view->length);
+
+    view->vadj = gtk_adjustment_new(0, 0, 1, 1, 1, 1);
+    view->hadj = gtk_adjustment_new(0, 0, 1, 1, 1, 1);
+    view->area = gtk_drawing_area_new();
+    gtk_widget_set_hexpand(view->area, TRUE);
+    gtk_widget_set_vexpand(view->area, TRUE);
+    gtk_widget_set_can_focus(view->area, TRUE);
+    gtk_widget_add_events(view->area, GDK_BUTTON_PRESS_MASK | GDK_KEY_PRESS_MASK |
+                          GDK_SCROLL_MASK | GDK_SMOOTH_SCROLL_MASK | GDK_FOCUS_CHANGE_MASK);
+    gtk_style_context_add_class(gtk_widget_get_style_context(view->area), GTK_STYLE_CLASS_VIEW);
+    g_signal_connect(view->area, "draw", G_CALLBACK(on_log_view_draw), view);
+    g_signal_connect(view->area, "size-allocate", G_CALLBACK(on_log_view_size_allocate), view);
+    g_signal_connect(view->area, "scroll-event", G_CALLBACK(on_log_view_scroll), view);
+    g_signal_connect(view->area, "button-press-event", G_CALLBACK(on_log_view_button), view);
+    g_signal_connect(view->area, "key-press-event", G_CALLBACK(on_log_view_key), view);
+    g_signal_connect(view->area, "focus-in-event", G_CALLBACK(on_log_view_focus), view);
+    g_signal_connect(view->area, "focus-out-event", G_CALLBACK(on_log_view_focus), view);
+    g_signal_connect(view->vadj, "value-changed", G_CALLBACK(on_log_view_scrolled), view);
+    g_signal_connect(view->hadj, "value-changed", G_CALLBACK(on_log_view_scrolled), view);
+
+    view->grid = gtk_grid_new();
+    gtk_grid_attach(GTK_GRID(view->grid), view->area, 0, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(view->grid),
+                    gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, view->vadj), 1, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(view->grid),
+                    gtk_scrollbar_new(GTK_ORIENTATION_HORIZONTAL, view->hadj), 0, 1, 1, 1);
+    g_object_ref_sink(view->grid);
+    gtk_widget_show_all(view->grid);
+
+    if (!LineIndexIsComplete(view->index)) {
+        view->indexTimer = g_timeout_add(LOG_VIEW_INDEX_POLL_MS, on_index_poll, view);
+    }
+    return view;
+}
+
+void LogViewFree(LogView *view) {
+    if (!view) return;
+    if (view->indexTimer) {
+        g_source_remove(view->indexTimer);
+    }
+    gtk_widget_destroy(view->grid);
+    g_object_unref(view->grid);
+    LineIndexFree(view->index);
+    if (view->font) {
+        pango_font_description_free(view->font);
+    }
+    g_mapped_file_unref(view->mapped);
+    g_free(view);
+}
+
+GtkWidget *LogViewGetWidget(LogView *view) {
+    return view->grid;
+}
+
+void LogViewGrabFocus(LogView *view) {
+    gtk_widget_grab_focus(view->area);
+}
+
+TextEncoding LogViewGetEncoding(LogView *view) {
+    return view->encoding;
+}
+
+void LogViewSetFont(LogView *view, const PangoFontDescription *font) {
+    if (view->font) {
+        pango_font_description_free(view->font);
+    }
+    view->font = font ? pango_font_description_copy(font) : NULL;
+    view->lineHeight = 0;
+    view->maxWidth = 0;
+    UpdateScrollRange(view);
+    gtk_widget_queue_draw(view->area);
+}
+
+void LogViewSetChangedFunc(LogView *view, void (*func)(gpointer data), gpointer data) {
+    view->changed = func;
+    view->changedData = data;
+}
+
+void LogViewGetPosition(LogView *view, LogViewPosition *position) {
+    position->line = view->caretLine + 1;
+    position->column = 1;
+    guint64 lineStart;
+    if (LineIndexLineStart(view->index, view->caretLine, &lineStart)) {
+        position->column = ColumnAtOffset(view, lineStart, view->caret) + 1;
+    }
+    position->lines = LineIndexLineCount(view->index);
+    position->progress = LineIndexProgress(view->index);
+}
+
+gboolean LogViewGotoLine(LogView *view, guint64 line) {
+    guint64 start;
+    if (!LineIndexLineStart(view->index, line, &start)) return FALSE;
+    view->goalColumn = 0;
+    SetSelection(view, start, start);
+    LogViewGrabFocus(view);
+    return TRUE;
+}
+
+void LogViewSelect(LogView *view, guint64 start, guint64 end) {
+    SetSelection(view, start, end);
+}
+
+void LogViewCopySelection(LogView *view, GtkClipboard *clipboard) {
+    guint64 start = MIN(view->anchor, view->caret);
+    guint64 end = MAX(view->anchor, view->caret);
+    if (start == end) return;
+
+    const char *p = view->text + start;
+    gsize length = end - start;
+    char *text = view->encoding == ENC_ANSI
+        ? g_convert(p, length, "UTF-8", "ISO-8859-1", NULL, NULL, NULL)
+        : g_utf8_make_valid(p, length);
+    if (text) {
+        gtk_clipboard_set_text(clipboard, text, -1);
+        g_free(text);
+    }
+}
+
+static void FreeLogFind(gpointer data) {
+    LogFind *find = (LogFind *)data;
+    g_mapped_file_unref(find->mapped);
+    TextPatternFree(find->pattern);
+    g_free(find);
+}
+
+// The mapping is one contiguous text, so blocks are just limits on a single scan; they
+// exist to check for cancellation. Matches starting in the overlap are found again,
+// whole, by the next block.
+static gint64 FindForwardFrom(const LogFind *find, guint64 from, gsize overlap,
+                              GCancellable *cancellable, gsize *matchLength) {
+    for (guint64 pos = from; pos < find->length; pos += LOG_VIEW_SEARCH_BLOCK) {
+        if (g_cancellable_is_cancelled(cancellable)) return -1;
+        guint64 limit = MIN(find->length, pos + LOG_VIEW_SEARCH_BLOCK + overlap);
+        gssize found = TextPatternFindForward(find->pattern, find->text, limit, pos, matchLength);
+        if (found >= 0 && ((guint64)found < pos + LOG_VIEW_SEARCH_BLOCK || limit == find->length)) {
+            return found;
+        }
+    }
+    return -1;
+}
+
+static gint64 FindBackwardFrom(const LogFind *find, guint64 limit, gsize overlap,
+                               GCancellable *cancellable, gsize *matchLength) {
+    guint64 end = limit;
+    for (;;) {
+        if (g_cancellable_is_cancelled(cancellable)) return -1;
+        guint64 start = end > LOG_VIEW_SEARCH_BLOCK + overlap ? end - LOG_VIEW_SEARCH_BLOCK - overlap : 0;
+        gssize found = TextPatternFindBackward(find->pattern, find->text + start, end - start,
+                                               matchLength);
+        if (found >= 0) return start + found;
+        if (start == 0) return -1;
+        end = start + overlap;
+    }
+}
+
+static void LogFindThread(GTask *task, gpointer sourceObject, gpointer taskData,
+                          GCancellable *cancellable) {
+    LogFind *find = (LogFind *)taskData;
+    gsize overlap = TextPatternMaxMatchLength(find->pattern);
+    gsize matchLength = 0;
+    gint64 found;
+
+    if (find->forward) {
+        found = FindForwardFrom(find, find->from, overlap, cancellable, &matchLength);
+        if (found < 0 && find->from > 0) {
+            found = FindForwardFrom(find, 0, overlap, cancellable, &matchLength);
+        }
+    } else {
+        found = FindBackwardFrom(find, find->from, overlap, cancellable, &matchLength);
+        if (found < 0 && find->from < find->length) {
+            found = FindBackwardFrom(find, find->length, overlap, cancellable, &matchLength);
+        }
+    }
+
+    GError *error = NULL;
+    if (g_cancellable_set_error_if_cancelled(cancellable, &error)) {
+        g_task_return_error(task, error);
+        return;
+    }
+    find->matchStart = found;
+    find->matchEnd = found + matchLength;
+    g_task_return_boolean(task, found >= 0);
+}
+
+void LogViewFindAsync(LogView *view, const char *needle, gboolean matchCase, gboolean forward,
+                      GCancellable *cancellable, GAsyncReadyCallback callback, gpointer userData) {
+    // ANSI files hold Latin-1 bytes, so the needle has to as well
+    char *converted = view->encoding == ENC_ANSI
+        ? g_convert(needle, -1, "ISO-8859-1", "UTF-8", NULL, NULL, NULL) : NULL;
+    const char *pattern = converted ? converted : needle;
+
+    LogFind *find = g_new0(LogFind, 1);
+    find->mapped = g_mapped_file_ref(view->mapped);
+    find->text = view->text;
+    find->length = view->length;
+    find->pattern = TextPatternNew(pattern, strlen(pattern), matchCase);
+    find->forward = forward;
+    find->from = forward ? MAX(view->anchor, view->caret) : MIN(view->anchor, view->caret);
+    g_free(converted);
+
+    GTask *task = g_task_new(NULL, cancellable, callback, userData);
+    g_task_set_task_data(task, find, FreeLogFind);
+    g_task_run_in_thread(task, LogFindThread);
+    g_object_unref(task);
+}
+
+gboolean LogViewFindFinish(GAsyncResult *result, guint64 *start, guint64 *end, GError **error) {
+    if (!g_task_propagate_boolean(G_TASK(result), error)) return FALSE;
+    const LogFind *find = (const LogFind *)g_task_get_task_data(G_TASK(result));
+    *start = find->matchStart;
+    *end = find->matchEnd;
+    return TRUE;
+}
@@ -0,0 +1,46 @@
+// Read-only viewer for very large text files such as logs. The file stays memory-mapped,
+// a LineIndex is built in the background, and only the lines on screen are laid out, so
+// opening, scrolling and jumping cost the same at any file size.
+#pragma once
+
+#include <gtk/gtk.h>
+#include "file_io.h"
+
+typedef struct LogView LogView;
+
+// Maps path for viewing. UTF-16 files need decoding and so cannot be shown straight from
+// the mapping; they fail with G_IO_ERROR_NOT_SUPPORTED.
+LogView *LogViewOpen(const char *path, GError **error);
+// Also destroys the widget.
+void LogViewFree(LogView *view);
+
+GtkWidget *LogViewGetWidget(LogView *view);
+void LogViewGrabFocus(LogView *view);
+TextEncoding LogViewGetEncoding(LogView *view);
+void LogViewSetFont(LogView *view, const PangoFontDescription *font);
+// Called whenever the caret moves or indexing makes progress
+void LogViewSetChangedFunc(LogView *view, void (*func)(gpointer data), gpointer data);
+
+typedef struct LogViewPosition {
+    guint64 line;       // 1-based caret line
+    guint64 column;     // 1-based caret column, in characters
+    guint64 lines;      // Lines indexed so far; all of them once progress reaches 1000
+    gint progress;      // Permille of the file indexed
+} LogViewPosition;
+
+void LogViewGetPosition(LogView *view, LogViewPosition *position);
+
+// Moves the caret to the start of a 0-based line. FALSE if the index has not reached
+// that line (yet).
+gboolean LogViewGotoLine(LogView *view, guint64 line);
+
+// Selects a byte range of the file and scrolls it into view, as soon as the index
+// reaches it if it has not already.
+void LogViewSelect(LogView *view, guint64 start, guint64 end);
+void LogViewCopySelection(LogView *view, GtkClipboard *clipboard);
+
+// Searches the mapping on a worker from the selection, wrapping around once. Finish
+// returns FALSE without setting error when there is no match.
+void LogViewFindAsync(LogView *view, const char *needle, gboolean matchCase, gboolean forward,
+                      GCancellable *cancellable, GAsyncReadyCallback callback, gpointer userData);
+gboolean LogViewFindFinish(GAsyncResult *result, guint64 *start, guint64 *end, GError **error);
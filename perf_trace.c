@@ -0,0 +1,213 @@
+// Each counter keeps a histogram with one bucket per power of two of microseconds, so
+// recording is a few adds whatever the session length, and percentiles are read back to
+// within a factor of two. Spans also go into a fixed ring for trace export; the oldest
+// are overwritten once it is full.
+#include "perf_trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PERF_TRACE_EVENTS 65536             // Most recent spans kept for the trace file
+#define PERF_BUCKETS 40                     // Bucket b holds durations below 2^b us
+#define STARTUP_PHASES 16
+
+typedef struct PerfHistogram {
+    guint64 count;
+    gint64 total;
+    gint64 max;
+    guint64 buckets[PERF_BUCKETS];
+} PerfHistogram;
+
+typedef struct PerfEvent {
+    gint64 start;
+    gint64 duration;
+    PerfCounter counter;
+} PerfEvent;
+
+static const char *const g_perfNames[PERF_COUNTER_COUNT] = {
+    "LoadDocumentFromPath",
+    "DoFileSave",
+    "FindInEdit",
+    "ReplaceAllOccurrences",
+    "PushUndoStack",
+    "UpdateStatusBar",
+    "KeyToFrame",
+};
+
+typedef struct StartupPhase {
+    const char *name;
+    gint64 end;
+} StartupPhase;
+
+static gboolean g_perfEnabled;
+static PerfHistogram g_perfHistograms[PERF_COUNTER_COUNT];
+static PerfEvent *g_perfEvents;
+static guint64 g_perfEventCount;            // Ever recorded; the ring holds the last ones
+static gint64 g_startupOrigin;              // Monotonic time the process started; 0 if off
+static StartupPhase g_startupPhases[STARTUP_PHASES];
+static guint g_startupPhaseCount;
+
+void PerfSetEnabled(gboolean enabled) {
+    g_perfEnabled = enabled;
+    if (enabled && !g_perfEvents) {
+        g_perfEvents = g_new(PerfEvent, PERF_TRACE_EVENTS);
+    }
+}
+
+gboolean PerfEnabled(void) {
+    return g_perfEnabled;
+}
+
+void PerfReset(void) {
+    memset(g_perfHistograms, 0, sizeof(g_perfHistograms));
+    g_perfEventCount = 0;
+}
+
+gint64 PerfBegin(void) {
+    return g_perfEnabled ? g_get_monotonic_time() : 0;
+}
+
+void PerfEnd(PerfCounter counter, gint64 start) {
+    if (start == 0 || !g_perfEvents) return;
+    gint64 duration = MAX(g_get_monotonic_time() - start, 0);
+
+    PerfHistogram *histogram = &g_perfHistograms[counter];
+    histogram->count++;
+    histogram->total += duration;
+    histogram->max = MAX(histogram->max, duration);
+    histogram->buckets[MIN(g_bit_storage((gulong)duration), PERF_BUCKETS - 1)]++;
+
+    PerfEvent *event = &g_perfEvents[g_perfEventCount % PERF_TRACE_EVENTS];
+    event->start = start;
+    event->duration = duration;
+    event->counter = counter;
+    g_perfEventCount++;
+}
+
+// Upper bound of the bucket holding the given percentile, capped at the maximum seen
+static gint64 HistogramPercentile(const PerfHistogram *histogram, guint percent) {
+    guint64 rank = (histogram->count * percent + 99) / 100;
+    guint64 seen = 0;
+    for (guint b = 0; b < PERF_BUCKETS; b++) {
+        seen += histogram->buckets[b];
+        if (seen >= rank && seen > 0) {
+            return MIN(((gint64)1 << b) - 1, histogram->max);
+        }
+    }
+    return histogram->max;
+}
+
+char *PerfSummary(void) {
+    GString *text = g_string_new(NULL);
+    g_string_append_printf(text, "%-22s %8s %9s %9s %9s %9s\n",
+                           "(milliseconds)", "count", "mean", "p50", "p99", "max");
+    for (guint i = 0; i < PERF_COUNTER_COUNT; i++) {
+        const PerfHistogram *histogram = &g_perfHistograms[i];
+        if (histogram->count == 0) continue;
+        g_string_append_printf(text, "%-22s %8" G_GUINT64_FORMAT " %9.3f %9.3f %9.3f %9.3f\n",
+                               g_perfNames[i], histogram->count,
+                               histogram->total / 1000.0 / histogram->count,
+                               HistogramPercentile(histogram, 50) / 1000.0,
+                               HistogramPercentile(histogram, 99) / 1000.0,
+                               histogram->max / 1000.0);
+    }
+    return g_string_free(text, FALSE);
+}
+
+gboolean PerfWriteTrace(const char *path, GError **error) {
+    GString *json = g_string_new("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    int pid = getpid();
+    g_string_append_printf(json,
+        "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": 1, "
+        "\"args\": {\"name\": \"main\"}}", pid);
+
+    guint64 kept = MIN(g_perfEventCount, (guint64)PERF_TRACE_EVENTS);
+    for (guint64 i = g_perfEventCount - kept; i < g_perfEventCount; i++) {
+        const PerfEvent *event = &g_perfEvents[i % PERF_TRACE_EVENTS];
+        g_string_append_printf(json,
+            ",\n{\"name\": \"%s\", \"cat\": \"retropad\", \"ph\": \"X\", \"ts\": %" G_GINT64_FORMAT
+            ", \"dur\": %" G_GINT64_FORMAT ", \"pid\": %d, \"tid\": 1}",
+            g_perfNames[event->counter], event->start, event->duration, pid);
+    }
+
+    // The histograms cover spans that have dropped out of the ring as well
+    g_string_append(json, "\n], \"otherData\": {");
+    gboolean first = TRUE;
+    for (guint i = 0; i < PERF_COUNTER_COUNT; i++) {
+        const PerfHistogram *histogram = &g_perfHistograms[i];
+        if (histogram->count == 0) continue;
+        g_string_append_printf(json,
+            "%s\n\"%s\": {\"count\": %" G_GUINT64_FORMAT ", \"mean_ms\": %.3f, \"p50_ms\": %.3f, "
+            "\"p99_ms\": %.3f, \"max_ms\": %.3f}",
+            first ? "" : ",", g_perfNames[i], histogram->count,
+            histogram->total / 1000.0 / histogram->count,
+            HistogramPercentile(histogram, 50) / 1000.0,
+            HistogramPercentile(histogram, 99) / 1000.0, histogram->max / 1000.0);
+        first = FALSE;
+    }
+    g_string_append(json, "\n}}\n");
+
+    gboolean ok = g_file_set_contents(path, json->str, json->len, error);
+    g_string_free(json, TRUE);
+    return ok;
+}
+
+// How long ago the process was started, from its start time in /proc (in clock ticks since
+// boot). Covers exec, the dynamic loader and library constructors before main; 0 if unknown.
+static gint64 ProcessAge(void) {
+#ifdef __linux__
+    char *stat = NULL;
+    if (!g_file_get_contents("/proc/self/stat", &stat, NULL, NULL)) return 0;
+    // The command name may contain spaces, so count fields from its closing parenthesis:
+    // starttime is field 22, the 20th after it
+    const char *field = strrchr(stat, ')');
+    for (int i = 0; field && i < 20; i++) {
+        field = strchr(field + 1, ' ');
+    }
+    guint64 ticks = field ? g_ascii_strtoull(field + 1, NULL, 10) : 0;
+    g_free(stat);
+
+    struct timespec now;
+    long ticksPerSecond = sysconf(_SC_CLK_TCK);
+    if (ticks == 0 || ticksPerSecond <= 0 || clock_gettime(CLOCK_BOOTTIME, &now) != 0) return 0;
+    gint64 age = (gint64)now.tv_sec * G_USEC_PER_SEC + now.tv_nsec / 1000 -
+                 (gint64)(ticks * G_USEC_PER_SEC / ticksPerSecond);
+    return MAX(age, 0);
+#else
+    return 0;
+#endif
+}
+
+void StartupTraceBegin(void) {
+    gint64 now = g_get_monotonic_time();
+    g_startupOrigin = now - ProcessAge();
+    g_startupPhaseCount = 0;
+    if (now > g_startupOrigin) {
+        StartupTraceMark("exec to main");
+    }
+}
+
+gboolean StartupTraceActive(void) {
+    return g_startupOrigin != 0;
+}
+
+void StartupTraceMark(const char *phase) {
+    if (!g_startupOrigin || g_startupPhaseCount == STARTUP_PHASES) return;
+    g_startupPhases[g_startupPhaseCount].name = phase;
+    g_startupPhases[g_startupPhaseCount].end = g_get_monotonic_time();
+    g_startupPhaseCount++;
+}
+
+void StartupTraceFinish(void) {
+    if (!g_startupOrigin) return;
+    fprintf(stderr, "%-16s %10s %10s\n", "startup (ms)", "phase", "total");
+    gint64 previous = g_startupOrigin;
+    for (guint i = 0; i < g_startupPhaseCount; i++) {
+        const StartupPhase *phase = &g_startupPhases[i];
+        fprintf(stderr, "%-16s %10.2f %10.2f\n", phase->name,
+                (phase->end - previous) / 1000.0, (phase->end - g_startupOrigin) / 1000.0);
+        previous = phase->end;
+    }
+    g_startupOrigin = 0;
+}
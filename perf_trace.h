@@ -0,0 +1,40 @@
+// Built-in performance counters: durations of a few hot operations, kept as running
+// histograms plus a ring of recent spans that can be saved as a Chrome trace-event file
+// (chrome://tracing, Perfetto). Off by default; all calls are made on the main thread.
+#pragma once
+
+#include <glib.h>
+
+typedef enum PerfCounter {
+    PERF_LOAD_DOCUMENT,         // LoadDocumentFromPath until the text is in the buffer
+    PERF_SAVE,                  // DoFileSave until the file is written
+    PERF_FIND,                  // FindInEdit
+    PERF_REPLACE_ALL,           // ReplaceAllOccurrences
+    PERF_UNDO_PUSH,             // PushUndoStack
+    PERF_STATUS_BAR,            // Status bar refresh
+    PERF_KEY_TO_FRAME,          // Key press until the next frame is painted
+    PERF_COUNTER_COUNT
+} PerfCounter;
+
+void PerfSetEnabled(gboolean enabled);
+gboolean PerfEnabled(void);
+// Forgets everything recorded so far
+void PerfReset(void);
+
+// Start of a span: the current time, or 0 while recording is off
+gint64 PerfBegin(void);
+// Records the span from start to now; does nothing if start is 0. The span may cover
+// asynchronous work, as long as it ends on the main thread.
+void PerfEnd(PerfCounter counter, gint64 start);
+
+// Count, mean, p50, p99 and max per counter, as a plain-text table
+char *PerfSummary(void);
+gboolean PerfWriteTrace(const char *path, GError **error);
+
+// Startup trace (--startup-trace): named phases from process start to the first frame and
+// the deferred UI after it, printed to stderr by StartupTraceFinish. Main thread only.
+void StartupTraceBegin(void);
+gboolean StartupTraceActive(void);
+// Ends the current phase, which is named for what it covered
+void StartupTraceMark(const char *phase);
+void StartupTraceFinish(void);
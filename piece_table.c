@@ -0,0 +1,390 @@
+// Piece table over a memory-mapped original. Line lookups into the original go through a
+// sparse checkpoint index built while the file is validated, so splitting a piece never
+// rescans more than one checkpoint interval; text in the add buffer is small and counted
+// directly. Pieces are kept in a flat array: edits touch one or two of them, and the
+// array only grows with the number of edits, not with the size of the file.
+#include "piece_table.h"
+#include "text_simd.h"
+#include <string.h>
+
+#define INDEX_LINE_STRIDE 256                  // Newlines between checkpoints
+#define INDEX_BYTE_STRIDE (1024 * 1024)        // ...or bytes, for files with long lines
+#define ADD_BLOCK_SIZE (1024 * 1024)
+#define ADD_OWN_BLOCK (ADD_BLOCK_SIZE / 4)     // Inserts this large get a block of their own
+
+typedef struct Piece {
+    const char *data;
+    guint64 length;
+    guint64 newlines;
+} Piece;
+
+typedef struct LineCheckpoint {
+    guint64 offset;     // Into the original text
+    guint64 line;       // Newlines before offset
+} LineCheckpoint;
+
+// Shared by a table and its snapshots. Add blocks are never moved or freed while any of
+// them is alive, so pieces can point straight into them.
+typedef struct PieceStore {
+    gint refs;
+    GMappedFile *mapped;
+    const char *original;       // Past the BOM
+    guint64 originalLength;
+    GArray *checkpoints;        // LineCheckpoint, ascending
+    GPtrArray *blocks;
+    char *tail;                 // Block currently being appended to
+    gsize tailUsed;
+} PieceStore;
+
+struct PieceTable {
+    PieceStore *store;
+    GArray *pieces;
+    guint64 length;
+    guint64 newlines;
+};
+
+static guint64 CountNewlines(const char *data, gsize length) {
+    guint64 count = 0;
+    const char *end = data + length;
+    while ((data = memchr(data, '\n', end - data)) != NULL) {
+        count++;
+        data++;
+    }
+    return count;
+}
+
+// Position just past the n-th newline (n >= 1) in data, or length if there are fewer
+static gsize SkipNewlines(const char *data, gsize length, guint64 n) {
+    const char *p = data;
+    const char *end = data + length;
+    while (n > 0 && (p = memchr(p, '\n', end - p)) != NULL) {
+        p++;
+        n--;
+    }
+    return n == 0 ? (gsize)(p - data) : length;
+}
+
+static PieceStore *PieceStoreRef(PieceStore *store) {
+    g_atomic_int_inc(&store->refs);
+    return store;
+}
+
+static void PieceStoreUnref(PieceStore *store) {
+    if (!g_atomic_int_dec_and_test(&store->refs)) return;
+    g_mapped_file_unref(store->mapped);
+    g_array_free(store->checkpoints, TRUE);
+    g_ptr_array_free(store->blocks, TRUE);
+    g_free(store);
+}
+
+static gboolean IsOriginal(const PieceStore *store, const char *data) {
+    return data >= store->original && data < store->original + store->originalLength;
+}
+
+// Last checkpoint at or before offset
+static const LineCheckpoint *CheckpointBefore(const PieceStore *store, guint64 offset) {
+    const LineCheckpoint *points = (const LineCheckpoint *)store->checkpoints->data;
+    guint lo = 0, hi = store->checkpoints->len;
+    while (hi - lo > 1) {
+        guint mid = lo + (hi - lo) / 2;
+        if (points[mid].offset <= offset) lo = mid; else hi = mid;
+    }
+    return &points[lo];
+}
+
+// Last checkpoint with fewer than line newlines before it (line >= 1), so that the
+// line-th newline comes after it
+static const LineCheckpoint *CheckpointBeforeLine(const PieceStore *store, guint64 line) {
+    const LineCheckpoint *points = (const LineCheckpoint *)store->checkpoints->data;
+    guint lo = 0, hi = store->checkpoints->len;
+    while (hi - lo > 1) {
+        guint mid = lo + (hi - lo) / 2;
+        if (points[mid].line < line) lo = mid; else hi = mid;
+    }
+    return &points[lo];
+}
+
+static guint64 OriginalLinesBefore(const PieceStore *store, guint64 offset) {
+    const LineCheckpoint *point = CheckpointBefore(store, offset);
+    return point->line + CountNewlines(store->original + point->offset, offset - point->offset);
+}
+
+static guint64 PieceNewlines(const PieceStore *store, const char *data, guint64 length) {
+    if (!IsOriginal(store, data)) {
+        return CountNewlines(data, length);
+    }
+    guint64 start = data - store->original;
+    return OriginalLinesBefore(store, start + length) - OriginalLinesBefore(store, start);
+}
+
+// Offset within the piece just past its n-th newline (1 <= n <= piece->newlines)
+static guint64 PieceSkipNewlines(const PieceStore *store, const Piece *piece, guint64 n) {
+    if (!IsOriginal(store, piece->data)) {
+        return SkipNewlines(piece->data, piece->length, n);
+    }
+    guint64 start = piece->data - store->original;
+    guint64 target = OriginalLinesBefore(store, start) + n;
+    const LineCheckpoint *point = CheckpointBeforeLine(store, target);
+    guint64 from = MAX(point->offset, start);
+    guint64 before = from == point->offset ? point->line : OriginalLinesBefore(store, from);
+    return from - start + SkipNewlines(store->original + from, start + piece->length - from,
+                                       target - before);
+}
+
+// Validates the mapping and records a checkpoint every INDEX_LINE_STRIDE newlines, and at
+// least every INDEX_BYTE_STRIDE bytes.
+static gboolean IndexOriginal(PieceStore *store, GCancellable *cancellable, gint *progress,
+                              guint64 *newlinesOut, GError **error) {
+    const char *text = store->original;
+    guint64 length = store->originalLength;
+    guint64 lines = 0;
+    guint64 pos = 0;
+    LineCheckpoint point = { 0, 0 };
+    g_array_append_val(store->checkpoints, point);
+
+    while (pos < length) {
+        if (g_cancellable_set_error_if_cancelled(cancellable, error)) return FALSE;
+
+        gsize block = MIN(length - pos, INDEX_BYTE_STRIDE);
+        gsize valid = Utf8ValidPrefix((const guchar *)text + pos, block);
+        // A sequence cut by the block boundary is rechecked at the start of the next block
+        gboolean split = valid < block && pos + block < length && block - valid < 4;
+        if ((valid < block && !split) || valid == 0 || memchr(text + pos, '\0', valid)) {
+            g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                "The file is not plain UTF-8 text");
+            return FALSE;
+        }
+
+        const char *p = text + pos;
+        const char *end = p + valid;
+        while ((p = memchr(p, '\n', end - p)) != NULL) {
+            p++;
+            if (++lines % INDEX_LINE_STRIDE == 0) {
+                point.offset = p - text;
+                point.line = lines;
+                g_array_append_val(store->checkpoints, point);
+            }
+        }
+        pos += valid;
+
+        if (pos - point.offset >= INDEX_BYTE_STRIDE) {
+            point.offset = pos;
+            point.line = lines;
+            g_array_append_val(store->checkpoints, point);
+        }
+        if (progress) {
+            g_atomic_int_set(progress, (gint)(pos * 1000 / length));
+        }
+    }
+
+    *newlinesOut = lines;
+    return TRUE;
+}
+
+PieceTable *PieceTableOpen(const char *path, GCancellable *cancellable, gint *progress,
+                           GError **error) {
+    GMappedFile *mapped = g_mapped_file_new(path, FALSE, error);
+    if (!mapped) return NULL;
+
+    const char *data = g_mapped_file_get_contents(mapped);
+    gsize size = g_mapped_file_get_length(mapped);
+    gsize bom = (size >= 3 && memcmp(data, "\xEF\xBB\xBF", 3) == 0) ? 3 : 0;
+
+    PieceStore *store = g_new0(PieceStore, 1);
+    store->refs = 1;
+    store->mapped = mapped;
+    store->original = data + bom;
+    store->originalLength = size - bom;
+    store->checkpoints = g_array_new(FALSE, FALSE, sizeof(LineCheckpoint));
+    store->blocks = g_ptr_array_new_with_free_func(g_free);
+
+    guint64 newlines = 0;
+    if (!IndexOriginal(store, cancellable, progress, &newlines, error)) {
+        PieceStoreUnref(store);
+        return NULL;
+    }
+
+    PieceTable *table = g_new0(PieceTable, 1);
+    table->store = store;
+    table->pieces = g_array_new(FALSE, FALSE, sizeof(Piece));
+    table->length = store->originalLength;
+    table->newlines = newlines;
+    if (table->length > 0) {
+        Piece piece = { store->original, store->originalLength, newlines };
+        g_array_append_val(table->pieces, piece);
+    }
+    return table;
+}
+
+PieceTable *PieceTableCopy(const PieceTable *table) {
+    PieceTable *copy = g_new0(PieceTable, 1);
+    copy->store = PieceStoreRef(table->store);
+    copy->pieces = g_array_copy(table->pieces);
+    copy->length = table->length;
+    copy->newlines = table->newlines;
+    return copy;
+}
+
+void PieceTableFree(PieceTable *table) {
+    if (!table) return;
+    g_array_free(table->pieces, TRUE);
+    PieceStoreUnref(table->store);
+    g_free(table);
+}
+
+guint64 PieceTableLength(const PieceTable *table) {
+    return table->length;
+}
+
+guint64 PieceTableLineCount(const PieceTable *table) {
+    return table->newlines + 1;
+}
+
+// Index of the piece containing offset, and where that piece starts
+static guint FindPiece(const PieceTable *table, guint64 offset, guint64 *pieceStart) {
+    const Piece *pieces = (const Piece *)table->pieces->data;
+    guint64 start = 0;
+    guint i = 0;
+    while (i < table->pieces->len && start + pieces[i].length <= offset) {
+        start += pieces[i].length;
+        i++;
+    }
+    *pieceStart = start;
+    return i;
+}
+
+// Makes offset a piece boundary; returns the index of the piece starting there
+static guint SplitAt(PieceTable *table, guint64 offset) {
+    guint64 start = 0;
+    guint i = FindPiece(table, offset, &start);
+    if (i == table->pieces->len || start == offset) return i;
+
+    Piece *piece = &g_array_index(table->pieces, Piece, i);
+    guint64 leftLength = offset - start;
+    Piece right = {
+        piece->data + leftLength,
+        piece->length - leftLength,
+        0
+    };
+    guint64 leftNewlines = PieceNewlines(table->store, piece->data, leftLength);
+    right.newlines = piece->newlines - leftNewlines;
+    piece->length = leftLength;
+    piece->newlines = leftNewlines;
+    g_array_insert_val(table->pieces, i + 1, right);
+    return i + 1;
+}
+
+// Copies text into the add buffer; returns where it landed
+static const char *StoreText(PieceStore *store, const char *text, gsize length) {
+    if (length >= ADD_OWN_BLOCK) {
+        char *block = g_malloc(length);
+        memcpy(block, text, length);
+        g_ptr_array_add(store->blocks, block);
+        return block;
+    }
+    if (!store->tail || ADD_BLOCK_SIZE - store->tailUsed < length) {
+        store->tail = g_malloc(ADD_BLOCK_SIZE);
+        store->tailUsed = 0;
+        g_ptr_array_add(store->blocks, store->tail);
+    }
+    char *dest = store->tail + store->tailUsed;
+    memcpy(dest, text, length);
+    store->tailUsed += length;
+    return dest;
+}
+
+void PieceTableInsert(PieceTable *table, guint64 offset, const char *text, gsize length) {
+    if (length == 0) return;
+    PieceStore *store = table->store;
+    guint i = SplitAt(table, MIN(offset, table->length));
+    guint64 newlines = CountNewlines(text, length);
+
+    // Typing: extend the previous piece when it ends where the add buffer does
+    if (i > 0 && length < ADD_OWN_BLOCK && store->tail) {
+        Piece *prev = &g_array_index(table->pieces, Piece, i - 1);
+        if (prev->data + prev->length == store->tail + store->tailUsed &&
+            ADD_BLOCK_SIZE - store->tailUsed >= length) {
+            StoreText(store, text, length);
+            prev->length += length;
+            prev->newlines += newlines;
+            table->length += length;
+            table->newlines += newlines;
+            return;
+        }
+    }
+
+    Piece piece = { StoreText(store, text, length), length, newlines };
+    g_array_insert_val(table->pieces, i, piece);
+    table->length += length;
+    table->newlines += newlines;
+}
+
+void PieceTableDelete(PieceTable *table, guint64 offset, guint64 length) {
+    if (offset >= table->length || length == 0) return;
+    length = MIN(length, table->length - offset);
+    guint first = SplitAt(table, offset);
+    guint last = SplitAt(table, offset + length);
+
+    for (guint i = first; i < last; i++) {
+        const Piece *piece = &g_array_index(table->pieces, Piece, i);
+        table->length -= piece->length;
+        table->newlines -= piece->newlines;
+    }
+    g_array_remove_range(table->pieces, first, last - first);
+}
+
+gsize PieceTableRead(const PieceTable *table, guint64 offset, char *out, gsize length) {
+    guint64 start = 0;
+    guint i = FindPiece(table, offset, &start);
+    gsize copied = 0;
+    for (; i < table->pieces->len && copied < length; i++) {
+        const Piece *piece = &g_array_index(table->pieces, Piece, i);
+        guint64 skip = offset + copied - start;
+        gsize count = (gsize)MIN(piece->length - skip, (guint64)(length - copied));
+        memcpy(out + copied, piece->data + skip, count);
+        copied += count;
+        start += piece->length;
+    }
+    return copied;
+}
+
+guint64 PieceTableLineStart(const PieceTable *table, guint64 line) {
+    if (line == 0) return 0;
+    if (line > table->newlines) return table->length;
+
+    guint64 start = 0;
+    guint64 before = 0;
+    for (guint i = 0; i < table->pieces->len; i++) {
+        const Piece *piece = &g_array_index(table->pieces, Piece, i);
+        if (before + piece->newlines >= line) {
+            return start + PieceSkipNewlines(table->store, piece, line - before);
+        }
+        before += piece->newlines;
+        start += piece->length;
+    }
+    return table->length;
+}
+
+guint64 PieceTableLineAt(const PieceTable *table, guint64 offset) {
+    guint64 start = 0;
+    guint64 before = 0;
+    for (guint i = 0; i < table->pieces->len; i++) {
+        const Piece *piece = &g_array_index(table->pieces, Piece, i);
+        if (start + piece->length > offset) {
+            return before + PieceNewlines(table->store, piece->data, offset - start);
+        }
+        before += piece->newlines;
+        start += piece->length;
+    }
+    return table->newlines;
+}
+
+gboolean PieceTableForeach(const PieceTable *table,
+                           gboolean (*fn)(const char *text, gsize length, gpointer data),
+                           gpointer data) {
+    for (guint i = 0; i < table->pieces->len; i++) {
+        const Piece *piece = &g_array_index(table->pieces, Piece, i);
+        if (!fn(piece->data, piece->length, data)) return FALSE;
+    }
+    return TRUE;
+}
@@ -0,0 +1,41 @@
+// Piece-table text store for very large UTF-8 documents. The original file stays
+// memory-mapped and is never copied; inserted text goes to an append-only add buffer,
+// and the document is the ordered list of pieces pointing into one or the other.
+#pragma once
+
+#include <gio/gio.h>
+
+typedef struct PieceTable PieceTable;
+
+// Maps path and indexes its lines. The file must be UTF-8 (a BOM is skipped) without NUL
+// bytes; anything else fails with G_IO_ERROR_INVALID_DATA so the caller can fall back to
+// decoding it. progress, if set, is updated atomically in permille while the file is read.
+PieceTable *PieceTableOpen(const char *path, GCancellable *cancellable, gint *progress,
+                           GError **error);
+
+// An immutable snapshot that shares the mapping and add buffer with table. Taking one is
+// cheap, and it stays valid however table is edited afterwards, so it can be handed to a
+// worker thread (e.g. for saving).
+PieceTable *PieceTableCopy(const PieceTable *table);
+void PieceTableFree(PieceTable *table);
+
+guint64 PieceTableLength(const PieceTable *table);
+guint64 PieceTableLineCount(const PieceTable *table);
+
+// Offsets are in bytes and must fall on character boundaries.
+void PieceTableInsert(PieceTable *table, guint64 offset, const char *text, gsize length);
+void PieceTableDelete(PieceTable *table, guint64 offset, guint64 length);
+
+// Copies up to length bytes starting at offset into out; returns the number copied.
+gsize PieceTableRead(const PieceTable *table, guint64 offset, char *out, gsize length);
+
+// Byte offset where a (0-based) line starts, or the document length past the last line.
+guint64 PieceTableLineStart(const PieceTable *table, guint64 line);
+// 0-based line containing offset
+guint64 PieceTableLineAt(const PieceTable *table, guint64 offset);
+
+// Calls fn with each run of text in document order until it returns FALSE.
+// Returns FALSE if fn did.
+gboolean PieceTableForeach(const PieceTable *table,
+                           gboolean (*fn)(const char *text, gsize length, gpointer data),
+                           gpointer data);
@@ -0,0 +1,220 @@
+// Regex search on GRegex. G_REGEX_OPTIMIZE lets PCRE2 JIT-compile the pattern where
+// the platform supports it, which is why compiled patterns are worth caching.
+#include "regex_search.h"
+#include <string.h>
+
+#define REGEX_CACHE_SIZE 16
+
+typedef struct RegexRequest {
+    GBytes *text;
+    GRegex *regex;
+    RegexSearchMode mode;
+    gsize position;
+    char *replacement;
+} RegexRequest;
+
+// Keyed by "flags:pattern"; g_regexOrder holds the keys, least recently used first
+static GHashTable *g_regexCache;
+static GQueue g_regexOrder = G_QUEUE_INIT;
+
+GRegex *RegexCacheLookup(const char *pattern, gboolean matchCase, GError **error) {
+    GRegexCompileFlags flags = G_REGEX_OPTIMIZE | G_REGEX_MULTILINE;
+    if (!matchCase) flags |= G_REGEX_CASELESS;
+
+    if (!g_regexCache) {
+        g_regexCache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify)g_regex_unref);
+    }
+
+    char *key = g_strdup_printf("%x:%s", (unsigned)flags, pattern);
+    GRegex *regex = g_hash_table_lookup(g_regexCache, key);
+    if (regex) {
+        // The queue and the table share the key string
+        GList *link = g_queue_find_custom(&g_regexOrder, key, (GCompareFunc)strcmp);
+        g_queue_unlink(&g_regexOrder, link);
+        g_queue_push_tail_link(&g_regexOrder, link);
+        g_free(key);
+        return g_regex_ref(regex);
+    }
+
+    regex = g_regex_new(pattern, flags, 0, error);
+    if (!regex) {
+        g_free(key);
+        return NULL;
+    }
+
+    if (g_queue_get_length(&g_regexOrder) >= REGEX_CACHE_SIZE) {
+        g_hash_table_remove(g_regexCache, g_queue_pop_head(&g_regexOrder));
+    }
+    g_hash_table_insert(g_regexCache, key, g_regex_ref(regex));
+    g_queue_push_tail(&g_regexOrder, key);
+    return regex;
+}
+
+void RegexCacheClear(void) {
+    g_queue_clear(&g_regexOrder);
+    if (g_regexCache) {
+        g_hash_table_destroy(g_regexCache);
+        g_regexCache = NULL;
+    }
+}
+
+void RegexMatchSetFree(RegexMatchSet *set) {
+    if (!set) return;
+    g_array_free(set->matches, TRUE);
+    if (set->replacements) {
+        g_string_free(set->replacements, TRUE);
+    }
+    if (set->replacementEnds) {
+        g_array_free(set->replacementEnds, TRUE);
+    }
+    g_free(set);
+}
+
+static void FreeRegexRequest(gpointer data) {
+    RegexRequest *request = (RegexRequest *)data;
+    g_bytes_unref(request->text);
+    g_regex_unref(request->regex);
+    g_free(request->replacement);
+    g_free(request);
+}
+
+// Walks the matches from start; calls back with each until it returns FALSE.
+// Returns FALSE if cancelled or matching failed (error set).
+static gboolean ScanMatches(const RegexRequest *request, const char *text, gsize length,
+                            gsize start, GCancellable *cancellable,
+                            gboolean (*onMatch)(GMatchInfo *info, gsize matchStart,
+                                                gsize matchEnd, gpointer data),
+                            gpointer data, GError **error) {
+    GMatchInfo *info = NULL;
+    GError *matchError = NULL;
+    gboolean ok = TRUE;
+
+    // Empty matches (^, $, \b, lookarounds) count too; g_match_info_next steps past them
+    g_regex_match_full(request->regex, text, length, start, 0, &info, &matchError);
+    while (!matchError && g_match_info_matches(info)) {
+        if (g_cancellable_set_error_if_cancelled(cancellable, error)) {
+            ok = FALSE;
+            break;
+        }
+        gint matchStart = 0, matchEnd = 0;
+        g_match_info_fetch_pos(info, 0, &matchStart, &matchEnd);
+        if (!onMatch(info, matchStart, matchEnd, data)) break;
+        g_match_info_next(info, &matchError);
+    }
+    g_match_info_free(info);
+
+    if (matchError) {
+        g_propagate_error(error, matchError);
+        ok = FALSE;
+    }
+    return ok;
+}
+
+typedef struct ScanState {
+    RegexMatchSet *set;
+    const char *replacement;
+    gsize limit;
+    GError *error;
+} ScanState;
+
+static gboolean TakeFirst(GMatchInfo *info, gsize matchStart, gsize matchEnd, gpointer data) {
+    ScanState *state = (ScanState *)data;
+    TextMatch match = { matchStart, matchEnd - matchStart };
+    g_array_append_val(state->set->matches, match);
+    return FALSE;
+}
+
+// Keeps only the latest match that ends within the limit
+static gboolean TakeLast(GMatchInfo *info, gsize matchStart, gsize matchEnd, gpointer data) {
+    ScanState *state = (ScanState *)data;
+    if (matchEnd > state->limit) return FALSE;
+    TextMatch match = { matchStart, matchEnd - matchStart };
+    g_array_set_size(state->set->matches, 0);
+    g_array_append_val(state->set->matches, match);
+    return TRUE;
+}
+
+static gboolean TakeAll(GMatchInfo *info, gsize matchStart, gsize matchEnd, gpointer data) {
+    ScanState *state = (ScanState *)data;
+    TextMatch match = { matchStart, matchEnd - matchStart };
+    g_array_append_val(state->set->matches, match);
+    if (state->replacement) {
+        char *expanded = g_match_info_expand_references(info, state->replacement, &state->error);
+        if (!expanded) return FALSE;
+        g_string_append(state->set->replacements, expanded);
+        g_free(expanded);
+        gsize end = state->set->replacements->len;
+        g_array_append_val(state->set->replacementEnds, end);
+    }
+    return TRUE;
+}
+
+static void RegexSearchThread(GTask *task, gpointer sourceObject, gpointer taskData,
+                              GCancellable *cancellable) {
+    RegexRequest *request = (RegexRequest *)taskData;
+    gsize length = 0;
+    const char *text = g_bytes_get_data(request->text, &length);
+
+    RegexMatchSet *set = g_new0(RegexMatchSet, 1);
+    set->matches = g_array_new(FALSE, FALSE, sizeof(TextMatch));
+    ScanState state = { set, request->replacement, request->position, NULL };
+    GError *error = NULL;
+    gboolean ok;
+
+    switch (request->mode) {
+    case REGEX_SEARCH_FORWARD:
+        ok = ScanMatches(request, text, length, MIN(request->position, length), cancellable,
+                         TakeFirst, &state, &error);
+        if (ok && set->matches->len == 0 && request->position > 0) {
+            ok = ScanMatches(request, text, length, 0, cancellable, TakeFirst, &state, &error);
+        }
+        break;
+    case REGEX_SEARCH_BACKWARD:
+        // PCRE only searches forward: keep the last match before the limit
+        ok = ScanMatches(request, text, length, 0, cancellable, TakeLast, &state, &error);
+        if (ok && set->matches->len == 0 && request->position < length) {
+            state.limit = length;
+            ok = ScanMatches(request, text, length, 0, cancellable, TakeLast, &state, &error);
+        }
+        break;
+    case REGEX_SEARCH_ALL:
+    default:
+        set->replacements = g_string_new(NULL);
+        set->replacementEnds = g_array_new(FALSE, FALSE, sizeof(gsize));
+        ok = ScanMatches(request, text, length, 0, cancellable, TakeAll, &state, &error);
+        if (ok && state.error) {
+            g_propagate_error(&error, state.error);
+            ok = FALSE;
+        }
+        break;
+    }
+
+    if (!ok) {
+        RegexMatchSetFree(set);
+        g_task_return_error(task, error);
+        return;
+    }
+    g_task_return_pointer(task, set, (GDestroyNotify)RegexMatchSetFree);
+}
+
+void RegexSearchAsync(GBytes *text, GRegex *regex, RegexSearchMode mode, gsize position,
+                      const char *replacement, GCancellable *cancellable,
+                      GAsyncReadyCallback callback, gpointer userData) {
+    RegexRequest *request = g_new0(RegexRequest, 1);
+    request->text = g_bytes_ref(text);
+    request->regex = g_regex_ref(regex);
+    request->mode = mode;
+    request->position = position;
+    request->replacement = g_strdup(replacement);
+
+    GTask *task = g_task_new(NULL, cancellable, callback, userData);
+    g_task_set_task_data(task, request, FreeRegexRequest);
+    g_task_set_return_on_cancel(task, TRUE);
+    g_task_run_in_thread(task, RegexSearchThread);
+    g_object_unref(task);
+}
+
+RegexMatchSet *RegexSearchFinish(GAsyncResult *result, GError **error) {
+    return g_task_propagate_pointer(G_TASK(result), error);
+}
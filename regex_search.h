@@ -0,0 +1,31 @@
+// Regular-expression find and replace for retropad, run off the UI thread
+#pragma once
+
+#include <gio/gio.h>
+#include "find_all.h"
+
+typedef enum RegexSearchMode {
+    REGEX_SEARCH_FORWARD,     // First match at or after position, wrapping to the start
+    REGEX_SEARCH_BACKWARD,    // Last match ending at or before position, wrapping to the end
+    REGEX_SEARCH_ALL          // Every match, with its expanded replacement
+} RegexSearchMode;
+
+typedef struct RegexMatchSet {
+    GArray *matches;          // TextMatch, in order
+    GString *replacements;    // REGEX_SEARCH_ALL: expanded replacements, back to back
+    GArray *replacementEnds;  // gsize: end of each match's replacement in replacements
+} RegexMatchSet;
+
+// Compiled patterns are cached by pattern and case setting, most recently used kept.
+// Returns a new reference, or NULL with error set if the pattern does not compile.
+GRegex *RegexCacheLookup(const char *pattern, gboolean matchCase, GError **error);
+void RegexCacheClear(void);
+
+// Runs the search on a worker thread. Cancelling completes the task at once with
+// G_IO_ERROR_CANCELLED; the worker stops at its next match and drops its references to
+// text and regex, so a pathological pattern never holds up the caller.
+void RegexSearchAsync(GBytes *text, GRegex *regex, RegexSearchMode mode, gsize position,
+                      const char *replacement, GCancellable *cancellable,
+                      GAsyncReadyCallback callback, gpointer userData);
+RegexMatchSet *RegexSearchFinish(GAsyncResult *result, GError **error);
+void RegexMatchSetFree(RegexMatchSet *set);
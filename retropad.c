@@ -1,25 +1,240 @@
 #include <gtk/gtk.h>
 #include <glib/gstdio.h>
+#include <glib-unix.h>
+#include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include "file_io.h"
+#include "text_search.h"
+#include "find_all.h"
+#include "regex_search.h"
+#include "undo_store.h"
+#include "piece_table.h"
+#include "log_view.h"
+#include "file_follow.h"
+#include "line_diff.h"
+#include "batch_convert.h"
+#include "perf_trace.h"
 
 #define APP_TITLE "retropad"
 #define UNTITLED_NAME "Untitled"
 #define MAX_PATH_BUFFER 1024
 #define DEFAULT_WIDTH 640
 #define DEFAULT_HEIGHT 480
-#define MAX_UNDO_STACK 100
-
+#define MAX_UNDO_STACK 1000
+#define UNDO_BYTE_BUDGET (32 * 1024 * 1024)  /* Resident undo/redo payload, see RETROPAD_UNDO_BUDGET_KB */
+#define UNDO_HOT_ENTRIES 4                   /* Newest entries are left uncompressed */
+#define UNDO_COMPRESS_MIN 4096               /* Smaller payloads aren't worth deflating */
+#define LOAD_READ_CHUNK (256 * 1024)
+#define LOAD_QUEUE_DEPTH 16                  /* Decoded chunks buffered ahead of the UI */
+#define LOAD_SLICE_USEC 8000                 /* Main-loop time spent inserting per slice */
+#define LOAD_POLL_MS 10
+#define REPLACE_MERGE_GAP 64                 /* Replace All joins matches closer than this (bytes) */
+#define SNAPSHOT_BATCH_EDITS 64              /* Edits of one batch patched into the search snapshot */
+#define SNAPSHOT_SLICE_CHARS (256 * 1024)    /* Characters copied per idle slice into the snapshot */
+#define MATCH_COUNT_DELAY_MS 120             /* Typing pause before the find bar recounts */
+#define REGEX_BUSY_DELAY_MS 250              /* Regex searches shorter than this show no progress */
+#define HIGHLIGHT_SLICE_USEC 4000            /* Main-loop time spent tagging matches per slice */
+#define HIGHLIGHT_CHUNK_CHARS (64 * 1024)    /* Text scanned per step of the background pass */
+#define LARGE_FILE_THRESHOLD_MB 256          /* Edit files this big through a piece table, see RETROPAD_LARGE_FILE_MB */
+#define LARGE_WINDOW_LINES 4000              /* Lines of a large document held in the text buffer */
+#define LARGE_WINDOW_MAX_BYTES (8 * 1024 * 1024)
+#define LARGE_WINDOW_MARGIN 500              /* Lines from a window edge at which the window moves */
+#define LARGE_SEARCH_BLOCK (4 * 1024 * 1024) /* Bytes of a large document searched per read */
+#define LARGE_ANCHOR_BLOCK (16 * 1024)       /* Bytes read per step when moving the window anchor */
+#define VIEWER_THRESHOLD_MB 1024             /* View files this big in place when the piece table
+                                              * can't take them, see RETROPAD_VIEWER_MB */
+#define APPLICATION_ID "org.retropad.Retropad" /* D-Bus name claimed in single-instance mode */
+#define RELOAD_SETTLE_MS 200                 /* Quiet time after an external write before diffing */
+#define STDIN_READ_BYTES (256 * 1024)        /* Most read from standard input per main-loop pass */
+#define STDIN_SETTLE_MS 200                  /* Quiet time before a short input's encoding is decided */
+
+typedef enum UndoEditType {
+    UNDO_EDIT_INSERT,
+    UNDO_EDIT_DELETE
+} UndoEditType;
+
+/* A single journaled buffer edit: only the affected span is kept */
+typedef struct UndoEdit {
+    UndoEditType type;
+    gint offset;        /* Character offset where the edit starts */
+    gint charCount;     /* Length of text in characters */
+    gsize textStart;    /* Byte range of the text within the entry payload */
+    gsize textLength;
+} UndoEdit;
+
+typedef enum UndoPayloadState {
+    UNDO_PAYLOAD_OPEN,        /* Newest entry, still growing in a GString */
+    UNDO_PAYLOAD_RAW,         /* Sealed, uncompressed in memory */
+    UNDO_PAYLOAD_COMPRESSED,  /* Sealed, deflated in memory */
+    UNDO_PAYLOAD_SPILLED      /* Evicted to the spill file */
+} UndoPayloadState;
+
+/* One undo step: a group of edits undone/redone together */
 typedef struct UndoRedoEntry {
-    char *text;
-    gint cursorPos;
+    GArray *edits;      /* UndoEdit, in the order they were applied; NULL while SPILLED */
+    UndoPayloadState state;
+    GString *openText;  /* Payload while OPEN */
+    GBytes *payload;    /* Payload while RAW or COMPRESSED */
+    gsize rawLength;
+    gboolean spilledCompressed;
+    goffset spillOffset;
+    gsize spillLength;
+    goffset spillEditsOffset;   /* The edit list is spilled along with the payload */
+    guint spillEditCount;
+    gsize residentBytes;        /* Payload, edit list and the entry itself */
+    GCancellable *compressJob;
+    gint cursorBefore;
+    gint cursorAfter;
+    /* Large documents: offsets are relative to the window the entry was made in, which
+     * is put back before the entry is replayed */
+    guint64 windowStart;
+    guint64 windowLengthBefore;
+    guint64 windowLengthAfter;
 } UndoRedoEntry;
 
+typedef struct UndoStats {
+    guint undoDepth;
+    guint redoDepth;
+    gsize residentBytes;
+    gsize spilledBytes;
+    gsize budget;
+} UndoStats;
+
+/* A file being streamed into a staging buffer: read/decoded on a worker, inserted in idle
+ * slices, and put in front of the view only once it has loaded completely */
+typedef struct DocumentLoad {
+    char *path;
+    GCancellable *cancellable;
+    GAsyncQueue *chunks;        /* GBytes of UTF-8 text, possibly views into the mapped file */
+    GtkTextBuffer *buffer;      /* Staging buffer; NULL once swapped in */
+    goffset totalBytes;
+    gint progress;              /* Permille read, updated atomically by the reader */
+    TextEncoding encoding;
+    gboolean readerDone;
+    gboolean readerOk;
+    gboolean cancelled;
+    guint sliceId;
+    gboolean sliceWaiting;
+    gboolean large;             /* Big enough to open through a piece table */
+    gboolean viewable;          /* Past viewerThreshold: viewed in place if the table fails */
+    gboolean viewInPlace;       /* Set by the reader instead of decoding: open in the viewer */
+    PieceTable *table;          /* Set by the reader instead of queuing chunks */
+    goffset loadedBytes;        /* File bytes the text came from; -1 if not known */
+    gint64 perfStart;
+} DocumentLoad;
+
+/* What a close, open or new was about to do when it had to wait for a save */
+typedef void (*SaveContinuation)(gpointer data);
+
+/* An immutable snapshot of the buffer being written out by a worker */
+typedef struct DocumentSave {
+    char *path;                 /* Becomes currentPath once written (Save As) */
+    GBytes *text;               /* The search snapshot's bytes, shared rather than copied */
+    PieceTable *table;          /* Large documents: a snapshot of the table instead of text */
+    TextEncoding encoding;
+    guint64 generation;         /* editGeneration when the snapshot was taken */
+    guint serial;               /* documentSerial of the document being saved */
+    gint64 perfStart;
+} DocumentSave;
+
+/* Identifies one version of a file on disk */
+typedef struct DiskStamp {
+    goffset size;
+    gint64 modified;            /* Microseconds */
+} DiskStamp;
+
+/* The open file as rewritten by another program, diffed against the buffer on a worker.
+ * The result is kept in the form ApplyReplacements takes. */
+typedef struct ExternalReload {
+    char *path;
+    GBytes *old;                /* Buffer snapshot the diff is against */
+    guint64 generation;
+    DiskStamp stamp;            /* The version that was read */
+    TextEncoding encoding;
+    GArray *matches;            /* TextMatch: the buffer bytes each hunk replaces */
+    GString *replacements;      /* The hunks' new text, back to back */
+    GArray *replacementEnds;    /* gsize: end of each hunk's text in replacements */
+} ExternalReload;
+
+/* Standard input streamed into an untitled document ("retropad -") */
+typedef struct StdinRead {
+    guint sourceId;
+    guint settleId;             /* Pending TextDecoderSettle while the writer is quiet */
+    TextDecoder *decoder;
+    guchar *buffer;             /* STDIN_READ_BYTES */
+    GString *text;              /* Decoded text of the latest read */
+    guint64 bytes;              /* Read so far */
+} StdinRead;
+
+/* A document too large to hold in the text buffer. The piece table is the document; the
+ * buffer holds a window of whole lines around the view, and every edit made in the
+ * buffer is mirrored into the table as it happens. */
+typedef struct LargeDocument {
+    PieceTable *table;
+    guint64 windowStart;        /* Document byte offset of the buffer's first character */
+    guint64 windowLength;       /* Bytes of the document in the buffer */
+    guint64 anchorChars;        /* A character offset in the window and its byte offset, */
+    guint64 anchorBytes;        /* so conversions only read the text between the two */
+    gboolean shifting;          /* Buffer being refilled from the table, not edited */
+    guint shiftIdle;
+} LargeDocument;
+
+/* A copy of the buffer text that searches scan in place. It is copied from the buffer
+ * once and then patched with each edit as it is made; the anchor pairs a byte position
+ * with its character offset so that byte <-> offset conversions only walk the distance
+ * from the last match or edit. */
+typedef struct SearchSnapshot {
+    GBytes *bytes;              /* Shared with background searches */
+    const char *text;
+    gsize length;
+    guint64 generation;
+    gsize anchorByte;
+    gint anchorChar;
+    guint batchEdits;           /* Patched during the current batch edit */
+    gboolean partial;           /* Still being copied from the buffer in idle slices */
+    gint copiedChars;           /* While partial: the buffer prefix copied so far */
+    guint copyIdle;
+} SearchSnapshot;
+
+/* The find bar's background match count. matches holds every match of needle in the
+ * buffer as of generation, and is reused by Replace All while it is still current. */
+typedef struct MatchCount {
+    GCancellable *job;
+    guint timer;
+    GArray *matches;            /* TextMatch */
+    char *needle;
+    gboolean matchCase;
+    guint64 generation;         /* Snapshot generation the matches were found in */
+    guint64 jobGeneration;      /* Snapshot generation the running job scans */
+} MatchCount;
+
+/* A buffer span waiting to be retagged after an edit */
+typedef struct HighlightRange {
+    GtkTextMark *start;
+    GtkTextMark *end;
+} HighlightRange;
+
+/* Highlight All: the visible lines are tagged at once; a background pass started at
+ * scanMark covers the rest of the document in idle slices, after edited ranges. */
+typedef struct HighlightState {
+    GtkTextTag *tag;
+    TextPattern *pattern;       /* NULL while the pass only clears old tags */
+    gboolean tagged;            /* Tags may be present somewhere in the buffer */
+    GtkTextMark *scanMark;      /* Where the background pass resumes; NULL when done */
+    GQueue *dirty;              /* HighlightRange, oldest first */
+    guint idle;
+} HighlightState;
+
 typedef struct AppState {
     GtkWidget *window;
     GtkWidget *textView;
+    GtkWidget *editorStack;     /* The text view's scrolled window, or the viewer */
+    GtkWidget *editorScroll;
     GtkWidget *statusbar;
+    GtkWidget *loadCancelButton;
+    GtkWidget *searchCancelButton;
     GtkTextBuffer *textBuffer;
     PangoFontDescription *fontDesc;
     char currentPath[MAX_PATH_BUFFER];
@@ -29,65 +244,462 @@ typedef struct AppState {
     TextEncoding encoding;
     GtkWidget *findBar;
     GtkWidget *findEntry;
+    GtkWidget *findCountLabel;
     GtkWidget *replaceBar;
     GtkWidget *replaceEntry;
+    GtkWidget *replaceAllButton; /* Insensitive while a large document is open */
+    GtkWidget *searchBars;      /* Holds the find and replace bars once they are built */
+    GtkWidget *openChooser;     /* File choosers and the font dialog, kept between uses */
+    GtkWidget *saveChooser;
+    GtkWidget *fontChooser;
     gboolean matchCase;
     gboolean searchDown;
+    gboolean highlightAll;
+    gboolean useRegex;
+    GCancellable *regexJob;     /* Regex or viewer search running on a worker, if any */
+    guint regexBusyTimer;
+    gint regexEmptyMatch;       /* 1 + character offset of the empty regex match last found, or 0 */
+    SearchSnapshot search;
+    MatchCount matchCount;
+    HighlightState highlight;
+    /* Title and status bar refreshes, flushed at most once per frame */
+    gboolean titleDirty;
+    gboolean statusDirty;
+    gboolean refreshScheduled;
+    gboolean shownModified;     /* What the title currently shows */
+    const char *shownMarker;
+    char shownPath[MAX_PATH_BUFFER];
+    gint64 shownLine;           /* What the status bar currently shows; 0 = nothing yet */
+    gint shownCol;
+    gint64 shownLines;
+    gint shownProgress;
     /* Undo/Redo stack */
     GQueue *undoStack;
     GQueue *redoStack;
     gboolean isUndoRedoInProgress;
+    gint userActionDepth;
+    gboolean batchEdit;          /* Inside a multi-edit operation; see BeginBatchEdit */
+    gboolean batchChanged;
+    gboolean userActionGrouped;  /* Current user action already has an undo entry */
+    gsize undoByteBudget;
+    gsize undoResidentBytes;
+    gsize undoSpilledBytes;
+    UndoSpillFile *undoSpill;
+    gboolean undoSpillFailed;   /* The spill file could not be created; don't retry per edit */
+    gboolean undoDropNoticed;   /* Told the user once that old undo steps were dropped */
+    guint undoDropNoticeId;
+    DocumentLoad *load;         /* In-flight streamed load, if any */
+    LargeDocument *large;       /* Set while a large document is open */
+    guint64 largeFileThreshold; /* Bytes */
+    LogView *viewer;            /* Set while a file is open in the read-only viewer */
+    guint64 viewerThreshold;    /* Bytes */
+    FileFollow *follow;         /* Set while following appends to the file */
+    gboolean followAfterLoad;   /* Start following once the reload in progress finishes */
+    StdinRead *stdinRead;       /* Set while standard input is being read into the buffer */
+    goffset fileBytes;          /* Size of the file the unmodified buffer matches; -1 = unknown */
+    GFileMonitor *fileMonitor;  /* Watches currentPath for changes made by other programs */
+    DiskStamp diskStamp;        /* Version of the file the buffer was last reconciled with */
+    guint reloadTimer;
+    GCancellable *reloadJob;
+    guint64 editGeneration;     /* Bumped on every buffer change */
+    guint documentSerial;       /* Bumped whenever another document takes the editor's place */
+    gboolean saveInFlight;
+    gboolean saveQueued;
+    SaveContinuation afterSave; /* Runs once the saves in flight have landed, unless one fails */
+    gpointer afterSaveData;
+    GDestroyNotify afterSaveFree;
+    char *saveTarget;           /* Path of the newest save in flight or queued */
+    DocumentSave *pendingSave;  /* Save waiting for the search snapshot to be copied */
+    guint pendingSaveTimer;
+    GtkWidget *perfMenuItem;    /* Help > Performance, hidden until recording is first enabled */
+    GtkWidget *perfRecordItem;
+    char *perfTracePath;        /* Trace written here on exit, from RETROPAD_TRACE */
+    gint64 keyPressTime;        /* First key press not yet shown on screen, while recording */
     /* Smart undo/redo */
-    gint lastUndoLength;
+    UndoEditType lastEditType;
     gint64 lastUndoTime;
     gchar lastChar;  /* Track last character for efficient break detection */
 } AppState;
 
 static AppState g_app = {0};
 static guint g_statusbar_context = 0;
+static guint g_load_context = 0;
+static guint g_save_context = 0;
+static guint g_search_context = 0;
 
-static void PushUndoStack(void);
+static void PushUndoStack(UndoEditType type, gint offset, const char *text, gint byteLength);
 static void ClearRedoStack(void);
 static void DoUndo(void);
 static void DoRedo(void);
 static void UpdateTitle(void);
 static void UpdateStatusBar(void);
-static gboolean GetEditText(char **bufferOut, int *lengthOut);
-static gboolean PromptSaveChanges(void);
+static gboolean PromptSaveChanges(SaveContinuation retry, gpointer data, GDestroyNotify destroy);
 static void DoFileNew(void);
-static void DoFileOpen(void);
+static void DoFileOpen(gboolean readOnly);
 static gboolean DoFileSave(gboolean saveAs);
 static void SetWordWrap(gboolean enabled);
 static void ToggleStatusBar(gboolean visible);
 static void ShowFindBar(void);
 static void ShowReplaceBar(void);
 static gboolean DoFindNext(gboolean reverse);
+static void ScheduleMatchCount(void);
+static void RestartHighlight(void);
 static void DoSelectFont(void);
 static void InsertTimeDate(void);
-static gboolean LoadDocumentFromPath(const char *path);
+static gboolean LoadDocumentFromPath(const char *path, gboolean readOnly);
+static void CancelDocumentLoad(void);
+static void ResetDocument(void);
+static void CloseLogViewer(void);
+static void CancelRegexSearch(void);
+static void ShowMessage(GtkMessageType type, const char *message);
+static void StopFollowing(void);
+static void StopReadingStdin(void);
+static void WatchCurrentFile(void);
+static void UnwatchCurrentFile(void);
+static void CreateSearchBars(void);
+
+/* Entry text of the find bar, or "" before it has been built */
+static const char *GetFindText(void) {
+    return g_app.findEntry ? gtk_entry_get_text(GTK_ENTRY(g_app.findEntry)) : "";
+}
+
+static void SetEntryResidentBytes(UndoRedoEntry *entry, gsize bytes) {
+    g_app.undoResidentBytes = g_app.undoResidentBytes - entry->residentBytes + bytes;
+    entry->residentBytes = bytes;
+}
+
+/* Everything the entry keeps in memory, so that edit-heavy steps such as Replace All
+ * count against the budget as well as large ones */
+static void UpdateEntryResidentBytes(UndoRedoEntry *entry) {
+    gsize bytes = sizeof(UndoRedoEntry);
+    if (entry->edits) {
+        bytes += entry->edits->len * sizeof(UndoEdit);
+    }
+    if (entry->state == UNDO_PAYLOAD_OPEN) {
+        bytes += entry->openText->len;
+    } else if (entry->payload) {
+        bytes += g_bytes_get_size(entry->payload);
+    }
+    SetEntryResidentBytes(entry, bytes);
+}
+
+static gsize SpilledEditBytes(const UndoRedoEntry *entry) {
+    return entry->spillEditCount * sizeof(UndoEdit);
+}
 
 static UndoRedoEntry* CreateUndoEntry(void) {
-    UndoRedoEntry *entry = g_new(UndoRedoEntry, 1);
-    GtkTextIter start, end;
-    gtk_text_buffer_get_bounds(g_app.textBuffer, &start, &end);
-    entry->text = gtk_text_buffer_get_text(g_app.textBuffer, &start, &end, FALSE);
-    
+    UndoRedoEntry *entry = g_new0(UndoRedoEntry, 1);
+    entry->edits = g_array_new(FALSE, FALSE, sizeof(UndoEdit));
+    entry->state = UNDO_PAYLOAD_OPEN;
+    entry->openText = g_string_new(NULL);
+
     GtkTextIter cursor;
     gtk_text_buffer_get_iter_at_mark(g_app.textBuffer,
         &cursor, gtk_text_buffer_get_insert(g_app.textBuffer));
-    entry->cursorPos = gtk_text_iter_get_offset(&cursor);
-    
+    entry->cursorBefore = gtk_text_iter_get_offset(&cursor);
+    entry->cursorAfter = entry->cursorBefore;
+
+    if (g_app.large) {
+        entry->windowStart = g_app.large->windowStart;
+        entry->windowLengthBefore = g_app.large->windowLength;
+        entry->windowLengthAfter = g_app.large->windowLength;
+    }
+
     return entry;
 }
 
+static void CancelUndoCompression(UndoRedoEntry *entry) {
+    if (entry->compressJob) {
+        g_cancellable_cancel(entry->compressJob);
+        g_object_unref(entry->compressJob);
+        entry->compressJob = NULL;
+    }
+}
+
 static void FreeUndoEntry(gpointer data) {
     UndoRedoEntry *entry = (UndoRedoEntry *)data;
     if (entry) {
-        g_free(entry->text);
+        CancelUndoCompression(entry);
+        SetEntryResidentBytes(entry, 0);
+        if (entry->state == UNDO_PAYLOAD_SPILLED) {
+            g_app.undoSpilledBytes -= entry->spillLength + SpilledEditBytes(entry);
+            UndoSpillFree(g_app.undoSpill, entry->spillOffset, entry->spillLength);
+            UndoSpillFree(g_app.undoSpill, entry->spillEditsOffset, SpilledEditBytes(entry));
+        }
+        if (entry->openText) {
+            g_string_free(entry->openText, TRUE);
+        }
+        if (entry->payload) {
+            g_bytes_unref(entry->payload);
+        }
+        if (entry->edits) {
+            g_array_free(entry->edits, TRUE);
+        }
         g_free(entry);
     }
 }
 
+static void SealUndoEntry(UndoRedoEntry *entry) {
+    if (entry->state != UNDO_PAYLOAD_OPEN) return;
+    entry->rawLength = entry->openText->len;
+    entry->payload = g_string_free_to_bytes(entry->openText);
+    entry->openText = NULL;
+    entry->state = UNDO_PAYLOAD_RAW;
+}
+
+static void AppendUndoEdit(UndoRedoEntry *entry, UndoEditType type, gint offset,
+                           const char *text, gint byteLength) {
+    gint charCount = g_utf8_strlen(text, byteLength);
+
+    /* Coalesce runs of typing into the previous insert */
+    if (type == UNDO_EDIT_INSERT && entry->edits->len > 0) {
+        UndoEdit *last = &g_array_index(entry->edits, UndoEdit, entry->edits->len - 1);
+        if (last->type == UNDO_EDIT_INSERT && last->offset + last->charCount == offset) {
+            g_string_append_len(entry->openText, text, byteLength);
+            last->charCount += charCount;
+            last->textLength += byteLength;
+            entry->cursorAfter = offset + charCount;
+            UpdateEntryResidentBytes(entry);
+            return;
+        }
+    }
+
+    UndoEdit edit;
+    edit.type = type;
+    edit.offset = offset;
+    edit.charCount = charCount;
+    edit.textStart = entry->openText->len;
+    edit.textLength = byteLength;
+    g_string_append_len(entry->openText, text, byteLength);
+    g_array_append_val(entry->edits, edit);
+
+    entry->cursorAfter = (type == UNDO_EDIT_INSERT) ? offset + charCount : offset;
+    UpdateEntryResidentBytes(entry);
+}
+
+static void CompressUndoPayloadThread(GTask *task, gpointer sourceObject,
+                                      gpointer taskData, GCancellable *cancellable) {
+    gsize length = 0;
+    const guint8 *data = g_bytes_get_data((GBytes *)taskData, &length);
+    GBytes *compressed = UndoCompress(data, length);
+    if (!compressed) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED, "Undo compression failed");
+        return;
+    }
+    g_task_return_pointer(task, compressed, (GDestroyNotify)g_bytes_unref);
+}
+
+static void EnforceUndoBudget(void);
+
+static void OnUndoPayloadCompressed(GObject *sourceObject, GAsyncResult *result, gpointer userData) {
+    /* A cancelled job means the entry was freed, spilled or reloaded: don't touch it */
+    GBytes *compressed = g_task_propagate_pointer(G_TASK(result), NULL);
+    if (!compressed) return;
+
+    UndoRedoEntry *entry = (UndoRedoEntry *)userData;
+    g_clear_object(&entry->compressJob);
+
+    if (entry->state == UNDO_PAYLOAD_RAW && g_bytes_get_size(compressed) < entry->rawLength) {
+        g_bytes_unref(entry->payload);
+        entry->payload = compressed;
+        entry->state = UNDO_PAYLOAD_COMPRESSED;
+        UpdateEntryResidentBytes(entry);
+        EnforceUndoBudget();
+    } else {
+        g_bytes_unref(compressed);
+    }
+}
+
+static void ScheduleUndoCompression(UndoRedoEntry *entry) {
+    if (!entry || entry->state != UNDO_PAYLOAD_RAW || entry->compressJob) return;
+    if (entry->rawLength < UNDO_COMPRESS_MIN) return;
+
+    entry->compressJob = g_cancellable_new();
+    GTask *task = g_task_new(NULL, entry->compressJob, OnUndoPayloadCompressed, entry);
+    g_task_set_task_data(task, g_bytes_ref(entry->payload), (GDestroyNotify)g_bytes_unref);
+    g_task_run_in_thread(task, CompressUndoPayloadThread);
+    g_object_unref(task);
+}
+
+static void GetUndoStats(UndoStats *stats) {
+    stats->undoDepth = g_queue_get_length(g_app.undoStack);
+    stats->redoDepth = g_queue_get_length(g_app.redoStack);
+    stats->residentBytes = g_app.undoResidentBytes;
+    stats->spilledBytes = g_app.undoSpilledBytes;
+    stats->budget = g_app.undoByteBudget;
+}
+
+/* A line for Help > Performance > Statistics */
+static char *FormatUndoStats(void) {
+    UndoStats stats;
+    GetUndoStats(&stats);
+    return g_strdup_printf("Undo: %u steps, redo: %u steps, %" G_GSIZE_FORMAT " of %"
+                           G_GSIZE_FORMAT " KB in memory, %" G_GSIZE_FORMAT " KB spilled%s",
+                           stats.undoDepth, stats.redoDepth, stats.residentBytes / 1024,
+                           stats.budget / 1024, stats.spilledBytes / 1024,
+                           g_app.undoSpillFailed ? " (no spill file)" : "");
+}
+
+static gboolean SpillUndoEntry(UndoRedoEntry *entry) {
+    if (entry->state != UNDO_PAYLOAD_RAW && entry->state != UNDO_PAYLOAD_COMPRESSED) return FALSE;
+
+    if (!g_app.undoSpill && !g_app.undoSpillFailed) {
+        g_app.undoSpill = UndoSpillOpen();
+        if (!g_app.undoSpill) {
+            g_app.undoSpillFailed = TRUE;
+            g_warning("Cannot create the undo spill file; undo history stays in memory");
+        }
+    }
+    if (!g_app.undoSpill) return FALSE;
+
+    gsize editBytes = entry->edits->len * sizeof(UndoEdit);
+    GBytes *edits = g_bytes_new_static(entry->edits->data, editBytes);
+    goffset editsOffset = 0;
+    goffset offset = 0;
+    gboolean written = UndoSpillWrite(g_app.undoSpill, edits, &editsOffset);
+    g_bytes_unref(edits);
+    if (written && !UndoSpillWrite(g_app.undoSpill, entry->payload, &offset)) {
+        UndoSpillFree(g_app.undoSpill, editsOffset, editBytes);
+        written = FALSE;
+    }
+    if (!written) return FALSE;
+
+    CancelUndoCompression(entry);
+    entry->spilledCompressed = (entry->state == UNDO_PAYLOAD_COMPRESSED);
+    entry->spillOffset = offset;
+    entry->spillLength = g_bytes_get_size(entry->payload);
+    entry->spillEditsOffset = editsOffset;
+    entry->spillEditCount = entry->edits->len;
+    g_bytes_unref(entry->payload);
+    entry->payload = NULL;
+    g_array_free(entry->edits, TRUE);
+    entry->edits = NULL;
+    entry->state = UNDO_PAYLOAD_SPILLED;
+    g_app.undoSpilledBytes += entry->spillLength + editBytes;
+    UpdateEntryResidentBytes(entry);
+    return TRUE;
+}
+
+/* Oldest sealed, in-memory entry. The newest entry of each stack, which the next Undo or
+ * Redo replays, only goes once nothing older is left. */
+static UndoRedoEntry *FindSpillVictim(gboolean newest) {
+    GQueue *stacks[] = { g_app.undoStack, g_app.redoStack };
+    for (guint s = 0; s < G_N_ELEMENTS(stacks); s++) {
+        for (GList *l = stacks[s]->head; l && (newest || l != stacks[s]->tail); l = l->next) {
+            UndoRedoEntry *entry = (UndoRedoEntry *)l->data;
+            if (entry->state == UNDO_PAYLOAD_RAW || entry->state == UNDO_PAYLOAD_COMPRESSED) {
+                return entry;
+            }
+        }
+    }
+    return NULL;
+}
+
+static gboolean on_undo_drop_notice(gpointer userData) {
+    g_app.undoDropNoticeId = 0;
+    ShowMessage(GTK_MESSAGE_WARNING,
+                "The undo history could not be saved to disk, so the oldest steps have been "
+                "dropped to stay within the undo memory limit.");
+    return G_SOURCE_REMOVE;
+}
+
+/* The oldest undo step, or once there are none the farthest redo step. Either can go
+ * without breaking the steps that remain. */
+static gboolean DropOldestUndoEntry(void) {
+    GQueue *stack = g_queue_is_empty(g_app.undoStack) ? g_app.redoStack : g_app.undoStack;
+    UndoRedoEntry *entry = (UndoRedoEntry *)g_queue_pop_head(stack);
+    if (!entry) return FALSE;
+    FreeUndoEntry(entry);
+    return TRUE;
+}
+
+static void EnforceUndoBudget(void) {
+    gboolean dropped = FALSE;
+    while (g_app.undoResidentBytes > g_app.undoByteBudget) {
+        UndoRedoEntry *victim = NULL;
+        if (!g_app.undoSpillFailed) {
+            victim = FindSpillVictim(FALSE);
+            if (!victim) {
+                victim = FindSpillVictim(TRUE);
+            }
+            if (!victim) {
+                /* Only the entry still being added to is left, e.g. one huge paste: close
+                 * it so it can be spilled too. Further typing starts a new entry. */
+                UndoRedoEntry *tail = (UndoRedoEntry *)g_queue_peek_tail(g_app.undoStack);
+                if (!tail || tail->state != UNDO_PAYLOAD_OPEN || tail->openText->len == 0) break;
+                SealUndoEntry(tail);
+                victim = tail;
+            }
+        }
+        if (victim && SpillUndoEntry(victim)) continue;
+
+        /* No spill file, or writing to it failed: the budget is only kept by forgetting */
+        if (!DropOldestUndoEntry()) break;
+        dropped = TRUE;
+    }
+    if (dropped && !g_app.undoDropNoticed) {
+        /* Edits journal from inside buffer signal handlers; don't run a dialog there */
+        g_app.undoDropNoticed = TRUE;
+        g_app.undoDropNoticeId = g_idle_add(on_undo_drop_notice, NULL);
+    }
+}
+
+/* Bring a sealed entry's payload back into memory, uncompressed */
+static gboolean LoadUndoEntry(UndoRedoEntry *entry) {
+    GBytes *raw = NULL;
+
+    switch (entry->state) {
+    case UNDO_PAYLOAD_OPEN:
+    case UNDO_PAYLOAD_RAW:
+        return TRUE;
+    case UNDO_PAYLOAD_COMPRESSED:
+        raw = UndoDecompress(entry->payload, entry->rawLength);
+        break;
+    case UNDO_PAYLOAD_SPILLED: {
+        GBytes *edits = UndoSpillRead(g_app.undoSpill, entry->spillEditsOffset,
+                                      SpilledEditBytes(entry));
+        if (!edits) return FALSE;
+        GBytes *stored = UndoSpillRead(g_app.undoSpill, entry->spillOffset, entry->spillLength);
+        if (stored && entry->spilledCompressed) {
+            raw = UndoDecompress(stored, entry->rawLength);
+            g_bytes_unref(stored);
+        } else {
+            raw = stored;
+        }
+        if (!raw) {
+            g_bytes_unref(edits);
+            return FALSE;
+        }
+
+        entry->edits = g_array_sized_new(FALSE, FALSE, sizeof(UndoEdit), entry->spillEditCount);
+        g_array_append_vals(entry->edits, g_bytes_get_data(edits, NULL), entry->spillEditCount);
+        g_bytes_unref(edits);
+        g_app.undoSpilledBytes -= entry->spillLength + SpilledEditBytes(entry);
+        UndoSpillFree(g_app.undoSpill, entry->spillOffset, entry->spillLength);
+        UndoSpillFree(g_app.undoSpill, entry->spillEditsOffset, SpilledEditBytes(entry));
+        entry->spillEditCount = 0;
+        break;
+    }
+    }
+
+    if (!raw) return FALSE;
+
+    if (entry->payload) {
+        g_bytes_unref(entry->payload);
+    }
+    entry->payload = raw;
+    entry->state = UNDO_PAYLOAD_RAW;
+    UpdateEntryResidentBytes(entry);
+    return TRUE;
+}
+
+static const char *UndoEntryText(UndoRedoEntry *entry) {
+    if (entry->state == UNDO_PAYLOAD_OPEN) {
+        return entry->openText->str;
+    }
+    return (const char *)g_bytes_get_data(entry->payload, NULL);
+}
+
 static gboolean IsSignificantChar(gchar c) {
     /* Check if character is a break point in undo/redo */
     return c == '\n' || c == ' ' || c == '\t' || 
@@ -96,56 +708,75 @@ static gboolean IsSignificantChar(gchar c) {
            c == '\0';  /* Also treat end of text as significant */
 }
 
-static void PushUndoStack(void) {
+static void PushUndoStack(UndoEditType type, gint offset, const char *text, gint byteLength) {
     if (g_app.isUndoRedoInProgress) return;
-    
-    /* Get current text length */
-    GtkTextIter start, end;
-    gtk_text_buffer_get_bounds(g_app.textBuffer, &start, &end);
-    gint currentLength = gtk_text_iter_get_offset(&end);
-    
+    if (byteLength <= 0) return;
+    gint64 perfStart = PerfBegin();
+
     /* Get current time */
     gint64 currentTime = g_get_monotonic_time();
-    
-    /* Get last character in buffer for efficient break detection */
-    gchar lastChar = '\0';
-    if (currentLength > 0) {
-        GtkTextIter lastIter;
-        gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, &lastIter, currentLength - 1);
-        lastChar = gtk_text_iter_get_char(&lastIter);
-    }
-    
-    /* Smart grouping: Only push a new undo state if:
+
+    /* Last character of the inserted text for efficient break detection */
+    gchar lastChar = (type == UNDO_EDIT_INSERT) ? text[byteLength - 1] : '\0';
+
+    /* Smart grouping: Only start a new undo entry if:
      * 1. More than 500ms has passed since last undo
      * 2. Text was deleted (length decreased)
      * 3. A significant character was just typed
+     * Edits made within one user action always share an entry.
      */
     gboolean shouldPush = TRUE;
-    
-    if (!g_queue_is_empty(g_app.undoStack)) {
+
+    if (g_app.userActionDepth > 0 && g_app.userActionGrouped) {
+        shouldPush = FALSE;
+    } else if (!g_queue_is_empty(g_app.undoStack)) {
         gint timeDiff = (currentTime - g_app.lastUndoTime) / 1000; /* Convert to ms */
-        gint lengthDiff = currentLength - g_app.lastUndoLength;
-        gboolean isSignificant = IsSignificantChar(lastChar);
-        
+        gboolean isSignificant = IsSignificantChar(g_app.lastChar);
+
         /* If less than 500ms, text grew (adding chars), and last char not significant, don't push */
-        if (timeDiff < 500 && lengthDiff > 0 && !isSignificant) {
+        if (timeDiff < 500 && type == UNDO_EDIT_INSERT &&
+            g_app.lastEditType == UNDO_EDIT_INSERT && !isSignificant) {
             shouldPush = FALSE;
         }
     }
-    
+
+    /* Only the newest entry can still grow */
+    UndoRedoEntry *tail = (UndoRedoEntry *)g_queue_peek_tail(g_app.undoStack);
+    if (!tail || tail->state != UNDO_PAYLOAD_OPEN) {
+        shouldPush = TRUE;
+    }
+
     if (shouldPush) {
-        /* Limit undo stack size */
+        /* Limit undo stack depth; memory is bounded by the byte budget */
         while (g_queue_get_length(g_app.undoStack) >= MAX_UNDO_STACK) {
             FreeUndoEntry(g_queue_pop_head(g_app.undoStack));
         }
-        
+
+        if (tail) {
+            SealUndoEntry(tail);
+        }
         g_queue_push_tail(g_app.undoStack, CreateUndoEntry());
+
+        /* Entries that fall out of the hot window get deflated in the background */
+        guint depth = g_queue_get_length(g_app.undoStack);
+        if (depth > UNDO_HOT_ENTRIES) {
+            ScheduleUndoCompression((UndoRedoEntry *)g_queue_peek_nth(g_app.undoStack,
+                                                                    depth - 1 - UNDO_HOT_ENTRIES));
+        }
     }
-    
+
+    AppendUndoEdit((UndoRedoEntry *)g_queue_peek_tail(g_app.undoStack),
+                   type, offset, text, byteLength);
+    if (g_app.userActionDepth > 0) {
+        g_app.userActionGrouped = TRUE;
+    }
+    EnforceUndoBudget();
+
     /* Update tracking variables */
-    g_app.lastUndoLength = currentLength;
+    g_app.lastEditType = type;
     g_app.lastUndoTime = currentTime;
     g_app.lastChar = lastChar;
+    PerfEnd(PERF_UNDO_PUSH, perfStart);
 }
 
 static void ClearRedoStack(void) {
@@ -153,27 +784,307 @@ static void ClearRedoStack(void) {
     g_queue_clear(g_app.redoStack);
 }
 
+static void ClearUndoHistory(void) {
+    ClearRedoStack();
+    g_queue_foreach(g_app.undoStack, (GFunc)FreeUndoEntry, NULL);
+    g_queue_clear(g_app.undoStack);
+    UndoSpillReset(g_app.undoSpill);
+    g_app.lastEditType = UNDO_EDIT_INSERT;
+    g_app.lastUndoTime = 0;
+    g_app.lastChar = '\0';
+}
+
+/* Buffer edits made between these don't refresh the title and status bar one by one */
+static void BeginBatchEdit(void) {
+    g_app.batchEdit = TRUE;
+    g_app.batchChanged = FALSE;
+    g_app.search.batchEdits = 0;
+}
+
+static void EndBatchEdit(void) {
+    g_app.batchEdit = FALSE;
+    if (g_app.batchChanged) {
+        g_app.modified = TRUE;
+        UpdateTitle();
+        UpdateStatusBar();
+        ScheduleMatchCount();
+        RestartHighlight();
+    }
+}
+
+/* Moves the window anchor to a character offset (byChar) or byte offset, both counted
+ * from the window start. The table always matches the buffer contents, so the text in
+ * between is read from there and characters are counted by their lead bytes. Line
+ * numbers can't be used: the buffer also breaks lines at a lone \r and U+2029. */
+static void LargeMoveAnchor(gboolean byChar, guint64 target) {
+    LargeDocument *large = g_app.large;
+    char block[LARGE_ANCHOR_BLOCK];
+    guint64 chars = large->anchorChars;
+    guint64 bytes = large->anchorBytes;
+
+    if (byChar ? target > chars : target > bytes) {
+        gboolean done = FALSE;
+        while (!done && bytes < large->windowLength) {
+            gsize n = PieceTableRead(large->table, large->windowStart + bytes, block,
+                                     (gsize)MIN(sizeof(block), large->windowLength - bytes));
+            if (n == 0) break;
+            for (gsize i = 0; i < n; i++) {
+                gboolean lead = ((guchar)block[i] & 0xC0) != 0x80;
+                /* Stop on the target's lead byte, not after it */
+                if (byChar ? lead && chars == target : bytes == target) {
+                    done = TRUE;
+                    break;
+                }
+                if (lead) chars++;
+                bytes++;
+            }
+        }
+    } else {
+        while (byChar ? chars > target : bytes > target) {
+            gsize n = (gsize)MIN(sizeof(block), bytes);
+            PieceTableRead(large->table, large->windowStart + bytes - n, block, n);
+            for (gsize i = n; i > 0 && (byChar ? chars > target : bytes > target); i--) {
+                bytes--;
+                if (((guchar)block[i - 1] & 0xC0) != 0x80) chars--;
+            }
+        }
+    }
+    large->anchorChars = chars;
+    large->anchorBytes = bytes;
+}
+
+/* Document byte offset of a buffer position */
+static guint64 LargeOffsetAtIter(const GtkTextIter *iter) {
+    LargeMoveAnchor(TRUE, (guint64)gtk_text_iter_get_offset(iter));
+    return g_app.large->windowStart + g_app.large->anchorBytes;
+}
+
+/* Buffer position of a document byte offset; FALSE if it lies outside the window */
+static gboolean LargeIterAtOffset(GtkTextIter *iter, guint64 offset) {
+    LargeDocument *large = g_app.large;
+    if (offset < large->windowStart || offset > large->windowStart + large->windowLength) {
+        return FALSE;
+    }
+    LargeMoveAnchor(FALSE, offset - large->windowStart);
+    gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, iter, (gint)large->anchorChars);
+    return TRUE;
+}
+
+static guint64 LargeCharBoundary(guint64 offset) {
+    char c;
+    while (offset > 0 && PieceTableRead(g_app.large->table, offset, &c, 1) == 1 &&
+           ((guchar)c & 0xC0) == 0x80) {
+        offset--;
+    }
+    return offset;
+}
+
+static void MirrorLargeEdit(void) {
+    /* The open undo entry now ends with this window length */
+    UndoRedoEntry *tail = (UndoRedoEntry *)g_queue_peek_tail(g_app.undoStack);
+    if (!g_app.isUndoRedoInProgress && tail && tail->state == UNDO_PAYLOAD_OPEN) {
+        tail->windowLengthAfter = g_app.large->windowLength;
+    }
+}
+
+static void MirrorLargeInsert(const GtkTextIter *location, const char *text, gint length) {
+    LargeDocument *large = g_app.large;
+    if (large->shifting) return;
+    /* The anchor is left at the insertion point, which the insert doesn't move */
+    PieceTableInsert(large->table, LargeOffsetAtIter(location), text, length);
+    large->windowLength += length;
+    MirrorLargeEdit();
+}
+
+static void MirrorLargeDelete(const GtkTextIter *start, const GtkTextIter *end) {
+    LargeDocument *large = g_app.large;
+    if (large->shifting) return;
+    /* end first, so the anchor is left at start, before the deleted text */
+    guint64 to = LargeOffsetAtIter(end);
+    guint64 from = LargeOffsetAtIter(start);
+    PieceTableDelete(large->table, from, to - from);
+    large->windowLength -= to - from;
+    MirrorLargeEdit();
+}
+
+/* Replaces the buffer with [start, start + length) of the document. Neither the undo
+ * journal nor the modified flag sees this; undo entries recorded against the old window
+ * are closed so that later edits start a new one. */
+static void FillLargeWindow(guint64 start, guint64 length) {
+    LargeDocument *large = g_app.large;
+    char *text = g_malloc(length + 1);
+    length = PieceTableRead(large->table, start, text, length);
+
+    large->windowStart = start;
+    large->windowLength = length;
+    large->anchorChars = 0;
+    large->anchorBytes = 0;
+    large->shifting = TRUE;
+    g_app.isUndoRedoInProgress = TRUE;
+    gtk_text_buffer_set_text(g_app.textBuffer, text, length);
+    g_app.isUndoRedoInProgress = FALSE;
+    large->shifting = FALSE;
+    g_free(text);
+
+    UndoRedoEntry *tail = (UndoRedoEntry *)g_queue_peek_tail(g_app.undoStack);
+    if (tail) {
+        SealUndoEntry(tail);
+    }
+    ScheduleMatchCount();
+    RestartHighlight();
+    UpdateStatusBar();
+}
+
+/* Loads the window of about LARGE_WINDOW_LINES lines centred on offset */
+static void ShowLargeWindowAround(guint64 offset) {
+    LargeDocument *large = g_app.large;
+    PieceTable *table = large->table;
+    guint64 line = PieceTableLineAt(table, offset);
+    guint64 start = PieceTableLineStart(table, line > LARGE_WINDOW_LINES / 2 ?
+                                               line - LARGE_WINDOW_LINES / 2 : 0);
+    if (offset - start > LARGE_WINDOW_MAX_BYTES / 2) {
+        start = PieceTableLineStart(table, line);
+        if (offset - start > LARGE_WINDOW_MAX_BYTES / 2) {
+            start = LargeCharBoundary(offset - LARGE_WINDOW_MAX_BYTES / 2);
+        }
+    }
+
+    guint64 end = PieceTableLineStart(table, PieceTableLineAt(table, start) + LARGE_WINDOW_LINES);
+    if (end - start > LARGE_WINDOW_MAX_BYTES) {
+        end = LargeCharBoundary(start + LARGE_WINDOW_MAX_BYTES);
+    }
+    FillLargeWindow(start, end - start);
+}
+
+/* Puts back an undo entry's window, unless the buffer already holds exactly that span */
+static void EnsureLargeWindow(guint64 start, guint64 length) {
+    LargeDocument *large = g_app.large;
+    if (!large || (large->windowStart == start && large->windowLength == length)) return;
+    FillLargeWindow(start, length);
+}
+
+/* Moves the window once the view comes within LARGE_WINDOW_MARGIN lines of either end,
+ * keeping the top visible line and the selection where they were in the document. */
+static gboolean on_large_shift(gpointer userData) {
+    LargeDocument *large = g_app.large;
+    large->shiftIdle = 0;
+
+    GtkTextView *view = GTK_TEXT_VIEW(g_app.textView);
+    GdkRectangle visible;
+    GtkTextIter top, bottom, insert, bound;
+    gtk_text_view_get_visible_rect(view, &visible);
+    gtk_text_view_get_iter_at_location(view, &top, visible.x, visible.y);
+    gtk_text_view_get_iter_at_location(view, &bottom, visible.x, visible.y + visible.height);
+
+    gint lines = gtk_text_buffer_get_line_count(g_app.textBuffer);
+    gboolean nearTop = large->windowStart > 0 &&
+                       gtk_text_iter_get_line(&top) < LARGE_WINDOW_MARGIN;
+    gboolean nearBottom = large->windowStart + large->windowLength < PieceTableLength(large->table) &&
+                          gtk_text_iter_get_line(&bottom) >= lines - LARGE_WINDOW_MARGIN;
+    if (!nearTop && !nearBottom) return G_SOURCE_REMOVE;
+
+    gtk_text_iter_set_line_offset(&top, 0);
+    gtk_text_buffer_get_selection_bounds(g_app.textBuffer, &insert, &bound);
+    guint64 topOffset = LargeOffsetAtIter(&top);
+    guint64 insertOffset = LargeOffsetAtIter(&insert);
+    guint64 boundOffset = LargeOffsetAtIter(&bound);
+
+    ShowLargeWindowAround(topOffset);
+
+    if (!LargeIterAtOffset(&top, topOffset)) {
+        gtk_text_buffer_get_start_iter(g_app.textBuffer, &top);
+    }
+    if (LargeIterAtOffset(&insert, insertOffset) && LargeIterAtOffset(&bound, boundOffset)) {
+        gtk_text_buffer_select_range(g_app.textBuffer, &insert, &bound);
+    } else {
+        gtk_text_buffer_place_cursor(g_app.textBuffer, &top);
+    }
+    GtkTextMark *topMark = gtk_text_buffer_create_mark(g_app.textBuffer, NULL, &top, TRUE);
+    gtk_text_view_scroll_to_mark(view, topMark, 0, TRUE, 0, 0);
+    gtk_text_buffer_delete_mark(g_app.textBuffer, topMark);
+    return G_SOURCE_REMOVE;
+}
+
+static void ScheduleLargeShift(void) {
+    LargeDocument *large = g_app.large;
+    if (!large || large->shifting || large->shiftIdle) return;
+    large->shiftIdle = g_idle_add(on_large_shift, NULL);
+}
+
+/* Replace All works on the whole buffer, which a large document only has a window of */
+static void UpdateReplaceAllButton(void) {
+    if (g_app.replaceAllButton) {
+        gtk_widget_set_sensitive(g_app.replaceAllButton, g_app.large == NULL);
+    }
+}
+
+static void OpenLargeDocument(PieceTable *table) {
+    g_app.large = g_new0(LargeDocument, 1);
+    g_app.large->table = table;
+    ShowLargeWindowAround(0);
+    UpdateReplaceAllButton();
+}
+
+static void CloseLargeDocument(void) {
+    LargeDocument *large = g_app.large;
+    if (!large) return;
+    if (large->shiftIdle) {
+        g_source_remove(large->shiftIdle);
+    }
+    PieceTableFree(large->table);
+    g_free(large);
+    g_app.large = NULL;
+    UpdateReplaceAllButton();
+}
+
+static void ApplyUndoEdit(const UndoEdit *edit, const char *text, gboolean inverse) {
+    GtkTextIter start, end;
+    gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, &start, edit->offset);
+
+    gboolean insert = (edit->type == UNDO_EDIT_INSERT) != inverse;
+    if (insert) {
+        gtk_text_buffer_insert(g_app.textBuffer, &start, text + edit->textStart, edit->textLength);
+    } else {
+        gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, &end, edit->offset + edit->charCount);
+        gtk_text_buffer_delete(g_app.textBuffer, &start, &end);
+    }
+}
+
+static void RestoreCursor(gint offset) {
+    GtkTextIter cursor;
+    gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, &cursor, offset);
+    gtk_text_buffer_place_cursor(g_app.textBuffer, &cursor);
+    gtk_text_view_scroll_to_iter(GTK_TEXT_VIEW(g_app.textView), &cursor, 0, FALSE, 0, 0);
+}
+
 static void DoUndo(void) {
     if (g_queue_is_empty(g_app.undoStack)) return;
     
-    g_app.isUndoRedoInProgress = TRUE;
-    
-    /* Save current state to redo stack */
-    g_queue_push_tail(g_app.redoStack, CreateUndoEntry());
-    
-    /* Pop and restore from undo stack */
     UndoRedoEntry *entry = (UndoRedoEntry *)g_queue_pop_tail(g_app.undoStack);
-    if (entry) {
-        gtk_text_buffer_set_text(g_app.textBuffer, entry->text, -1);
-        
-        GtkTextIter cursor;
-        gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, &cursor, entry->cursorPos);
-        gtk_text_buffer_place_cursor(g_app.textBuffer, &cursor);
-        gtk_text_view_scroll_to_iter(GTK_TEXT_VIEW(g_app.textView), &cursor, 0, FALSE, 0, 0);
-        
+    if (!LoadUndoEntry(entry)) {
+        /* The history is unusable past a lost entry */
         FreeUndoEntry(entry);
+        ClearUndoHistory();
+        return;
+    }
+    SealUndoEntry(entry);
+    EnsureLargeWindow(entry->windowStart, entry->windowLengthAfter);
+
+    g_app.isUndoRedoInProgress = TRUE;
+    
+    /* Apply the inverse of each edit, newest first */
+    const char *text = UndoEntryText(entry);
+    BeginBatchEdit();
+    for (guint i = entry->edits->len; i > 0; i--) {
+        ApplyUndoEdit(&g_array_index(entry->edits, UndoEdit, i - 1), text, TRUE);
     }
+    EndBatchEdit();
+    RestoreCursor(entry->cursorBefore);
+    g_queue_push_tail(g_app.redoStack, entry);
+    EnforceUndoBudget();
     
+    /* Next edit must not merge into an entry that has been undone */
+    g_app.lastChar = '\0';
     g_app.isUndoRedoInProgress = FALSE;
     UpdateStatusBar();
 }
@@ -181,29 +1092,45 @@ static void DoUndo(void) {
 static void DoRedo(void) {
     if (g_queue_is_empty(g_app.redoStack)) return;
     
-    g_app.isUndoRedoInProgress = TRUE;
-    
-    /* Save current state to undo stack */
-    g_queue_push_tail(g_app.undoStack, CreateUndoEntry());
-    
-    /* Pop and restore from redo stack */
     UndoRedoEntry *entry = (UndoRedoEntry *)g_queue_pop_tail(g_app.redoStack);
-    if (entry) {
-        gtk_text_buffer_set_text(g_app.textBuffer, entry->text, -1);
-        
-        GtkTextIter cursor;
-        gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, &cursor, entry->cursorPos);
-        gtk_text_buffer_place_cursor(g_app.textBuffer, &cursor);
-        gtk_text_view_scroll_to_iter(GTK_TEXT_VIEW(g_app.textView), &cursor, 0, FALSE, 0, 0);
-        
+    if (!LoadUndoEntry(entry)) {
         FreeUndoEntry(entry);
+        ClearRedoStack();
+        return;
+    }
+    EnsureLargeWindow(entry->windowStart, entry->windowLengthBefore);
+
+    g_app.isUndoRedoInProgress = TRUE;
+    
+    /* Re-apply each edit in its original order */
+    const char *text = UndoEntryText(entry);
+    BeginBatchEdit();
+    for (guint i = 0; i < entry->edits->len; i++) {
+        ApplyUndoEdit(&g_array_index(entry->edits, UndoEdit, i), text, FALSE);
     }
+    EndBatchEdit();
+    RestoreCursor(entry->cursorAfter);
+    g_queue_push_tail(g_app.undoStack, entry);
+    EnforceUndoBudget();
     
+    g_app.lastChar = '\0';
     g_app.isUndoRedoInProgress = FALSE;
     UpdateStatusBar();
 }
 
-static void UpdateTitle(void) {
+static void RefreshTitle(void) {
+    /* Only the modified flag and the path appear in the title */
+    const char *marker = g_app.viewer ? " [Read-Only]" : g_app.follow ? " [Following]" :
+                         g_app.stdinRead ? " [Reading]" : "";
+    if (g_app.window && gtk_window_get_title(GTK_WINDOW(g_app.window)) &&
+        g_app.shownModified == g_app.modified && g_app.shownMarker == marker &&
+        strcmp(g_app.shownPath, g_app.currentPath) == 0) {
+        return;
+    }
+    g_app.shownModified = g_app.modified;
+    g_app.shownMarker = marker;
+    strcpy(g_app.shownPath, g_app.currentPath);
+
     char name[MAX_PATH_BUFFER];
     if (g_app.currentPath[0]) {
         const char *fileName = g_app.currentPath;
@@ -216,287 +1143,1746 @@ static void UpdateTitle(void) {
     name[MAX_PATH_BUFFER - 1] = '\0';
 
     char title[MAX_PATH_BUFFER + 32];
-    snprintf(title, sizeof(title), "%s%s - %s",
-             (g_app.modified ? "*" : ""), name, APP_TITLE);
+    snprintf(title, sizeof(title), "%s%s%s - %s",
+             (g_app.modified ? "*" : ""), name, marker, APP_TITLE);
     gtk_window_set_title(GTK_WINDOW(g_app.window), title);
 }
 
-static void UpdateStatusBar(void) {
+/* The viewer reports from its line index, which may still be growing */
+static void RefreshViewerStatusBar(void) {
+    LogViewPosition position;
+    LogViewGetPosition(g_app.viewer, &position);
+    if ((gint64)position.line == g_app.shownLine && (gint64)position.lines == g_app.shownLines &&
+        position.progress == g_app.shownProgress && (gint)position.column == g_app.shownCol) {
+        return;
+    }
+    g_app.shownLine = position.line;
+    g_app.shownCol = (gint)position.column;
+    g_app.shownLines = position.lines;
+    g_app.shownProgress = position.progress;
+
+    char status[160];
+    if (position.progress < 1000) {
+        snprintf(status, sizeof(status), "Ln %" G_GUINT64_FORMAT ", Col %" G_GUINT64_FORMAT
+                 "    Lines: %" G_GUINT64_FORMAT "+ (indexing %d%%)", position.line,
+                 position.column, position.lines, position.progress / 10);
+    } else {
+        snprintf(status, sizeof(status), "Ln %" G_GUINT64_FORMAT ", Col %" G_GUINT64_FORMAT
+                 "    Lines: %" G_GUINT64_FORMAT, position.line, position.column, position.lines);
+    }
+    gtk_statusbar_pop(GTK_STATUSBAR(g_app.statusbar), g_statusbar_context);
+    gtk_statusbar_push(GTK_STATUSBAR(g_app.statusbar), g_statusbar_context, status);
+}
+
+static void RefreshStatusBar(void) {
     if (!g_app.statusVisible) return;
+    if (g_app.viewer) {
+        RefreshViewerStatusBar();
+        return;
+    }
 
-    GtkTextIter start, end;
-    gtk_text_buffer_get_bounds(g_app.textBuffer, &start, &end);
-    gint totalLines = gtk_text_iter_get_line(&end) + 1;
+    gint64 totalLines = gtk_text_buffer_get_line_count(g_app.textBuffer);
 
     GtkTextIter cursor;
     gtk_text_buffer_get_iter_at_mark(g_app.textBuffer,
         &cursor, gtk_text_buffer_get_insert(g_app.textBuffer));
-    gint line = gtk_text_iter_get_line(&cursor) + 1;
+    gint64 line = gtk_text_iter_get_line(&cursor) + 1;
     gint col = gtk_text_iter_get_line_offset(&cursor) + 1;
 
+    /* Large documents: the buffer is a window; count from the start of the document */
+    if (g_app.large) {
+        totalLines = PieceTableLineCount(g_app.large->table);
+        line = PieceTableLineAt(g_app.large->table, LargeOffsetAtIter(&cursor)) + 1;
+    }
+
+    if (line == g_app.shownLine && col == g_app.shownCol && totalLines == g_app.shownLines &&
+        g_app.shownProgress == 1000) {
+        return;
+    }
+    g_app.shownLine = line;
+    g_app.shownCol = col;
+    g_app.shownLines = totalLines;
+    g_app.shownProgress = 1000;
+
     char status[128];
-    snprintf(status, sizeof(status), "Ln %d, Col %d    Lines: %d",
+    snprintf(status, sizeof(status), "Ln %" G_GINT64_FORMAT ", Col %d    Lines: %" G_GINT64_FORMAT,
              line, col, totalLines);
 
     gtk_statusbar_pop(GTK_STATUSBAR(g_app.statusbar), g_statusbar_context);
     gtk_statusbar_push(GTK_STATUSBAR(g_app.statusbar), g_statusbar_context, status);
 }
 
-static gboolean GetEditText(char **bufferOut, int *lengthOut) {
-    GtkTextIter start, end;
-    gtk_text_buffer_get_bounds(g_app.textBuffer, &start, &end);
-    char *text = gtk_text_buffer_get_text(g_app.textBuffer, &start, &end, FALSE);
-    if (!text) return FALSE;
-
-    int len = strlen(text);
-    if (lengthOut) *lengthOut = len;
-    *bufferOut = text;
-    return TRUE;
+static void FlushUiRefresh(void) {
+    g_app.refreshScheduled = FALSE;
+    if (g_app.titleDirty) {
+        g_app.titleDirty = FALSE;
+        RefreshTitle();
+    }
+    if (g_app.statusDirty) {
+        g_app.statusDirty = FALSE;
+        gint64 perfStart = PerfBegin();
+        RefreshStatusBar();
+        PerfEnd(PERF_STATUS_BAR, perfStart);
+    }
 }
 
-static gboolean FindInEdit(const char *needle, gboolean matchCase, gboolean searchDown,
-                          GtkTextIter *outStart, GtkTextIter *outEnd) {
-    if (!needle || needle[0] == '\0') return FALSE;
-
-    char *text = NULL;
-    int len = 0;
-    if (!GetEditText(&text, &len)) return FALSE;
+static gboolean on_refresh_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer user_data) {
+    FlushUiRefresh();
+    return G_SOURCE_REMOVE;
+}
 
-    char *haystack = text;
-    char *needleBuf = g_strdup(needle);
+static gboolean on_refresh_idle(gpointer user_data) {
+    FlushUiRefresh();
+    return G_SOURCE_REMOVE;
+}
 
-    if (!matchCase) {
-        char *p = haystack;
-        while (*p) {
-            *p = g_ascii_tolower(*p);
-            p++;
-        }
-        p = needleBuf;
-        while (*p) {
-            *p = g_ascii_tolower(*p);
-            p++;
-        }
+/* Runs the flush just before the next frame is painted. Until the window is mapped there
+ * is no frame clock, so an idle at redraw priority stands in. */
+static void ScheduleUiRefresh(void) {
+    if (g_app.refreshScheduled) return;
+    g_app.refreshScheduled = TRUE;
+    if (g_app.window && gtk_widget_get_mapped(g_app.window)) {
+        gtk_widget_add_tick_callback(g_app.window, on_refresh_tick, NULL, NULL);
+    } else {
+        g_idle_add_full(GDK_PRIORITY_REDRAW, on_refresh_idle, NULL, NULL);
     }
+}
 
-    GtkTextIter cursor;
-    gtk_text_buffer_get_iter_at_mark(g_app.textBuffer,
-        &cursor, gtk_text_buffer_get_insert(g_app.textBuffer));
-    gint searchPos = gtk_text_iter_get_offset(&cursor);
-    if (!searchDown) searchPos = 0;
+/* Both only mark their widget stale; bursts of edits and cursor moves collapse into one
+ * refresh per frame. */
+static void UpdateTitle(void) {
+    g_app.titleDirty = TRUE;
+    ScheduleUiRefresh();
+}
+
+static void UpdateStatusBar(void) {
+    g_app.statusDirty = TRUE;
+    ScheduleUiRefresh();
+}
 
-    char *found = strstr(haystack + searchPos, needleBuf);
-    if (!found && searchDown) {
-        found = strstr(haystack, needleBuf);
+static void ClearSearchSnapshot(void) {
+    if (g_app.search.copyIdle) {
+        g_source_remove(g_app.search.copyIdle);
+    }
+    if (g_app.search.bytes) {
+        g_bytes_unref(g_app.search.bytes);
     }
+    memset(&g_app.search, 0, sizeof(g_app.search));
+}
 
-    gboolean result = FALSE;
-    if (found) {
-        gint pos = found - haystack;
-        gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, outStart, pos);
-        gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, outEnd,
-                                          pos + strlen(needle));
-        result = TRUE;
+/* Makes text (g_malloc'd, NUL-terminated) the snapshot of the current buffer contents */
+static void SetSearchSnapshot(char *text, gsize length) {
+    SearchSnapshot *snapshot = &g_app.search;
+    ClearSearchSnapshot();
+    snapshot->length = length;
+    snapshot->bytes = g_bytes_new_take(text, length);
+    snapshot->text = text;
+    snapshot->generation = g_app.editGeneration;
+}
+
+static gboolean CopySnapshotSlice(gint maxChars);
+
+/* The snapshot if it is whole and current, without copying anything */
+static SearchSnapshot *PeekSearchSnapshot(void) {
+    SearchSnapshot *snapshot = &g_app.search;
+    if (!snapshot->text || snapshot->partial || snapshot->generation != g_app.editGeneration) {
+        return NULL;
     }
+    return snapshot;
+}
 
-    g_free(text);
-    g_free(needleBuf);
-    return result;
+/* Returns the snapshot for the current buffer contents. The buffer is only copied when
+ * there is no snapshot yet, or an edit could not be patched into it; a copy being made
+ * in the background is finished on the spot. */
+static SearchSnapshot *GetSearchSnapshot(void) {
+    SearchSnapshot *snapshot = &g_app.search;
+    if (snapshot->text && snapshot->generation == g_app.editGeneration) {
+        if (snapshot->partial) {
+            g_source_remove(snapshot->copyIdle);
+            snapshot->copyIdle = 0;
+            CopySnapshotSlice(G_MAXINT);
+        }
+        return snapshot;
+    }
+
+    GtkTextIter start, end;
+    gtk_text_buffer_get_bounds(g_app.textBuffer, &start, &end);
+    /* Include embedded objects as U+FFFC so byte positions map back to buffer offsets */
+    char *text = gtk_text_buffer_get_text(g_app.textBuffer, &start, &end, TRUE);
+    if (!text) {
+        ClearSearchSnapshot();
+        return NULL;
+    }
+    SetSearchSnapshot(text, strlen(text));
+    return snapshot;
+}
+
+static gsize SnapshotByteAtOffset(SearchSnapshot *snapshot, gint charOffset) {
+    const char *p = g_utf8_offset_to_pointer(snapshot->text + snapshot->anchorByte,
+                                             charOffset - snapshot->anchorChar);
+    snapshot->anchorByte = p - snapshot->text;
+    snapshot->anchorChar = charOffset;
+    return snapshot->anchorByte;
+}
+
+static gint SnapshotOffsetAtByte(SearchSnapshot *snapshot, gsize byte) {
+    snapshot->anchorChar += g_utf8_pointer_to_offset(snapshot->text + snapshot->anchorByte,
+                                                     snapshot->text + byte);
+    snapshot->anchorByte = byte;
+    return snapshot->anchorChar;
+}
+
+/* Applies an edit the buffer is about to make, replacing the characters between
+ * startChar and endChar with insert. The text is patched in place unless a search, save
+ * or reload still holds the bytes, in which case GBytes hands back a private copy. Edits
+ * made in bulk (large undo steps, window refills) drop the snapshot instead; it is
+ * copied afresh by the next search. */
+static void PatchSearchSnapshot(gint startChar, gint endChar, const char *insert, gsize insertLength) {
+    SearchSnapshot *snapshot = &g_app.search;
+    if (!snapshot->text) return;
+    if ((g_app.large && g_app.large->shifting) ||
+        (g_app.batchEdit && ++snapshot->batchEdits > SNAPSHOT_BATCH_EDITS)) {
+        ClearSearchSnapshot();
+        return;
+    }
+    if (snapshot->partial) {
+        /* Text past the copied prefix is copied later, as it stands by then */
+        snapshot->generation = g_app.editGeneration + 1;
+        if (startChar >= snapshot->copiedChars) return;
+        endChar = MIN(endChar, snapshot->copiedChars);
+        snapshot->copiedChars += g_utf8_strlen(insert, insertLength) - (endChar - startChar);
+    }
+
+    gsize startByte = SnapshotByteAtOffset(snapshot, startChar);
+    gsize endByte = endChar > startChar ? SnapshotByteAtOffset(snapshot, endChar) : startByte;
+    gsize length = 0;
+    char *text = (char *)g_bytes_unref_to_data(snapshot->bytes, &length);
+    gsize newLength = length - (endByte - startByte) + insertLength;
+
+    text = g_realloc(text, MAX(length, newLength) + 1);
+    memmove(text + startByte + insertLength, text + endByte, length - endByte);
+    memcpy(text + startByte, insert, insertLength);
+    text[newLength] = '\0';
+
+    snapshot->bytes = g_bytes_new_take(text, newLength);
+    snapshot->text = text;
+    snapshot->length = newLength;
+    snapshot->anchorByte = startByte;
+    snapshot->anchorChar = startChar;
+    /* The "changed" signal that follows bumps editGeneration to match */
+    snapshot->generation = g_app.editGeneration + 1;
+}
+
+static void StartMatchCount(void);
+
+/* Appends up to maxChars more of the buffer to a partial snapshot; TRUE once it is whole.
+ * The match count that was waiting for it then starts. */
+static gboolean CopySnapshotSlice(gint maxChars) {
+    SearchSnapshot *snapshot = &g_app.search;
+    GtkTextIter start, end;
+    gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, &start, snapshot->copiedChars);
+    end = start;
+    gtk_text_iter_forward_chars(&end, maxChars);
+    char *slice = gtk_text_buffer_get_text(g_app.textBuffer, &start, &end, TRUE);
+    gsize sliceLength = strlen(slice);
+
+    gsize length = 0;
+    char *text = (char *)g_bytes_unref_to_data(snapshot->bytes, &length);
+    text = g_realloc(text, length + sliceLength + 1);
+    memcpy(text + length, slice, sliceLength + 1);
+    g_free(slice);
+    snapshot->bytes = g_bytes_new_take(text, length + sliceLength);
+    snapshot->text = text;
+    snapshot->length = length + sliceLength;
+    snapshot->copiedChars = gtk_text_iter_get_offset(&end);
+    if (!gtk_text_iter_is_end(&end)) return FALSE;
+
+    snapshot->partial = FALSE;
+    if (g_app.findBar && gtk_widget_get_visible(g_app.findBar) && !g_app.matchCount.timer &&
+        !g_app.matchCount.job) {
+        StartMatchCount();
+    }
+    return TRUE;
+}
+
+static gboolean on_snapshot_copy(gpointer userData) {
+    if (!CopySnapshotSlice(SNAPSHOT_SLICE_CHARS)) return G_SOURCE_CONTINUE;
+    g_app.search.copyIdle = 0;
+    return G_SOURCE_REMOVE;
+}
+
+/* Starts copying the buffer into a new snapshot in idle slices, so that the background
+ * match count does not stall typing with a whole-document copy. Edits made meanwhile
+ * are patched into the part already copied. */
+static void StartSnapshotCopy(void) {
+    SetSearchSnapshot(g_strdup(""), 0);
+    g_app.search.partial = TRUE;
+    g_app.search.copyIdle = g_idle_add(on_snapshot_copy, NULL);
+}
+
+/* Finds the next match after the selection, or with searchDown FALSE the last match
+ * before it, wrapping around the document once. */
+static gboolean FindInEdit(const char *needle, gboolean matchCase, gboolean searchDown,
+                          GtkTextIter *outStart, GtkTextIter *outEnd) {
+    if (!needle || needle[0] == '\0') return FALSE;
+
+    gint64 perfStart = PerfBegin();
+    SearchSnapshot *snapshot = GetSearchSnapshot();
+    if (!snapshot) return FALSE;
+
+    TextPattern *pattern = TextPatternNew(needle, strlen(needle), matchCase);
+    GtkTextIter selStart, selEnd;
+    gtk_text_buffer_get_selection_bounds(g_app.textBuffer, &selStart, &selEnd);
+
+    gsize matchLength = 0;
+    gssize found;
+    if (searchDown) {
+        /* Start past the current selection so repeated Find Next moves on */
+        gsize from = SnapshotByteAtOffset(snapshot, gtk_text_iter_get_offset(&selEnd));
+        found = TextPatternFindForward(pattern, snapshot->text, snapshot->length, from, &matchLength);
+        if (found < 0 && from > 0) {
+            found = TextPatternFindForward(pattern, snapshot->text, snapshot->length, 0, &matchLength);
+        }
+    } else {
+        gsize limit = SnapshotByteAtOffset(snapshot, gtk_text_iter_get_offset(&selStart));
+        found = TextPatternFindBackward(pattern, snapshot->text, limit, &matchLength);
+        if (found < 0 && limit < snapshot->length) {
+            found = TextPatternFindBackward(pattern, snapshot->text, snapshot->length, &matchLength);
+        }
+    }
+    TextPatternFree(pattern);
+    if (found < 0) {
+        PerfEnd(PERF_FIND, perfStart);
+        return FALSE;
+    }
+
+    gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, outStart,
+                                       SnapshotOffsetAtByte(snapshot, found));
+    gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, outEnd,
+                                       SnapshotOffsetAtByte(snapshot, found + matchLength));
+    PerfEnd(PERF_FIND, perfStart);
+    return TRUE;
+}
+
+/* First match at or after from, read from the piece table a block at a time. Blocks
+ * overlap by the longest possible match so none is missed at a boundary. */
+static gint64 LargeSearchForward(const TextPattern *pattern, guint64 from, char *block,
+                                 gsize overlap, gsize *matchLength) {
+    PieceTable *table = g_app.large->table;
+    guint64 length = PieceTableLength(table);
+    for (guint64 pos = from; pos < length; pos += LARGE_SEARCH_BLOCK) {
+        gsize n = PieceTableRead(table, pos, block, LARGE_SEARCH_BLOCK + overlap);
+        gssize found = TextPatternFindForward(pattern, block, n, 0, matchLength);
+        /* A match starting in the overlap is found again, whole, by the next block */
+        if (found >= 0 && ((gsize)found < LARGE_SEARCH_BLOCK || pos + n == length)) {
+            return pos + found;
+        }
+    }
+    return -1;
+}
+
+/* Last match ending at or before limit, reading blocks backwards from it */
+static gint64 LargeSearchBackward(const TextPattern *pattern, guint64 limit, char *block,
+                                  gsize overlap, gsize *matchLength) {
+    PieceTable *table = g_app.large->table;
+    guint64 end = limit;
+    for (;;) {
+        guint64 start = end > LARGE_SEARCH_BLOCK + overlap ? end - LARGE_SEARCH_BLOCK - overlap : 0;
+        gsize n = PieceTableRead(table, start, block, end - start);
+        gssize found = TextPatternFindBackward(pattern, block, n, matchLength);
+        if (found >= 0) return start + found;
+        if (start == 0) return -1;
+        end = start + overlap;
+    }
+}
+
+/* FindInEdit for large documents: searches the whole table, not just the window, and
+ * moves the window to the match. */
+static gboolean FindInLargeDocument(const char *needle, gboolean matchCase, gboolean searchDown,
+                                    GtkTextIter *outStart, GtkTextIter *outEnd) {
+    if (!needle || needle[0] == '\0') return FALSE;
+
+    TextPattern *pattern = TextPatternNew(needle, strlen(needle), matchCase);
+    gsize overlap = TextPatternMaxMatchLength(pattern);
+    char *block = g_malloc(LARGE_SEARCH_BLOCK + overlap);
+    guint64 length = PieceTableLength(g_app.large->table);
+    GtkTextIter selStart, selEnd;
+    gtk_text_buffer_get_selection_bounds(g_app.textBuffer, &selStart, &selEnd);
+
+    gsize matchLength = 0;
+    gint64 found;
+    if (searchDown) {
+        guint64 from = LargeOffsetAtIter(&selEnd);
+        found = LargeSearchForward(pattern, from, block, overlap, &matchLength);
+        if (found < 0 && from > 0) {
+            found = LargeSearchForward(pattern, 0, block, overlap, &matchLength);
+        }
+    } else {
+        guint64 limit = LargeOffsetAtIter(&selStart);
+        found = LargeSearchBackward(pattern, limit, block, overlap, &matchLength);
+        if (found < 0 && limit < length) {
+            found = LargeSearchBackward(pattern, length, block, overlap, &matchLength);
+        }
+    }
+    g_free(block);
+    TextPatternFree(pattern);
+    if (found < 0) return FALSE;
+
+    if (!LargeIterAtOffset(outStart, found) || !LargeIterAtOffset(outEnd, found + matchLength)) {
+        ShowLargeWindowAround(found);
+        LargeIterAtOffset(outStart, found);
+        LargeIterAtOffset(outEnd, found + matchLength);
+    }
+    return TRUE;
+}
+
+/* One replacement: the character span it removes and its text in the shared insert buffer */
+typedef struct ReplaceEdit {
+    gint startChar;
+    gint endChar;
+    gsize insertStart;
+    gsize insertLength;
+} ReplaceEdit;
+
+/* Every match of needle in the snapshot: the find bar's count if it is still current,
+ * otherwise a fresh scan split across the find-all worker pool. */
+static GArray *CollectMatches(SearchSnapshot *snapshot, const char *needle, gboolean matchCase) {
+    MatchCount *count = &g_app.matchCount;
+    if (count->matches && count->generation == snapshot->generation &&
+        count->matchCase == matchCase && g_strcmp0(count->needle, needle) == 0) {
+        return g_array_ref(count->matches);
+    }
+
+    TextPattern *pattern = TextPatternNew(needle, strlen(needle), matchCase);
+    GArray *matches = FindAllMatches(pattern, snapshot->text, snapshot->length, NULL);
+    TextPatternFree(pattern);
+    return matches;
+}
+
+/* Replaces the given matches of the snapshot, last to first so earlier offsets stay
+ * valid, as a single undoable action. Each match gets the fixed replacement, or with
+ * replacementEnds its own slice of replacements. The cursor and the top visible line
+ * are held by marks rather than reset as set_text would. */
+static int ApplyReplacements(SearchSnapshot *snapshot, GArray *matches, const char *replacement,
+                             const char *replacements, const gsize *replacementEnds) {
+    gsize replacementLength = replacement ? strlen(replacement) : 0;
+    GArray *edits = g_array_new(FALSE, FALSE, sizeof(ReplaceEdit));
+    GString *inserts = g_string_new(NULL);
+    /* The snapshot as it will be afterwards, so the next search need not copy the buffer */
+    GString *after = g_string_sized_new(matches->len > 0 ? snapshot->length : 0);
+    ReplaceEdit *last = NULL;
+    gsize lastEnd = 0;
+    int count = matches->len;
+
+    for (guint i = 0; i < matches->len; i++) {
+        const TextMatch *match = &g_array_index(matches, TextMatch, i);
+        gsize found = match->start;
+        gsize end = found + match->length;
+        if (replacementEnds) {
+            gsize begin = i > 0 ? replacementEnds[i - 1] : 0;
+            replacement = replacements + begin;
+            replacementLength = replacementEnds[i] - begin;
+        }
+        g_string_append_len(after, snapshot->text + lastEnd, found - lastEnd);
+        g_string_append_len(after, replacement, replacementLength);
+        if (last && found - lastEnd <= REPLACE_MERGE_GAP) {
+            /* Close neighbours become one edit that rewrites the gap unchanged */
+            g_string_append_len(inserts, snapshot->text + lastEnd, found - lastEnd);
+            g_string_append_len(inserts, replacement, replacementLength);
+            last->endChar = SnapshotOffsetAtByte(snapshot, end);
+            last->insertLength = inserts->len - last->insertStart;
+        } else {
+            ReplaceEdit edit;
+            edit.startChar = SnapshotOffsetAtByte(snapshot, found);
+            edit.endChar = SnapshotOffsetAtByte(snapshot, end);
+            edit.insertStart = inserts->len;
+            edit.insertLength = replacementLength;
+            g_string_append_len(inserts, replacement, replacementLength);
+            g_array_append_val(edits, edit);
+            last = &g_array_index(edits, ReplaceEdit, edits->len - 1);
+        }
+        lastEnd = end;
+    }
+
+    if (count > 0) {
+        GtkTextView *view = GTK_TEXT_VIEW(g_app.textView);
+        GdkRectangle visible;
+        GtkTextIter top, start, stop;
+        gtk_text_view_get_visible_rect(view, &visible);
+        gtk_text_view_get_iter_at_location(view, &top, visible.x, visible.y);
+        gtk_text_iter_set_line_offset(&top, 0);
+        GtkTextMark *topMark = gtk_text_buffer_create_mark(g_app.textBuffer, NULL, &top, TRUE);
+
+        g_string_append_len(after, snapshot->text + lastEnd, snapshot->length - lastEnd);
+        /* Everything needed is in edits/inserts; patching the old snapshot edit by edit
+         * would only be thrown away */
+        ClearSearchSnapshot();
+        BeginBatchEdit();
+        gtk_text_buffer_begin_user_action(g_app.textBuffer);
+        for (guint i = edits->len; i > 0; i--) {
+            const ReplaceEdit *edit = &g_array_index(edits, ReplaceEdit, i - 1);
+            gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, &start, edit->startChar);
+            gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, &stop, edit->endChar);
+            gtk_text_buffer_delete(g_app.textBuffer, &start, &stop);
+            if (edit->insertLength > 0) {
+                gtk_text_buffer_insert(g_app.textBuffer, &start,
+                                       inserts->str + edit->insertStart, edit->insertLength);
+            }
+        }
+        gtk_text_buffer_end_user_action(g_app.textBuffer);
+        gsize afterLength = after->len;
+        SetSearchSnapshot(g_string_free(after, FALSE), afterLength);
+        after = NULL;
+        EndBatchEdit();
+
+        gtk_text_view_scroll_to_mark(view, topMark, 0, TRUE, 0, 0);
+        gtk_text_buffer_delete_mark(g_app.textBuffer, topMark);
+    }
+
+    g_array_free(edits, TRUE);
+    g_string_free(inserts, TRUE);
+    if (after) {
+        g_string_free(after, TRUE);
+    }
+    return count;
 }
 
 static int ReplaceAllOccurrences(const char *needle, const char *replacement,
                                 gboolean matchCase) {
     if (!needle || needle[0] == '\0') return 0;
 
-    char *text = NULL;
-    int len = 0;
-    if (!GetEditText(&text, &len)) return 0;
+    gint64 perfStart = PerfBegin();
+    SearchSnapshot *snapshot = GetSearchSnapshot();
+    if (!snapshot) return 0;
+
+    GArray *matches = CollectMatches(snapshot, needle, matchCase);
+    int count = ApplyReplacements(snapshot, matches, replacement ? replacement : "", NULL, NULL);
+    g_array_unref(matches);
+    PerfEnd(PERF_REPLACE_ALL, perfStart);
+    return count;
+}
+
+/* The viewer never edits; a followed file or standard input is only changed by whatever
+ * appends to it */
+static gboolean IsReadOnly(void) {
+    return g_app.load != NULL || g_app.viewer != NULL || g_app.follow != NULL ||
+           g_app.stdinRead != NULL;
+}
+
+static const char *ReadOnlyReason(void) {
+    return g_app.load ? "Wait for the file to finish loading, or press Cancel." :
+           g_app.viewer ? "This file is open read-only." :
+           g_app.follow ? "Stop following the file to edit or save it." :
+                          "Standard input is still being read. Press Cancel to stop reading.";
+}
+
+static void RetryFileNew(gpointer data) {
+    DoFileNew();
+}
+
+static void DoFileNew(void) {
+    if (!PromptSaveChanges(RetryFileNew, NULL, NULL)) return;
+    CancelDocumentLoad();
+    ResetDocument();
+}
+
+/* Runs the open or save chooser and returns the chosen path, or NULL. Each is built on
+ * first use and only hidden afterwards, which also keeps the folder it was left in. */
+static char *RunFileChooser(GtkFileChooserAction action, const char *title,
+                            const char *suggestedName) {
+    gboolean save = action == GTK_FILE_CHOOSER_ACTION_SAVE;
+    GtkWidget **cached = save ? &g_app.saveChooser : &g_app.openChooser;
+    if (!*cached) {
+        *cached = gtk_file_chooser_dialog_new(
+            title, GTK_WINDOW(g_app.window),
+            action,
+            "_Cancel", GTK_RESPONSE_CANCEL,
+            save ? "_Save" : "_Open", GTK_RESPONSE_ACCEPT,
+            NULL);
+        gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(*cached), save);
+    }
+    GtkWidget *dialog = *cached;
+    gtk_window_set_title(GTK_WINDOW(dialog), title);
+    if (save) {
+        gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog), suggestedName);
+    }
+
+    char *path = NULL;
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+    }
+    gtk_widget_hide(dialog);
+    return path;
+}
+
+static void RetryFileOpen(gpointer readOnly) {
+    DoFileOpen(GPOINTER_TO_INT(readOnly));
+}
+
+static void DoFileOpen(gboolean readOnly) {
+    if (!PromptSaveChanges(RetryFileOpen, GINT_TO_POINTER(readOnly), NULL)) return;
+
+    char *path = RunFileChooser(GTK_FILE_CHOOSER_ACTION_OPEN,
+                                readOnly ? "Open Read-Only" : "Open File", NULL);
+    if (path) {
+        LoadDocumentFromPath(path, readOnly);
+        g_free(path);
+    }
+}
+
+static void FreeDocumentSave(gpointer data) {
+    DocumentSave *save = (DocumentSave *)data;
+    g_free(save->path);
+    if (save->text) {
+        g_bytes_unref(save->text);
+    }
+    PieceTableFree(save->table);
+    g_free(save);
+}
+
+static gboolean WriteTableSpans(gpointer source, TextSpanFunc emit, gpointer emitData) {
+    return PieceTableForeach((const PieceTable *)source, emit, emitData);
+}
+
+static void SaveWriterThread(GTask *task, gpointer sourceObject,
+                             gpointer taskData, GCancellable *cancellable) {
+    DocumentSave *save = (DocumentSave *)taskData;
+    if (save->table) {
+        /* Straight from the mapping and add buffer; the document is never joined up */
+        g_task_return_boolean(task, SaveTextSpans(save->path, WriteTableSpans, save->table,
+                                                  save->encoding));
+        return;
+    }
+    gsize length = 0;
+    const char *text = (const char *)g_bytes_get_data(save->text, &length);
+    g_task_return_boolean(task, SaveTextFile(NULL, save->path, text, length, save->encoding));
+}
+
+static void StartDocumentSave(const char *path);
+
+static void ClearAfterSave(void) {
+    if (g_app.afterSaveFree) {
+        g_app.afterSaveFree(g_app.afterSaveData);
+    }
+    g_app.afterSave = NULL;
+    g_app.afterSaveData = NULL;
+    g_app.afterSaveFree = NULL;
+}
+
+/* Has retry run with data once the saves in flight have landed. Only the latest
+ * action waits; an earlier one is dropped. */
+static void DeferUntilSaved(SaveContinuation retry, gpointer data, GDestroyNotify destroy) {
+    ClearAfterSave();
+    g_app.afterSave = retry;
+    g_app.afterSaveData = data;
+    g_app.afterSaveFree = destroy;
+}
+
+static void RunAfterSave(void) {
+    SaveContinuation retry = g_app.afterSave;
+    gpointer data = g_app.afterSaveData;
+    GDestroyNotify destroy = g_app.afterSaveFree;
+    g_app.afterSave = NULL;
+    g_app.afterSaveData = NULL;
+    g_app.afterSaveFree = NULL;
+    if (retry) {
+        retry(data);
+    }
+    if (destroy) {
+        destroy(data);
+    }
+}
+
+static void OnDocumentSaved(GObject *sourceObject, GAsyncResult *result, gpointer userData) {
+    DocumentSave *save = (DocumentSave *)g_task_get_task_data(G_TASK(result));
+    gboolean ok = g_task_propagate_boolean(G_TASK(result), NULL);
+    PerfEnd(PERF_SAVE, save->perfStart);
+
+    g_app.saveInFlight = FALSE;
+    gtk_statusbar_pop(GTK_STATUSBAR(g_app.statusbar), g_save_context);
+
+    /* Another document may have been opened meanwhile; it is left alone */
+    gboolean sameDocument = save->serial == g_app.documentSerial;
+    if (ok && sameDocument) {
+        /* A Save As moves the document only once the file is there */
+        g_strlcpy(g_app.currentPath, save->path, MAX_PATH_BUFFER);
+        /* Only clear the flag if nothing was typed while the snapshot was being written */
+        if (save->generation == g_app.editGeneration) {
+            g_app.modified = FALSE;
+        }
+        UpdateTitle();
+        g_app.fileBytes = -1;
+        WatchCurrentFile();
+    }
+
+    if (!ok || !sameDocument) {
+        g_app.saveQueued = FALSE;
+        g_clear_pointer(&g_app.saveTarget, g_free);
+    }
+    if (!ok) {
+        /* Whatever waited for the save is off: the changes are still unsaved */
+        ClearAfterSave();
+        GtkWidget *dialog = gtk_message_dialog_new(
+            GTK_WINDOW(g_app.window),
+            GTK_DIALOG_MODAL,
+            GTK_MESSAGE_ERROR,
+            GTK_BUTTONS_OK,
+            "Cannot save %s.", save->path);
+        gtk_dialog_run(GTK_DIALOG(dialog));
+        gtk_widget_destroy(dialog);
+        return;
+    }
+
+    if (g_app.saveQueued) {
+        g_app.saveQueued = FALSE;
+        char *path = g_strdup(g_app.saveTarget);
+        StartDocumentSave(path);
+        g_free(path);
+    } else {
+        g_clear_pointer(&g_app.saveTarget, g_free);
+        RunAfterSave();
+    }
+}
+
+static void RunDocumentSave(DocumentSave *save) {
+    GTask *task = g_task_new(NULL, NULL, OnDocumentSaved, NULL);
+    g_task_set_task_data(task, save, FreeDocumentSave);
+    g_task_run_in_thread(task, SaveWriterThread);
+    g_object_unref(task);
+}
+
+/* Hands the pending save the search snapshot's bytes once the snapshot is whole, so the
+ * buffer is never copied on this thread for a save. TRUE once the save has started, or
+ * has been dropped because its document was replaced while it waited. */
+static gboolean TryStartPendingSave(void) {
+    DocumentSave *save = g_app.pendingSave;
+    if (save->serial != g_app.documentSerial) {
+        g_app.pendingSave = NULL;
+        FreeDocumentSave(save);
+        g_app.saveInFlight = FALSE;
+        g_app.saveQueued = FALSE;
+        ClearAfterSave();
+        g_clear_pointer(&g_app.saveTarget, g_free);
+        gtk_statusbar_pop(GTK_STATUSBAR(g_app.statusbar), g_save_context);
+        return TRUE;
+    }
+
+    SearchSnapshot *snapshot = PeekSearchSnapshot();
+    if (!snapshot) {
+        if (!g_app.search.partial) StartSnapshotCopy();
+        return FALSE;
+    }
+    g_app.pendingSave = NULL;
+    save->text = g_bytes_ref(snapshot->bytes);
+    save->generation = snapshot->generation;
+    RunDocumentSave(save);
+    return TRUE;
+}
+
+static gboolean on_pending_save_timer(gpointer userData) {
+    if (!TryStartPendingSave()) return G_SOURCE_CONTINUE;
+    g_app.pendingSaveTimer = 0;
+    return G_SOURCE_REMOVE;
+}
+
+/* Writes the document to path on a worker thread. The text is the search snapshot, which
+ * edits keep current; if there is none yet it is copied in idle slices first. */
+static void StartDocumentSave(const char *path) {
+    DocumentSave *save = g_new0(DocumentSave, 1);
+    save->path = g_strdup(path);
+    save->encoding = g_app.encoding;
+    save->serial = g_app.documentSerial;
+    save->perfStart = PerfBegin();
+
+    g_free(g_app.saveTarget);
+    g_app.saveTarget = g_strdup(path);
+    g_app.saveInFlight = TRUE;
+
+    const char *fileName = strrchr(save->path, '/');
+    fileName = fileName ? fileName + 1 : save->path;
+    char status[MAX_PATH_BUFFER + 32];
+    snprintf(status, sizeof(status), "Saving %s...", fileName);
+    gtk_statusbar_push(GTK_STATUSBAR(g_app.statusbar), g_save_context, status);
+
+    if (g_app.large) {
+        save->table = PieceTableCopy(g_app.large->table);
+        save->generation = g_app.editGeneration;
+        RunDocumentSave(save);
+        return;
+    }
+    g_app.pendingSave = save;
+    if (!TryStartPendingSave()) {
+        g_app.pendingSaveTimer = g_timeout_add(LOAD_POLL_MS, on_pending_save_timer, NULL);
+    }
+}
+
+static gboolean DoFileSave(gboolean saveAs) {
+    char path[MAX_PATH_BUFFER];
+
+    if (IsReadOnly()) {
+        ShowMessage(GTK_MESSAGE_INFO, ReadOnlyReason());
+        return FALSE;
+    }
+
+    if (saveAs || (g_app.currentPath[0] == '\0' && !g_app.saveTarget)) {
+        char *baseName = g_path_get_basename(g_app.currentPath[0] ? g_app.currentPath : "");
+        char *filename = RunFileChooser(GTK_FILE_CHOOSER_ACTION_SAVE, "Save File",
+                                        g_app.currentPath[0] ? baseName : "");
+        g_free(baseName);
+        if (!filename) {
+            return FALSE;
+        }
+        g_strlcpy(path, filename, MAX_PATH_BUFFER);
+        g_free(filename);
+    } else {
+        /* Follow a Save As that has not landed yet */
+        g_strlcpy(path, g_app.saveTarget ? g_app.saveTarget : g_app.currentPath, MAX_PATH_BUFFER);
+    }
+
+    /* A save already in flight picks up the latest text, and path, when it finishes */
+    if (g_app.saveInFlight) {
+        g_app.saveQueued = TRUE;
+        g_free(g_app.saveTarget);
+        g_app.saveTarget = g_strdup(path);
+        return TRUE;
+    }
+    StartDocumentSave(path);
+    return TRUE;
+}
+
+static void FreeDocumentLoad(DocumentLoad *load) {
+    g_free(load->path);
+    g_object_unref(load->cancellable);
+    g_async_queue_unref(load->chunks);
+    if (load->buffer) {
+        g_object_unref(load->buffer);
+    }
+    PieceTableFree(load->table);
+    g_free(load);
+}
+
+static void FreeLoadChunk(gpointer data) {
+    g_bytes_unref((GBytes *)data);
+}
+
+static void PushLoadChunk(DocumentLoad *load, GBytes *chunk, goffset bytesRead,
+                          GCancellable *cancellable) {
+    if (g_bytes_get_size(chunk) > 0) {
+        g_async_queue_push(load->chunks, chunk);
+    } else {
+        g_bytes_unref(chunk);
+    }
+
+    if (load->totalBytes > 0) {
+        g_atomic_int_set(&load->progress, (gint)(MIN(bytesRead, load->totalBytes) * 1000 / load->totalBytes));
+    }
+
+    /* Don't run further ahead of the UI than LOAD_QUEUE_DEPTH chunks */
+    while (g_async_queue_length(load->chunks) >= LOAD_QUEUE_DEPTH &&
+           !g_cancellable_is_cancelled(cancellable)) {
+        g_usleep(LOAD_POLL_MS * 1000);
+    }
+}
+
+/* Queue the file straight out of its mapping; UTF-8 chunks are views, not copies */
+static gboolean ReadMappedDocument(DocumentLoad *load, GMappedFile *mapped,
+                                   GCancellable *cancellable, GError **error) {
+    const guchar *data = (const guchar *)g_mapped_file_get_contents(mapped);
+    gsize size = g_mapped_file_get_length(mapped);
+    gsize bom = 0;
+    load->encoding = DetectTextEncoding(data, size, &bom);
+
+    if (load->encoding == ENC_UTF8) {
+        GBytes *all = g_mapped_file_get_bytes(mapped);
+        gsize pos = bom;
+        while (pos < size) {
+            if (g_cancellable_set_error_if_cancelled(cancellable, error)) break;
+
+            /* Detection already validated the whole mapping; just cut on character boundaries */
+            gsize end = MIN(pos + LOAD_READ_CHUNK, size);
+            while (end < size && end > pos + 1 && (data[end] & 0xC0) == 0x80) {
+                end--;
+            }
+            PushLoadChunk(load, g_bytes_new_from_bytes(all, pos, end - pos), end, cancellable);
+            pos = end;
+        }
+        g_bytes_unref(all);
+        load->loadedBytes = size;
+        return pos >= size;
+    }
+
+    /* Other encodings still need transcoding, but straight from the mapping. The decoder
+     * takes the encoding detected from the whole file rather than guessing from its start. */
+    TextDecoder *decoder = TextDecoderNewForEncoding(load->encoding);
+    gsize pos = bom;
+    gboolean ok = TRUE;
+    do {
+        if (g_cancellable_set_error_if_cancelled(cancellable, error)) {
+            ok = FALSE;
+            break;
+        }
+        gsize n = MIN(LOAD_READ_CHUNK, size - pos);
+        GString *decoded = g_string_sized_new(n * 2 + 1);
+        if (!TextDecoderFeed(decoder, data + pos, n, pos + n == size, decoded)) {
+            g_string_free(decoded, TRUE);
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                        "%s is not valid text", load->path);
+            ok = FALSE;
+            break;
+        }
+        pos += n;
+        PushLoadChunk(load, g_string_free_to_bytes(decoded), pos, cancellable);
+    } while (pos < size);
+    TextDecoderFree(decoder);
+    load->loadedBytes = size;
+    return ok;
+}
+
+/* Fallback for files that can't be mapped (pipes, some network filesystems) */
+static gboolean ReadStreamedDocument(DocumentLoad *load, GCancellable *cancellable, GError **error) {
+    GFile *file = g_file_new_for_path(load->path);
+    GFileInputStream *stream = g_file_read(file, cancellable, error);
+    g_object_unref(file);
+    if (!stream) {
+        return FALSE;
+    }
+
+    TextDecoder *decoder = TextDecoderNew();
+    guchar *buffer = g_malloc(LOAD_READ_CHUNK);
+    goffset bytesRead = 0;
+    gboolean ok = FALSE;
+
+    for (;;) {
+        gssize n = g_input_stream_read(G_INPUT_STREAM(stream), buffer, LOAD_READ_CHUNK,
+                                       cancellable, error);
+        if (n < 0) break;
+
+        GString *decoded = g_string_sized_new(n + 1);
+        if (!TextDecoderFeed(decoder, buffer, n, n == 0, decoded)) {
+            g_string_free(decoded, TRUE);
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                        "%s is not valid text", load->path);
+            break;
+        }
+        bytesRead += n;
+        PushLoadChunk(load, g_string_free_to_bytes(decoded), bytesRead, cancellable);
+        if (n == 0) {
+            load->loadedBytes = bytesRead;
+            ok = TRUE;
+            break;
+        }
+    }
+
+    load->encoding = TextDecoderGetEncoding(decoder);
+    TextDecoderFree(decoder);
+    g_free(buffer);
+    g_input_stream_close(G_INPUT_STREAM(stream), NULL, NULL);
+    g_object_unref(stream);
+    return ok;
+}
+
+static void LoadReaderThread(GTask *task, gpointer sourceObject,
+                             gpointer taskData, GCancellable *cancellable) {
+    DocumentLoad *load = (DocumentLoad *)taskData;
+    GError *error = NULL;
+    gboolean ok;
+
+    if (load->large) {
+        /* Index the file in place rather than copying it into the buffer */
+        load->table = PieceTableOpen(load->path, cancellable, &load->progress, &error);
+        if (load->table) {
+            load->encoding = ENC_UTF8;
+            g_task_return_boolean(task, TRUE);
+            return;
+        }
+        if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_task_return_error(task, error);
+            return;
+        }
+        g_clear_error(&error);
+        /* Not plain UTF-8, or not mappable. Too big to decode into the buffer: the UI
+         * thread shows it in the viewer instead */
+        if (load->viewable) {
+            load->viewInPlace = TRUE;
+            g_task_return_boolean(task, TRUE);
+            return;
+        }
+        /* Load it the ordinary way */
+    }
+
+    GMappedFile *mapped = g_mapped_file_new(load->path, FALSE, NULL);
+    if (mapped) {
+        ok = ReadMappedDocument(load, mapped, cancellable, &error);
+        g_mapped_file_unref(mapped);
+    } else {
+        ok = ReadStreamedDocument(load, cancellable, &error);
+    }
+
+    if (!ok) {
+        g_task_return_error(task, error ? error :
+            g_error_new(G_IO_ERROR, G_IO_ERROR_FAILED, "Cannot read %s", load->path));
+    } else {
+        g_task_return_boolean(task, TRUE);
+    }
+}
+
+static void OnDocumentLoadRead(GObject *sourceObject, GAsyncResult *result, gpointer userData) {
+    DocumentLoad *load = (DocumentLoad *)userData;
+    load->readerOk = g_task_propagate_boolean(G_TASK(result), NULL);
+    load->readerDone = TRUE;
+
+    /* A cancelled load is already detached from the UI; this was its last owner */
+    if (load->cancelled) {
+        FreeDocumentLoad(load);
+    }
+}
+
+static void ShowLoadProgress(DocumentLoad *load) {
+    const char *fileName = strrchr(load->path, '/');
+    fileName = fileName ? fileName + 1 : load->path;
+
+    char status[MAX_PATH_BUFFER + 64];
+    snprintf(status, sizeof(status), "Loading %s... %d%%",
+             fileName, g_atomic_int_get(&load->progress) / 10);
+
+    gtk_statusbar_pop(GTK_STATUSBAR(g_app.statusbar), g_load_context);
+    gtk_statusbar_push(GTK_STATUSBAR(g_app.statusbar), g_load_context, status);
+}
+
+static void EndLoadUI(void) {
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(g_app.textView), !IsReadOnly());
+    gtk_widget_hide(g_app.loadCancelButton);
+    gtk_statusbar_pop(GTK_STATUSBAR(g_app.statusbar), g_load_context);
+}
+
+static void ResetDocument(void) {
+    StopFollowing();
+    StopReadingStdin();
+    UnwatchCurrentFile();
+    CloseLargeDocument();
+    CloseLogViewer();
+    /* Don't journal the wholesale replacement; history is reset below */
+    g_app.isUndoRedoInProgress = TRUE;
+    gtk_text_buffer_set_text(g_app.textBuffer, "", -1);
+    g_app.isUndoRedoInProgress = FALSE;
+    g_app.currentPath[0] = '\0';
+    g_app.encoding = ENC_UTF8;
+    g_app.modified = FALSE;
+    g_app.fileBytes = -1;
+    g_app.documentSerial++;
+    ClearUndoHistory();
+    UpdateTitle();
+    UpdateStatusBar();
+}
+
+static void BeginFollowing(void);
+static void SetDocumentBuffer(GtkTextBuffer *buffer);
+
+static void StartDocumentLoad(const char *path, goffset size, gboolean viewable,
+                              gint64 perfStart);
+static gboolean OpenLogViewer(const char *path);
+
+static void CompleteDocumentLoad(DocumentLoad *load) {
+    g_app.load = NULL;
+
+    if (load->readerOk && load->viewInPlace) {
+        EndLoadUI();
+        if (OpenLogViewer(load->path)) {
+            PerfEnd(PERF_LOAD_DOCUMENT, load->perfStart);
+            g_app.followAfterLoad = FALSE;
+        } else {
+            /* UTF-16, which the viewer can't show in place: decode it after all */
+            StartDocumentLoad(load->path, load->totalBytes, FALSE, load->perfStart);
+        }
+        FreeDocumentLoad(load);
+        return;
+    }
+
+    if (load->readerOk) {
+        PerfEnd(PERF_LOAD_DOCUMENT, load->perfStart);
+        /* Only now is the previous document retired */
+        UnwatchCurrentFile();
+        CloseLargeDocument();
+        CloseLogViewer();
+        ClearUndoHistory();
+        SetDocumentBuffer(load->buffer);
+        load->buffer = NULL;
+        g_app.documentSerial++;
+        if (load->table) {
+            OpenLargeDocument(load->table);
+            load->table = NULL;
+        }
+        GtkTextIter start;
+        gtk_text_buffer_get_start_iter(g_app.textBuffer, &start);
+        gtk_text_buffer_place_cursor(g_app.textBuffer, &start);
+        strncpy(g_app.currentPath, load->path, MAX_PATH_BUFFER - 1);
+        g_app.encoding = load->encoding;
+        g_app.modified = FALSE;
+        g_app.fileBytes = load->loadedBytes;
+        EndLoadUI();
+        WatchCurrentFile();
+        UpdateTitle();
+        UpdateStatusBar();
+        RestartHighlight();
+        FreeDocumentLoad(load);
+        if (g_app.followAfterLoad) {
+            g_app.followAfterLoad = FALSE;
+            BeginFollowing();
+        }
+        return;
+    }
+
+    /* The document that was open before is left as it was */
+    g_app.followAfterLoad = FALSE;
+    EndLoadUI();
+    GtkWidget *dialog = gtk_message_dialog_new(
+        GTK_WINDOW(g_app.window),
+        GTK_DIALOG_MODAL,
+        GTK_MESSAGE_ERROR,
+        GTK_BUTTONS_OK,
+        "Cannot open %s.", load->path);
+    FreeDocumentLoad(load);
+    gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+}
+
+static void ScheduleLoadSlice(DocumentLoad *load, gboolean waitForData);
+
+static gboolean LoadInsertSlice(gpointer userData) {
+    DocumentLoad *load = (DocumentLoad *)userData;
+    gint64 deadline = g_get_monotonic_time() + LOAD_SLICE_USEC;
+    gboolean inserted = FALSE;
+    GBytes *chunk;
+
+    while ((chunk = (GBytes *)g_async_queue_try_pop(load->chunks)) != NULL) {
+        gsize length = 0;
+        const gchar *text = (const gchar *)g_bytes_get_data(chunk, &length);
+        GtkTextIter end;
+        gtk_text_buffer_get_end_iter(load->buffer, &end);
+        gtk_text_buffer_insert(load->buffer, &end, text, length);
+        g_bytes_unref(chunk);
+        inserted = TRUE;
+        if (g_get_monotonic_time() >= deadline) break;
+    }
+
+    if (load->readerDone && g_async_queue_length(load->chunks) == 0) {
+        load->sliceId = 0;
+        CompleteDocumentLoad(load);
+        return G_SOURCE_REMOVE;
+    }
+
+    ShowLoadProgress(load);
+
+    /* Insert back-to-back while data flows; poll gently while waiting on the disk */
+    if (inserted == load->sliceWaiting) {
+        ScheduleLoadSlice(load, !inserted);
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static void ScheduleLoadSlice(DocumentLoad *load, gboolean waitForData) {
+    load->sliceWaiting = waitForData;
+    if (waitForData) {
+        load->sliceId = g_timeout_add_full(G_PRIORITY_DEFAULT_IDLE, LOAD_POLL_MS,
+                                           LoadInsertSlice, load, NULL);
+    } else {
+        load->sliceId = g_idle_add(LoadInsertSlice, load);
+    }
+}
+
+static void CancelDocumentLoad(void) {
+    DocumentLoad *load = g_app.load;
+    if (!load) return;
+
+    g_app.load = NULL;
+    g_app.followAfterLoad = FALSE;
+    if (load->sliceId) {
+        g_source_remove(load->sliceId);
+        load->sliceId = 0;
+    }
+    load->cancelled = TRUE;
+    g_cancellable_cancel(load->cancellable);
+    if (load->readerDone) {
+        FreeDocumentLoad(load);
+    }
+    EndLoadUI();
+}
+
+static void on_viewer_changed(gpointer data) {
+    UpdateStatusBar();
+}
+
+static void CloseLogViewer(void) {
+    if (!g_app.viewer) return;
+    CancelRegexSearch();
+    gtk_stack_set_visible_child(GTK_STACK(g_app.editorStack), g_app.editorScroll);
+    LogViewFree(g_app.viewer);
+    g_app.viewer = NULL;
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(g_app.textView), TRUE);
+    UpdateTitle();
+    UpdateStatusBar();
+}
+
+/* Shows path in the read-only viewer instead of loading it into the buffer. FALSE if the
+ * file cannot be viewed in place (UTF-16, or not mappable); it is then loaded as usual. */
+static gboolean OpenLogViewer(const char *path) {
+    LogView *viewer = LogViewOpen(path, NULL);
+    if (!viewer) return FALSE;
+
+    CancelDocumentLoad();
+    StopFollowing();
+    StopReadingStdin();
+    UnwatchCurrentFile();
+    CloseLargeDocument();
+    CloseLogViewer();
+
+    /* Don't journal the wholesale replacement; history is reset below */
+    g_app.isUndoRedoInProgress = TRUE;
+    gtk_text_buffer_set_text(g_app.textBuffer, "", -1);
+    g_app.isUndoRedoInProgress = FALSE;
+    ClearUndoHistory();
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(g_app.textView), FALSE);
+
+    g_app.viewer = viewer;
+    LogViewSetFont(viewer, g_app.fontDesc);
+    LogViewSetChangedFunc(viewer, on_viewer_changed, NULL);
+    GtkWidget *widget = LogViewGetWidget(viewer);
+    gtk_container_add(GTK_CONTAINER(g_app.editorStack), widget);
+    gtk_stack_set_visible_child(GTK_STACK(g_app.editorStack), widget);
+    LogViewGrabFocus(viewer);
+
+    strncpy(g_app.currentPath, path, MAX_PATH_BUFFER - 1);
+    g_app.documentSerial++;
+    g_app.encoding = LogViewGetEncoding(viewer);
+    g_app.modified = FALSE;
+    UpdateTitle();
+    UpdateStatusBar();
+    return TRUE;
+}
+
+/* Streams path into a staging buffer, or a piece table when it is large. viewable files
+ * go to the viewer instead if the piece table can't take them. */
+static void StartDocumentLoad(const char *path, goffset size, gboolean viewable,
+                              gint64 perfStart) {
+    /* The open document stays in place, read-only, until the new one has fully loaded;
+     * live appends to it stop here so the Cancel button belongs to the load */
+    CancelDocumentLoad();
+    StopFollowing();
+    StopReadingStdin();
+
+    DocumentLoad *load = g_new0(DocumentLoad, 1);
+    load->path = g_strdup(path);
+    load->cancellable = g_cancellable_new();
+    load->chunks = g_async_queue_new_full(FreeLoadChunk);
+    /* Sharing the tag table keeps the highlight tag valid after the swap */
+    load->buffer = gtk_text_buffer_new(gtk_text_buffer_get_tag_table(g_app.textBuffer));
+    load->totalBytes = size;
+    load->viewable = viewable;
+    load->large = (guint64)size >= g_app.largeFileThreshold || viewable;
+    load->loadedBytes = -1;
+    load->perfStart = perfStart;
+    g_app.load = load;
+
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(g_app.textView), FALSE);
+    gtk_widget_show(g_app.loadCancelButton);
+    ShowLoadProgress(load);
+
+    GTask *task = g_task_new(NULL, load->cancellable, OnDocumentLoadRead, load);
+    g_task_set_task_data(task, load, NULL);
+    g_task_run_in_thread(task, LoadReaderThread);
+    g_object_unref(task);
+
+    ScheduleLoadSlice(load, TRUE);
+}
+
+/* readOnly opens the viewer. Otherwise files past viewerThreshold only get it when they
+ * are not plain UTF-8, so that the piece table can edit them; that is decided while the
+ * file is read. */
+static gboolean LoadDocumentFromPath(const char *path, gboolean readOnly) {
+    gint64 perfStart = PerfBegin();
+    GStatBuf st;
+    if (g_stat(path, &st) != 0) {
+        return FALSE;
+    }
+    if (readOnly && OpenLogViewer(path)) {
+        PerfEnd(PERF_LOAD_DOCUMENT, perfStart);
+        return TRUE;
+    }
+    StartDocumentLoad(path, st.st_size,
+                      !readOnly && (guint64)st.st_size >= g_app.viewerThreshold, perfStart);
+    return TRUE;
+}
+
+/* TRUE if the document may be replaced now. While a save is on its way, including one
+ * started here by choosing Save, FALSE is returned instead and retry runs with data once
+ * it has landed; nothing waits in a nested main loop. data is freed with destroy either
+ * way. */
+static gboolean PromptSaveChanges(SaveContinuation retry, gpointer data, GDestroyNotify destroy) {
+    if (g_app.saveInFlight || g_app.saveQueued) {
+        DeferUntilSaved(retry, data, destroy);
+        return FALSE;
+    }
+    if (!g_app.modified) {
+        if (destroy) destroy(data);
+        return TRUE;
+    }
+
+    GtkWidget *dialog = gtk_message_dialog_new(
+        GTK_WINDOW(g_app.window),
+        GTK_DIALOG_MODAL,
+        GTK_MESSAGE_QUESTION,
+        GTK_BUTTONS_NONE,
+        "Save changes to %s?",
+        g_app.currentPath[0] ? g_app.currentPath : UNTITLED_NAME);
+
+    gtk_dialog_add_buttons(GTK_DIALOG(dialog),
+        "_Don't Save", GTK_RESPONSE_NO,
+        "_Cancel", GTK_RESPONSE_CANCEL,
+        "_Save", GTK_RESPONSE_YES,
+        NULL);
+
+    gint res = gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+
+    if (res == GTK_RESPONSE_YES && DoFileSave(FALSE)) {
+        DeferUntilSaved(retry, data, destroy);
+        return FALSE;
+    }
+    if (destroy) destroy(data);
+    return res == GTK_RESPONSE_NO;
+}
+
+/* Appends arrive with the document unmodified and read-only, so they go to the end of
+ * the buffer unjournaled, and history from before following stays valid. */
+static void on_follow_appended(const char *text, gsize length, gboolean restart,
+                               TextEncoding encoding, gpointer userData) {
+    GtkTextIter cursor, end;
+    gtk_text_buffer_get_iter_at_mark(g_app.textBuffer, &cursor,
+                                     gtk_text_buffer_get_insert(g_app.textBuffer));
+    gtk_text_buffer_get_end_iter(g_app.textBuffer, &end);
+    /* Moving the cursor off the end pauses auto-scroll */
+    gboolean scroll = restart || gtk_text_iter_equal(&cursor, &end);
+
+    g_app.isUndoRedoInProgress = TRUE;
+    if (restart) {
+        /* Truncated or rotated: show the new file */
+        gtk_text_buffer_set_text(g_app.textBuffer, text, (gint)length);
+        ClearUndoHistory();
+        g_app.encoding = encoding;
+    } else {
+        gtk_text_buffer_insert(g_app.textBuffer, &end, text, (gint)length);
+    }
+    g_app.isUndoRedoInProgress = FALSE;
+    g_app.modified = FALSE;
+
+    if (scroll) {
+        gtk_text_buffer_get_end_iter(g_app.textBuffer, &end);
+        gtk_text_buffer_place_cursor(g_app.textBuffer, &end);
+        gtk_text_view_scroll_mark_onscreen(GTK_TEXT_VIEW(g_app.textView),
+                                           gtk_text_buffer_get_insert(g_app.textBuffer));
+    }
+}
+
+static void on_follow_failed(const GError *error, gpointer userData) {
+    char *message = g_strdup_printf("Stopped following: %s", error->message);
+    StopFollowing();
+    ShowMessage(GTK_MESSAGE_ERROR, message);
+    g_free(message);
+}
+
+/* The buffer must match the first fileBytes bytes of the file */
+static void BeginFollowing(void) {
+    GError *error = NULL;
+    g_app.follow = FileFollowStart(g_app.currentPath, (guint64)g_app.fileBytes, g_app.encoding,
+                                   on_follow_appended, on_follow_failed, NULL, &error);
+    if (!g_app.follow) {
+        char *message = g_strdup_printf("Cannot follow %s: %s", g_app.currentPath, error->message);
+        ShowMessage(GTK_MESSAGE_ERROR, message);
+        g_free(message);
+        g_error_free(error);
+        return;
+    }
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(g_app.textView), FALSE);
+    UpdateTitle();
+}
+
+static void StopFollowing(void) {
+    g_app.followAfterLoad = FALSE;
+    if (!g_app.follow) return;
+    FileFollowStop(g_app.follow);
+    g_app.follow = NULL;
+    /* Whatever was appended is on disk already */
+    g_app.fileBytes = -1;
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(g_app.textView), TRUE);
+    UpdateTitle();
+}
 
-    char *searchBuf = g_strdup(text);
-    char *needleBuf = g_strdup(needle);
+static void StartFollowing(void);
 
-    if (!matchCase) {
-        char *p = searchBuf;
-        while (*p) {
-            *p = g_ascii_tolower(*p);
-            p++;
-        }
-        p = needleBuf;
-        while (*p) {
-            *p = g_ascii_tolower(*p);
-            p++;
-        }
-    }
+static void RetryFollowing(gpointer data) {
+    StartFollowing();
+}
 
-    int count = 0;
-    char *p = searchBuf;
-    while ((p = strstr(p, needleBuf)) != NULL) {
-        count++;
-        p += strlen(needle);
+/* Follows appends to the current file. Unless the buffer still holds exactly what was
+ * loaded from it, the file is reloaded first and following starts when that finishes. */
+static void StartFollowing(void) {
+    if (g_app.currentPath[0] == '\0') {
+        ShowMessage(GTK_MESSAGE_INFO, "Open a file to follow first.");
+        return;
     }
-
-    if (count == 0) {
-        g_free(text);
-        g_free(searchBuf);
-        g_free(needleBuf);
-        return 0;
+    if (g_app.viewer || g_app.large) {
+        ShowMessage(GTK_MESSAGE_INFO, "Following is not available for files this large.");
+        return;
     }
+    if (!PromptSaveChanges(RetryFollowing, NULL, NULL)) return;
 
-    GString *result = g_string_new("");
-    p = searchBuf;
-    const char *orig = text;
-    
-    while ((p = strstr(p, needleBuf)) != NULL) {
-        int delta = p - searchBuf;
-        g_string_append_len(result, orig, delta);
-        if (replacement) {
-            g_string_append(result, replacement);
+    if (g_app.load || g_app.modified || g_app.fileBytes < 0) {
+        char path[MAX_PATH_BUFFER];
+        g_strlcpy(path, g_app.currentPath, sizeof(path));
+        if (LoadDocumentFromPath(path, FALSE) && g_app.load) {
+            g_app.followAfterLoad = TRUE;
         }
-        orig += delta + strlen(needle);
-        searchBuf += delta + strlen(needleBuf);
+        return;
     }
-    g_string_append(result, orig);
+    BeginFollowing();
+}
 
-    gtk_text_buffer_set_text(g_app.textBuffer, result->str, -1);
-    g_string_free(result, TRUE);
-    g_free(text);
-    g_free(searchBuf);
-    g_free(needleBuf);
-    
-    g_app.modified = TRUE;
-    UpdateTitle();
-    return count;
+static void FreeStdinRead(StdinRead *input) {
+    g_source_remove(input->sourceId);
+    if (input->settleId) {
+        g_source_remove(input->settleId);
+    }
+    TextDecoderFree(input->decoder);
+    g_free(input->buffer);
+    g_string_free(input->text, TRUE);
+    g_free(input);
 }
 
-static void DoFileNew(void) {
-    if (!PromptSaveChanges()) return;
-    gtk_text_buffer_set_text(g_app.textBuffer, "", -1);
-    g_app.currentPath[0] = '\0';
-    g_app.encoding = ENC_UTF8;
-    g_app.modified = FALSE;
-    ClearRedoStack();
-    g_queue_foreach(g_app.undoStack, (GFunc)FreeUndoEntry, NULL);
-    g_queue_clear(g_app.undoStack);
-    g_app.lastUndoLength = 0;
-    g_app.lastUndoTime = 0;
-    g_app.lastChar = '\0';
+static void StopReadingStdin(void) {
+    if (!g_app.stdinRead) return;
+    FreeStdinRead(g_app.stdinRead);
+    g_app.stdinRead = NULL;
+    EndLoadUI();
     UpdateTitle();
-    UpdateStatusBar();
 }
 
-static void DoFileOpen(void) {
-    if (!PromptSaveChanges()) return;
-
-    GtkWidget *dialog = gtk_file_chooser_dialog_new(
-        "Open File", GTK_WINDOW(g_app.window),
-        GTK_FILE_CHOOSER_ACTION_OPEN,
-        "_Cancel", GTK_RESPONSE_CANCEL,
-        "_Open", GTK_RESPONSE_ACCEPT,
-        NULL);
+static void ShowStdinProgress(const StdinRead *input) {
+    char status[64];
+    snprintf(status, sizeof(status), "Reading standard input... %.1f MB",
+             input->bytes / (1024.0 * 1024.0));
+    gtk_statusbar_pop(GTK_STATUSBAR(g_app.statusbar), g_load_context);
+    gtk_statusbar_push(GTK_STATUSBAR(g_app.statusbar), g_load_context, status);
+}
 
-    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
-        char *path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
-        if (path) {
-            LoadDocumentFromPath(path);
-            g_free(path);
+/* Appends the decoded text of the latest read to the end of the buffer, unjournaled as
+ * in follow mode, scrolling along while the cursor is at the end */
+static void AppendStdinText(StdinRead *input) {
+    if (input->text->len > 0) {
+        GtkTextIter cursor, end;
+        gtk_text_buffer_get_iter_at_mark(g_app.textBuffer, &cursor,
+                                         gtk_text_buffer_get_insert(g_app.textBuffer));
+        gtk_text_buffer_get_end_iter(g_app.textBuffer, &end);
+        gboolean scroll = gtk_text_iter_equal(&cursor, &end);
+
+        g_app.isUndoRedoInProgress = TRUE;
+        gtk_text_buffer_insert(g_app.textBuffer, &end, input->text->str, (gint)input->text->len);
+        g_app.isUndoRedoInProgress = FALSE;
+
+        if (scroll) {
+            gtk_text_buffer_get_end_iter(g_app.textBuffer, &end);
+            gtk_text_buffer_place_cursor(g_app.textBuffer, &end);
+            gtk_text_view_scroll_mark_onscreen(GTK_TEXT_VIEW(g_app.textView),
+                                               gtk_text_buffer_get_insert(g_app.textBuffer));
         }
     }
-    gtk_widget_destroy(dialog);
+    g_app.encoding = TextDecoderGetEncoding(input->decoder);
 }
 
-static gboolean DoFileSave(gboolean saveAs) {
-    char path[MAX_PATH_BUFFER];
-
-    if (saveAs || g_app.currentPath[0] == '\0') {
-        GtkWidget *dialog = gtk_file_chooser_dialog_new(
-            "Save File", GTK_WINDOW(g_app.window),
-            GTK_FILE_CHOOSER_ACTION_SAVE,
-            "_Cancel", GTK_RESPONSE_CANCEL,
-            "_Save", GTK_RESPONSE_ACCEPT,
-            NULL);
-
-        gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog), TRUE);
+/* The decoder holds back the first few KB until it can tell the encoding; a writer that
+ * sends less and then pauses gets it decided from what has arrived */
+static gboolean on_stdin_settle(gpointer userData) {
+    StdinRead *input = g_app.stdinRead;
+    input->settleId = 0;
+    g_string_truncate(input->text, 0);
+    TextDecoderSettle(input->decoder, input->text);
+    AppendStdinText(input);
+    return G_SOURCE_REMOVE;
+}
 
-        if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
-            char *filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
-            if (filename) {
-                strncpy(path, filename, MAX_PATH_BUFFER - 1);
-                g_free(filename);
-            } else {
-                gtk_widget_destroy(dialog);
-                return FALSE;
-            }
-        } else {
-            gtk_widget_destroy(dialog);
-            return FALSE;
-        }
-        gtk_widget_destroy(dialog);
-        strncpy(g_app.currentPath, path, MAX_PATH_BUFFER - 1);
-    } else {
-        strncpy(path, g_app.currentPath, MAX_PATH_BUFFER - 1);
+/* One read per call: the poll said data is waiting, so it returns at once with whatever
+ * has arrived, and the text is on screen before the writer sends more. */
+static gboolean on_stdin_readable(gint fd, GIOCondition condition, gpointer userData) {
+    StdinRead *input = g_app.stdinRead;
+    gssize got = read(fd, input->buffer, STDIN_READ_BYTES);
+    int readError = errno;
+    if (got < 0 && (readError == EINTR || readError == EAGAIN)) {
+        return G_SOURCE_CONTINUE;
     }
 
-    char *text = NULL;
-    int len = 0;
-    if (!GetEditText(&text, &len)) return FALSE;
+    if (got < 0) {
+        char *message = g_strdup_printf("Cannot read standard input: %s", g_strerror(readError));
+        StopReadingStdin();
+        ShowMessage(GTK_MESSAGE_ERROR, message);
+        g_free(message);
+        return G_SOURCE_REMOVE;
+    }
 
-    gboolean ok = SaveTextFile(NULL, path, text, len, g_app.encoding);
-    g_free(text);
+    gboolean atEnd = got == 0;
+    g_string_truncate(input->text, 0);
+    TextDecoderFeed(input->decoder, input->buffer, got, atEnd, input->text);
+    input->bytes += got;
+    AppendStdinText(input);
 
-    if (ok) {
-        g_app.modified = FALSE;
-        UpdateTitle();
+    if (atEnd) {
+        StopReadingStdin();
+        return G_SOURCE_REMOVE;
     }
-    return ok;
-}
-
-static gboolean LoadDocumentFromPath(const char *path) {
-    char *text = NULL;
-    TextEncoding enc = ENC_UTF8;
-    if (!LoadTextFile(NULL, path, &text, NULL, &enc)) {
-        return FALSE;
+    if (input->settleId) {
+        g_source_remove(input->settleId);
+        input->settleId = 0;
+    }
+    if (input->text->len == 0) {
+        input->settleId = g_timeout_add(STDIN_SETTLE_MS, on_stdin_settle, NULL);
     }
+    ShowStdinProgress(input);
+    return G_SOURCE_CONTINUE;
+}
 
-    gtk_text_buffer_set_text(g_app.textBuffer, text, -1);
-    
-    g_free(text);
-    strncpy(g_app.currentPath, path, MAX_PATH_BUFFER - 1);
-    g_app.encoding = enc;
-    g_app.modified = FALSE;
-    ClearRedoStack();
-    g_queue_foreach(g_app.undoStack, (GFunc)FreeUndoEntry, NULL);
-    g_queue_clear(g_app.undoStack);
-    g_app.lastUndoLength = 0;
-    g_app.lastUndoTime = 0;
-    g_app.lastChar = '\0';
+/* Reads standard input into a new untitled document as it arrives. The text is unsaved,
+ * so the document counts as modified; it is read-only until the input ends. */
+static void StartReadingStdin(void) {
+    ResetDocument();
+
+    StdinRead *input = g_new0(StdinRead, 1);
+    input->decoder = TextDecoderNew();
+    /* Whatever arrives is shown; a stray byte must not end the read */
+    TextDecoderSetLenient(input->decoder);
+    input->buffer = g_malloc(STDIN_READ_BYTES);
+    input->text = g_string_new(NULL);
+    /* Below redraw priority, so a fast writer cannot starve painting */
+    input->sourceId = g_unix_fd_add_full(G_PRIORITY_DEFAULT_IDLE, STDIN_FILENO,
+                                         G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                         on_stdin_readable, NULL, NULL);
+    g_app.stdinRead = input;
+
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(g_app.textView), FALSE);
+    gtk_widget_show(g_app.loadCancelButton);
+    ShowStdinProgress(input);
     UpdateTitle();
-    UpdateStatusBar();
+}
+
+static gboolean QueryDiskStamp(const char *path, DiskStamp *stamp) {
+    GFile *file = g_file_new_for_path(path);
+    GFileInfo *info = g_file_query_info(file,
+        G_FILE_ATTRIBUTE_STANDARD_SIZE "," G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+        G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC, G_FILE_QUERY_INFO_NONE, NULL, NULL);
+    g_object_unref(file);
+    if (!info) return FALSE;
+    stamp->size = g_file_info_get_size(info);
+    stamp->modified = (gint64)g_file_info_get_attribute_uint64(info, G_FILE_ATTRIBUTE_TIME_MODIFIED) *
+                      G_USEC_PER_SEC +
+                      g_file_info_get_attribute_uint32(info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+    g_object_unref(info);
     return TRUE;
 }
 
-static gboolean PromptSaveChanges(void) {
-    if (!g_app.modified) return TRUE;
+static void FreeExternalReload(gpointer data) {
+    ExternalReload *reload = (ExternalReload *)data;
+    g_free(reload->path);
+    g_bytes_unref(reload->old);
+    g_array_free(reload->matches, TRUE);
+    g_string_free(reload->replacements, TRUE);
+    g_array_free(reload->replacementEnds, TRUE);
+    g_free(reload);
+}
+
+static void ExternalReloadThread(GTask *task, gpointer sourceObject,
+                                 gpointer taskData, GCancellable *cancellable) {
+    ExternalReload *reload = (ExternalReload *)taskData;
+    GBytes *text = NULL;
+    if (!QueryDiskStamp(reload->path, &reload->stamp) ||
+        !LoadTextFileBytes(reload->path, &text, &reload->encoding)) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED, "Cannot read %s", reload->path);
+        return;
+    }
+
+    gsize oldLength = 0, newLength = 0;
+    const char *oldText = g_bytes_get_data(reload->old, &oldLength);
+    const char *newText = g_bytes_get_data(text, &newLength);
+    GArray *hunks = LineDiff(oldText, oldLength, newText, newLength, cancellable);
+    if (!hunks) {
+        g_bytes_unref(text);
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Cancelled");
+        return;
+    }
+
+    /* Copy out only the changed lines, releasing the file's mapping here */
+    for (guint i = 0; i < hunks->len; i++) {
+        const LineDiffHunk *hunk = &g_array_index(hunks, LineDiffHunk, i);
+        TextMatch match = { hunk->oldStart, hunk->oldLength };
+        g_array_append_val(reload->matches, match);
+        g_string_append_len(reload->replacements, newText + hunk->newStart, hunk->newLength);
+        gsize end = reload->replacements->len;
+        g_array_append_val(reload->replacementEnds, end);
+    }
+    g_array_free(hunks, TRUE);
+    g_bytes_unref(text);
+    g_task_return_boolean(task, TRUE);
+}
 
+static gboolean ConfirmExternalReload(void) {
     GtkWidget *dialog = gtk_message_dialog_new(
         GTK_WINDOW(g_app.window),
         GTK_DIALOG_MODAL,
         GTK_MESSAGE_QUESTION,
         GTK_BUTTONS_NONE,
-        "Save changes to %s?",
-        g_app.currentPath[0] ? g_app.currentPath : UNTITLED_NAME);
-
+        "%s has been changed by another program.\n\n"
+        "Apply those changes? Your unsaved edits will be replaced; Undo brings them back.",
+        g_app.currentPath);
     gtk_dialog_add_buttons(GTK_DIALOG(dialog),
-        "_Don't Save", GTK_RESPONSE_NO,
-        "_Cancel", GTK_RESPONSE_CANCEL,
-        "_Save", GTK_RESPONSE_YES,
+        "_Keep My Version", GTK_RESPONSE_NO,
+        "_Apply Changes", GTK_RESPONSE_YES,
         NULL);
-
     gint res = gtk_dialog_run(GTK_DIALOG(dialog));
     gtk_widget_destroy(dialog);
+    return res == GTK_RESPONSE_YES;
+}
 
-    if (res == GTK_RESPONSE_YES) {
-        return DoFileSave(FALSE);
+static void ScheduleExternalCheck(void);
+
+/* Applies the changed hunks as one undoable edit, so the cursor, scroll position and
+ * history survive the reload. */
+static void OnExternalReload(GObject *sourceObject, GAsyncResult *result, gpointer userData) {
+    ExternalReload *reload = (ExternalReload *)g_task_get_task_data(G_TASK(result));
+    GError *error = NULL;
+    if (!g_task_propagate_boolean(G_TASK(result), &error)) {
+        /* Cancelled by a newer check, or the file is gone or half-written; the next
+         * change notification tries again. */
+        gboolean cancelled = g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+        g_error_free(error);
+        if (!cancelled) g_clear_object(&g_app.reloadJob);
+        return;
+    }
+    g_clear_object(&g_app.reloadJob);
+
+    /* Typed into while diffing: the hunks no longer fit the buffer */
+    if (reload->generation != g_app.editGeneration) {
+        ScheduleExternalCheck();
+        return;
+    }
+
+    if (reload->matches->len > 0) {
+        if (g_app.modified && !ConfirmExternalReload()) {
+            g_app.diskStamp = reload->stamp;   /* Don't ask again about this version */
+            return;
+        }
+        /* Edited while the question was up: diff again */
+        if (reload->generation != g_app.editGeneration) {
+            ScheduleExternalCheck();
+            return;
+        }
+        /* The hunks are offsets into the text the diff read, which the generation check
+         * says is still the buffer's, so apply them to that rather than copy the buffer */
+        SearchSnapshot old = { 0 };
+        old.bytes = reload->old;
+        old.text = g_bytes_get_data(reload->old, &old.length);
+        old.generation = reload->generation;
+        ApplyReplacements(&old, reload->matches, NULL, reload->replacements->str,
+                          (const gsize *)reload->replacementEnds->data);
+    }
+    g_app.diskStamp = reload->stamp;
+    g_app.encoding = reload->encoding;
+    g_app.modified = FALSE;
+    g_app.fileBytes = -1;
+    UpdateTitle();
+    UpdateStatusBar();
+}
+
+static void CancelExternalReload(void) {
+    if (!g_app.reloadJob) return;
+    g_cancellable_cancel(g_app.reloadJob);
+    g_clear_object(&g_app.reloadJob);
+}
+
+static void CheckExternalChange(void) {
+    /* Loads, saves and follow mode account for the file's contents themselves */
+    if (!g_app.fileMonitor || g_app.load || g_app.saveInFlight || g_app.follow) return;
+
+    DiskStamp stamp;
+    if (!QueryDiskStamp(g_app.currentPath, &stamp) ||
+        (stamp.size == g_app.diskStamp.size && stamp.modified == g_app.diskStamp.modified)) {
+        return;
+    }
+    /* The diff runs against the search snapshot; rather than copy the buffer here, have
+     * it copied in idle slices and look again once that is done */
+    SearchSnapshot *snapshot = PeekSearchSnapshot();
+    if (!snapshot) {
+        if (!g_app.search.partial) StartSnapshotCopy();
+        ScheduleExternalCheck();
+        return;
+    }
+
+    CancelExternalReload();
+    ExternalReload *reload = g_new0(ExternalReload, 1);
+    reload->path = g_strdup(g_app.currentPath);
+    reload->old = g_bytes_ref(snapshot->bytes);
+    reload->generation = snapshot->generation;
+    reload->matches = g_array_new(FALSE, FALSE, sizeof(TextMatch));
+    reload->replacements = g_string_new(NULL);
+    reload->replacementEnds = g_array_new(FALSE, FALSE, sizeof(gsize));
+
+    g_app.reloadJob = g_cancellable_new();
+    GTask *task = g_task_new(NULL, g_app.reloadJob, OnExternalReload, NULL);
+    g_task_set_task_data(task, reload, FreeExternalReload);
+    g_task_run_in_thread(task, ExternalReloadThread);
+    g_object_unref(task);
+}
+
+static gboolean on_reload_timer(gpointer userData) {
+    g_app.reloadTimer = 0;
+    CheckExternalChange();
+    return G_SOURCE_REMOVE;
+}
+
+/* Writers often touch a file several times in a row; wait for them to settle */
+static void ScheduleExternalCheck(void) {
+    if (g_app.reloadTimer) {
+        g_source_remove(g_app.reloadTimer);
+    }
+    g_app.reloadTimer = g_timeout_add(RELOAD_SETTLE_MS, on_reload_timer, NULL);
+}
+
+static void on_file_changed(GFileMonitor *monitor, GFile *file, GFile *otherFile,
+                            GFileMonitorEvent event, gpointer userData) {
+    ScheduleExternalCheck();
+}
+
+static void UnwatchCurrentFile(void) {
+    CancelExternalReload();
+    if (g_app.reloadTimer) {
+        g_source_remove(g_app.reloadTimer);
+        g_app.reloadTimer = 0;
+    }
+    if (g_app.fileMonitor) {
+        g_file_monitor_cancel(g_app.fileMonitor);
+        g_clear_object(&g_app.fileMonitor);
+    }
+}
+
+/* Starts watching the current file, taking its present version as the one the buffer
+ * matches. Large documents and the viewer are not reconciled. */
+static void WatchCurrentFile(void) {
+    UnwatchCurrentFile();
+    if (!g_app.currentPath[0] || g_app.large || g_app.viewer) return;
+    if (!QueryDiskStamp(g_app.currentPath, &g_app.diskStamp)) return;
+
+    GFile *file = g_file_new_for_path(g_app.currentPath);
+    g_app.fileMonitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE, NULL, NULL);
+    g_object_unref(file);
+    if (g_app.fileMonitor) {
+        g_signal_connect(g_app.fileMonitor, "changed", G_CALLBACK(on_file_changed), NULL);
     }
-    return res == GTK_RESPONSE_NO;
 }
 
 static void SetWordWrap(gboolean enabled) {
@@ -514,39 +2900,240 @@ static void ToggleStatusBar(gboolean visible) {
     g_app.statusVisible = visible;
     if (visible) {
         gtk_widget_show(g_app.statusbar);
+        UpdateStatusBar();   /* Refreshes were skipped while hidden */
     } else {
         gtk_widget_hide(g_app.statusbar);
     }
 }
 
+static void ShowMessage(GtkMessageType type, const char *message) {
+    GtkWidget *dialog = gtk_message_dialog_new(
+        GTK_WINDOW(g_app.window),
+        GTK_DIALOG_MODAL,
+        type,
+        GTK_BUTTONS_OK,
+        "%s", message);
+    gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+}
+
+static void ShowReplaceCount(int replaced) {
+    char message[64];
+    snprintf(message, sizeof(message), "Replaced %d occurrence%s.",
+             replaced, replaced == 1 ? "" : "s");
+    ShowMessage(GTK_MESSAGE_INFO, message);
+}
+
+static void EndRegexSearchUI(void) {
+    if (g_app.regexBusyTimer) {
+        g_source_remove(g_app.regexBusyTimer);
+        g_app.regexBusyTimer = 0;
+    }
+    gtk_widget_hide(g_app.searchCancelButton);
+    gtk_statusbar_pop(GTK_STATUSBAR(g_app.statusbar), g_search_context);
+}
+
+static gboolean on_regex_busy(gpointer userData) {
+    g_app.regexBusyTimer = 0;
+    gtk_statusbar_push(GTK_STATUSBAR(g_app.statusbar), g_search_context, "Searching...");
+    gtk_widget_show(g_app.searchCancelButton);
+    return G_SOURCE_REMOVE;
+}
+
+static void CancelRegexSearch(void) {
+    if (!g_app.regexJob) return;
+    g_cancellable_cancel(g_app.regexJob);
+    g_clear_object(&g_app.regexJob);
+    EndRegexSearchUI();
+}
+
+/* Collects a regex search's result. NULL if it was cancelled or failed; failures
+ * other than cancellation are reported. A result that does arrive is never stale:
+ * any edit cancels the running search. */
+static RegexMatchSet *FinishRegexSearch(GAsyncResult *result) {
+    GError *error = NULL;
+    RegexMatchSet *set = RegexSearchFinish(result, &error);
+    if (!set && g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        g_error_free(error);
+        return NULL;
+    }
+
+    g_clear_object(&g_app.regexJob);
+    EndRegexSearchUI();
+    if (!set) {
+        char *message = g_strdup_printf("Search failed: %s", error->message);
+        ShowMessage(GTK_MESSAGE_ERROR, message);
+        g_free(message);
+        g_error_free(error);
+        return NULL;
+    }
+    if (g_app.search.generation != g_app.editGeneration || !g_app.search.bytes) {
+        RegexMatchSetFree(set);
+        return NULL;
+    }
+    return set;
+}
+
+static void OnRegexFound(GObject *sourceObject, GAsyncResult *result, gpointer userData) {
+    RegexMatchSet *set = FinishRegexSearch(result);
+    if (!set) return;
+
+    if (set->matches->len == 0) {
+        ShowMessage(GTK_MESSAGE_INFO, "Cannot find the text.");
+    } else {
+        const TextMatch *match = &g_array_index(set->matches, TextMatch, 0);
+        GtkTextIter start, end;
+        gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, &start,
+                                           SnapshotOffsetAtByte(&g_app.search, match->start));
+        gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, &end,
+                                           SnapshotOffsetAtByte(&g_app.search, match->start + match->length));
+        gtk_text_buffer_select_range(g_app.textBuffer, &start, &end);
+        gtk_text_view_scroll_to_iter(GTK_TEXT_VIEW(g_app.textView), &start, 0, FALSE, 0, 0);
+        g_app.regexEmptyMatch = match->length == 0 ? gtk_text_iter_get_offset(&start) + 1 : 0;
+    }
+    RegexMatchSetFree(set);
+}
+
+static void OnRegexReplaced(GObject *sourceObject, GAsyncResult *result, gpointer userData) {
+    RegexMatchSet *set = FinishRegexSearch(result);
+    if (!set) return;
+
+    int replaced = ApplyReplacements(&g_app.search, set->matches, NULL, set->replacements->str,
+                                     (const gsize *)set->replacementEnds->data);
+    RegexMatchSetFree(set);
+    ShowReplaceCount(replaced);
+}
+
+/* Starts a regex search of the current buffer on a worker. The pattern comes from the
+ * compiled-pattern cache; invalid patterns and replacements are reported here. */
+static gboolean StartRegexSearch(RegexSearchMode mode, const char *replacement,
+                                 GAsyncReadyCallback callback) {
+    const char *needle = GetFindText();
+    GError *error = NULL;
+    GRegex *regex = RegexCacheLookup(needle, g_app.matchCase, &error);
+    if (!regex || (replacement && !g_regex_check_replacement(replacement, NULL, &error))) {
+        char *message = g_strdup_printf("%s: %s", regex ? "Invalid replacement" :
+                                        "Invalid regular expression", error->message);
+        ShowMessage(GTK_MESSAGE_ERROR, message);
+        g_free(message);
+        g_error_free(error);
+        if (regex) g_regex_unref(regex);
+        return FALSE;
+    }
+
+    SearchSnapshot *snapshot = GetSearchSnapshot();
+    if (!snapshot) {
+        g_regex_unref(regex);
+        return FALSE;
+    }
+
+    GtkTextIter selStart, selEnd;
+    gtk_text_buffer_get_selection_bounds(g_app.textBuffer, &selStart, &selEnd);
+    /* Sitting on the empty match found last time: step over it, or Find Next would
+     * find it again */
+    if (gtk_text_iter_equal(&selStart, &selEnd) &&
+        g_app.regexEmptyMatch == gtk_text_iter_get_offset(&selStart) + 1) {
+        /* At either end of the buffer that means wrapping around */
+        if (mode == REGEX_SEARCH_FORWARD && !gtk_text_iter_forward_char(&selEnd)) {
+            gtk_text_buffer_get_start_iter(g_app.textBuffer, &selEnd);
+        } else if (mode == REGEX_SEARCH_BACKWARD && !gtk_text_iter_backward_char(&selStart)) {
+            gtk_text_buffer_get_end_iter(g_app.textBuffer, &selStart);
+        }
+    }
+    gsize position = 0;
+    if (mode == REGEX_SEARCH_FORWARD) {
+        position = SnapshotByteAtOffset(snapshot, gtk_text_iter_get_offset(&selEnd));
+    } else if (mode == REGEX_SEARCH_BACKWARD) {
+        position = SnapshotByteAtOffset(snapshot, gtk_text_iter_get_offset(&selStart));
+    }
+
+    CancelRegexSearch();
+    g_app.regexJob = g_cancellable_new();
+    g_app.regexBusyTimer = g_timeout_add(REGEX_BUSY_DELAY_MS, on_regex_busy, NULL);
+    RegexSearchAsync(snapshot->bytes, regex, mode, position, replacement, g_app.regexJob,
+                     callback, NULL);
+    g_regex_unref(regex);
+    return TRUE;
+}
+
+static void OnViewerFound(GObject *sourceObject, GAsyncResult *result, gpointer userData) {
+    GError *error = NULL;
+    guint64 start, end;
+    gboolean found = LogViewFindFinish(result, &start, &end, &error);
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        g_error_free(error);
+        return;
+    }
+
+    g_clear_object(&g_app.regexJob);
+    EndRegexSearchUI();
+    if (error) {
+        char *message = g_strdup_printf("Search failed: %s", error->message);
+        ShowMessage(GTK_MESSAGE_ERROR, message);
+        g_free(message);
+        g_error_free(error);
+    } else if (!found) {
+        ShowMessage(GTK_MESSAGE_INFO, "Cannot find the text.");
+    } else {
+        LogViewSelect(g_app.viewer, start, end);
+    }
+}
+
+/* The viewer searches the mapped file on a worker, with the regex search's busy
+ * indicator and Stop button. */
+static gboolean FindInViewer(const char *needle, gboolean reverse) {
+    if (g_app.useRegex) {
+        ShowMessage(GTK_MESSAGE_INFO, "Regular expressions are not available in the read-only viewer.");
+        return FALSE;
+    }
+    CancelRegexSearch();
+    g_app.regexJob = g_cancellable_new();
+    g_app.regexBusyTimer = g_timeout_add(REGEX_BUSY_DELAY_MS, on_regex_busy, NULL);
+    LogViewFindAsync(g_app.viewer, needle, g_app.matchCase, !reverse, g_app.regexJob,
+                     OnViewerFound, NULL);
+    return TRUE;
+}
+
 static gboolean DoFindNext(gboolean reverse) {
-    const char *needle = gtk_entry_get_text(GTK_ENTRY(g_app.findEntry));
+    const char *needle = GetFindText();
     if (!needle || needle[0] == '\0') {
         ShowFindBar();
         return FALSE;
     }
+    if (g_app.viewer) {
+        return FindInViewer(needle, reverse);
+    }
+
+    if (g_app.useRegex) {
+        if (g_app.large) {
+            ShowMessage(GTK_MESSAGE_INFO, "Regular expressions are not available for files this large.");
+            return FALSE;
+        }
+        /* The selection moves when the worker reports back */
+        return StartRegexSearch(reverse ? REGEX_SEARCH_BACKWARD : REGEX_SEARCH_FORWARD,
+                                NULL, OnRegexFound);
+    }
 
     GtkTextIter outStart, outEnd;
-    if (FindInEdit(needle, g_app.matchCase, !reverse, &outStart, &outEnd)) {
+    gboolean found = g_app.large
+        ? FindInLargeDocument(needle, g_app.matchCase, !reverse, &outStart, &outEnd)
+        : FindInEdit(needle, g_app.matchCase, !reverse, &outStart, &outEnd);
+    if (found) {
         gtk_text_buffer_select_range(g_app.textBuffer, &outStart, &outEnd);
         gtk_text_view_scroll_to_iter(GTK_TEXT_VIEW(g_app.textView), &outStart, 0, FALSE, 0, 0);
         return TRUE;
     }
 
-    GtkWidget *dialog = gtk_message_dialog_new(
-        GTK_WINDOW(g_app.window),
-        GTK_DIALOG_MODAL,
-        GTK_MESSAGE_INFO,
-        GTK_BUTTONS_OK,
-        "Cannot find the text.");
-    gtk_dialog_run(GTK_DIALOG(dialog));
-    gtk_widget_destroy(dialog);
+    ShowMessage(GTK_MESSAGE_INFO, "Cannot find the text.");
     return FALSE;
 }
 
 static void DoSelectFont(void) {
-    GtkWidget *dialog = gtk_font_chooser_dialog_new(
-        "Select Font", GTK_WINDOW(g_app.window));
+    /* Built once: listing the installed font families is slow */
+    if (!g_app.fontChooser) {
+        g_app.fontChooser = gtk_font_chooser_dialog_new("Select Font", GTK_WINDOW(g_app.window));
+    }
+    GtkWidget *dialog = g_app.fontChooser;
 
     if (g_app.fontDesc) {
         gtk_font_chooser_set_font_desc(GTK_FONT_CHOOSER(dialog), g_app.fontDesc);
@@ -559,7 +3146,7 @@ static void DoSelectFont(void) {
             if (g_app.fontDesc) {
                 pango_font_description_free(g_app.fontDesc);
             }
-            g_app.fontDesc = pango_font_description_copy(fontDesc);
+            g_app.fontDesc = fontDesc;
             GtkCssProvider *provider = gtk_css_provider_new();
             gchar *font_name = pango_font_description_to_string(g_app.fontDesc);
             gchar *css = g_strdup_printf("textview { font: %s; }", font_name);
@@ -571,38 +3158,425 @@ static void DoSelectFont(void) {
             g_free(css);
             g_free(font_name);
             g_object_unref(provider);
+            if (g_app.viewer) {
+                LogViewSetFont(g_app.viewer, g_app.fontDesc);
+            }
+        }
+    }
+    gtk_widget_hide(dialog);
+}
+
+static void InsertTimeDate(void) {
+    if (IsReadOnly()) return;
+    time_t now = time(NULL);
+    struct tm *tm_info = localtime(&now);
+    char stamp[128];
+    strftime(stamp, sizeof(stamp), "%X %x", tm_info);
+
+    GtkTextIter cursor;
+    gtk_text_buffer_get_iter_at_mark(g_app.textBuffer,
+        &cursor, gtk_text_buffer_get_insert(g_app.textBuffer));
+    gtk_text_buffer_insert(g_app.textBuffer, &cursor, stamp, -1);
+}
+
+/* Moves the cursor to the start of a 0-based line; FALSE if there is no such line */
+static gboolean GoToLine(guint64 line) {
+    if (g_app.viewer) {
+        return LogViewGotoLine(g_app.viewer, line);
+    }
+
+    GtkTextIter iter;
+    if (g_app.large) {
+        PieceTable *table = g_app.large->table;
+        if (line >= PieceTableLineCount(table)) return FALSE;
+        guint64 offset = PieceTableLineStart(table, line);
+        if (!LargeIterAtOffset(&iter, offset)) {
+            ShowLargeWindowAround(offset);
+            LargeIterAtOffset(&iter, offset);
+        }
+    } else {
+        if (line >= (guint64)gtk_text_buffer_get_line_count(g_app.textBuffer)) return FALSE;
+        gtk_text_buffer_get_iter_at_line(g_app.textBuffer, &iter, (gint)line);
+    }
+    gtk_text_buffer_place_cursor(g_app.textBuffer, &iter);
+    gtk_text_view_scroll_to_iter(GTK_TEXT_VIEW(g_app.textView), &iter, 0, FALSE, 0, 0);
+    gtk_widget_grab_focus(g_app.textView);
+    return TRUE;
+}
+
+static void DoGoToLine(void) {
+    GtkWidget *dialog = gtk_dialog_new_with_buttons(
+        "Go To Line", GTK_WINDOW(g_app.window),
+        GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+        "_Cancel", GTK_RESPONSE_CANCEL,
+        "_Go To", GTK_RESPONSE_ACCEPT,
+        NULL);
+    gtk_dialog_set_default_response(GTK_DIALOG(dialog), GTK_RESPONSE_ACCEPT);
+
+    GtkWidget *content = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
+    gtk_container_set_border_width(GTK_CONTAINER(content), 5);
+    GtkWidget *entry = gtk_entry_new();
+    gtk_entry_set_activates_default(GTK_ENTRY(entry), TRUE);
+    gtk_box_pack_start(GTK_BOX(content), gtk_label_new("Line number:"), FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(content), entry, FALSE, FALSE, 0);
+    gtk_widget_show_all(content);
+
+    guint64 line = 0;
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        line = g_ascii_strtoull(gtk_entry_get_text(GTK_ENTRY(entry)), NULL, 10);
+    }
+    gtk_widget_destroy(dialog);
+    if (line == 0 || GoToLine(line - 1)) return;
+
+    LogViewPosition position;
+    if (g_app.viewer && (LogViewGetPosition(g_app.viewer, &position), position.progress < 1000)) {
+        ShowMessage(GTK_MESSAGE_INFO, "That line has not been indexed yet; try again shortly.");
+    } else {
+        ShowMessage(GTK_MESSAGE_INFO, "The line number is beyond the total number of lines.");
+    }
+}
+
+static void CancelMatchCount(void) {
+    MatchCount *count = &g_app.matchCount;
+    if (count->timer) {
+        g_source_remove(count->timer);
+        count->timer = 0;
+    }
+    if (count->job) {
+        g_cancellable_cancel(count->job);
+        g_object_unref(count->job);
+        count->job = NULL;
+    }
+}
+
+static void ClearMatchCount(void) {
+    MatchCount *count = &g_app.matchCount;
+    CancelMatchCount();
+    if (count->matches) {
+        g_array_unref(count->matches);
+    }
+    g_free(count->needle);
+    memset(count, 0, sizeof(*count));
+}
+
+static void OnMatchesCounted(GObject *sourceObject, GAsyncResult *result, gpointer userData) {
+    GError *error = NULL;
+    GArray *matches = FindAllMatchesFinish(result, &error);
+    if (!matches) {
+        /* Cancelled: a newer count has replaced this one */
+        g_clear_error(&error);
+        return;
+    }
+
+    /* The matches are offsets into the snapshot the job started on; CollectMatches
+     * only reuses them while that is still the buffer's generation. */
+    MatchCount *count = &g_app.matchCount;
+    g_clear_object(&count->job);
+    if (count->matches) {
+        g_array_unref(count->matches);
+    }
+    g_free(count->needle);
+    count->matches = matches;
+    count->needle = g_strdup(GetFindText());
+    count->matchCase = g_app.matchCase;
+    count->generation = count->jobGeneration;
+
+    /* Large documents are only counted within the window */
+    const char *scope = g_app.large ? " nearby" : "";
+    char label[64];
+    if (matches->len == 0) {
+        snprintf(label, sizeof(label), "No matches%s", scope);
+    } else {
+        snprintf(label, sizeof(label), "%u match%s%s", matches->len,
+                 matches->len == 1 ? "" : "es", scope);
+    }
+    gtk_label_set_text(GTK_LABEL(g_app.findCountLabel), label);
+}
+
+static void StartMatchCount(void) {
+    MatchCount *count = &g_app.matchCount;
+    const char *needle = GetFindText();
+    /* Counts are for literal searches; a regex could be arbitrarily slow per keystroke */
+    if (!needle[0] || g_app.useRegex || g_app.viewer) {
+        gtk_label_set_text(GTK_LABEL(g_app.findCountLabel), "");
+        return;
+    }
+
+    /* Without a current snapshot, copy one in the background; it starts the count */
+    SearchSnapshot *snapshot = PeekSearchSnapshot();
+    if (!snapshot) {
+        if (!g_app.search.partial) StartSnapshotCopy();
+        return;
+    }
+
+    count->job = g_cancellable_new();
+    count->jobGeneration = snapshot->generation;
+    FindAllMatchesAsync(snapshot->bytes, needle, g_app.matchCase, count->job,
+                        OnMatchesCounted, NULL);
+}
+
+static gboolean on_match_count_timer(gpointer userData) {
+    g_app.matchCount.timer = 0;
+    StartMatchCount();
+    return G_SOURCE_REMOVE;
+}
+
+/* Recount after a short pause; the running count, if any, is stale as of now. */
+static void ScheduleMatchCount(void) {
+    if (!g_app.findBar || !gtk_widget_get_visible(g_app.findBar)) return;
+    CancelMatchCount();
+    g_app.matchCount.timer = g_timeout_add(MATCH_COUNT_DELAY_MS, on_match_count_timer, NULL);
+}
+
+/* Retags matches in [start, end), widened to whole lines */
+static void HighlightRangeNow(GtkTextIter *start, GtkTextIter *end) {
+    HighlightState *hl = &g_app.highlight;
+    gtk_text_iter_set_line_offset(start, 0);
+    if (!gtk_text_iter_ends_line(end)) {
+        gtk_text_iter_forward_to_line_end(end);
+    }
+    gtk_text_buffer_remove_tag(g_app.textBuffer, hl->tag, start, end);
+    if (!hl->pattern) return;
+
+    /* The slice keeps U+FFFC for embedded objects, so character offsets line up */
+    char *text = gtk_text_iter_get_slice(start, end);
+    gsize length = strlen(text);
+    gint base = gtk_text_iter_get_offset(start);
+    const char *anchor = text;
+    gint anchorChar = 0;
+    gsize from = 0;
+    gsize matchLength = 0;
+    gssize found;
+    while ((found = TextPatternFindForward(hl->pattern, text, length, from, &matchLength)) >= 0) {
+        anchorChar += g_utf8_pointer_to_offset(anchor, text + found);
+        anchor = text + found;
+        GtkTextIter matchStart, matchEnd;
+        gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, &matchStart, base + anchorChar);
+        matchEnd = matchStart;
+        gtk_text_iter_forward_chars(&matchEnd, g_utf8_strlen(anchor, matchLength));
+        gtk_text_buffer_apply_tag(g_app.textBuffer, hl->tag, &matchStart, &matchEnd);
+        hl->tagged = TRUE;
+        from = found + matchLength;
+    }
+    g_free(text);
+}
+
+static void HighlightVisibleRange(void) {
+    HighlightState *hl = &g_app.highlight;
+    if (!hl->pattern && !hl->tagged) return;
+
+    GtkTextView *view = GTK_TEXT_VIEW(g_app.textView);
+    GdkRectangle visible;
+    GtkTextIter top, bottom;
+    gtk_text_view_get_visible_rect(view, &visible);
+    gtk_text_view_get_iter_at_location(view, &top, visible.x, visible.y);
+    gtk_text_view_get_iter_at_location(view, &bottom, visible.x + visible.width,
+                                       visible.y + visible.height);
+    HighlightRangeNow(&top, &bottom);
+}
+
+static void FreeHighlightRange(gpointer data) {
+    HighlightRange *range = (HighlightRange *)data;
+    gtk_text_buffer_delete_mark(g_app.textBuffer, range->start);
+    gtk_text_buffer_delete_mark(g_app.textBuffer, range->end);
+    g_free(range);
+}
+
+static gboolean HighlightSlice(gpointer userData) {
+    HighlightState *hl = &g_app.highlight;
+    gint64 deadline = g_get_monotonic_time() + HIGHLIGHT_SLICE_USEC;
+    GtkTextIter start, end;
+
+    do {
+        HighlightRange *range = (HighlightRange *)g_queue_pop_head(hl->dirty);
+        if (range) {
+            gtk_text_buffer_get_iter_at_mark(g_app.textBuffer, &start, range->start);
+            gtk_text_buffer_get_iter_at_mark(g_app.textBuffer, &end, range->end);
+            HighlightRangeNow(&start, &end);
+            FreeHighlightRange(range);
+        } else if (hl->scanMark) {
+            gtk_text_buffer_get_iter_at_mark(g_app.textBuffer, &start, hl->scanMark);
+            end = start;
+            gtk_text_iter_forward_chars(&end, HIGHLIGHT_CHUNK_CHARS);
+            HighlightRangeNow(&start, &end);
+            if (gtk_text_iter_is_end(&end)) {
+                gtk_text_buffer_delete_mark(g_app.textBuffer, hl->scanMark);
+                hl->scanMark = NULL;
+                if (!hl->pattern) hl->tagged = FALSE;
+            } else {
+                gtk_text_iter_forward_char(&end);
+                gtk_text_buffer_move_mark(g_app.textBuffer, hl->scanMark, &end);
+            }
+        } else {
+            hl->idle = 0;
+            return G_SOURCE_REMOVE;
         }
+    } while (g_get_monotonic_time() < deadline);
+    return G_SOURCE_CONTINUE;
+}
+
+static void ScheduleHighlightSlice(void) {
+    if (!g_app.highlight.idle) {
+        g_app.highlight.idle = g_idle_add_full(G_PRIORITY_LOW, HighlightSlice, NULL, NULL);
     }
-    gtk_widget_destroy(dialog);
 }
 
-static void InsertTimeDate(void) {
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    char stamp[128];
-    strftime(stamp, sizeof(stamp), "%X %x", tm_info);
+/* Starts over for a new needle, case setting or document: the visible lines now, the
+ * rest in the background. Old tags are cleared chunk by chunk as the pass reaches them,
+ * so a restart never walks millions of stale tags at once. */
+static void RestartHighlight(void) {
+    HighlightState *hl = &g_app.highlight;
+    if (!hl->tag) return;
+
+    g_queue_free_full(hl->dirty, FreeHighlightRange);
+    hl->dirty = g_queue_new();
+    TextPatternFree(hl->pattern);
+    hl->pattern = NULL;
+
+    const char *needle = GetFindText();
+    if (g_app.highlightAll && !g_app.useRegex && g_app.findBar &&
+        gtk_widget_get_visible(g_app.findBar) && needle[0]) {
+        hl->pattern = TextPatternNew(needle, strlen(needle), g_app.matchCase);
+    }
+    if (!hl->pattern && !hl->tagged) {
+        if (hl->scanMark) {
+            gtk_text_buffer_delete_mark(g_app.textBuffer, hl->scanMark);
+            hl->scanMark = NULL;
+        }
+        return;
+    }
 
-    GtkTextIter cursor;
-    gtk_text_buffer_get_iter_at_mark(g_app.textBuffer,
-        &cursor, gtk_text_buffer_get_insert(g_app.textBuffer));
-    gtk_text_buffer_insert(g_app.textBuffer, &cursor, stamp, -1);
+    GtkTextIter start;
+    gtk_text_buffer_get_start_iter(g_app.textBuffer, &start);
+    if (hl->scanMark) {
+        gtk_text_buffer_move_mark(g_app.textBuffer, hl->scanMark, &start);
+    } else {
+        hl->scanMark = gtk_text_buffer_create_mark(g_app.textBuffer, NULL, &start, TRUE);
+    }
+    HighlightVisibleRange();
+    ScheduleHighlightSlice();
+}
+
+/* Queues the lines touched by an edit, folding it into the previous range when the two
+ * touch, so a burst of typing stays one small range. */
+static void MarkHighlightDirty(GtkTextIter *start, GtkTextIter *end) {
+    HighlightState *hl = &g_app.highlight;
+    if (!hl->pattern || g_app.load || g_app.batchEdit || (g_app.large && g_app.large->shifting)) return;
+
+    HighlightRange *last = (HighlightRange *)g_queue_peek_tail(hl->dirty);
+    if (last) {
+        GtkTextIter lastStart, lastEnd;
+        gtk_text_buffer_get_iter_at_mark(g_app.textBuffer, &lastStart, last->start);
+        gtk_text_buffer_get_iter_at_mark(g_app.textBuffer, &lastEnd, last->end);
+        if (gtk_text_iter_get_line(start) <= gtk_text_iter_get_line(&lastEnd) + 1 &&
+            gtk_text_iter_get_line(end) + 1 >= gtk_text_iter_get_line(&lastStart)) {
+            if (gtk_text_iter_compare(start, &lastStart) < 0) {
+                gtk_text_buffer_move_mark(g_app.textBuffer, last->start, start);
+            }
+            if (gtk_text_iter_compare(end, &lastEnd) > 0) {
+                gtk_text_buffer_move_mark(g_app.textBuffer, last->end, end);
+            }
+            ScheduleHighlightSlice();
+            return;
+        }
+    }
+
+    HighlightRange *range = g_new0(HighlightRange, 1);
+    range->start = gtk_text_buffer_create_mark(g_app.textBuffer, NULL, start, TRUE);
+    range->end = gtk_text_buffer_create_mark(g_app.textBuffer, NULL, end, FALSE);
+    g_queue_push_tail(hl->dirty, range);
+    ScheduleHighlightSlice();
+}
+
+static void ClearHighlight(void) {
+    HighlightState *hl = &g_app.highlight;
+    if (hl->idle) {
+        g_source_remove(hl->idle);
+    }
+    if (hl->dirty) {
+        g_queue_free_full(hl->dirty, FreeHighlightRange);
+    }
+    TextPatternFree(hl->pattern);
+    memset(hl, 0, sizeof(*hl));
 }
 
 static void ShowFindBar(void) {
+    CreateSearchBars();
     gtk_widget_show_all(g_app.findBar);
     gtk_widget_grab_focus(g_app.findEntry);
+    ScheduleMatchCount();
+    RestartHighlight();
 }
 
 static void ShowReplaceBar(void) {
+    CreateSearchBars();
     gtk_widget_show_all(g_app.replaceBar);
     gtk_widget_grab_focus(g_app.replaceEntry);
 }
 
-static void on_text_changed(GtkTextBuffer *buffer, gpointer user_data) {
+static void on_insert_text(GtkTextBuffer *buffer, GtkTextIter *location,
+                           gchar *text, gint len, gpointer user_data) {
+    gint offset = gtk_text_iter_get_offset(location);
     if (!g_app.isUndoRedoInProgress) {
-        PushUndoStack();
+        PushUndoStack(UNDO_EDIT_INSERT, offset, text, len);
         ClearRedoStack();
     }
+    PatchSearchSnapshot(offset, offset, text, len);
+    /* Undo and redo replays are mirrored too; only window refills are not */
+    if (g_app.large) {
+        MirrorLargeInsert(location, text, len);
+    }
+}
+
+static void on_delete_range(GtkTextBuffer *buffer, GtkTextIter *start,
+                            GtkTextIter *end, gpointer user_data) {
+    if (!g_app.isUndoRedoInProgress) {
+        /* Runs before the default handler, so the doomed text is still readable */
+        char *text = gtk_text_buffer_get_text(buffer, start, end, TRUE);
+        PushUndoStack(UNDO_EDIT_DELETE, gtk_text_iter_get_offset(start), text, strlen(text));
+        g_free(text);
+        ClearRedoStack();
+    }
+    PatchSearchSnapshot(gtk_text_iter_get_offset(start), gtk_text_iter_get_offset(end), "", 0);
+    if (g_app.large) {
+        MirrorLargeDelete(start, end);
+    }
+}
+
+static void on_text_inserted(GtkTextBuffer *buffer, GtkTextIter *location,
+                             gchar *text, gint len, gpointer user_data) {
+    /* Connected after the default handler: location is now the end of the new text */
+    GtkTextIter start = *location;
+    gtk_text_iter_backward_chars(&start, g_utf8_strlen(text, len));
+    MarkHighlightDirty(&start, location);
+}
+
+static void on_range_deleted(GtkTextBuffer *buffer, GtkTextIter *start,
+                             GtkTextIter *end, gpointer user_data) {
+    MarkHighlightDirty(start, end);
+}
+
+static void on_begin_user_action(GtkTextBuffer *buffer, gpointer user_data) {
+    if (g_app.userActionDepth++ == 0) {
+        g_app.userActionGrouped = FALSE;
+    }
+}
+
+static void on_end_user_action(GtkTextBuffer *buffer, gpointer user_data) {
+    if (g_app.userActionDepth > 0) {
+        g_app.userActionDepth--;
+    }
+}
+
+static void on_text_changed(GtkTextBuffer *buffer, gpointer user_data) {
+    g_app.editGeneration++;
+    CancelRegexSearch();
+    if (g_app.large && g_app.large->shifting) return;
+    if (g_app.batchEdit) {
+        g_app.batchChanged = TRUE;
+        return;
+    }
+    ScheduleMatchCount();
     g_app.modified = TRUE;
     UpdateTitle();
     UpdateStatusBar();
@@ -610,16 +3584,53 @@ static void on_text_changed(GtkTextBuffer *buffer, gpointer user_data) {
 
 static void on_cursor_moved(GtkTextBuffer *buffer, GParamSpec *pspec, gpointer user_data) {
     UpdateStatusBar();
+    ScheduleLargeShift();
+}
+
+static void RetryClose(gpointer data) {
+    gtk_window_close(GTK_WINDOW(g_app.window));
 }
 
 static gboolean on_window_delete(GtkWidget *widget, GdkEvent *event, gpointer user_data) {
-    if (!PromptSaveChanges()) {
+    if (!PromptSaveChanges(RetryClose, NULL, NULL)) {
         return TRUE;
     }
-    gtk_main_quit();
+    CancelDocumentLoad();
+    /* In single-instance mode GtkApplication quits once its last window is gone */
+    if (gtk_main_level() > 0) {
+        gtk_main_quit();
+    }
     return FALSE;
 }
 
+static void on_cancel_load(GtkWidget *widget, gpointer user_data) {
+    /* What standard input delivered so far is kept */
+    if (g_app.stdinRead) {
+        StopReadingStdin();
+        return;
+    }
+    /* The document that was open before the load is still in place */
+    CancelDocumentLoad();
+}
+
+static void on_find_entry_changed(GtkEditable *editable, gpointer user_data) {
+    ScheduleMatchCount();
+    RestartHighlight();
+}
+
+static void on_highlight_all_toggled(GtkToggleButton *button, gpointer user_data) {
+    g_app.highlightAll = gtk_toggle_button_get_active(button);
+    RestartHighlight();
+}
+
+static void on_view_scrolled(GtkAdjustment *adjustment, gpointer user_data) {
+    /* Lines scrolled into view ahead of the background pass are tagged right away */
+    if (g_app.highlight.scanMark) {
+        HighlightVisibleRange();
+    }
+    ScheduleLargeShift();
+}
+
 static void on_find_next(GtkWidget *widget, gpointer user_data) {
     DoFindNext(FALSE);
 }
@@ -629,19 +3640,31 @@ static void on_find_previous(GtkWidget *widget, gpointer user_data) {
 }
 
 static void on_replace_all(GtkWidget *widget, gpointer user_data) {
-    const char *needle = gtk_entry_get_text(GTK_ENTRY(g_app.findEntry));
+    const char *needle = GetFindText();
     const char *replacement = gtk_entry_get_text(GTK_ENTRY(g_app.replaceEntry));
-    int replaced = ReplaceAllOccurrences(needle, replacement, g_app.matchCase);
+    if (IsReadOnly()) {
+        ShowMessage(GTK_MESSAGE_INFO, ReadOnlyReason());
+        return;
+    }
+    if (g_app.large) return;
+    if (g_app.useRegex) {
+        if (needle[0]) {
+            StartRegexSearch(REGEX_SEARCH_ALL, replacement, OnRegexReplaced);
+        }
+        return;
+    }
+    ShowReplaceCount(ReplaceAllOccurrences(needle, replacement, g_app.matchCase));
+}
 
-    GtkWidget *dialog = gtk_message_dialog_new(
-        GTK_WINDOW(g_app.window),
-        GTK_DIALOG_MODAL,
-        GTK_MESSAGE_INFO,
-        GTK_BUTTONS_OK,
-        "Replaced %d occurrence%s.",
-        replaced, replaced == 1 ? "" : "s");
-    gtk_dialog_run(GTK_DIALOG(dialog));
-    gtk_widget_destroy(dialog);
+static void on_cancel_search(GtkWidget *widget, gpointer user_data) {
+    CancelRegexSearch();
+}
+
+static void on_regex_toggled(GtkToggleButton *button, gpointer user_data) {
+    g_app.useRegex = gtk_toggle_button_get_active(button);
+    CancelRegexSearch();
+    ScheduleMatchCount();
+    RestartHighlight();
 }
 
 static void on_menu_file_new(GtkWidget *widget, gpointer user_data) {
@@ -649,7 +3672,11 @@ static void on_menu_file_new(GtkWidget *widget, gpointer user_data) {
 }
 
 static void on_menu_file_open(GtkWidget *widget, gpointer user_data) {
-    DoFileOpen();
+    DoFileOpen(FALSE);
+}
+
+static void on_menu_file_open_read_only(GtkWidget *widget, gpointer user_data) {
+    DoFileOpen(TRUE);
 }
 
 static void on_menu_file_save(GtkWidget *widget, gpointer user_data) {
@@ -665,31 +3692,38 @@ static void on_menu_file_quit(GtkWidget *widget, gpointer user_data) {
 }
 
 static void on_menu_edit_undo(GtkWidget *widget, gpointer user_data) {
-    // GTK3 GtkTextBuffer doesn't have undo/redo built-in
-    // This would require GtkSourceView for undo support
+    if (IsReadOnly()) return;
     DoUndo();
 }
 
 static void on_menu_edit_redo(GtkWidget *widget, gpointer user_data) {
+    if (IsReadOnly()) return;
     DoRedo();
 }
 
 static void on_menu_edit_cut(GtkWidget *widget, gpointer user_data) {
+    if (IsReadOnly()) return;
     GtkClipboard *clipboard = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
     gtk_text_buffer_cut_clipboard(g_app.textBuffer, clipboard, TRUE);
 }
 
 static void on_menu_edit_copy(GtkWidget *widget, gpointer user_data) {
     GtkClipboard *clipboard = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
+    if (g_app.viewer) {
+        LogViewCopySelection(g_app.viewer, clipboard);
+        return;
+    }
     gtk_text_buffer_copy_clipboard(g_app.textBuffer, clipboard);
 }
 
 static void on_menu_edit_paste(GtkWidget *widget, gpointer user_data) {
+    if (IsReadOnly()) return;
     GtkClipboard *clipboard = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
     gtk_text_buffer_paste_clipboard(g_app.textBuffer, clipboard, NULL, TRUE);
 }
 
 static void on_menu_edit_delete(GtkWidget *widget, gpointer user_data) {
+    if (IsReadOnly()) return;
     gtk_text_buffer_delete_selection(g_app.textBuffer, TRUE, TRUE);
 }
 
@@ -707,6 +3741,10 @@ static void on_menu_edit_replace(GtkWidget *widget, gpointer user_data) {
     ShowReplaceBar();
 }
 
+static void on_menu_edit_go_to(GtkWidget *widget, gpointer user_data) {
+    DoGoToLine();
+}
+
 static void on_menu_edit_time_date(GtkWidget *widget, gpointer user_data) {
     InsertTimeDate();
 }
@@ -719,6 +3757,14 @@ static void on_menu_format_font(GtkWidget *widget, gpointer user_data) {
     DoSelectFont();
 }
 
+static void on_menu_view_follow(GtkWidget *widget, gpointer user_data) {
+    if (g_app.follow || g_app.followAfterLoad) {
+        StopFollowing();
+    } else {
+        StartFollowing();
+    }
+}
+
 static void on_menu_view_status_bar(GtkWidget *widget, gpointer user_data) {
     ToggleStatusBar(!g_app.statusVisible);
 }
@@ -734,6 +3780,92 @@ static void on_menu_help_about(GtkWidget *widget, gpointer user_data) {
     gtk_widget_destroy(dialog);
 }
 
+static void SetPerfRecording(gboolean enabled) {
+    PerfSetEnabled(enabled);
+    gtk_widget_show(g_app.perfMenuItem);
+    gtk_menu_item_set_label(GTK_MENU_ITEM(g_app.perfRecordItem),
+        enabled ? "Stop _Recording" : "Start _Recording");
+}
+
+static void on_menu_help_perf_record(GtkWidget *widget, gpointer user_data) {
+    SetPerfRecording(!PerfEnabled());
+}
+
+/* Ctrl+Shift+F12: the menu is hidden until first used */
+static gboolean on_perf_shortcut(GtkAccelGroup *group, GObject *acceleratable,
+                                 guint keyval, GdkModifierType modifier, gpointer user_data) {
+    SetPerfRecording(!PerfEnabled());
+    return TRUE;
+}
+
+static void on_menu_help_perf_stats(GtkWidget *widget, gpointer user_data) {
+    char *counters = PerfSummary();
+    char *undo = FormatUndoStats();
+    char *summary = g_strdup_printf("%s\n%s", counters, undo);
+    g_free(counters);
+    g_free(undo);
+    char *escaped = g_markup_escape_text(summary, -1);
+    GtkWidget *dialog = gtk_message_dialog_new(
+        GTK_WINDOW(g_app.window),
+        GTK_DIALOG_MODAL,
+        GTK_MESSAGE_INFO,
+        GTK_BUTTONS_OK,
+        PerfEnabled() ? "Performance counters (recording)" : "Performance counters");
+    gtk_message_dialog_format_secondary_markup(GTK_MESSAGE_DIALOG(dialog), "<tt>%s</tt>", escaped);
+    gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+    g_free(escaped);
+    g_free(summary);
+}
+
+static void on_menu_help_perf_save(GtkWidget *widget, gpointer user_data) {
+    char *filename = RunFileChooser(GTK_FILE_CHOOSER_ACTION_SAVE, "Save Performance Trace",
+                                    "retropad-trace.json");
+    if (!filename) return;
+
+    GError *error = NULL;
+    if (!PerfWriteTrace(filename, &error)) {
+        ShowMessage(GTK_MESSAGE_ERROR, error->message);
+        g_error_free(error);
+    }
+    g_free(filename);
+}
+
+/* Keystroke-to-frame latency: from a key press in the editor until the next frame has
+ * been painted. Presses arriving before that frame count from the first. */
+static gboolean on_editor_key_press(GtkWidget *widget, GdkEventKey *event, gpointer user_data) {
+    if (!g_app.keyPressTime) {
+        g_app.keyPressTime = PerfBegin();
+    }
+    return FALSE;
+}
+
+static void on_frame_painted(GdkFrameClock *clock, gpointer user_data) {
+    if (!g_app.keyPressTime) return;
+    PerfEnd(PERF_KEY_TO_FRAME, g_app.keyPressTime);
+    g_app.keyPressTime = 0;
+}
+
+/* Builds what the first frame does not need once it is on screen */
+static gboolean on_build_deferred_ui(gpointer user_data) {
+    CreateSearchBars();
+    StartupTraceMark("deferred UI");
+    StartupTraceFinish();
+    return G_SOURCE_REMOVE;
+}
+
+static void on_first_frame(GdkFrameClock *clock, gpointer user_data) {
+    g_signal_handlers_disconnect_by_func(clock, G_CALLBACK(on_first_frame), user_data);
+    StartupTraceMark("first frame");
+    g_idle_add_full(G_PRIORITY_LOW, on_build_deferred_ui, NULL, NULL);
+}
+
+static void on_window_realized(GtkWidget *widget, gpointer user_data) {
+    GdkFrameClock *clock = gtk_widget_get_frame_clock(widget);
+    g_signal_connect(clock, "after-paint", G_CALLBACK(on_frame_painted), NULL);
+    g_signal_connect(clock, "after-paint", G_CALLBACK(on_first_frame), NULL);
+}
+
 static GtkWidget *CreateMenuBar(GtkAccelGroup *accelGroup) {
     GtkWidget *menubar = gtk_menu_bar_new();
 
@@ -752,6 +3884,10 @@ static GtkWidget *CreateMenuBar(GtkAccelGroup *accelGroup) {
     gtk_widget_add_accelerator(openItem, "activate", accelGroup, GDK_KEY_o, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
     gtk_menu_shell_append(GTK_MENU_SHELL(fileMenu), openItem);
 
+    GtkWidget *openReadOnlyItem = gtk_menu_item_new_with_mnemonic("Open _Read-Only...");
+    g_signal_connect(openReadOnlyItem, "activate", G_CALLBACK(on_menu_file_open_read_only), NULL);
+    gtk_menu_shell_append(GTK_MENU_SHELL(fileMenu), openReadOnlyItem);
+
     GtkWidget *saveItem = gtk_menu_item_new_with_mnemonic("_Save");
     g_signal_connect(saveItem, "activate", G_CALLBACK(on_menu_file_save), NULL);
     gtk_widget_add_accelerator(saveItem, "activate", accelGroup, GDK_KEY_s, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
@@ -826,6 +3962,11 @@ static GtkWidget *CreateMenuBar(GtkAccelGroup *accelGroup) {
     gtk_widget_add_accelerator(replaceItem, "activate", accelGroup, GDK_KEY_h, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
     gtk_menu_shell_append(GTK_MENU_SHELL(editMenu), replaceItem);
 
+    GtkWidget *goToItem = gtk_menu_item_new_with_mnemonic("_Go To...");
+    g_signal_connect(goToItem, "activate", G_CALLBACK(on_menu_edit_go_to), NULL);
+    gtk_widget_add_accelerator(goToItem, "activate", accelGroup, GDK_KEY_g, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
+    gtk_menu_shell_append(GTK_MENU_SHELL(editMenu), goToItem);
+
     gtk_menu_shell_append(GTK_MENU_SHELL(editMenu), gtk_separator_menu_item_new());
 
     GtkWidget *timeDateItem = gtk_menu_item_new_with_mnemonic("Time/Date");
@@ -860,6 +4001,10 @@ static GtkWidget *CreateMenuBar(GtkAccelGroup *accelGroup) {
     g_signal_connect(statusBarItem, "activate", G_CALLBACK(on_menu_view_status_bar), NULL);
     gtk_menu_shell_append(GTK_MENU_SHELL(viewMenu), statusBarItem);
 
+    GtkWidget *followItem = gtk_menu_item_new_with_mnemonic("_Follow Tail");
+    g_signal_connect(followItem, "activate", G_CALLBACK(on_menu_view_follow), NULL);
+    gtk_menu_shell_append(GTK_MENU_SHELL(viewMenu), followItem);
+
     gtk_menu_shell_append(GTK_MENU_SHELL(menubar), viewItem);
 
     // Help menu
@@ -871,20 +4016,129 @@ static GtkWidget *CreateMenuBar(GtkAccelGroup *accelGroup) {
     g_signal_connect(aboutItem, "activate", G_CALLBACK(on_menu_help_about), NULL);
     gtk_menu_shell_append(GTK_MENU_SHELL(helpMenu), aboutItem);
 
+    GtkWidget *perfMenu = gtk_menu_new();
+    g_app.perfMenuItem = gtk_menu_item_new_with_mnemonic("_Performance");
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(g_app.perfMenuItem), perfMenu);
+    gtk_widget_set_no_show_all(g_app.perfMenuItem, TRUE);
+    gtk_menu_shell_append(GTK_MENU_SHELL(helpMenu), g_app.perfMenuItem);
+
+    g_app.perfRecordItem = gtk_menu_item_new_with_mnemonic("Start _Recording");
+    g_signal_connect(g_app.perfRecordItem, "activate", G_CALLBACK(on_menu_help_perf_record), NULL);
+    gtk_accel_label_set_accel(GTK_ACCEL_LABEL(gtk_bin_get_child(GTK_BIN(g_app.perfRecordItem))),
+                              GDK_KEY_F12, GDK_CONTROL_MASK | GDK_SHIFT_MASK);
+    gtk_menu_shell_append(GTK_MENU_SHELL(perfMenu), g_app.perfRecordItem);
+
+    GtkWidget *perfStatsItem = gtk_menu_item_new_with_mnemonic("_Statistics...");
+    g_signal_connect(perfStatsItem, "activate", G_CALLBACK(on_menu_help_perf_stats), NULL);
+    gtk_menu_shell_append(GTK_MENU_SHELL(perfMenu), perfStatsItem);
+
+    GtkWidget *perfSaveItem = gtk_menu_item_new_with_mnemonic("Save _Trace...");
+    g_signal_connect(perfSaveItem, "activate", G_CALLBACK(on_menu_help_perf_save), NULL);
+    gtk_menu_shell_append(GTK_MENU_SHELL(perfMenu), perfSaveItem);
+
+    /* Bound to the group rather than the item, which ignores accelerators while hidden */
+    gtk_accel_group_connect(accelGroup, GDK_KEY_F12, GDK_CONTROL_MASK | GDK_SHIFT_MASK, 0,
+                            g_cclosure_new(G_CALLBACK(on_perf_shortcut), NULL, NULL));
+
     gtk_menu_shell_append(GTK_MENU_SHELL(menubar), helpItem);
 
     gtk_widget_show_all(menubar);
     return menubar;
 }
 
-int main(int argc, char *argv[]) {
-    gtk_init(&argc, &argv);
+/* Builds the find and replace bars, hidden. Runs from idle once the window is on screen,
+ * or earlier if one is needed first. */
+static void CreateSearchBars(void) {
+    if (g_app.findBar) return;
+
+    // Create find bar
+    g_app.findBar = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_container_set_border_width(GTK_CONTAINER(g_app.findBar), 5);
+    g_app.findEntry = gtk_entry_new();
+    g_signal_connect(g_app.findEntry, "changed", G_CALLBACK(on_find_entry_changed), NULL);
+    g_app.findCountLabel = gtk_label_new("");
+    GtkWidget *highlightCheck = gtk_check_button_new_with_label("Highlight All");
+    g_signal_connect(highlightCheck, "toggled", G_CALLBACK(on_highlight_all_toggled), NULL);
+    GtkWidget *regexCheck = gtk_check_button_new_with_label("Regex");
+    g_signal_connect(regexCheck, "toggled", G_CALLBACK(on_regex_toggled), NULL);
+    GtkWidget *findBtn = gtk_button_new_with_label("Find Next");
+    GtkWidget *prevBtn = gtk_button_new_with_label("Find Previous");
+    g_signal_connect(findBtn, "clicked", G_CALLBACK(on_find_next), NULL);
+    g_signal_connect(prevBtn, "clicked", G_CALLBACK(on_find_previous), NULL);
+
+    gtk_box_pack_start(GTK_BOX(g_app.findBar), gtk_label_new("Find:"), FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(g_app.findBar), g_app.findEntry, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(g_app.findBar), g_app.findCountLabel, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(g_app.findBar), findBtn, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(g_app.findBar), prevBtn, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(g_app.findBar), highlightCheck, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(g_app.findBar), regexCheck, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(g_app.searchBars), g_app.findBar, FALSE, FALSE, 0);
+
+    // Create replace bar
+    g_app.replaceBar = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_container_set_border_width(GTK_CONTAINER(g_app.replaceBar), 5);
+    g_app.replaceEntry = gtk_entry_new();
+    g_app.replaceAllButton = gtk_button_new_with_label("Replace All");
+    g_signal_connect(g_app.replaceAllButton, "clicked", G_CALLBACK(on_replace_all), NULL);
+    /* FreeAppState closes the large document after the window is gone */
+    g_signal_connect(g_app.replaceAllButton, "destroy", G_CALLBACK(gtk_widget_destroyed),
+                     &g_app.replaceAllButton);
+    UpdateReplaceAllButton();
+
+    gtk_box_pack_start(GTK_BOX(g_app.replaceBar), gtk_label_new("Replace:"), FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(g_app.replaceBar), g_app.replaceEntry, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(g_app.replaceBar), g_app.replaceAllButton, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(g_app.searchBars), g_app.replaceBar, FALSE, FALSE, 0);
+
+    gtk_widget_show(g_app.searchBars);
+}
+
+static void ConnectBufferSignals(GtkTextBuffer *buffer) {
+    g_signal_connect(buffer, "insert-text", G_CALLBACK(on_insert_text), NULL);
+    g_signal_connect(buffer, "delete-range", G_CALLBACK(on_delete_range), NULL);
+    g_signal_connect_after(buffer, "insert-text", G_CALLBACK(on_text_inserted), NULL);
+    g_signal_connect_after(buffer, "delete-range", G_CALLBACK(on_range_deleted), NULL);
+    g_signal_connect(buffer, "begin-user-action", G_CALLBACK(on_begin_user_action), NULL);
+    g_signal_connect(buffer, "end-user-action", G_CALLBACK(on_end_user_action), NULL);
+    g_signal_connect(buffer, "changed", G_CALLBACK(on_text_changed), NULL);
+    g_signal_connect(buffer, "notify::cursor-position", G_CALLBACK(on_cursor_moved), NULL);
+}
+
+/* Puts a freshly loaded buffer in front of the view and drops the previous document's */
+static void SetDocumentBuffer(GtkTextBuffer *buffer) {
+    HighlightState *hl = &g_app.highlight;
+    HighlightRange *range;
+
+    /* Highlight marks live in the old buffer; RestartHighlight rescans the new one */
+    while ((range = (HighlightRange *)g_queue_pop_head(hl->dirty)) != NULL) {
+        FreeHighlightRange(range);
+    }
+    if (hl->scanMark) {
+        gtk_text_buffer_delete_mark(g_app.textBuffer, hl->scanMark);
+        hl->scanMark = NULL;
+    }
+    hl->tagged = FALSE;
+    CancelRegexSearch();
+    ClearSearchSnapshot();
+
+    GtkTextBuffer *old = g_app.textBuffer;
+    g_app.textBuffer = buffer;
+    ConnectBufferSignals(buffer);
+    gtk_text_view_set_buffer(GTK_TEXT_VIEW(g_app.textView), buffer);
+    g_object_unref(old);
+    g_app.editGeneration++;
+    ScheduleMatchCount();
+}
 
+/* Builds the (hidden) main window and initializes the document state */
+static void CreateMainWindow(void) {
     // Create main window
     g_app.window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title(GTK_WINDOW(g_app.window), APP_TITLE);
     gtk_window_set_default_size(GTK_WINDOW(g_app.window), DEFAULT_WIDTH, DEFAULT_HEIGHT);
     g_signal_connect(g_app.window, "delete-event", G_CALLBACK(on_window_delete), NULL);
+    g_signal_connect(g_app.window, "realize", G_CALLBACK(on_window_realized), NULL);
 
     // Create accelerator group
     GtkAccelGroup *accelGroup = gtk_accel_group_new();
@@ -900,84 +4154,321 @@ int main(int argc, char *argv[]) {
 
     // Create text view with buffer
     g_app.textBuffer = gtk_text_buffer_new(NULL);
-    g_signal_connect(g_app.textBuffer, "changed", G_CALLBACK(on_text_changed), NULL);
-    g_signal_connect(g_app.textBuffer, "notify::cursor-position",
-        G_CALLBACK(on_cursor_moved), NULL);
+    ConnectBufferSignals(g_app.textBuffer);
 
     g_app.textView = gtk_text_view_new_with_buffer(g_app.textBuffer);
+    g_signal_connect(g_app.textView, "key-press-event", G_CALLBACK(on_editor_key_press), NULL);
     gtk_text_view_set_wrap_mode(GTK_TEXT_VIEW(g_app.textView), GTK_WRAP_WORD);
+    g_app.highlight.tag = gtk_text_buffer_create_tag(g_app.textBuffer, "search-match",
+                                                     "background", "#ffe066", NULL);
+    g_app.highlight.dirty = g_queue_new();
+    g_signal_connect(gtk_scrollable_get_vadjustment(GTK_SCROLLABLE(g_app.textView)),
+                     "value-changed", G_CALLBACK(on_view_scrolled), NULL);
 
     GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
     gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled),
         GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
     gtk_container_add(GTK_CONTAINER(scrolled), g_app.textView);
-    gtk_box_pack_start(GTK_BOX(vbox), scrolled, TRUE, TRUE, 0);
-
-    // Create find bar
-    g_app.findBar = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
-    gtk_container_set_border_width(GTK_CONTAINER(g_app.findBar), 5);
-    g_app.findEntry = gtk_entry_new();
-    GtkWidget *findBtn = gtk_button_new_with_label("Find Next");
-    GtkWidget *prevBtn = gtk_button_new_with_label("Find Previous");
-    g_signal_connect(findBtn, "clicked", G_CALLBACK(on_find_next), NULL);
-    g_signal_connect(prevBtn, "clicked", G_CALLBACK(on_find_previous), NULL);
-
-    gtk_box_pack_start(GTK_BOX(g_app.findBar), gtk_label_new("Find:"), FALSE, FALSE, 0);
-    gtk_box_pack_start(GTK_BOX(g_app.findBar), g_app.findEntry, TRUE, TRUE, 0);
-    gtk_box_pack_start(GTK_BOX(g_app.findBar), findBtn, FALSE, FALSE, 0);
-    gtk_box_pack_start(GTK_BOX(g_app.findBar), prevBtn, FALSE, FALSE, 0);
-    gtk_box_pack_start(GTK_BOX(vbox), g_app.findBar, FALSE, FALSE, 0);
-    gtk_widget_hide(g_app.findBar);
+    g_app.editorScroll = scrolled;
 
-    // Create replace bar
-    g_app.replaceBar = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
-    gtk_container_set_border_width(GTK_CONTAINER(g_app.replaceBar), 5);
-    g_app.replaceEntry = gtk_entry_new();
-    GtkWidget *replaceAllBtn = gtk_button_new_with_label("Replace All");
-    g_signal_connect(replaceAllBtn, "clicked", G_CALLBACK(on_replace_all), NULL);
+    /* The read-only viewer takes the text view's place while it is open */
+    g_app.editorStack = gtk_stack_new();
+    gtk_container_add(GTK_CONTAINER(g_app.editorStack), scrolled);
+    gtk_box_pack_start(GTK_BOX(vbox), g_app.editorStack, TRUE, TRUE, 0);
 
-    gtk_box_pack_start(GTK_BOX(g_app.replaceBar), gtk_label_new("Replace:"), FALSE, FALSE, 0);
-    gtk_box_pack_start(GTK_BOX(g_app.replaceBar), g_app.replaceEntry, TRUE, TRUE, 0);
-    gtk_box_pack_start(GTK_BOX(g_app.replaceBar), replaceAllBtn, FALSE, FALSE, 0);
-    gtk_box_pack_start(GTK_BOX(vbox), g_app.replaceBar, FALSE, FALSE, 0);
-    gtk_widget_hide(g_app.replaceBar);
+    /* The find and replace bars are built after the first frame, see CreateSearchBars */
+    g_app.searchBars = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    gtk_box_pack_start(GTK_BOX(vbox), g_app.searchBars, FALSE, FALSE, 0);
 
     // Create status bar
     g_app.statusbar = gtk_statusbar_new();
     g_statusbar_context = gtk_statusbar_get_context_id(GTK_STATUSBAR(g_app.statusbar), "main");
+    g_load_context = gtk_statusbar_get_context_id(GTK_STATUSBAR(g_app.statusbar), "load");
+    g_save_context = gtk_statusbar_get_context_id(GTK_STATUSBAR(g_app.statusbar), "save");
+    g_search_context = gtk_statusbar_get_context_id(GTK_STATUSBAR(g_app.statusbar), "search");
+    g_app.loadCancelButton = gtk_button_new_with_label("Cancel");
+    g_signal_connect(g_app.loadCancelButton, "clicked", G_CALLBACK(on_cancel_load), NULL);
+    gtk_box_pack_end(GTK_BOX(g_app.statusbar), g_app.loadCancelButton, FALSE, FALSE, 0);
+    g_app.searchCancelButton = gtk_button_new_with_label("Stop");
+    g_signal_connect(g_app.searchCancelButton, "clicked", G_CALLBACK(on_cancel_search), NULL);
+    gtk_box_pack_end(GTK_BOX(g_app.statusbar), g_app.searchCancelButton, FALSE, FALSE, 0);
     gtk_box_pack_start(GTK_BOX(vbox), g_app.statusbar, FALSE, FALSE, 0);
 
     /* Initialize undo/redo stacks */
     g_app.undoStack = g_queue_new();
     g_app.redoStack = g_queue_new();
     g_app.isUndoRedoInProgress = FALSE;
-    g_app.lastUndoLength = 0;
+    g_app.userActionDepth = 0;
+    g_app.undoByteBudget = UNDO_BYTE_BUDGET;
+    const char *budgetEnv = g_getenv("RETROPAD_UNDO_BUDGET_KB");
+    if (budgetEnv) {
+        guint64 budgetKb = g_ascii_strtoull(budgetEnv, NULL, 10);
+        if (budgetKb > 0) {
+            g_app.undoByteBudget = (gsize)budgetKb * 1024;
+        }
+    }
+    g_app.lastEditType = UNDO_EDIT_INSERT;
     g_app.lastUndoTime = 0;
     g_app.lastChar = '\0';
 
+    g_app.largeFileThreshold = (guint64)LARGE_FILE_THRESHOLD_MB * 1024 * 1024;
+    const char *largeEnv = g_getenv("RETROPAD_LARGE_FILE_MB");
+    if (largeEnv) {
+        guint64 largeMb = g_ascii_strtoull(largeEnv, NULL, 10);
+        if (largeMb > 0) {
+            g_app.largeFileThreshold = largeMb * 1024 * 1024;
+        }
+    }
+    g_app.viewerThreshold = (guint64)VIEWER_THRESHOLD_MB * 1024 * 1024;
+    const char *viewerEnv = g_getenv("RETROPAD_VIEWER_MB");
+    if (viewerEnv) {
+        guint64 viewerMb = g_ascii_strtoull(viewerEnv, NULL, 10);
+        if (viewerMb > 0) {
+            g_app.viewerThreshold = viewerMb * 1024 * 1024;
+        }
+    }
+
+    /* RETROPAD_TRACE=1 records from startup; any other value also names the file the
+     * trace is written to on exit */
+    const char *traceEnv = g_getenv("RETROPAD_TRACE");
+    if (traceEnv && traceEnv[0]) {
+        SetPerfRecording(TRUE);
+        if (strcmp(traceEnv, "1") != 0) {
+            g_app.perfTracePath = g_strdup(traceEnv);
+        }
+    }
+
     g_app.wordWrap = TRUE;
     g_app.statusVisible = TRUE;
     g_app.encoding = ENC_UTF8;
     g_app.modified = FALSE;
+    g_app.fileBytes = -1;
 
     UpdateTitle();
     UpdateStatusBar();
+}
 
+static void ShowMainWindow(void) {
     gtk_widget_show_all(g_app.window);
-    gtk_widget_hide(g_app.findBar);
-    gtk_widget_hide(g_app.replaceBar);
-
-    gtk_main();
+    gtk_widget_hide(g_app.searchBars);
+    gtk_widget_hide(g_app.loadCancelButton);
+    gtk_widget_hide(g_app.searchCancelButton);
+}
 
+static void FreeAppState(void) {
     /* Cleanup undo/redo stacks */
     g_queue_foreach(g_app.undoStack, (GFunc)FreeUndoEntry, NULL);
     g_queue_free(g_app.undoStack);
     g_queue_foreach(g_app.redoStack, (GFunc)FreeUndoEntry, NULL);
     g_queue_free(g_app.redoStack);
+    UndoSpillClose(g_app.undoSpill);
+    if (g_app.undoDropNoticeId) {
+        g_source_remove(g_app.undoDropNoticeId);
+    }
+    CancelRegexSearch();
+    RegexCacheClear();
+    ClearMatchCount();
+    ClearHighlight();
+    ClearSearchSnapshot();
+    CloseLargeDocument();
+    LogViewFree(g_app.viewer);
+    FileFollowStop(g_app.follow);
+    if (g_app.stdinRead) {
+        FreeStdinRead(g_app.stdinRead);
+    }
+    UnwatchCurrentFile();
+    if (g_app.pendingSave) {
+        g_source_remove(g_app.pendingSaveTimer);
+        FreeDocumentSave(g_app.pendingSave);
+    }
+    ClearAfterSave();
+    g_free(g_app.saveTarget);
 
     if (g_app.fontDesc) {
         pango_font_description_free(g_app.fontDesc);
     }
+    if (g_app.openChooser) gtk_widget_destroy(g_app.openChooser);
+    if (g_app.saveChooser) gtk_widget_destroy(g_app.saveChooser);
+    if (g_app.fontChooser) gtk_widget_destroy(g_app.fontChooser);
+
+    if (g_app.perfTracePath) {
+        GError *error = NULL;
+        if (!PerfWriteTrace(g_app.perfTracePath, &error)) {
+            g_printerr("retropad: %s\n", error->message);
+            g_error_free(error);
+        }
+        g_free(g_app.perfTracePath);
+    }
+}
+
+/* The benchmark builds this file with its own main */
+#ifndef RETROPAD_NO_MAIN
+/* Starts reading the named files into the page cache while GTK initializes. GTK has not
+ * removed its own options yet, so an option's value may be tried as well; that is harmless. */
+static void PrefetchCommandLineFiles(int argc, char **argv) {
+    gboolean options = TRUE;
+    for (int i = 1; i < argc; i++) {
+        if (options && strcmp(argv[i], "--") == 0) {
+            options = FALSE;
+        } else if (!options || argv[i][0] != '-') {
+            PrefetchTextFile(argv[i]);
+        }
+    }
+}
+
+/* Removes flag from argv if it comes before "--"; TRUE if it was there */
+static gboolean TakeFlag(int *argc, char **argv, const char *flag) {
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], "--") == 0) break;
+        if (strcmp(argv[i], flag) == 0) {
+            memmove(&argv[i], &argv[i + 1], (*argc - i) * sizeof(char *));
+            (*argc)--;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static gboolean ReadsStdin(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--") == 0) break;
+        if (strcmp(argv[i], "-") == 0) return TRUE;
+    }
+    return FALSE;
+}
+
+/* A name that does not exist yet gives an empty document that saves there */
+static void OpenCommandLineFile(GFile *file) {
+    char *path = g_file_get_path(file);
+    if (!path) {
+        char *name = g_file_get_parse_name(file);
+        g_printerr("retropad: %s is not a local file\n", name);
+        g_free(name);
+        return;
+    }
+    if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+        CancelDocumentLoad();
+        ResetDocument();
+        g_strlcpy(g_app.currentPath, path, MAX_PATH_BUFFER);
+        UpdateTitle();
+    } else if (!LoadDocumentFromPath(path, FALSE)) {
+        g_printerr("retropad: cannot open %s\n", path);
+    }
+    g_free(path);
+}
+
+/* Opens the file named on the command line, or reads standard input for "-". There is
+ * one document per window, so further names are ignored. */
+static void OpenCommandLineFiles(int argc, char **argv) {
+    const char *arg = NULL;
+    gboolean options = TRUE;
+    gboolean fromStdin = FALSE;
+    for (int i = 1; i < argc; i++) {
+        if (options && strcmp(argv[i], "--") == 0) {
+            options = FALSE;
+            continue;
+        }
+        if (options && argv[i][0] == '-' && argv[i][1] != '\0') {
+            g_printerr("retropad: unknown option %s\n", argv[i]);
+            continue;
+        }
+        if (arg) {
+            g_printerr("retropad: opens one file at a time; ignoring %s\n", argv[i]);
+            continue;
+        }
+        arg = argv[i];
+        fromStdin = options && strcmp(arg, "-") == 0;
+    }
+    if (!arg) return;
+
+    if (fromStdin) {
+        StartReadingStdin();
+        return;
+    }
+
+    GFile *file = g_file_new_for_commandline_arg(arg);
+    OpenCommandLineFile(file);
+    g_object_unref(file);
+}
+
+/* Single-instance mode. The first launch owns APPLICATION_ID on the session bus and
+ * keeps the window; later launches hand their files to it over D-Bus from inside
+ * g_application_run and exit without initializing GTK. */
+static void on_app_startup(GApplication *application, gpointer user_data) {
+    StartupTraceMark("gtk_init");
+    CreateMainWindow();
+    gtk_application_add_window(GTK_APPLICATION(application), GTK_WINDOW(g_app.window));
+    StartupTraceMark("build window");
+    ShowMainWindow();
+    StartupTraceMark("show window");
+}
+
+static void on_app_activate(GApplication *application, gpointer user_data) {
+    gtk_window_present(GTK_WINDOW(g_app.window));
+}
+
+static void OpenFileWhenSaved(gpointer file) {
+    if (PromptSaveChanges(OpenFileWhenSaved, g_object_ref(file), g_object_unref)) {
+        OpenCommandLineFile(file);
+    }
+}
+
+static void on_app_open(GApplication *application, GFile **files, gint count,
+                        const gchar *hint, gpointer user_data) {
+    gtk_window_present(GTK_WINDOW(g_app.window));
+    for (gint i = 1; i < count; i++) {
+        char *name = g_file_get_parse_name(files[i]);
+        g_printerr("retropad: opens one file at a time; ignoring %s\n", name);
+        g_free(name);
+    }
+    OpenFileWhenSaved(files[0]);
+}
+
+static int RunSingleInstance(int argc, char **argv) {
+    GtkApplication *application = gtk_application_new(APPLICATION_ID, G_APPLICATION_HANDLES_OPEN);
+    g_signal_connect(application, "startup", G_CALLBACK(on_app_startup), NULL);
+    g_signal_connect(application, "activate", G_CALLBACK(on_app_activate), NULL);
+    g_signal_connect(application, "open", G_CALLBACK(on_app_open), NULL);
+    int status = g_application_run(G_APPLICATION(application), argc, argv);
+    /* Only the primary instance built any state */
+    if (g_app.window) {
+        FreeAppState();
+    }
+    g_object_unref(application);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    // Batch conversion runs headless, before GTK is initialized
+    if (IsConvertCommand(argc, argv)) {
+        return RunConvertCommand(argc, argv);
+    }
+
+    // --startup-trace prints how long each startup phase took, up to the deferred UI
+    if (TakeFlag(&argc, argv, "--startup-trace")) {
+        StartupTraceBegin();
+    }
+    gboolean singleInstance = TakeFlag(&argc, argv, "--single-instance");
 
+    // Named files are read from disk while GTK starts up
+    PrefetchCommandLineFiles(argc, argv);
+
+    // Standard input cannot be handed to another process, so "-" always gets its own
+    if (singleInstance && !ReadsStdin(argc, argv)) {
+        return RunSingleInstance(argc, argv);
+    }
+
+    gtk_init(&argc, &argv);
+    StartupTraceMark("gtk_init");
+    CreateMainWindow();
+    StartupTraceMark("build window");
+    ShowMainWindow();
+    StartupTraceMark("show window");
+    OpenCommandLineFiles(argc, argv);
+
+    gtk_main();
+
+    FreeAppState();
     return 0;
-}
\ No newline at end of file
+}
+#endif
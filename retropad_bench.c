@@ -0,0 +1,426 @@
+// Benchmarks for retropad's hot paths: file load and save, Find Next, Replace All, and
+// typing and undo through the undo journal. The editor functions are static, so this
+// file compiles retropad.c in (without its main) and drives them against the real, but
+// never shown, main window and text buffer.
+//
+//   retropad_bench [--sizes 1,8,32] [--iterations 5] [--label TEXT] [--output FILE]
+//
+// Corpora are generated deterministically into a temporary directory. Results are
+// written as JSON: per benchmark the p50/p99/mean of its samples, throughput where a
+// sample processes the whole document, and the peak RSS so far.
+#include "retropad.c"
+
+#include "text_simd.h"
+#include <stdio.h>
+#include <sys/resource.h>
+
+#define BENCH_DEFAULT_SIZES "1,8,32"       // MB
+#define BENCH_DEFAULT_ITERATIONS 5
+#define BENCH_FIND_SAMPLES 200             // Find Next calls per corpus
+#define BENCH_TYPED_WORDS 200              // Words typed (and undone) per corpus
+#define BENCH_NEEDLE "needle"
+#define BENCH_NEEDLE_EVERY 2000            // Roughly one needle per this many words
+
+typedef enum BenchCorpusKind {
+    CORPUS_ASCII,
+    CORPUS_MIXED_UTF8,
+    CORPUS_UTF16LE,
+    CORPUS_LONG_LINES,
+    CORPUS_SHORT_LINES
+} BenchCorpusKind;
+
+static const char *const g_corpusNames[] = {
+    "ascii", "mixed-utf8", "utf16le", "long-lines", "short-lines"
+};
+
+static const char *const g_asciiWords[] = {
+    "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit",
+    "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore", "et", "magna",
+    "aliqua", "request", "status=200", "latency_ms", "0x7f3a", "ERROR", "INFO",
+};
+
+static const char *const g_mixedWords[] = {
+    "naïve", "café", "straße", "Привет", "мир", "ελληνικά", "日本語", "テキスト",
+    "中文", "한국어", "emoji😀", "€42", "über", "façade", "smörgåsbord", "ℤ",
+};
+
+typedef struct BenchRun {
+    GString *json;
+    gboolean first;
+    const char *corpus;
+    gsize bytes;                // Document size, in its file encoding
+} BenchRun;
+
+static gint64 BenchNow(void) {
+    return g_get_monotonic_time();
+}
+
+static glong PeakRssKb(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return usage.ru_maxrss;    // Kilobytes on Linux
+}
+
+// Lets idle refreshes and background completions run, outside any timed region
+static void DrainEvents(void) {
+    while (gtk_events_pending()) {
+        gtk_main_iteration();
+    }
+}
+
+static void AppendWord(GString *text, GRand *rand, gboolean mixed) {
+    if (g_rand_int_range(rand, 0, BENCH_NEEDLE_EVERY) == 0) {
+        g_string_append(text, BENCH_NEEDLE);
+    } else if (mixed && g_rand_boolean(rand)) {
+        g_string_append(text, g_mixedWords[g_rand_int_range(rand, 0, G_N_ELEMENTS(g_mixedWords))]);
+    } else {
+        g_string_append(text, g_asciiWords[g_rand_int_range(rand, 0, G_N_ELEMENTS(g_asciiWords))]);
+    }
+}
+
+// UTF-8 text of about size bytes, cut at a line end
+static GString *GenerateText(BenchCorpusKind kind, gsize size, GRand *rand) {
+    GString *text = g_string_sized_new(size + 1024);
+    gboolean mixed = kind == CORPUS_MIXED_UTF8 || kind == CORPUS_UTF16LE;
+    while (text->len < size) {
+        gsize lineLength;
+        switch (kind) {
+        case CORPUS_LONG_LINES: lineLength = 256 * 1024; break;
+        case CORPUS_SHORT_LINES: lineLength = g_rand_int_range(rand, 0, 7); break;
+        default: lineLength = g_rand_int_range(rand, 40, 120); break;
+        }
+        gsize lineStart = text->len;
+        while (text->len - lineStart < lineLength) {
+            if (text->len > lineStart) g_string_append_c(text, ' ');
+            AppendWord(text, rand, mixed);
+            if (kind == CORPUS_SHORT_LINES) break;
+        }
+        g_string_append_c(text, '\n');
+    }
+    return text;
+}
+
+static char *WriteCorpus(const char *dir, BenchCorpusKind kind, gsize size, GError **error) {
+    GRand *rand = g_rand_new_with_seed(42 + kind);
+    GString *text = GenerateText(kind, kind == CORPUS_UTF16LE ? size / 2 : size, rand);
+    g_rand_free(rand);
+
+    char *name = g_strdup_printf("%s-%" G_GSIZE_FORMAT ".txt", g_corpusNames[kind], size);
+    char *path = g_build_filename(dir, name, NULL);
+    g_free(name);
+
+    gboolean ok;
+    if (kind == CORPUS_UTF16LE) {
+        gsize written = 0;
+        char *encoded = g_convert(text->str, text->len, "UTF-16LE", "UTF-8", NULL, &written, error);
+        ok = encoded != NULL;
+        if (ok) {
+            GString *file = g_string_new_len("\xFF\xFE", 2);
+            g_string_append_len(file, encoded, written);
+            ok = g_file_set_contents(path, file->str, file->len, error);
+            g_string_free(file, TRUE);
+            g_free(encoded);
+        }
+    } else {
+        ok = g_file_set_contents(path, text->str, text->len, error);
+    }
+    g_string_free(text, TRUE);
+    if (!ok) {
+        g_free(path);
+        return NULL;
+    }
+    return path;
+}
+
+static void AppendJsonString(GString *json, const char *text) {
+    g_string_append_c(json, '"');
+    for (const char *c = text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            g_string_append_printf(json, "\\%c", *c);
+        } else if ((guchar)*c < 0x20) {
+            g_string_append_printf(json, "\\u%04x", (guchar)*c);
+        } else {
+            g_string_append_c(json, *c);
+        }
+    }
+    g_string_append_c(json, '"');
+}
+
+static int CompareSamples(gconstpointer a, gconstpointer b) {
+    gdouble x = *(const gdouble *)a;
+    gdouble y = *(const gdouble *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples
+static gdouble Percentile(const GArray *sorted, guint percent) {
+    guint rank = (sorted->len * percent + 99) / 100;
+    return g_array_index(sorted, gdouble, MAX(rank, 1) - 1);
+}
+
+// Records one benchmark. samples are durations in microseconds; bytesPerSample is 0 for
+// per-operation benchmarks, which report operations per second instead of throughput.
+static void ReportSamples(BenchRun *run, const char *benchmark, GArray *samples,
+                          gsize bytesPerSample) {
+    if (samples->len == 0) return;
+    g_array_sort(samples, CompareSamples);
+    gdouble sum = 0;
+    for (guint i = 0; i < samples->len; i++) {
+        sum += g_array_index(samples, gdouble, i);
+    }
+    gdouble p50 = Percentile(samples, 50);
+    gdouble p99 = Percentile(samples, 99);
+    gdouble seconds = MAX(p50, 0.001) / G_USEC_PER_SEC;
+
+    g_string_append_printf(run->json,
+        "%s\n    {\"benchmark\": \"%s\", \"corpus\": \"%s\", \"bytes\": %" G_GSIZE_FORMAT
+        ", \"samples\": %u, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"mean_ms\": %.3f, ",
+        run->first ? "" : ",", benchmark, run->corpus, run->bytes, samples->len,
+        p50 / 1000, p99 / 1000, sum / samples->len / 1000);
+    if (bytesPerSample > 0) {
+        g_string_append_printf(run->json, "\"throughput_mb_s\": %.1f, ",
+                               bytesPerSample / (1024.0 * 1024.0) / seconds);
+    } else {
+        g_string_append_printf(run->json, "\"ops_per_s\": %.0f, ", 1 / seconds);
+    }
+    g_string_append_printf(run->json, "\"peak_rss_kb\": %ld}", PeakRssKb());
+    run->first = FALSE;
+
+    g_printerr("  %-8s %-12s p50 %9.3f ms  p99 %9.3f ms\n",
+               benchmark, run->corpus, p50 / 1000, p99 / 1000);
+    g_array_set_size(samples, 0);
+}
+
+// Puts text in the editor as a freshly opened document would be
+static void LoadIntoBuffer(const char *text, gsize length, TextEncoding encoding) {
+    ResetDocument();
+    g_app.isUndoRedoInProgress = TRUE;
+    gtk_text_buffer_set_text(g_app.textBuffer, text, length);
+    g_app.isUndoRedoInProgress = FALSE;
+    ClearUndoHistory();
+    GtkTextIter start;
+    gtk_text_buffer_get_start_iter(g_app.textBuffer, &start);
+    gtk_text_buffer_place_cursor(g_app.textBuffer, &start);
+    g_app.encoding = encoding;
+    g_app.modified = FALSE;
+    DrainEvents();
+}
+
+static gboolean BenchCorpus(BenchRun *run, const char *path, const char *dir,
+                            guint iterations, GError **error) {
+    GArray *samples = g_array_new(FALSE, FALSE, sizeof(gdouble));
+    char *text = NULL;
+    size_t length = 0;
+    TextEncoding encoding = ENC_UTF8;
+
+    for (guint i = 0; i < iterations; i++) {
+        g_free(text);
+        gint64 start = BenchNow();
+        gboolean ok = LoadTextFile(NULL, path, &text, &length, &encoding);
+        gdouble elapsed = BenchNow() - start;
+        if (!ok) {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Cannot load %s", path);
+            g_array_free(samples, TRUE);
+            return FALSE;
+        }
+        g_array_append_val(samples, elapsed);
+    }
+    ReportSamples(run, "load", samples, run->bytes);
+
+    char *savePath = g_build_filename(dir, "save.txt", NULL);
+    for (guint i = 0; i < iterations; i++) {
+        gint64 start = BenchNow();
+        gboolean ok = SaveTextFile(NULL, savePath, text, length, encoding);
+        gdouble elapsed = BenchNow() - start;
+        if (!ok) {
+            g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "Cannot save %s", savePath);
+            g_free(savePath);
+            g_free(text);
+            g_array_free(samples, TRUE);
+            return FALSE;
+        }
+        g_array_append_val(samples, elapsed);
+    }
+    ReportSamples(run, "save", samples, run->bytes);
+    g_unlink(savePath);
+    g_free(savePath);
+
+    LoadIntoBuffer(text, length, encoding);
+    g_free(text);
+
+    // Find Next from the top, wrapping; the first call also takes the buffer snapshot
+    GtkTextIter matchStart, matchEnd;
+    for (guint i = 0; i < BENCH_FIND_SAMPLES; i++) {
+        gint64 start = BenchNow();
+        gboolean found = FindInEdit(BENCH_NEEDLE, TRUE, TRUE, &matchStart, &matchEnd);
+        gdouble elapsed = BenchNow() - start;
+        g_array_append_val(samples, elapsed);
+        if (!found) break;
+        gtk_text_buffer_select_range(g_app.textBuffer, &matchStart, &matchEnd);
+    }
+    ReportSamples(run, "find", samples, 0);
+
+    // Baseline for the find kernel: the same walk with plain strstr over the snapshot
+    if (GetSearchSnapshot()) {
+        const char *snapshot = g_app.search.text;
+        const char *pos = snapshot;
+        for (guint i = 0; i < BENCH_FIND_SAMPLES; i++) {
+            gint64 start = BenchNow();
+            const char *found = strstr(pos, BENCH_NEEDLE);
+            if (!found) found = strstr(snapshot, BENCH_NEEDLE);
+            gdouble elapsed = BenchNow() - start;
+            g_array_append_val(samples, elapsed);
+            if (!found) break;
+            pos = found + strlen(BENCH_NEEDLE);
+        }
+        ReportSamples(run, "strstr", samples, 0);
+    }
+
+    // Each Replace All is undone again, untimed, so every iteration sees the same text
+    gsize snapshotBytes = GetSearchSnapshot() ? g_app.search.length : 0;
+    for (guint i = 0; i < iterations; i++) {
+        gint64 start = BenchNow();
+        ReplaceAllOccurrences(BENCH_NEEDLE, "NEEDLE!", TRUE);
+        gdouble elapsed = BenchNow() - start;
+        g_array_append_val(samples, elapsed);
+        DrainEvents();
+        DoUndo();
+        DrainEvents();
+    }
+    ReportSamples(run, "replace", samples, snapshotBytes);
+
+    // Typing in the middle journals each keystroke; a space closes the undo group
+    GtkTextIter middle;
+    gtk_text_buffer_get_iter_at_offset(g_app.textBuffer, &middle,
+                                       gtk_text_buffer_get_char_count(g_app.textBuffer) / 2);
+    gtk_text_buffer_place_cursor(g_app.textBuffer, &middle);
+    ClearUndoHistory();
+    static const char typed[] = "word ";
+    for (guint w = 0; w < BENCH_TYPED_WORDS; w++) {
+        for (const char *c = typed; *c; c++) {
+            gint64 start = BenchNow();
+            gtk_text_buffer_insert_interactive_at_cursor(g_app.textBuffer, c, 1, TRUE);
+            gdouble elapsed = BenchNow() - start;
+            g_array_append_val(samples, elapsed);
+        }
+    }
+    ReportSamples(run, "type", samples, 0);
+    DrainEvents();
+
+    while (!g_queue_is_empty(g_app.undoStack)) {
+        gint64 start = BenchNow();
+        DoUndo();
+        gdouble elapsed = BenchNow() - start;
+        g_array_append_val(samples, elapsed);
+    }
+    ReportSamples(run, "undo", samples, 0);
+    DrainEvents();
+
+    ResetDocument();
+    DrainEvents();
+    g_array_free(samples, TRUE);
+    return TRUE;
+}
+
+int main(int argc, char *argv[]) {
+    char *sizes = NULL;
+    gint iterations = BENCH_DEFAULT_ITERATIONS;
+    char *label = NULL;
+    char *output = NULL;
+    GOptionEntry entries[] = {
+        { "sizes", 's', 0, G_OPTION_ARG_STRING, &sizes,
+          "Corpus sizes in MB, comma-separated (default " BENCH_DEFAULT_SIZES ")", "LIST" },
+        { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+          "Samples per load, save and replace benchmark", "N" },
+        { "label", 'l', 0, G_OPTION_ARG_STRING, &label,
+          "Recorded in the results, e.g. a commit hash", "TEXT" },
+        { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+          "Write the JSON results here instead of to stdout", "FILE" },
+        { NULL }
+    };
+    GOptionContext *context = g_option_context_new("- benchmark retropad's editing hot paths");
+    g_option_context_add_main_entries(context, entries, NULL);
+    GError *error = NULL;
+    gboolean parsed = g_option_context_parse(context, &argc, &argv, &error);
+    g_option_context_free(context);
+    if (!parsed) {
+        g_printerr("retropad_bench: %s\n", error->message);
+        g_error_free(error);
+        return 2;
+    }
+    if (iterations < 1) iterations = 1;
+
+    // The window is never shown, but GTK still needs a display (use xvfb-run on servers)
+    if (!gtk_init_check(&argc, &argv)) {
+        g_printerr("retropad_bench: cannot open a display\n");
+        return 1;
+    }
+    CreateMainWindow();
+    DrainEvents();
+
+    char *dir = g_dir_make_tmp("retropad-bench-XXXXXX", &error);
+    if (!dir) {
+        g_printerr("retropad_bench: %s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+
+    BenchRun run = { g_string_new(NULL), TRUE, NULL, 0 };
+    g_string_append(run.json, "{\n  \"label\": ");
+    AppendJsonString(run.json, label ? label : "");
+    g_string_append_printf(run.json,
+        ",\n  \"simd\": \"%s\",\n  \"processors\": %u,\n  \"iterations\": %d,\n"
+        "  \"results\": [",
+        TextSimdLevel(), g_get_num_processors(), iterations);
+
+    int status = 0;
+    char **sizeList = g_strsplit(sizes ? sizes : BENCH_DEFAULT_SIZES, ",", -1);
+    for (char **size = sizeList; *size && status == 0; size++) {
+        guint64 megabytes = g_ascii_strtoull(*size, NULL, 10);
+        if (megabytes == 0) continue;
+        for (guint kind = 0; kind < G_N_ELEMENTS(g_corpusNames) && status == 0; kind++) {
+            g_printerr("%s, %" G_GUINT64_FORMAT " MB\n", g_corpusNames[kind], megabytes);
+            char *path = WriteCorpus(dir, kind, megabytes * 1024 * 1024, &error);
+            GStatBuf st;
+            if (path && g_stat(path, &st) == 0) {
+                char *corpus = g_strdup_printf("%s-%" G_GUINT64_FORMAT "mb",
+                                               g_corpusNames[kind], megabytes);
+                run.corpus = corpus;
+                run.bytes = st.st_size;
+                if (!BenchCorpus(&run, path, dir, iterations, &error)) status = 1;
+                g_free(corpus);
+            } else if (!path) {
+                status = 1;
+            }
+            if (path) {
+                g_unlink(path);
+                g_free(path);
+            }
+            if (status != 0) {
+                g_printerr("retropad_bench: %s\n", error ? error->message : "failed");
+                g_clear_error(&error);
+            }
+        }
+    }
+    g_strfreev(sizeList);
+    g_rmdir(dir);
+    g_free(dir);
+
+    g_string_append_printf(run.json, "\n  ],\n  \"peak_rss_kb\": %ld\n}\n", PeakRssKb());
+    if (output) {
+        if (!g_file_set_contents(output, run.json->str, run.json->len, &error)) {
+            g_printerr("retropad_bench: %s\n", error->message);
+            g_clear_error(&error);
+            status = 1;
+        }
+    } else {
+        fputs(run.json->str, stdout);
+    }
+
+    g_string_free(run.json, TRUE);
+    FreeAppState();
+    g_free(sizes);
+    g_free(label);
+    g_free(output);
+    return status;
+}
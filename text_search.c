@@ -0,0 +1,507 @@
+// Substring search. Candidates come from a two-position byte filter run 16 or 32 bytes at
+// a time (the generic first/last-byte filter from Muła's "SIMD-friendly algorithms for
+// substring searching", here on the needle's two rarest bytes) and are then verified one
+// by one; without a vector unit the fixed-length modes fall back to Horspool.
+#include "text_search.h"
+#include "text_simd.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TEXT_SEARCH_X86 1
+#include <immintrin.h>
+#endif
+
+#define FOLD_LIMIT 0x20000          // Nothing above the SMP has case mappings
+#define FOLD_BLOCKS (FOLD_LIMIT >> 8)
+#define FILTER_SET_SIZE 4
+#define FOLD_MAX_VARIANTS 16
+#define INVALID_CHAR 0xFFFFFFFFu    // Decoded from malformed bytes; folds to nothing real
+
+typedef enum PatternMode {
+    PATTERN_EXACT,          // Byte-for-byte
+    PATTERN_ASCII_FOLD,     // ASCII needle with no non-ASCII case variants: fixed length
+    PATTERN_UNICODE_FOLD    // Any other case-insensitive needle: variable match length
+} PatternMode;
+
+struct TextPattern {
+    PatternMode mode;
+    guchar *needle;
+    gsize length;
+    gunichar *folded;           // PATTERN_UNICODE_FOLD: the needle, folded per character
+    guint foldedCount;
+    // Candidate filter: a byte from setA at p + offsetA and one from setB at p + offsetB.
+    // Every match covers at least reach + 1 bytes.
+    guchar setA[FILTER_SET_SIZE];
+    guchar setB[FILTER_SET_SIZE];
+    guint8 inA[256];
+    guint8 inB[256];
+    guint countA;
+    guint countB;
+    gsize offsetA;
+    gsize offsetB;
+    gsize reach;
+    gsize shift[256];           // Horspool shifts for the fixed-length modes
+    gsize backShift[256];
+};
+
+// Two-level simple case folding table for U+0000..U+1FFFF, built on first use
+static gunichar *g_foldBlocks[FOLD_BLOCKS];   // NULL where every character folds to itself
+static gboolean g_asciiHasWideVariant[128];   // Some non-ASCII character folds to this one
+
+static gunichar FoldUncached(gunichar c) {
+    // Leave the Turkic dotted and dotless i alone, as CaseFolding.txt's C+S mappings do
+    if (c == 0x130 || c == 0x131) return c;
+    return g_unichar_tolower(g_unichar_toupper(c));
+}
+
+static void BuildFoldTables(void) {
+    for (guint block = 0; block < FOLD_BLOCKS; block++) {
+        gunichar folded[256];
+        gboolean identity = TRUE;
+        for (guint i = 0; i < 256; i++) {
+            gunichar c = block << 8 | i;
+            folded[i] = FoldUncached(c);
+            if (folded[i] != c) identity = FALSE;
+            if (c >= 0x80 && folded[i] < 0x80) g_asciiHasWideVariant[folded[i]] = TRUE;
+        }
+        if (!identity) {
+            g_foldBlocks[block] = g_new(gunichar, 256);
+            memcpy(g_foldBlocks[block], folded, sizeof(folded));
+        }
+    }
+}
+
+static void EnsureFoldTables(void) {
+    static gsize ready = 0;
+    if (g_once_init_enter(&ready)) {
+        BuildFoldTables();
+        g_once_init_leave(&ready, 1);
+    }
+}
+
+static inline gunichar FoldLookup(gunichar c) {
+    if (c >= FOLD_LIMIT || !g_foldBlocks[c >> 8]) return c;
+    return g_foldBlocks[c >> 8][c & 0xFF];
+}
+
+gunichar TextFoldChar(gunichar c) {
+    EnsureFoldTables();
+    return FoldLookup(c);
+}
+
+// Every character that folds to folded, itself included.
+static guint FoldVariants(gunichar folded, gunichar *out, guint max) {
+    guint count = 0;
+    if (folded >= FOLD_LIMIT || !g_foldBlocks[folded >> 8]) {
+        out[count++] = folded;
+    }
+    for (guint block = 0; block < FOLD_BLOCKS && count < max; block++) {
+        if (!g_foldBlocks[block]) continue;
+        for (guint i = 0; i < 256 && count < max; i++) {
+            if (g_foldBlocks[block][i] == folded) {
+                out[count++] = block << 8 | i;
+            }
+        }
+    }
+    return count;
+}
+
+// Lenient decode: malformed bytes come back one at a time as INVALID_CHAR.
+static inline gsize DecodeChar(const guchar *p, gsize left, gunichar *c) {
+    guchar lead = p[0];
+    if (lead < 0x80) {
+        *c = lead;
+        return 1;
+    }
+    gsize length = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 0;
+    if (length == 0 || length > left) {
+        *c = INVALID_CHAR;
+        return 1;
+    }
+    gunichar value = lead & (0x7F >> length);
+    for (gsize i = 1; i < length; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            *c = INVALID_CHAR;
+            return 1;
+        }
+        value = value << 6 | (p[i] & 0x3F);
+    }
+    *c = value;
+    return length;
+}
+
+// Checks for a match at pos that ends within text[0..length).
+static inline gboolean VerifyAt(const TextPattern *pattern, const guchar *text, gsize length,
+                                gsize pos, gsize *matchLength) {
+    switch (pattern->mode) {
+    case PATTERN_EXACT:
+        if (length - pos < pattern->length || memcmp(text + pos, pattern->needle, pattern->length) != 0) {
+            return FALSE;
+        }
+        *matchLength = pattern->length;
+        return TRUE;
+    case PATTERN_ASCII_FOLD:
+        if (length - pos < pattern->length) return FALSE;
+        for (gsize i = 0; i < pattern->length; i++) {
+            if (g_ascii_tolower(text[pos + i]) != pattern->needle[i]) return FALSE;
+        }
+        *matchLength = pattern->length;
+        return TRUE;
+    case PATTERN_UNICODE_FOLD:
+    default: {
+        gsize p = pos;
+        for (guint i = 0; i < pattern->foldedCount; i++) {
+            if (p >= length) return FALSE;
+            gunichar c;
+            p += DecodeChar(text + p, length - p, &c);
+            if (FoldLookup(c) != pattern->folded[i]) return FALSE;
+        }
+        *matchLength = p - pos;
+        return TRUE;
+    }
+    }
+}
+
+static void AddFilterByte(guchar *set, guint8 *in, guint *count, guchar byte) {
+    if (in[byte]) return;
+    in[byte] = 1;
+    if (*count < FILTER_SET_SIZE) set[*count] = byte;
+    (*count)++;
+}
+
+// Lead bytes of every spelling of a folded character; returns FALSE if any is multi-byte.
+static gboolean AddFoldedLeadBytes(gunichar folded, guchar *set, guint8 *in, guint *count) {
+    gunichar variants[FOLD_MAX_VARIANTS];
+    guint n = FoldVariants(folded, variants, FOLD_MAX_VARIANTS);
+    gboolean singleByte = TRUE;
+    for (guint i = 0; i < n; i++) {
+        gchar utf8[6];
+        g_unichar_to_utf8(variants[i], utf8);
+        AddFilterByte(set, in, count, (guchar)utf8[0]);
+        if (variants[i] >= 0x80) singleByte = FALSE;
+    }
+    return singleByte;
+}
+
+static void BuildHorspoolTables(TextPattern *pattern) {
+    for (guint c = 0; c < 256; c++) {
+        pattern->shift[c] = pattern->length;
+        pattern->backShift[c] = pattern->length;
+    }
+    // ASCII_FOLD keeps the needle lowercased; the scans look up lowercased bytes
+    for (gsize i = 0; i + 1 < pattern->length; i++) {
+        pattern->shift[pattern->needle[i]] = pattern->length - 1 - i;
+    }
+    for (gsize i = pattern->length - 1; i >= 1; i--) {
+        pattern->backShift[pattern->needle[i]] = i;
+    }
+}
+
+// Rough frequency rank of a byte in text and code: lower is more common.
+static guint ByteCommonness(guchar byte) {
+    static const char common[] = " etaoinsrhldcumfpgwybvkxjqz\n.,_;()=\"'-/:0123456789{}";
+    const char *hit = byte ? strchr(common, g_ascii_tolower(byte)) : NULL;
+    return hit ? (guint)(hit - common) : G_N_ELEMENTS(common);
+}
+
+// Fixed-length needles filter on their two rarest bytes rather than the first and last,
+// so common letters at the ends don't flood the verifier with candidates.
+static void ChooseFilterOffsets(TextPattern *pattern) {
+    gsize rarest = 0;
+    for (gsize i = 1; i < pattern->length; i++) {
+        if (ByteCommonness(pattern->needle[i]) > ByteCommonness(pattern->needle[rarest])) rarest = i;
+    }
+    gsize second = rarest == 0 ? pattern->length - 1 : 0;
+    for (gsize i = 0; i < pattern->length; i++) {
+        if (i == rarest) continue;
+        guint rank = ByteCommonness(pattern->needle[i]);
+        guint best = ByteCommonness(pattern->needle[second]);
+        // Prefer a different byte value: the same byte twice filters little better than once
+        gboolean distinct = pattern->needle[i] != pattern->needle[rarest];
+        gboolean bestDistinct = pattern->needle[second] != pattern->needle[rarest];
+        if ((distinct && !bestDistinct) || (distinct == bestDistinct && rank > best)) second = i;
+    }
+    pattern->offsetA = MIN(rarest, second);
+    pattern->offsetB = MAX(rarest, second);
+}
+
+TextPattern *TextPatternNew(const char *needle, gsize length, gboolean matchCase) {
+    if (!needle || length == 0) return NULL;
+
+    TextPattern *pattern = g_new0(TextPattern, 1);
+    pattern->needle = g_malloc(length);
+    memcpy(pattern->needle, needle, length);
+    pattern->length = length;
+    pattern->mode = PATTERN_EXACT;
+
+    if (!matchCase) {
+        EnsureFoldTables();
+        pattern->folded = g_new(gunichar, length);
+        gboolean ascii = TRUE;
+        for (gsize p = 0; p < length;) {
+            gunichar c;
+            p += DecodeChar(pattern->needle + p, length - p, &c);
+            gunichar folded = FoldLookup(c);
+            pattern->folded[pattern->foldedCount++] = folded;
+            if (c >= 0x80 || g_asciiHasWideVariant[folded]) ascii = FALSE;
+        }
+        pattern->mode = ascii ? PATTERN_ASCII_FOLD : PATTERN_UNICODE_FOLD;
+    }
+
+    switch (pattern->mode) {
+    case PATTERN_EXACT:
+        ChooseFilterOffsets(pattern);
+        AddFilterByte(pattern->setA, pattern->inA, &pattern->countA, pattern->needle[pattern->offsetA]);
+        AddFilterByte(pattern->setB, pattern->inB, &pattern->countB, pattern->needle[pattern->offsetB]);
+        BuildHorspoolTables(pattern);
+        break;
+    case PATTERN_ASCII_FOLD:
+        for (gsize i = 0; i < length; i++) {
+            pattern->needle[i] = g_ascii_tolower(pattern->needle[i]);
+        }
+        ChooseFilterOffsets(pattern);
+        guchar a = pattern->needle[pattern->offsetA];
+        guchar b = pattern->needle[pattern->offsetB];
+        AddFilterByte(pattern->setA, pattern->inA, &pattern->countA, a);
+        AddFilterByte(pattern->setA, pattern->inA, &pattern->countA, g_ascii_toupper(a));
+        AddFilterByte(pattern->setB, pattern->inB, &pattern->countB, b);
+        AddFilterByte(pattern->setB, pattern->inB, &pattern->countB, g_ascii_toupper(b));
+        BuildHorspoolTables(pattern);
+        break;
+    case PATTERN_UNICODE_FOLD:
+        // The second character only sits at a fixed offset if the first is always one byte
+        if (AddFoldedLeadBytes(pattern->folded[0], pattern->setA, pattern->inA, &pattern->countA) &&
+            pattern->foldedCount > 1) {
+            AddFoldedLeadBytes(pattern->folded[1], pattern->setB, pattern->inB, &pattern->countB);
+            pattern->offsetB = 1;
+        } else {
+            memcpy(pattern->setB, pattern->setA, sizeof(pattern->setB));
+            memcpy(pattern->inB, pattern->inA, sizeof(pattern->inB));
+            pattern->countB = pattern->countA;
+        }
+        break;
+    }
+
+    pattern->reach = MAX(pattern->offsetA, pattern->offsetB);
+
+    // Pad the sets by repetition so the vector filter always tests FILTER_SET_SIZE bytes
+    for (guint i = pattern->countA; i < FILTER_SET_SIZE; i++) pattern->setA[i] = pattern->setA[0];
+    for (guint i = pattern->countB; i < FILTER_SET_SIZE; i++) pattern->setB[i] = pattern->setB[0];
+    return pattern;
+}
+
+void TextPatternFree(TextPattern *pattern) {
+    if (!pattern) return;
+    g_free(pattern->needle);
+    g_free(pattern->folded);
+    g_free(pattern);
+}
+
+gsize TextPatternMaxMatchLength(const TextPattern *pattern) {
+    if (!pattern) return 0;
+    // A folded match decodes one character per needle character, each at most 4 bytes
+    return pattern->mode == PATTERN_UNICODE_FOLD ? (gsize)pattern->foldedCount * 4 : pattern->length;
+}
+
+static inline guchar ShiftKey(const TextPattern *pattern, guchar byte) {
+    return pattern->mode == PATTERN_ASCII_FOLD ? g_ascii_tolower(byte) : byte;
+}
+
+static gssize HorspoolForward(const TextPattern *pattern, const guchar *text, gsize length,
+                              gsize from, gsize *matchLength) {
+    gsize n = pattern->length;
+    for (gsize p = from; p + n <= length;) {
+        if (VerifyAt(pattern, text, length, p, matchLength)) return (gssize)p;
+        p += pattern->shift[ShiftKey(pattern, text[p + n - 1])];
+    }
+    return -1;
+}
+
+static gssize HorspoolBackward(const TextPattern *pattern, const guchar *text, gsize limit,
+                               gsize *matchLength) {
+    if (limit < pattern->length) return -1;
+    for (gsize p = limit - pattern->length;;) {
+        if (VerifyAt(pattern, text, limit, p, matchLength)) return (gssize)p;
+        gsize shift = pattern->backShift[ShiftKey(pattern, text[p])];
+        if (p < shift) break;
+        p -= shift;
+    }
+    return -1;
+}
+
+// Scalar filter over candidate positions [begin, end); also finishes the vector scans.
+static gssize ScanForward(const TextPattern *pattern, const guchar *text, gsize length,
+                          gsize begin, gsize end, gsize *matchLength) {
+    for (gsize p = begin; p < end; p++) {
+        if (pattern->inA[text[p + pattern->offsetA]] && pattern->inB[text[p + pattern->offsetB]] &&
+            VerifyAt(pattern, text, length, p, matchLength)) {
+            return (gssize)p;
+        }
+    }
+    return -1;
+}
+
+static gssize ScanBackward(const TextPattern *pattern, const guchar *text, gsize limit,
+                           gsize begin, gsize end, gsize *matchLength) {
+    for (gsize p = end; p-- > begin;) {
+        if (pattern->inA[text[p + pattern->offsetA]] && pattern->inB[text[p + pattern->offsetB]] &&
+            VerifyAt(pattern, text, limit, p, matchLength)) {
+            return (gssize)p;
+        }
+    }
+    return -1;
+}
+
+#ifdef TEXT_SEARCH_X86
+
+__attribute__((target("sse2")))
+static inline int Sse2Candidates(const guchar *p, gsize offsetA, gsize offsetB,
+                                 const __m128i *setA, const __m128i *setB) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(p + offsetA));
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + offsetB));
+    __m128i hitA = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(a, setA[0]), _mm_cmpeq_epi8(a, setA[1])),
+                                _mm_or_si128(_mm_cmpeq_epi8(a, setA[2]), _mm_cmpeq_epi8(a, setA[3])));
+    __m128i hitB = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(b, setB[0]), _mm_cmpeq_epi8(b, setB[1])),
+                                _mm_or_si128(_mm_cmpeq_epi8(b, setB[2]), _mm_cmpeq_epi8(b, setB[3])));
+    return _mm_movemask_epi8(_mm_and_si128(hitA, hitB));
+}
+
+__attribute__((target("sse2")))
+static gssize Sse2FindForward(const TextPattern *pattern, const guchar *text, gsize length,
+                              gsize from, gsize *matchLength) {
+    __m128i setA[FILTER_SET_SIZE], setB[FILTER_SET_SIZE];
+    for (guint i = 0; i < FILTER_SET_SIZE; i++) {
+        setA[i] = _mm_set1_epi8((char)pattern->setA[i]);
+        setB[i] = _mm_set1_epi8((char)pattern->setB[i]);
+    }
+    gsize p = from;
+    for (; length - p >= pattern->reach + 16; p += 16) {
+        unsigned mask = (unsigned)Sse2Candidates(text + p, pattern->offsetA, pattern->offsetB, setA, setB);
+        while (mask) {
+            gsize pos = p + __builtin_ctz(mask);
+            if (VerifyAt(pattern, text, length, pos, matchLength)) return (gssize)pos;
+            mask &= mask - 1;
+        }
+    }
+    return ScanForward(pattern, text, length, p, length - pattern->reach, matchLength);
+}
+
+__attribute__((target("sse2")))
+static gssize Sse2FindBackward(const TextPattern *pattern, const guchar *text, gsize limit,
+                               gsize *matchLength) {
+    __m128i setA[FILTER_SET_SIZE], setB[FILTER_SET_SIZE];
+    for (guint i = 0; i < FILTER_SET_SIZE; i++) {
+        setA[i] = _mm_set1_epi8((char)pattern->setA[i]);
+        setB[i] = _mm_set1_epi8((char)pattern->setB[i]);
+    }
+    gsize end = limit - pattern->reach;
+    for (; end >= 16; end -= 16) {
+        gsize block = end - 16;
+        unsigned mask = (unsigned)Sse2Candidates(text + block, pattern->offsetA, pattern->offsetB, setA, setB);
+        while (mask) {
+            int bit = 31 - __builtin_clz(mask);
+            if (VerifyAt(pattern, text, limit, block + bit, matchLength)) return (gssize)(block + bit);
+            mask &= ~(1u << bit);
+        }
+    }
+    return ScanBackward(pattern, text, limit, 0, end, matchLength);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned Avx2Candidates(const guchar *p, gsize offsetA, gsize offsetB,
+                                      const __m256i *setA, const __m256i *setB) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(p + offsetA));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(p + offsetB));
+    __m256i hitA = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(a, setA[0]), _mm256_cmpeq_epi8(a, setA[1])),
+                                   _mm256_or_si256(_mm256_cmpeq_epi8(a, setA[2]), _mm256_cmpeq_epi8(a, setA[3])));
+    __m256i hitB = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(b, setB[0]), _mm256_cmpeq_epi8(b, setB[1])),
+                                   _mm256_or_si256(_mm256_cmpeq_epi8(b, setB[2]), _mm256_cmpeq_epi8(b, setB[3])));
+    return (unsigned)_mm256_movemask_epi8(_mm256_and_si256(hitA, hitB));
+}
+
+__attribute__((target("avx2")))
+static gssize Avx2FindForward(const TextPattern *pattern, const guchar *text, gsize length,
+                              gsize from, gsize *matchLength) {
+    __m256i setA[FILTER_SET_SIZE], setB[FILTER_SET_SIZE];
+    for (guint i = 0; i < FILTER_SET_SIZE; i++) {
+        setA[i] = _mm256_set1_epi8((char)pattern->setA[i]);
+        setB[i] = _mm256_set1_epi8((char)pattern->setB[i]);
+    }
+    gsize p = from;
+    for (; length - p >= pattern->reach + 32; p += 32) {
+        unsigned mask = Avx2Candidates(text + p, pattern->offsetA, pattern->offsetB, setA, setB);
+        while (mask) {
+            gsize pos = p + __builtin_ctz(mask);
+            if (VerifyAt(pattern, text, length, pos, matchLength)) return (gssize)pos;
+            mask &= mask - 1;
+        }
+    }
+    return ScanForward(pattern, text, length, p, length - pattern->reach, matchLength);
+}
+
+__attribute__((target("avx2")))
+static gssize Avx2FindBackward(const TextPattern *pattern, const guchar *text, gsize limit,
+                               gsize *matchLength) {
+    __m256i setA[FILTER_SET_SIZE], setB[FILTER_SET_SIZE];
+    for (guint i = 0; i < FILTER_SET_SIZE; i++) {
+        setA[i] = _mm256_set1_epi8((char)pattern->setA[i]);
+        setB[i] = _mm256_set1_epi8((char)pattern->setB[i]);
+    }
+    gsize end = limit - pattern->reach;
+    for (; end >= 32; end -= 32) {
+        gsize block = end - 32;
+        unsigned mask = Avx2Candidates(text + block, pattern->offsetA, pattern->offsetB, setA, setB);
+        while (mask) {
+            int bit = 31 - __builtin_clz(mask);
+            if (VerifyAt(pattern, text, limit, block + bit, matchLength)) return (gssize)(block + bit);
+            mask &= ~(1u << bit);
+        }
+    }
+    return ScanBackward(pattern, text, limit, 0, end, matchLength);
+}
+
+#endif
+
+gssize TextPatternFindForward(const TextPattern *pattern, const char *text, gsize length,
+                              gsize from, gsize *matchLength) {
+    const guchar *data = (const guchar *)text;
+    gsize matched = 0;
+    if (!matchLength) matchLength = &matched;
+    if (!pattern || from > length || length - from <= pattern->reach) return -1;
+
+#ifdef TEXT_SEARCH_X86
+    if (pattern->countA <= FILTER_SET_SIZE && pattern->countB <= FILTER_SET_SIZE) {
+        switch (GetSimdLevel()) {
+        case SIMD_LEVEL_AVX2: return Avx2FindForward(pattern, data, length, from, matchLength);
+        case SIMD_LEVEL_SSE2: return Sse2FindForward(pattern, data, length, from, matchLength);
+        default: break;
+        }
+    }
+#endif
+    if (pattern->mode != PATTERN_UNICODE_FOLD) {
+        return HorspoolForward(pattern, data, length, from, matchLength);
+    }
+    return ScanForward(pattern, data, length, from, length - pattern->reach, matchLength);
+}
+
+gssize TextPatternFindBackward(const TextPattern *pattern, const char *text, gsize limit,
+                               gsize *matchLength) {
+    const guchar *data = (const guchar *)text;
+    gsize matched = 0;
+    if (!matchLength) matchLength = &matched;
+    if (!pattern || limit <= pattern->reach) return -1;
+
+#ifdef TEXT_SEARCH_X86
+    if (pattern->countA <= FILTER_SET_SIZE && pattern->countB <= FILTER_SET_SIZE) {
+        switch (GetSimdLevel()) {
+        case SIMD_LEVEL_AVX2: return Avx2FindBackward(pattern, data, limit, matchLength);
+        case SIMD_LEVEL_SSE2: return Sse2FindBackward(pattern, data, limit, matchLength);
+        default: break;
+        }
+    }
+#endif
+    if (pattern->mode != PATTERN_UNICODE_FOLD) {
+        return HorspoolBackward(pattern, data, limit, matchLength);
+    }
+    return ScanBackward(pattern, data, limit, 0, limit - pattern->reach, matchLength);
+}
@@ -0,0 +1,27 @@
+// Substring search over UTF-8 text for retropad's find and replace
+#pragma once
+
+#include <glib.h>
+
+// A needle prepared for repeated searching: case folding, filter bytes and shift tables
+// are worked out once here rather than on every scan.
+typedef struct TextPattern TextPattern;
+
+// Case-insensitive patterns use Unicode simple case folding, so a match may be longer
+// or shorter in bytes than the needle (e.g. "K" vs the Kelvin sign).
+TextPattern *TextPatternNew(const char *needle, gsize length, gboolean matchCase);
+void TextPatternFree(TextPattern *pattern);
+
+// First match starting at or after from; returns its byte position or -1.
+gssize TextPatternFindForward(const TextPattern *pattern, const char *text, gsize length,
+                              gsize from, gsize *matchLength);
+
+// Last match that ends at or before limit; returns its byte position or -1.
+gssize TextPatternFindBackward(const TextPattern *pattern, const char *text, gsize limit,
+                               gsize *matchLength);
+
+// Upper bound on the byte length of any match, for splitting text into overlapping chunks.
+gsize TextPatternMaxMatchLength(const TextPattern *pattern);
+
+// Simple case folding of one character, as used for case-insensitive patterns.
+gunichar TextFoldChar(gunichar c);
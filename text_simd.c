@@ -0,0 +1,688 @@
+// Runtime-dispatched text kernels. The AVX2 UTF-8 validator follows the lookup-table
+// approach of Keiser & Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte".
+#include "text_simd.h"
+#include <string.h>
+#include <glib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TEXT_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+static SimdLevel g_simdLevel = SIMD_LEVEL_UNKNOWN;
+
+SimdLevel GetSimdLevel(void) {
+    if (g_simdLevel == SIMD_LEVEL_UNKNOWN) {
+        SimdLevel level = SIMD_LEVEL_SCALAR;
+#ifdef TEXT_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            level = SIMD_LEVEL_AVX2;
+        } else if (__builtin_cpu_supports("sse2")) {
+            level = SIMD_LEVEL_SSE2;
+        }
+#endif
+        if (g_getenv("RETROPAD_NO_SIMD")) {
+            level = SIMD_LEVEL_SCALAR;
+        }
+        g_simdLevel = level;
+    }
+    return g_simdLevel;
+}
+
+const char *TextSimdLevel(void) {
+    switch (GetSimdLevel()) {
+    case SIMD_LEVEL_AVX2: return "avx2";
+    case SIMD_LEVEL_SSE2: return "sse2";
+    default: return "scalar";
+    }
+}
+
+// Length of the valid sequence starting at p, or 0 if it is invalid or truncated.
+static gsize ScalarSequenceLength(const guchar *p, gsize left) {
+    guchar c = p[0];
+    if (c < 0x80) {
+        return c != 0 ? 1 : 0;
+    }
+    if (c < 0xC2) {
+        return 0;   // Stray continuation or overlong 2-byte lead
+    }
+    if (c < 0xE0) {
+        return (left >= 2 && (p[1] & 0xC0) == 0x80) ? 2 : 0;
+    }
+    if (c < 0xF0) {
+        if (left < 3 || (p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80) return 0;
+        if (c == 0xE0 && p[1] < 0xA0) return 0;    // Overlong
+        if (c == 0xED && p[1] >= 0xA0) return 0;   // Surrogate
+        return 3;
+    }
+    if (c < 0xF5) {
+        if (left < 4 || (p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80 || (p[3] & 0xC0) != 0x80) return 0;
+        if (c == 0xF0 && p[1] < 0x90) return 0;    // Overlong
+        if (c == 0xF4 && p[1] >= 0x90) return 0;   // Above U+10FFFF
+        return 4;
+    }
+    return 0;
+}
+
+static gsize ScalarValidPrefix(const guchar *data, gsize size, gsize pos) {
+    while (pos < size) {
+        gsize n = ScalarSequenceLength(data + pos, size - pos);
+        if (n == 0) break;
+        pos += n;
+    }
+    return pos;
+}
+
+#ifdef TEXT_SIMD_X86
+
+// Skips 16 bytes at a time while they are plain non-NUL ASCII.
+__attribute__((target("sse2")))
+static gsize Sse2AsciiRun(const guchar *data, gsize size) {
+    gsize pos = 0;
+    const __m128i zero = _mm_setzero_si128();
+    while (pos + 16 <= size) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + pos));
+        int bad = _mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, zero)));
+        if (bad) {
+            return pos + __builtin_ctz(bad);
+        }
+        pos += 16;
+    }
+    return pos;
+}
+
+static gsize Sse2ValidPrefix(const guchar *data, gsize size) {
+    gsize pos = 0;
+    while (pos < size) {
+        pos += Sse2AsciiRun(data + pos, size - pos);
+        if (pos >= size) break;
+        gsize n = ScalarSequenceLength(data + pos, size - pos);
+        if (n == 0) return pos;
+        pos += n;
+    }
+    return size;
+}
+
+#define TOO_SHORT      (1 << 0)
+#define TOO_LONG       (1 << 1)
+#define OVERLONG_3     (1 << 2)
+#define TOO_LARGE      (1 << 3)
+#define SURROGATE      (1 << 4)
+#define OVERLONG_2     (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4     (1 << 6)
+#define TWO_CONTS      (1 << 7)
+#define CARRY          (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define LOOKUP16(a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15) \
+    _mm256_setr_epi8(a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15, \
+                     a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15)
+
+typedef struct Avx2Utf8State {
+    __m256i error;
+    __m256i prevInput;
+    __m256i prevIncomplete;
+} Avx2Utf8State;
+
+__attribute__((target("avx2")))
+static inline __m256i Avx2Prev(__m256i input, __m256i prevInput, int n) {
+    __m256i shifted = _mm256_permute2x128_si256(prevInput, input, 0x21);
+    switch (n) {
+    case 1: return _mm256_alignr_epi8(input, shifted, 15);
+    case 2: return _mm256_alignr_epi8(input, shifted, 14);
+    default: return _mm256_alignr_epi8(input, shifted, 13);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i Avx2High4(__m256i v) {
+    return _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0F));
+}
+
+__attribute__((target("avx2")))
+static void Avx2CheckBlock(Avx2Utf8State *state, __m256i input) {
+    const __m256i zero = _mm256_setzero_si256();
+    state->error = _mm256_or_si256(state->error, _mm256_cmpeq_epi8(input, zero));
+
+    if (_mm256_movemask_epi8(input) == 0) {
+        // Pure ASCII: only a sequence left open by the previous block can be wrong
+        state->error = _mm256_or_si256(state->error, state->prevIncomplete);
+        state->prevInput = input;
+        state->prevIncomplete = zero;
+        return;
+    }
+
+    const __m256i prev1 = Avx2Prev(input, state->prevInput, 1);
+    const __m256i byte1High = _mm256_shuffle_epi8(LOOKUP16(
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4), Avx2High4(prev1));
+    const __m256i byte1Low = _mm256_shuffle_epi8(LOOKUP16(
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY,
+        CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000), _mm256_and_si256(prev1, _mm256_set1_epi8(0x0F)));
+    const __m256i byte2High = _mm256_shuffle_epi8(LOOKUP16(
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT), Avx2High4(input));
+    const __m256i special = _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+
+    // Third and fourth bytes of 3/4-byte sequences must be continuations
+    const __m256i prev2 = Avx2Prev(input, state->prevInput, 2);
+    const __m256i prev3 = Avx2Prev(input, state->prevInput, 3);
+    const __m256i isThird = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+    const __m256i isFourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+    const __m256i must23 = _mm256_and_si256(_mm256_or_si256(isThird, isFourth), _mm256_set1_epi8((char)0x80));
+    state->error = _mm256_or_si256(state->error, _mm256_xor_si256(must23, special));
+
+    // A lead byte in the last three positions continues into the next block
+    const __m256i maxValue = _mm256_setr_epi8(
+        (char)255, (char)255, (char)255, (char)255, (char)255, (char)255, (char)255, (char)255,
+        (char)255, (char)255, (char)255, (char)255, (char)255, (char)255, (char)255, (char)255,
+        (char)255, (char)255, (char)255, (char)255, (char)255, (char)255, (char)255, (char)255,
+        (char)255, (char)255, (char)255, (char)255, (char)255,
+        (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    state->prevIncomplete = _mm256_subs_epu8(input, maxValue);
+    state->prevInput = input;
+}
+
+__attribute__((target("avx2")))
+static gboolean Avx2Validate(const guchar *data, gsize size) {
+    Avx2Utf8State state;
+    state.error = _mm256_setzero_si256();
+    state.prevInput = _mm256_setzero_si256();
+    state.prevIncomplete = _mm256_setzero_si256();
+
+    gsize pos = 0;
+    for (; pos + 32 <= size; pos += 32) {
+        Avx2CheckBlock(&state, _mm256_loadu_si256((const __m256i *)(data + pos)));
+        // Bail out early on multi-GB inputs rather than scanning to the end
+        if ((pos & 0xFFFF) == 0 && !_mm256_testz_si256(state.error, state.error)) {
+            return FALSE;
+        }
+    }
+
+    // Pad the tail with spaces: ASCII, non-NUL, and it closes out any open sequence check
+    guchar tail[32];
+    memset(tail, ' ', sizeof(tail));
+    memcpy(tail, data + pos, size - pos);
+    Avx2CheckBlock(&state, _mm256_loadu_si256((const __m256i *)tail));
+    state.error = _mm256_or_si256(state.error, state.prevIncomplete);
+
+    return _mm256_testz_si256(state.error, state.error);
+}
+
+#endif
+
+gboolean Utf8Validate(const guchar *data, gsize size) {
+    if (size == 0) return TRUE;
+#ifdef TEXT_SIMD_X86
+    switch (GetSimdLevel()) {
+    case SIMD_LEVEL_AVX2:
+        return Avx2Validate(data, size);
+    case SIMD_LEVEL_SSE2:
+        return Sse2ValidPrefix(data, size) == size;
+    default:
+        break;
+    }
+#endif
+    return ScalarValidPrefix(data, size, 0) == size;
+}
+
+gsize Utf8ValidPrefix(const guchar *data, gsize size) {
+    if (size == 0) return 0;
+#ifdef TEXT_SIMD_X86
+    if (GetSimdLevel() >= SIMD_LEVEL_SSE2) {
+        return Sse2ValidPrefix(data, size);
+    }
+#endif
+    return ScalarValidPrefix(data, size, 0);
+}
+
+// Transcoding between UTF-16 and UTF-8. The scalar steps below are the reference and also
+// handle everything the vector loops leave behind (surrogates, block tails, bad input).
+
+#define TRANSCODE_SLACK 32
+
+gsize Utf16ToUtf8Bound(gsize utf16Bytes) {
+    return utf16Bytes / 2 * 3 + TRANSCODE_SLACK;
+}
+
+gsize Utf8ToUtf16Bound(gsize utf8Bytes) {
+    return utf8Bytes * 2 + TRANSCODE_SLACK;
+}
+
+static inline guint ReadUnit(const guchar *p, gboolean bigEndian) {
+    return bigEndian ? ((guint)p[0] << 8 | p[1]) : (p[0] | (guint)p[1] << 8);
+}
+
+static inline void WriteUnit(guchar *p, guint unit, gboolean bigEndian) {
+    if (bigEndian) {
+        p[0] = (guchar)(unit >> 8);
+        p[1] = (guchar)unit;
+    } else {
+        p[0] = (guchar)unit;
+        p[1] = (guchar)(unit >> 8);
+    }
+}
+
+// Converts the code point at *in; returns 1 on success, 0 if it needs more input, -1 if malformed.
+static int ScalarUtf16Step(const guchar *src, gsize size, gboolean bigEndian,
+                           gsize *in, guchar *restrict dst, gsize *out) {
+    if (size - *in < 2) return 0;
+    guint cp = ReadUnit(src + *in, bigEndian);
+    gsize unitBytes = 2;
+    if (cp >= 0xD800 && cp <= 0xDFFF) {
+        if (cp >= 0xDC00) return -1;
+        if (size - *in < 4) return 0;
+        guint low = ReadUnit(src + *in + 2, bigEndian);
+        if (low < 0xDC00 || low > 0xDFFF) return -1;
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        unitBytes = 4;
+    }
+
+    guchar *p = dst + *out;
+    if (cp < 0x80) {
+        p[0] = (guchar)cp;
+        *out += 1;
+    } else if (cp < 0x800) {
+        p[0] = (guchar)(0xC0 | cp >> 6);
+        p[1] = (guchar)(0x80 | (cp & 0x3F));
+        *out += 2;
+    } else if (cp < 0x10000) {
+        p[0] = (guchar)(0xE0 | cp >> 12);
+        p[1] = (guchar)(0x80 | ((cp >> 6) & 0x3F));
+        p[2] = (guchar)(0x80 | (cp & 0x3F));
+        *out += 3;
+    } else {
+        p[0] = (guchar)(0xF0 | cp >> 18);
+        p[1] = (guchar)(0x80 | ((cp >> 12) & 0x3F));
+        p[2] = (guchar)(0x80 | ((cp >> 6) & 0x3F));
+        p[3] = (guchar)(0x80 | (cp & 0x3F));
+        *out += 4;
+    }
+    *in += unitBytes;
+    return 1;
+}
+
+static int ScalarUtf8Step(const guchar *src, gsize size, gboolean bigEndian,
+                          gsize *in, guchar *restrict dst, gsize *out) {
+    const guchar *p = src + *in;
+    gsize left = size - *in;
+    guint cp = p[0];
+    gsize length = 1;
+
+    if (cp >= 0x80) {
+        length = ScalarSequenceLength(p, left);
+        if (length == 0) {
+            // Tell a sequence cut off by the end of src apart from a malformed one
+            gsize want = cp >= 0xF0 ? 4 : cp >= 0xE0 ? 3 : 2;
+            if (cp < 0xC2 || cp >= 0xF5 || left >= want) return -1;
+            for (gsize i = 1; i < left; i++) {
+                if ((p[i] & 0xC0) != 0x80) return -1;
+            }
+            return 0;
+        }
+        switch (length) {
+        case 2: cp = (cp & 0x1F) << 6 | (p[1] & 0x3F); break;
+        case 3: cp = (cp & 0x0F) << 12 | (guint)(p[1] & 0x3F) << 6 | (p[2] & 0x3F); break;
+        default: cp = (cp & 0x07) << 18 | (guint)(p[1] & 0x3F) << 12 | (guint)(p[2] & 0x3F) << 6 | (p[3] & 0x3F); break;
+        }
+    }
+
+    if (cp < 0x10000) {
+        WriteUnit(dst + *out, cp, bigEndian);
+        *out += 2;
+    } else {
+        cp -= 0x10000;
+        WriteUnit(dst + *out, 0xD800 + (cp >> 10), bigEndian);
+        WriteUnit(dst + *out + 2, 0xDC00 + (cp & 0x3FF), bigEndian);
+        *out += 4;
+    }
+    *in += length;
+    return 1;
+}
+
+#ifdef TEXT_SIMD_X86
+
+__attribute__((target("sse2")))
+static inline __m128i Sse2SwapUnits(__m128i v) {
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+// Narrows 16 code units at a time while they are all ASCII; other blocks go through the scalar step.
+__attribute__((target("sse2")))
+static void Sse2Utf16ToUtf8(const guchar *src, gsize size, gboolean bigEndian,
+                            gsize *in, guchar *restrict dst, gsize *out) {
+    const __m128i nonAscii = _mm_set1_epi16((short)0xFF80);
+    const __m128i zero = _mm_setzero_si128();
+    while (size - *in >= 32) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + *in));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + *in + 16));
+        if (bigEndian) {
+            a = Sse2SwapUnits(a);
+            b = Sse2SwapUnits(b);
+        }
+        __m128i high = _mm_and_si128(_mm_or_si128(a, b), nonAscii);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(high, zero)) != 0xFFFF) {
+            gsize stop = *in + 32;
+            while (*in < stop) {
+                if (ScalarUtf16Step(src, size, bigEndian, in, dst, out) <= 0) return;
+            }
+            continue;
+        }
+        _mm_storeu_si128((__m128i *)(dst + *out), _mm_packus_epi16(a, b));
+        *in += 32;
+        *out += 16;
+    }
+}
+
+// Widens the leading ASCII run of each 16-byte block; the scalar step takes the byte after it.
+__attribute__((target("sse2")))
+static void Sse2Utf8ToUtf16(const guchar *src, gsize size, gboolean bigEndian,
+                            gsize *in, guchar *restrict dst, gsize *out) {
+    const __m128i zero = _mm_setzero_si128();
+    while (size - *in >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + *in));
+        int high = _mm_movemask_epi8(v);
+        gsize ascii = high ? (gsize)__builtin_ctz(high) : 16;
+        __m128i lo = bigEndian ? _mm_unpacklo_epi8(zero, v) : _mm_unpacklo_epi8(v, zero);
+        __m128i hi = bigEndian ? _mm_unpackhi_epi8(zero, v) : _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_si128((__m128i *)(dst + *out), lo);
+        _mm_storeu_si128((__m128i *)(dst + *out + 16), hi);
+        *in += ascii;
+        *out += ascii * 2;
+        if (high != 0 && ScalarUtf8Step(src, size, bigEndian, in, dst, out) <= 0) return;
+    }
+}
+
+#endif
+
+// Shuffle tables for the AVX2-level transcoders, built on first use.
+// g_utf16Pack*: key bit j / bit 4+j mean lane j encodes to at least 2 / 3 bytes; the
+// shuffle squeezes four 4-byte lanes down to their used bytes.
+// g_utf8Unpack*: key bit i means byte i ends a character; the shuffle gathers up to four
+// complete 1-3 byte characters from the first 12 bytes, last byte first, into 32-bit lanes.
+// g_utf8Unpack2*: the same for up to six 1-2 byte characters into 16-bit lanes, which
+// moves more text per step through accented Latin, Greek or Cyrillic.
+static guchar g_utf16PackShuffle[256][16];
+static guchar g_utf16PackLength[256];
+static guchar g_utf8UnpackShuffle[4096][16];
+static guchar g_utf8UnpackChars[4096];
+static guchar g_utf8UnpackBytes[4096];
+static guchar g_utf8Unpack2Shuffle[4096][16];
+static guchar g_utf8Unpack2Chars[4096];
+static guchar g_utf8Unpack2Bytes[4096];
+
+static void BuildUtf8UnpackEntry(guint key, guint maxLength, guint maxChars, guint laneBytes,
+                                 guchar *shuffle, guchar *charsOut, guchar *bytesOut) {
+    guint start = 0;
+    guint chars = 0;
+    memset(shuffle, 0x80, 16);
+    for (guint i = 0; i < 12 && chars < maxChars; i++) {
+        if (!(key & (1u << i))) continue;
+        guint length = i - start + 1;
+        if (length > maxLength) break;   // Longer sequences take another path
+        for (guint b = 0; b < length; b++) {
+            shuffle[chars * laneBytes + b] = (guchar)(i - b);
+        }
+        chars++;
+        start = i + 1;
+    }
+    *charsOut = (guchar)chars;
+    *bytesOut = (guchar)start;
+}
+
+static void BuildTranscodeTables(void) {
+    for (guint key = 0; key < 256; key++) {
+        guint pos = 0;
+        memset(g_utf16PackShuffle[key], 0x80, 16);
+        for (guint lane = 0; lane < 4; lane++) {
+            guint length = 1 + ((key >> lane) & 1) + ((key >> (lane + 4)) & 1);
+            for (guint b = 0; b < length; b++) {
+                g_utf16PackShuffle[key][pos++] = (guchar)(lane * 4 + b);
+            }
+        }
+        g_utf16PackLength[key] = (guchar)pos;
+    }
+
+    for (guint key = 0; key < 4096; key++) {
+        BuildUtf8UnpackEntry(key, 3, 4, 4, g_utf8UnpackShuffle[key],
+                             &g_utf8UnpackChars[key], &g_utf8UnpackBytes[key]);
+        BuildUtf8UnpackEntry(key, 2, 6, 2, g_utf8Unpack2Shuffle[key],
+                             &g_utf8Unpack2Chars[key], &g_utf8Unpack2Bytes[key]);
+    }
+}
+
+static void EnsureTranscodeTables(void) {
+    static gsize ready = 0;
+    if (g_once_init_enter(&ready)) {
+        BuildTranscodeTables();
+        g_once_init_leave(&ready, 1);
+    }
+}
+
+#ifdef TEXT_SIMD_X86
+
+// Encodes four code units (zero-extended to 32 bits, no surrogates) and stores the packed
+// UTF-8; returns how many of the 16 stored bytes are meaningful.
+__attribute__((target("avx2")))
+static inline gsize Avx2EncodeLanes(__m128i c, guchar *dst) {
+    const __m128i low6 = _mm_set1_epi32(0x3F);
+    __m128i two = _mm_or_si128(_mm_set1_epi32(0x80C0),
+                               _mm_or_si128(_mm_srli_epi32(c, 6), _mm_slli_epi32(_mm_and_si128(c, low6), 8)));
+    __m128i three = _mm_or_si128(_mm_set1_epi32(0x8080E0),
+                                 _mm_or_si128(_mm_srli_epi32(c, 12),
+                                              _mm_or_si128(_mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(c, 6), low6), 8),
+                                                           _mm_slli_epi32(_mm_and_si128(c, low6), 16))));
+    __m128i atLeast2 = _mm_cmpgt_epi32(c, _mm_set1_epi32(0x7F));
+    __m128i atLeast3 = _mm_cmpgt_epi32(c, _mm_set1_epi32(0x7FF));
+    __m128i lanes = _mm_blendv_epi8(_mm_blendv_epi8(c, two, atLeast2), three, atLeast3);
+
+    int key = _mm_movemask_ps(_mm_castsi128_ps(atLeast2)) | _mm_movemask_ps(_mm_castsi128_ps(atLeast3)) << 4;
+    __m128i packed = _mm_shuffle_epi8(lanes, _mm_loadu_si128((const __m128i *)g_utf16PackShuffle[key]));
+    _mm_storeu_si128((__m128i *)dst, packed);
+    return g_utf16PackLength[key];
+}
+
+// Eight code units per step: pure ASCII narrows directly, BMP text without surrogates is
+// encoded lane-wise and compacted by table, and blocks with surrogates go to the scalar step.
+__attribute__((target("avx2")))
+static void Avx2Utf16ToUtf8(const guchar *src, gsize size, gboolean bigEndian,
+                            gsize *in, guchar *restrict dst, gsize *out) {
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    const __m128i zero = _mm_setzero_si128();
+    while (size - *in >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + *in));
+        if (bigEndian) {
+            v = _mm_shuffle_epi8(v, swap);
+        }
+        if (_mm_testz_si128(v, _mm_set1_epi16((short)0xFF80))) {
+            __m128i next = zero;
+            if (size - *in >= 32) {
+                next = _mm_loadu_si128((const __m128i *)(src + *in + 16));
+                if (bigEndian) {
+                    next = _mm_shuffle_epi8(next, swap);
+                }
+            }
+            if (size - *in >= 32 && _mm_testz_si128(next, _mm_set1_epi16((short)0xFF80))) {
+                _mm_storeu_si128((__m128i *)(dst + *out), _mm_packus_epi16(v, next));
+                *in += 32;
+                *out += 16;
+            } else {
+                _mm_storel_epi64((__m128i *)(dst + *out), _mm_packus_epi16(v, v));
+                *in += 16;
+                *out += 8;
+            }
+            continue;
+        }
+        __m128i surrogate = _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short)0xF800)),
+                                            _mm_set1_epi16((short)0xD800));
+        if (_mm_movemask_epi8(surrogate)) {
+            gsize stop = *in + 16;
+            while (*in < stop) {
+                if (ScalarUtf16Step(src, size, bigEndian, in, dst, out) <= 0) return;
+            }
+            continue;
+        }
+        *out += Avx2EncodeLanes(_mm_unpacklo_epi16(v, zero), dst + *out);
+        *out += Avx2EncodeLanes(_mm_unpackhi_epi16(v, zero), dst + *out);
+        *in += 16;
+    }
+}
+
+#define UTF8_VALIDATE_WINDOW 16384
+
+// Leading ASCII is widened in bulk, then each table step decodes up to six 1-2 byte or
+// four 1-3 byte characters; 4-byte sequences go to the scalar step. Table steps take
+// character boundaries straight from the continuation-byte mask, so they only run inside
+// windows that validated; ASCII never needs the check. size must not split a sequence.
+__attribute__((target("avx2")))
+static void Avx2Utf8ToUtf16(const guchar *src, gsize size, gboolean bigEndian,
+                            gsize *in, guchar *restrict dst, gsize *out) {
+    gsize validEnd = *in;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    // Payload bits kept for each byte, by its high nibble: ASCII, continuation, 2/3/4-byte lead
+    const __m128i payload = _mm_setr_epi8(0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F, 0x7F,
+                                          0x3F, 0x3F, 0x3F, 0x3F, 0x1F, 0x1F, 0x0F, 0x07);
+    while (size - *in >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + *in));
+        int high = _mm_movemask_epi8(v);
+        if (high == 0) {
+            __m128i lo = bigEndian ? _mm_unpacklo_epi8(zero, v) : _mm_unpacklo_epi8(v, zero);
+            __m128i hi = bigEndian ? _mm_unpackhi_epi8(zero, v) : _mm_unpackhi_epi8(v, zero);
+            _mm_storeu_si128((__m128i *)(dst + *out), lo);
+            _mm_storeu_si128((__m128i *)(dst + *out + 16), hi);
+            *in += 16;
+            *out += 32;
+            continue;
+        }
+
+        if (*in + 16 > validEnd) {
+            gsize windowEnd = MIN(size, *in + UTF8_VALIDATE_WINDOW);
+            while (windowEnd < size && windowEnd > *in && (src[windowEnd] & 0xC0) == 0x80) {
+                windowEnd--;
+            }
+            if (windowEnd < *in + 16 || !Utf8Validate(src + *in, windowEnd - *in)) return;
+            validEnd = windowEnd;
+        }
+
+        int continuation = _mm_movemask_epi8(_mm_cmplt_epi8(v, _mm_set1_epi8((char)0xC0)));
+        guint key = (guint)(~continuation >> 1) & 0xFFF;
+        __m128i nibbles = _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0F));
+        __m128i bits = _mm_and_si128(v, _mm_shuffle_epi8(payload, nibbles));
+
+        guint chars = g_utf8Unpack2Chars[key];
+        if (chars > g_utf8UnpackChars[key]) {
+            __m128i pairs = _mm_shuffle_epi8(bits, _mm_loadu_si128((const __m128i *)g_utf8Unpack2Shuffle[key]));
+            __m128i units = _mm_or_si128(_mm_and_si128(pairs, _mm_set1_epi16(0x7F)),
+                                         _mm_and_si128(_mm_srli_epi16(pairs, 2), _mm_set1_epi16(0x7C0)));
+            if (bigEndian) {
+                units = _mm_shuffle_epi8(units, swap);
+            }
+            _mm_storeu_si128((__m128i *)(dst + *out), units);
+            *in += g_utf8Unpack2Bytes[key];
+            *out += chars * 2;
+            continue;
+        }
+
+        chars = g_utf8UnpackChars[key];
+        if (chars == 0) {
+            if (ScalarUtf8Step(src, size, bigEndian, in, dst, out) <= 0) return;
+            continue;
+        }
+        __m128i lanes = _mm_shuffle_epi8(bits, _mm_loadu_si128((const __m128i *)g_utf8UnpackShuffle[key]));
+        __m128i code = _mm_or_si128(_mm_and_si128(lanes, _mm_set1_epi32(0x7F)),
+                                    _mm_or_si128(_mm_and_si128(_mm_srli_epi32(lanes, 2), _mm_set1_epi32(0xFC0)),
+                                                 _mm_and_si128(_mm_srli_epi32(lanes, 4), _mm_set1_epi32(0xF000))));
+        __m128i units = _mm_packus_epi32(code, code);
+        if (bigEndian) {
+            units = _mm_shuffle_epi8(units, swap);
+        }
+        _mm_storel_epi64((__m128i *)(dst + *out), units);
+        *in += g_utf8UnpackBytes[key];
+        *out += chars * 2;
+    }
+}
+
+#endif
+
+gboolean Utf16ToUtf8(const guchar *src, gsize size, gboolean bigEndian,
+                     guchar *dst, gsize *consumed, gsize *produced) {
+    gsize in = 0;
+    gsize out = 0;
+#ifdef TEXT_SIMD_X86
+    switch (GetSimdLevel()) {
+    case SIMD_LEVEL_AVX2:
+        EnsureTranscodeTables();
+        Avx2Utf16ToUtf8(src, size, bigEndian, &in, dst, &out);
+        break;
+    case SIMD_LEVEL_SSE2:
+        Sse2Utf16ToUtf8(src, size, bigEndian, &in, dst, &out);
+        break;
+    default:
+        break;
+    }
+#endif
+    int status = 1;
+    while (in < size && (status = ScalarUtf16Step(src, size, bigEndian, &in, dst, &out)) > 0) {
+    }
+    *consumed = in;
+    *produced = out;
+    return status >= 0;
+}
+
+gboolean Utf8ToUtf16(const guchar *src, gsize size, gboolean bigEndian,
+                     guchar *dst, gsize *consumed, gsize *produced) {
+    gsize in = 0;
+    gsize out = 0;
+#ifdef TEXT_SIMD_X86
+    switch (GetSimdLevel()) {
+    case SIMD_LEVEL_AVX2: {
+        // Back off to before the last multi-byte sequence in case src splits it
+        gsize end = size;
+        while (end > 0 && size - end < 3 && (src[end - 1] & 0xC0) == 0x80) {
+            end--;
+        }
+        if (end > 0 && src[end - 1] >= 0xC0) {
+            end--;
+        }
+        EnsureTranscodeTables();
+        Avx2Utf8ToUtf16(src, end, bigEndian, &in, dst, &out);
+        break;
+    }
+    case SIMD_LEVEL_SSE2:
+        Sse2Utf8ToUtf16(src, size, bigEndian, &in, dst, &out);
+        break;
+    default:
+        break;
+    }
+#endif
+    int status = 1;
+    while (in < size && (status = ScalarUtf8Step(src, size, bigEndian, &in, dst, &out)) > 0) {
+    }
+    *consumed = in;
+    *produced = out;
+    return status >= 0;
+}
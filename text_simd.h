@@ -0,0 +1,41 @@
+// Vectorized text kernels for retropad (runtime-dispatched AVX2 / SSE2 / scalar)
+#pragma once
+
+#include <glib.h>
+#include <stddef.h>
+
+typedef enum SimdLevel {
+    SIMD_LEVEL_UNKNOWN = 0,
+    SIMD_LEVEL_SCALAR,
+    SIMD_LEVEL_SSE2,
+    SIMD_LEVEL_AVX2
+} SimdLevel;
+
+// Instruction set the kernels dispatch on, detected once; RETROPAD_NO_SIMD forces scalar.
+SimdLevel GetSimdLevel(void);
+
+// Strict UTF-8 check matching g_utf8_validate: rejects overlongs, surrogates,
+// code points above U+10FFFF, truncated sequences and NUL bytes.
+gboolean Utf8Validate(const guchar *data, gsize size);
+
+// Length of the longest valid prefix; ends on a character boundary.
+gsize Utf8ValidPrefix(const guchar *data, gsize size);
+
+// Name of the instruction set the dispatcher picked, for diagnostics.
+const char *TextSimdLevel(void);
+
+// Worst-case output sizes for the transcoders below, including the few bytes of slack
+// the vector kernels may write past the converted data.
+gsize Utf16ToUtf8Bound(gsize utf16Bytes);
+gsize Utf8ToUtf16Bound(gsize utf8Bytes);
+
+// UTF-16 (LE or BE, no BOM) to UTF-8. Stops before a trailing odd byte or a high
+// surrogate whose pair lies past the end of src, so streaming callers can carry it into
+// the next chunk. Returns FALSE on an unpaired surrogate; *consumed marks where.
+gboolean Utf16ToUtf8(const guchar *src, gsize size, gboolean bigEndian,
+                     guchar *dst, gsize *consumed, gsize *produced);
+
+// UTF-8 to UTF-16 (LE or BE, no BOM). Stops before a sequence truncated by the end of
+// src; returns FALSE on malformed input with *consumed at the offending byte.
+gboolean Utf8ToUtf16(const guchar *src, gsize size, gboolean bigEndian,
+                     guchar *dst, gsize *consumed, gsize *produced);
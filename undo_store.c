@@ -0,0 +1,226 @@
+// Undo payload compression (raw deflate) and a spill file in the user cache dir. Freed
+// ranges of the spill file are reused by later writes, and the file is truncated when
+// its tail is freed, so it stays about as large as what is actually spilled.
+#include "undo_store.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#define UNDO_COMPRESS_LEVEL 3
+#define CONVERT_CHUNK (64 * 1024)
+
+typedef struct SpillExtent {
+    goffset offset;
+    gsize length;
+} SpillExtent;
+
+struct UndoSpillFile {
+    FILE *file;
+    goffset size;
+    GArray *freeExtents;        // SpillExtent, sorted by offset, never touching each other
+};
+
+static GBytes *RunConverter(GConverter *converter, const guint8 *data, gsize length, gsize sizeHint) {
+    GByteArray *out = g_byte_array_sized_new(sizeHint > 0 ? sizeHint : CONVERT_CHUNK);
+    gsize inPos = 0;
+    gsize outPos = 0;
+
+    for (;;) {
+        if (out->len - outPos < CONVERT_CHUNK / 4) {
+            g_byte_array_set_size(out, outPos + CONVERT_CHUNK);
+        }
+
+        gsize bytesRead = 0;
+        gsize bytesWritten = 0;
+        GError *error = NULL;
+        GConverterResult res = g_converter_convert(converter,
+            data + inPos, length - inPos,
+            out->data + outPos, out->len - outPos,
+            G_CONVERTER_INPUT_AT_END, &bytesRead, &bytesWritten, &error);
+
+        if (res == G_CONVERTER_ERROR) {
+            if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE)) {
+                g_error_free(error);
+                g_byte_array_set_size(out, out->len * 2);
+                continue;
+            }
+            g_error_free(error);
+            g_byte_array_free(out, TRUE);
+            return NULL;
+        }
+
+        inPos += bytesRead;
+        outPos += bytesWritten;
+        if (res == G_CONVERTER_FINISHED) break;
+    }
+
+    g_byte_array_set_size(out, outPos);
+    return g_byte_array_free_to_bytes(out);
+}
+
+GBytes *UndoCompress(const guint8 *data, gsize length) {
+    GZlibCompressor *compressor = g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_RAW, UNDO_COMPRESS_LEVEL);
+    GBytes *result = RunConverter(G_CONVERTER(compressor), data, length, length / 2 + 64);
+    g_object_unref(compressor);
+    return result;
+}
+
+GBytes *UndoDecompress(GBytes *compressed, gsize rawLength) {
+    gsize length = 0;
+    const guint8 *data = g_bytes_get_data(compressed, &length);
+    GZlibDecompressor *decompressor = g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_RAW);
+    GBytes *result = RunConverter(G_CONVERTER(decompressor), data, length, rawLength + 64);
+    g_object_unref(decompressor);
+
+    if (result && g_bytes_get_size(result) != rawLength) {
+        g_bytes_unref(result);
+        return NULL;
+    }
+    return result;
+}
+
+UndoSpillFile *UndoSpillOpen(void) {
+    char *dir = g_build_filename(g_get_user_cache_dir(), "retropad", NULL);
+    if (g_mkdir_with_parents(dir, 0700) != 0) {
+        g_free(dir);
+        return NULL;
+    }
+
+    char *name = g_strdup_printf("undo-%d.spill", (int)getpid());
+    char *path = g_build_filename(dir, name, NULL);
+    FILE *file = g_fopen(path, "w+b");
+    if (file) {
+        // Unlink right away so the spill never outlives the process, even on a crash
+        g_unlink(path);
+    }
+    g_free(path);
+    g_free(name);
+    g_free(dir);
+
+    if (!file) return NULL;
+
+    UndoSpillFile *spill = g_new0(UndoSpillFile, 1);
+    spill->file = file;
+    spill->size = 0;
+    spill->freeExtents = g_array_new(FALSE, FALSE, sizeof(SpillExtent));
+    return spill;
+}
+
+void UndoSpillClose(UndoSpillFile *spill) {
+    if (!spill) return;
+    fclose(spill->file);
+    g_array_free(spill->freeExtents, TRUE);
+    g_free(spill);
+}
+
+static void TruncateSpill(UndoSpillFile *spill, goffset size) {
+    fflush(spill->file);
+    if (ftruncate(fileno(spill->file), size) == 0) {
+        spill->size = size;
+    }
+}
+
+void UndoSpillReset(UndoSpillFile *spill) {
+    if (!spill) return;
+    g_array_set_size(spill->freeExtents, 0);
+    TruncateSpill(spill, 0);
+}
+
+// First fit among the freed ranges; -1 if none is large enough
+static goffset TakeFreeExtent(UndoSpillFile *spill, gsize length) {
+    for (guint i = 0; i < spill->freeExtents->len; i++) {
+        SpillExtent *extent = &g_array_index(spill->freeExtents, SpillExtent, i);
+        if (extent->length < length) continue;
+        goffset offset = extent->offset;
+        extent->offset += length;
+        extent->length -= length;
+        if (extent->length == 0) {
+            g_array_remove_index(spill->freeExtents, i);
+        }
+        return offset;
+    }
+    return -1;
+}
+
+gboolean UndoSpillWrite(UndoSpillFile *spill, GBytes *data, goffset *offsetOut) {
+    if (!spill) return FALSE;
+
+    gsize length = 0;
+    const guint8 *bytes = g_bytes_get_data(data, &length);
+    goffset offset = length > 0 ? TakeFreeExtent(spill, length) : -1;
+    gboolean append = offset < 0;
+    if (append) {
+        offset = spill->size;
+    }
+    if (fseeko(spill->file, offset, SEEK_SET) != 0 ||
+        fwrite(bytes, 1, length, spill->file) != length) {
+        if (!append) {
+            UndoSpillFree(spill, offset, length);
+        }
+        return FALSE;
+    }
+
+    *offsetOut = offset;
+    if (append) {
+        spill->size += length;
+    }
+    return TRUE;
+}
+
+void UndoSpillFree(UndoSpillFile *spill, goffset offset, gsize length) {
+    if (!spill || length == 0) return;
+
+    GArray *extents = spill->freeExtents;
+    guint i = 0;
+    while (i < extents->len && g_array_index(extents, SpillExtent, i).offset < offset) {
+        i++;
+    }
+    SpillExtent added = { offset, length };
+    g_array_insert_val(extents, i, added);
+
+    // Merge with the following range, then with the preceding one
+    SpillExtent *extent = &g_array_index(extents, SpillExtent, i);
+    if (i + 1 < extents->len) {
+        SpillExtent *next = &g_array_index(extents, SpillExtent, i + 1);
+        if (extent->offset + (goffset)extent->length == next->offset) {
+            extent->length += next->length;
+            g_array_remove_index(extents, i + 1);
+        }
+    }
+    if (i > 0) {
+        SpillExtent *previous = &g_array_index(extents, SpillExtent, i - 1);
+        if (previous->offset + (goffset)previous->length == extent->offset) {
+            previous->length += extent->length;
+            g_array_remove_index(extents, i);
+            i--;
+        }
+    }
+
+    // A free range at the end of the file is given back to the file system
+    SpillExtent *last = &g_array_index(extents, SpillExtent, extents->len - 1);
+    if (last->offset + (goffset)last->length == spill->size) {
+        goffset size = last->offset;
+        g_array_remove_index(extents, extents->len - 1);
+        TruncateSpill(spill, size);
+    }
+}
+
+GBytes *UndoSpillRead(UndoSpillFile *spill, goffset offset, gsize length) {
+    if (!spill) return NULL;
+
+    fflush(spill->file);
+    if (fseeko(spill->file, offset, SEEK_SET) != 0) {
+        return NULL;
+    }
+
+    guint8 *data = g_malloc(length > 0 ? length : 1);
+    if (fread(data, 1, length, spill->file) != length) {
+        g_free(data);
+        return NULL;
+    }
+    return g_bytes_new_take(data, length);
+}
@@ -0,0 +1,19 @@
+// Compressed and disk-spilled storage for retropad undo history
+#pragma once
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct UndoSpillFile UndoSpillFile;
+
+GBytes *UndoCompress(const guint8 *data, gsize length);
+GBytes *UndoDecompress(GBytes *compressed, gsize rawLength);
+
+UndoSpillFile *UndoSpillOpen(void);
+void UndoSpillClose(UndoSpillFile *spill);
+void UndoSpillReset(UndoSpillFile *spill);
+gboolean UndoSpillWrite(UndoSpillFile *spill, GBytes *data, goffset *offsetOut);
+GBytes *UndoSpillRead(UndoSpillFile *spill, goffset offset, gsize length);
+// The range is no longer needed; later writes may reuse it
+void UndoSpillFree(UndoSpillFile *spill, goffset offset, gsize length);